@@ -0,0 +1,256 @@
+//
+// RT64
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#include "benchmark_scene.h"
+
+namespace {
+	const float InstanceSpacing = 2.5f;
+	const int TextureSize = 8;
+
+	struct VERTEX {
+		RT64_VECTOR4 position;
+		RT64_VECTOR3 normal;
+		RT64_VECTOR2 uv;
+		RT64_VECTOR4 input1;
+	};
+
+	int gridSide(int instanceCount) {
+		return std::max((int)(ceilf(sqrtf((float)(instanceCount)))), 1);
+	}
+
+	RT64_MATRIX4 identityMatrix() {
+		RT64_MATRIX4 matrix;
+		memset(matrix.m, 0, sizeof(RT64_MATRIX4));
+		matrix.m[0][0] = 1.0f;
+		matrix.m[1][1] = 1.0f;
+		matrix.m[2][2] = 1.0f;
+		matrix.m[3][3] = 1.0f;
+		return matrix;
+	}
+};
+
+BenchmarkScene::BenchmarkScene(RT64_LIBRARY &lib) : lib(lib) {
+	device = nullptr;
+	scene = nullptr;
+	view = nullptr;
+	texture = nullptr;
+	instanceFlags = 0;
+	memset(&material, 0, sizeof(RT64_MATERIAL));
+}
+
+BenchmarkScene::~BenchmarkScene() {
+	destroyInstances();
+
+	if (view != nullptr) {
+		lib.DestroyView(view);
+	}
+
+	for (RT64_MESH *mesh : meshes) {
+		lib.DestroyMesh(mesh);
+	}
+
+	for (RT64_SHADER *shader : shaders) {
+		lib.DestroyShader(shader);
+	}
+
+	if (texture != nullptr) {
+		lib.DestroyTexture(texture);
+	}
+
+	if (scene != nullptr) {
+		lib.DestroyScene(scene);
+	}
+
+	if (device != nullptr) {
+		lib.DestroyDevice(device);
+	}
+}
+
+bool BenchmarkScene::create(int width, int height, int meshFlags, int meshCount, int shaderFlags, int shaderCount) {
+	device = lib.CreateHeadlessDevice(width, height);
+	if (device == nullptr) {
+		fprintf(stderr, "Failed to create headless device: %s\n", lib.GetLastError());
+		return false;
+	}
+
+	scene = lib.CreateScene(device);
+	view = lib.CreateView(scene);
+
+	// Light 0 is always the ambient light.
+	RT64_LIGHT lights[2];
+	memset(lights, 0, sizeof(lights));
+	lights[0].diffuseColor = { 0.3f, 0.35f, 0.45f };
+	lights[1].position = { 15000.0f, 30000.0f, 15000.0f };
+	lights[1].attenuationRadius = 1e9;
+	lights[1].pointRadius = 5000.0f;
+	lights[1].diffuseColor = { 0.8f, 0.75f, 0.65f };
+	lights[1].specularColor = { 0.8f, 0.75f, 0.65f };
+	lights[1].attenuationExponent = 1.0f;
+	for (RT64_LIGHT &light : lights) {
+		light.groupBits = RT64_LIGHT_GROUP_DEFAULT;
+	}
+
+	lib.SetSceneLights(scene, lights, _countof(lights));
+
+	// Checkerboard shared by all the instances.
+	std::vector<unsigned int> texels(TextureSize * TextureSize);
+	for (int y = 0; y < TextureSize; y++) {
+		for (int x = 0; x < TextureSize; x++) {
+			texels[y * TextureSize + x] = ((x + y) & 1) ? 0xFFFFFFFF : 0xFF808080;
+		}
+	}
+
+	texture = lib.CreateTextureFromRGBA8(device, texels.data(), TextureSize, TextureSize, 4);
+
+	// Every mesh is the same cube, but the view doesn't know that.
+	VERTEX vertices[8];
+	for (int i = 0; i < (int)(_countof(vertices)); i++) {
+		const float x = (i & 1) ? 0.5f : -0.5f;
+		const float y = (i & 2) ? 0.5f : -0.5f;
+		const float z = (i & 4) ? 0.5f : -0.5f;
+		const float invLength = 1.0f / sqrtf(x * x + y * y + z * z);
+		vertices[i].position = { x, y, z, 1.0f };
+		vertices[i].normal = { x * invLength, y * invLength, z * invLength };
+		vertices[i].uv = { x + 0.5f, y + 0.5f };
+		vertices[i].input1 = { 1.0f, 1.0f, 1.0f, 1.0f };
+	}
+
+	unsigned int indices[36] = {
+		0, 2, 1, 1, 2, 3,
+		4, 5, 6, 5, 7, 6,
+		0, 1, 4, 1, 5, 4,
+		2, 6, 3, 3, 6, 7,
+		0, 4, 2, 2, 4, 6,
+		1, 3, 5, 3, 7, 5
+	};
+
+	for (int i = 0; i < meshCount; i++) {
+		RT64_MESH *mesh = lib.CreateMesh(device, meshFlags);
+		lib.SetMesh(mesh, vertices, _countof(vertices), sizeof(VERTEX), indices, _countof(indices));
+		meshes.push_back(mesh);
+	}
+
+	// The shaders only differ in their sampler, which is enough for them to need their own pipelines.
+	for (int i = 0; i < shaderCount; i++) {
+		const unsigned int filter = (i & 1) ? RT64_SHADER_FILTER_POINT : RT64_SHADER_FILTER_LINEAR;
+		const unsigned int addressing = (i & 2) ? RT64_SHADER_ADDRESSING_CLAMP : RT64_SHADER_ADDRESSING_WRAP;
+		shaders.push_back(lib.CreateShader(device, 0x01200a00, filter, addressing, addressing, shaderFlags));
+	}
+
+	material.uvDetailScale = 1.0f;
+	material.reflectionFresnelFactor = 1.0f;
+	material.specularColor = { 1.0f, 1.0f, 1.0f };
+	material.specularExponent = 1.0f;
+	material.solidAlphaMultiplier = 1.0f;
+	material.shadowAlphaMultiplier = 1.0f;
+	material.lightGroupMaskBits = 0xFFFFFFFF;
+	material.fogColor = { 0.3f, 0.5f, 0.7f };
+	material.fogMul = 1.0f;
+
+	return true;
+}
+
+void BenchmarkScene::describeInstance(int index, float offset) {
+	const int side = gridSide((int)(instances.size()));
+	RT64_INSTANCE_DESC instDesc;
+	instDesc.scissorRect = { 0, 0, 0, 0 };
+	instDesc.viewportRect = { 0, 0, 0, 0 };
+	instDesc.mesh = meshes[index % meshes.size()];
+	instDesc.transform = identityMatrix();
+	instDesc.transform.m[3][0] = ((index % side) - (side / 2)) * InstanceSpacing;
+	instDesc.transform.m[3][1] = ((index / side) - (side / 2)) * InstanceSpacing + offset;
+	instDesc.diffuseTexture = texture;
+	instDesc.normalTexture = nullptr;
+	instDesc.specularTexture = nullptr;
+	instDesc.shader = shaders[(index / meshes.size()) % shaders.size()];
+	instDesc.material = material;
+	instDesc.flags = instanceFlags;
+	lib.SetInstanceDescription(instances[index], instDesc);
+}
+
+void BenchmarkScene::destroyInstances() {
+	for (RT64_INSTANCE *instance : instances) {
+		lib.DestroyInstance(instance);
+	}
+
+	instances.clear();
+}
+
+void BenchmarkScene::setInstanceCount(int count, unsigned int flags) {
+	destroyInstances();
+	instanceFlags = flags;
+	for (int i = 0; i < count; i++) {
+		instances.push_back(lib.CreateInstance(scene));
+	}
+
+	for (int i = 0; i < count; i++) {
+		describeInstance(i, 0.0f);
+	}
+
+	// Back away from the grid until all of it fits in the view.
+	RT64_MATRIX4 viewMatrix = identityMatrix();
+	viewMatrix.m[3][2] = -(gridSide(count) * InstanceSpacing * 1.25f);
+	lib.SetViewPerspective(view, viewMatrix, (45.0f * 3.14159265f) / 180.0f, 0.1f, -viewMatrix.m[3][2] * 2.0f);
+}
+
+BenchmarkScene::Frames BenchmarkScene::drawFrames(int frameCount, bool moveInstances) {
+	Frames frames = {};
+	frames.count = frameCount;
+	for (int f = 0; f < frameCount; f++) {
+		if (moveInstances) {
+			auto describeStart = std::chrono::steady_clock::now();
+			const float offset = (f & 1) ? 0.25f : -0.25f;
+			for (int i = 0; i < (int)(instances.size()); i++) {
+				describeInstance(i, offset);
+			}
+
+			frames.describeTime += std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - describeStart).count();
+		}
+
+		lib.DrawDevice(device, 0);
+
+		RT64_FRAME_TIMES frameTimes;
+		lib.GetDeviceFrameTimes(device, &frameTimes);
+		frames.updateTime += frameTimes.updateTime;
+		frames.renderTime += frameTimes.renderTime;
+		frames.submitTime += frameTimes.submitTime;
+	}
+
+	if (frameCount > 0) {
+		frames.updateTime /= frameCount;
+		frames.renderTime /= frameCount;
+		frames.submitTime /= frameCount;
+		frames.describeTime /= frameCount;
+	}
+
+	// Query the size of the log first.
+	std::vector<RT64_COMMAND> commands(lib.GetDeviceCommandLog(device, nullptr, 0));
+	lib.GetDeviceCommandLog(device, commands.data(), (int)(commands.size()));
+	for (const RT64_COMMAND &command : commands) {
+		if ((command.type >= 0) && (command.type < (int)(_countof(frames.commandCounts)))) {
+			frames.commandCounts[command.type]++;
+		}
+	}
+
+	return frames;
+}
+
+RT64_VIEW *BenchmarkScene::getView() const {
+	return view;
+}
+
+void printFramesHeader(const char *title) {
+	printf("\n%s\n", title);
+	printf("%-16s %10s %10s %10s %10s %10s %8s %10s %8s %10s\n", "frames", "instances", "describe", "update", "render", "submit", "draws", "dispatches", "builds", "barriers");
+}
+
+void printFrames(const char *name, int instanceCount, const BenchmarkScene::Frames &frames) {
+	printf("%-16s %10d %10.3f %10.3f %10.3f %10.3f %8d %10d %8d %10d\n", name, instanceCount, frames.describeTime, frames.updateTime, frames.renderTime, frames.submitTime,
+		frames.commandCounts[RT64_COMMAND_DRAW], frames.commandCounts[RT64_COMMAND_DISPATCH_RAYS], frames.commandCounts[RT64_COMMAND_BUILD_AS], frames.commandCounts[RT64_COMMAND_BARRIER]);
+}
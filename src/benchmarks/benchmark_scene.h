@@ -0,0 +1,57 @@
+//
+// RT64
+//
+
+#pragma once
+
+#include <vector>
+
+#include "rt64.h"
+
+// Headless device with a scene and a view that the benchmarks fill with copies of a cube. The instances are laid out
+// in a grid in front of the camera, and they cycle through a few meshes and shaders so the view can't draw or trace
+// all of them with the same state.
+class BenchmarkScene {
+public:
+	// Mean CPU times of the measured frames in milliseconds, and the commands recorded by the last one.
+	struct Frames {
+		int count;
+		float updateTime;
+		float renderTime;
+		float submitTime;
+		float describeTime;
+		int commandCounts[RT64_COMMAND_WAIT + 1];
+	};
+private:
+	RT64_LIBRARY &lib;
+	RT64_DEVICE *device;
+	RT64_SCENE *scene;
+	RT64_VIEW *view;
+	RT64_TEXTURE *texture;
+	std::vector<RT64_MESH *> meshes;
+	std::vector<RT64_SHADER *> shaders;
+	std::vector<RT64_INSTANCE *> instances;
+	unsigned int instanceFlags;
+	RT64_MATERIAL material;
+
+	void describeInstance(int index, float offset);
+	void destroyInstances();
+public:
+	BenchmarkScene(RT64_LIBRARY &lib);
+	~BenchmarkScene();
+
+	// Returns false and prints the error of the library if the device can't be created.
+	bool create(int width, int height, int meshFlags, int meshCount, int shaderFlags, int shaderCount);
+
+	// Replaces all the instances and points the camera at the new grid.
+	void setInstanceCount(int count, unsigned int flags);
+
+	// Moving the instances describes every one of them again with a new transform before each frame. The time spent
+	// doing so is measured separately, as it's spent by the caller and not by the device.
+	Frames drawFrames(int frameCount, bool moveInstances);
+
+	RT64_VIEW *getView() const;
+};
+
+void printFramesHeader(const char *title);
+void printFrames(const char *name, int instanceCount, const BenchmarkScene::Frames &frames);
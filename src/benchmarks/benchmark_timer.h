@@ -0,0 +1,29 @@
+//
+// RT64
+//
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+
+// Mean time in milliseconds of a function. It runs once to warm up and then as many times as fit in the target time,
+// so fast functions are still averaged over enough runs.
+inline float measureTime(const std::function<void()> &function, float targetTime = 250.0f, int maxRunCount = 100) {
+	auto warmupStart = std::chrono::steady_clock::now();
+	function();
+	const float warmupTime = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - warmupStart).count();
+	const int runCount = std::clamp((int)(targetTime / std::max(warmupTime, 0.001f)), 1, maxRunCount);
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < runCount; i++) {
+		function();
+	}
+
+	return std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count() / runCount;
+}
+
+// Throughput in megabytes per second of processing the given amount of bytes in the given time.
+inline float megabytesPerSecond(size_t byteCount, float time) {
+	return (byteCount / (1024.0f * 1024.0f)) / (time / 1000.0f);
+}
@@ -0,0 +1,70 @@
+//
+// RT64
+//
+
+// Measures the throughput of the block compressor on a 1024x1024 RGBA8 texture for every format and a few qualities.
+// The throughput per core divides the one of all the threads by their count, so it shows how well the rows of blocks
+// are split across the worker pool.
+
+#include <cstdio>
+#include <vector>
+
+#include "benchmark_timer.h"
+
+#include "private/rt64_block_compression.h"
+#include "private/rt64_workers.h"
+
+namespace {
+	const int TextureSize = 1024;
+	const int Qualities[] = { 0, 2, RT64::BlockCompressor::MaxQuality };
+
+	void generatePixels(int size, std::vector<uint8_t> &pixels) {
+		pixels.resize((size_t)(size) * size * 4);
+		uint32_t noise = 0x12345678;
+		for (int y = 0; y < size; y++) {
+			for (int x = 0; x < size; x++) {
+				noise = noise * 1664525 + 1013904223;
+				uint8_t *pixel = &pixels[((size_t)(y) * size + x) * 4];
+				pixel[0] = (uint8_t)((x * 255) / size);
+				pixel[1] = (uint8_t)((y * 255) / size);
+				pixel[2] = (uint8_t)(noise >> 24);
+				pixel[3] = (uint8_t)(((x ^ y) * 255) / size);
+			}
+		}
+	}
+};
+
+void runBlockCompressionBenchmarks() {
+	RT64::WorkerPool singleWorkerPool(1);
+	RT64::WorkerPool workerPool;
+	printf("\nBlock compression of %dx%d RGBA8 (MB/s, %u threads)\n", TextureSize, TextureSize, workerPool.getThreadCount());
+	printf("%-8s %8s %12s %12s %12s %12s\n", "format", "quality", "1T", "all", "per core", "ratio");
+
+	const struct {
+		const char *name;
+		RT64::BlockCompressor::Format format;
+	} formats[] = {
+		{ "BC1", RT64::BlockCompressor::Format::BC1 },
+		{ "BC3", RT64::BlockCompressor::Format::BC3 },
+		{ "BC7", RT64::BlockCompressor::Format::BC7 }
+	};
+
+	std::vector<uint8_t> pixels;
+	std::vector<uint8_t> output;
+	generatePixels(TextureSize, pixels);
+	for (const auto &format : formats) {
+		for (int quality : Qualities) {
+			const float singleTime = measureTime([&]() {
+				RT64::BlockCompressor::compress(pixels.data(), TextureSize, TextureSize, format.format, quality, &singleWorkerPool, output);
+			});
+
+			const float time = measureTime([&]() {
+				RT64::BlockCompressor::compress(pixels.data(), TextureSize, TextureSize, format.format, quality, &workerPool, output);
+			});
+
+			const float throughput = megabytesPerSecond(pixels.size(), time);
+			printf("%-8s %8d %12.1f %12.1f %12.1f %11.1fx\n", format.name, quality, megabytesPerSecond(pixels.size(), singleTime), throughput,
+				throughput / workerPool.getThreadCount(), (float)(pixels.size()) / output.size());
+		}
+	}
+}
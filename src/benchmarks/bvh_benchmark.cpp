@@ -0,0 +1,158 @@
+//
+// RT64
+//
+
+// Measures building, refitting and traversing the BVH of a mesh from a hundred to a million triangles. The meshes are
+// height fields with the same vertex layout as the sample, and the rays are cast down on them from random points.
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+#include "benchmark_timer.h"
+
+#include "private/rt64_bvh.h"
+#include "private/rt64_workers.h"
+
+namespace {
+	// Position, normal, UV and input color, like the vertices of the sample.
+	const int VertexStride = sizeof(float) * 13;
+	const int RayCount = 100000;
+	const int GridSides[] = { 7, 71, 224, 708 };
+
+	struct HeightField {
+		int side;
+		std::vector<uint8_t> vertexData;
+		std::vector<unsigned int> indexData;
+
+		void generate(int side, float phase) {
+			this->side = side;
+			const int vertexSide = side + 1;
+			vertexData.resize((size_t)(vertexSide) * vertexSide * VertexStride);
+			for (int z = 0; z < vertexSide; z++) {
+				for (int x = 0; x < vertexSide; x++) {
+					const float position[3] = { (float)(x), sinf(x * 0.37f + phase) * cosf(z * 0.23f + phase) * 4.0f, (float)(z) };
+					memcpy(&vertexData[((size_t)(z) * vertexSide + x) * VertexStride], position, sizeof(position));
+				}
+			}
+
+			if (!indexData.empty()) {
+				return;
+			}
+
+			indexData.reserve((size_t)(side) * side * 6);
+			for (int z = 0; z < side; z++) {
+				for (int x = 0; x < side; x++) {
+					const unsigned int i = z * vertexSide + x;
+					indexData.insert(indexData.end(), { i, i + vertexSide, i + 1, i + 1, i + vertexSide, i + vertexSide + 1 });
+				}
+			}
+		}
+
+		int getVertexCount() const {
+			return (side + 1) * (side + 1);
+		}
+
+		int getTriangleCount() const {
+			return (int)(indexData.size() / 3);
+		}
+
+		const float *getPosition(unsigned int index) const {
+			return reinterpret_cast<const float *>(&vertexData[(size_t)(index) * VertexStride]);
+		}
+	};
+
+	// Moller-Trumbore intersection. Returns the distance to the hit or a negative value if there's none.
+	float intersectTriangle(const float origin[3], const float direction[3], const float *p0, const float *p1, const float *p2) {
+		const float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+		const float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+		const float p[3] = { direction[1] * e2[2] - direction[2] * e2[1], direction[2] * e2[0] - direction[0] * e2[2], direction[0] * e2[1] - direction[1] * e2[0] };
+		const float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+		if (fabsf(det) < 1e-8f) {
+			return -1.0f;
+		}
+
+		const float invDet = 1.0f / det;
+		const float s[3] = { origin[0] - p0[0], origin[1] - p0[1], origin[2] - p0[2] };
+		const float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * invDet;
+		if ((u < 0.0f) || (u > 1.0f)) {
+			return -1.0f;
+		}
+
+		const float q[3] = { s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0] };
+		const float v = (direction[0] * q[0] + direction[1] * q[1] + direction[2] * q[2]) * invDet;
+		if ((v < 0.0f) || ((u + v) > 1.0f)) {
+			return -1.0f;
+		}
+
+		return (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * invDet;
+	}
+
+	int traceRays(const RT64::BVH &bvh, const HeightField &field, const std::vector<float> &origins) {
+		const float direction[3] = { 0.01f, -1.0f, 0.01f };
+		int hitCount = 0;
+		for (size_t r = 0; r < origins.size(); r += 3) {
+			float tMax = FLT_MAX;
+			bvh.traverse(&origins[r], direction, 0.0f, tMax, [&](uint32_t primitive) {
+				const unsigned int *index3 = &field.indexData[primitive * 3];
+				const float t = intersectTriangle(&origins[r], direction, field.getPosition(index3[0]), field.getPosition(index3[1]), field.getPosition(index3[2]));
+				if ((t >= 0.0f) && (t < tMax)) {
+					tMax = t;
+				}
+
+				return false;
+			});
+
+			hitCount += (tMax < FLT_MAX) ? 1 : 0;
+		}
+
+		return hitCount;
+	}
+};
+
+void runBVHBenchmarks() {
+	RT64::WorkerPool workerPool;
+	printf("\nMesh BVH (ms, %u threads)\n", workerPool.getThreadCount());
+	printf("%-12s %12s %12s %12s %12s %12s\n", "triangles", "build 1T", "build", "refit", "Mrays/s", "hit rate");
+
+	std::mt19937 random(1);
+	for (int side : GridSides) {
+		HeightField field;
+		field.generate(side, 0.0f);
+
+		RT64::BVH bvh;
+		const float singleBuildTime = measureTime([&]() {
+			bvh.build(field.vertexData, field.getVertexCount(), VertexStride, field.indexData, nullptr);
+		});
+
+		const float buildTime = measureTime([&]() {
+			bvh.build(field.vertexData, field.getVertexCount(), VertexStride, field.indexData, &workerPool);
+		});
+
+		// Refit the tree to a displaced version of the same height field.
+		HeightField displaced = field;
+		displaced.generate(side, 0.5f);
+		const float refitTime = measureTime([&]() {
+			bvh.refit(displaced.vertexData, displaced.getVertexCount(), VertexStride, displaced.indexData, &workerPool);
+		});
+
+		// Trace against a tree that was built for the displaced field to leave the refit out of the traversal time.
+		bvh.build(displaced.vertexData, displaced.getVertexCount(), VertexStride, displaced.indexData, &workerPool);
+		std::uniform_real_distribution<float> distribution(0.0f, (float)(side));
+		std::vector<float> origins(RayCount * 3);
+		for (int r = 0; r < RayCount; r++) {
+			origins[r * 3 + 0] = distribution(random);
+			origins[r * 3 + 1] = 10.0f;
+			origins[r * 3 + 2] = distribution(random);
+		}
+
+		int hitCount = 0;
+		const float traceTime = measureTime([&]() {
+			hitCount = traceRays(bvh, displaced, origins);
+		});
+
+		printf("%-12d %12.3f %12.3f %12.3f %12.2f %11.1f%%\n", field.getTriangleCount(), singleBuildTime, buildTime, refitTime,
+			(RayCount / 1000000.0f) / (traceTime / 1000.0f), (hitCount * 100.0f) / RayCount);
+	}
+}
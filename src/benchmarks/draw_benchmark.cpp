@@ -0,0 +1,49 @@
+//
+// RT64
+//
+
+// Measures the CPU cost of recording the raster draws of a view, like the ones of a UI or a HUD. The raster stats of
+// the view show how many of the instances were merged into the same draw and how often the state had to change.
+
+#include "benchmark_scene.h"
+
+namespace {
+	const int Width = 320;
+	const int Height = 240;
+	const int MeshCount = 4;
+	const int ShaderCount = 2;
+	const int FrameCount = 16;
+	const int DrawCounts[] = { 1000, 10000, 50000 };
+
+	void printRasterStats(RT64_LIBRARY &lib, RT64_VIEW *view) {
+		RT64_RASTER_STATS stats;
+		lib.GetViewRasterStats(view, &stats);
+		printf("%-16s %10u draws for %u instances, %u pipeline changes, %u mesh changes\n", "", stats.drawCount, stats.instanceCount, stats.pipelineChanges, stats.meshChanges);
+	}
+};
+
+void runDrawBenchmarks(RT64_LIBRARY &lib) {
+	BenchmarkScene scene(lib);
+	if (!scene.create(Width, Height, 0, MeshCount, RT64_SHADER_RASTER_ENABLED, ShaderCount)) {
+		return;
+	}
+
+	const struct {
+		const char *title;
+		unsigned int flags;
+	} passes[] = {
+		{ "Raster background draws (ms per frame)", RT64_INSTANCE_RASTER_BACKGROUND },
+		{ "Raster foreground draws (ms per frame)", 0 }
+	};
+
+	for (const auto &pass : passes) {
+		printFramesHeader(pass.title);
+		for (int drawCount : DrawCounts) {
+			scene.setInstanceCount(drawCount, pass.flags);
+			printFrames("first", drawCount, scene.drawFrames(1, false));
+			printFrames("static", drawCount, scene.drawFrames(FrameCount, false));
+			printFrames("moving", drawCount, scene.drawFrames(FrameCount, true));
+			printRasterStats(lib, scene.getView());
+		}
+	}
+}
@@ -0,0 +1,33 @@
+//
+// RT64
+//
+
+// Measures the CPU cost of updating and rendering a view as the amount of raytraced instances grows. The first frame
+// gathers the instances and builds the top level AS from scratch, while the static frames show the cost of a view
+// where nothing changed and the moving frames the cost of updating every transform.
+
+#include "benchmark_scene.h"
+
+namespace {
+	const int Width = 320;
+	const int Height = 240;
+	const int MeshCount = 4;
+	const int ShaderCount = 2;
+	const int FrameCount = 16;
+	const int InstanceCounts[] = { 1000, 10000, 50000 };
+};
+
+void runInstanceBenchmarks(RT64_LIBRARY &lib) {
+	BenchmarkScene scene(lib);
+	if (!scene.create(Width, Height, RT64_MESH_RAYTRACE_ENABLED, MeshCount, RT64_SHADER_RASTER_ENABLED | RT64_SHADER_RAYTRACE_ENABLED, ShaderCount)) {
+		return;
+	}
+
+	printFramesHeader("Raytraced instances (ms per frame)");
+	for (int instanceCount : InstanceCounts) {
+		scene.setInstanceCount(instanceCount, 0);
+		printFrames("first", instanceCount, scene.drawFrames(1, false));
+		printFrames("static", instanceCount, scene.drawFrames(FrameCount, false));
+		printFrames("moving", instanceCount, scene.drawFrames(FrameCount, true));
+	}
+}
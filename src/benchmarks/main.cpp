@@ -0,0 +1,35 @@
+//
+// RT64
+//
+
+// Benchmarks for the parts of the library whose cost grows with the size of the scene or its textures. The CPU modules
+// are compiled into the benchmarks and measured directly. The rest draws on a headless device, so it needs the D3D12
+// runtime but neither a window nor a GPU that can raytrace. WARP does the GPU work when there's no such GPU, which
+// only makes the submit times meaningless. All the times are CPU times.
+
+#include <cstdio>
+
+#include "rt64.h"
+
+void runBVHBenchmarks();
+void runMipmapBenchmarks();
+void runBlockCompressionBenchmarks();
+void runInstanceBenchmarks(RT64_LIBRARY &lib);
+void runDrawBenchmarks(RT64_LIBRARY &lib);
+
+int main(int argc, char *argv[]) {
+	runBVHBenchmarks();
+	runMipmapBenchmarks();
+	runBlockCompressionBenchmarks();
+
+	RT64_LIBRARY lib = RT64_LoadLibrary();
+	if (lib.handle == 0) {
+		fprintf(stderr, "Failed to load RT64 library.\n");
+		return 1;
+	}
+
+	runInstanceBenchmarks(lib);
+	runDrawBenchmarks(lib);
+	RT64_UnloadLibrary(lib);
+	return 0;
+}
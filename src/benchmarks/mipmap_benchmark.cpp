@@ -0,0 +1,71 @@
+//
+// RT64
+//
+
+// Measures generating the mip chain of RGBA8 textures from 64x64 to 4096x4096 with both filters. Cutout textures are
+// measured separately, as they also scale the alpha of every level to keep the coverage of the top one.
+
+#include <cstdio>
+#include <vector>
+
+#include "benchmark_timer.h"
+
+#include "private/rt64_mipmaps.h"
+#include "private/rt64_workers.h"
+
+namespace {
+	const int TextureSizes[] = { 64, 256, 1024, 4096 };
+
+	void generatePixels(int size, bool cutout, std::vector<uint8_t> &pixels) {
+		pixels.resize((size_t)(size) * size * 4);
+		uint32_t noise = 0x12345678;
+		for (int y = 0; y < size; y++) {
+			for (int x = 0; x < size; x++) {
+				noise = noise * 1664525 + 1013904223;
+				uint8_t *pixel = &pixels[((size_t)(y) * size + x) * 4];
+				pixel[0] = (uint8_t)((x * 255) / size);
+				pixel[1] = (uint8_t)((y * 255) / size);
+				pixel[2] = (uint8_t)(noise >> 24);
+				pixel[3] = cutout ? ((((x / 8) + (y / 8)) & 1) ? 255 : 0) : 255;
+			}
+		}
+	}
+};
+
+void runMipmapBenchmarks() {
+	RT64::WorkerPool singleWorkerPool(1);
+	RT64::WorkerPool workerPool;
+	printf("\nMip chain generation (ms, %u threads)\n", workerPool.getThreadCount());
+	printf("%-12s %-8s %12s %12s %12s %12s\n", "size", "filter", "opaque 1T", "opaque", "cutout", "MB/s");
+
+	const struct {
+		const char *name;
+		RT64::MipChain::Filter filter;
+	} filters[] = {
+		{ "box", RT64::MipChain::Filter::Box },
+		{ "kaiser", RT64::MipChain::Filter::Kaiser }
+	};
+
+	std::vector<uint8_t> opaquePixels;
+	std::vector<uint8_t> cutoutPixels;
+	for (int size : TextureSizes) {
+		generatePixels(size, false, opaquePixels);
+		generatePixels(size, true, cutoutPixels);
+		for (const auto &filter : filters) {
+			RT64::MipChain mipChain;
+			const float singleTime = measureTime([&]() {
+				mipChain.generate(opaquePixels.data(), size, size, filter.filter, &singleWorkerPool);
+			});
+
+			const float opaqueTime = measureTime([&]() {
+				mipChain.generate(opaquePixels.data(), size, size, filter.filter, &workerPool);
+			});
+
+			const float cutoutTime = measureTime([&]() {
+				mipChain.generate(cutoutPixels.data(), size, size, filter.filter, &workerPool);
+			});
+
+			printf("%-12d %-8s %12.3f %12.3f %12.3f %12.1f\n", size, filter.name, singleTime, opaqueTime, cutoutTime, megabytesPerSecond(opaquePixels.size(), opaqueTime));
+		}
+	}
+}
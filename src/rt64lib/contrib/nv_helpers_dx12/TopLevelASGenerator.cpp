@@ -129,8 +129,14 @@ void TopLevelASGenerator::ComputeASBufferSizes(
   // Buffer sizes need to be 256-byte-aligned
   info.ResultDataMaxSizeInBytes =
       ROUND_UP(info.ResultDataMaxSizeInBytes, D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT);
+  // The same scratch buffer is used for both builds and updates
+  UINT64 scratchSizeInBytes = info.ScratchDataSizeInBytes;
+  if (allowUpdate && (info.UpdateScratchDataSizeInBytes > scratchSizeInBytes))
+  {
+    scratchSizeInBytes = info.UpdateScratchDataSizeInBytes;
+  }
   info.ScratchDataSizeInBytes =
-      ROUND_UP(info.ScratchDataSizeInBytes, D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT);
+      ROUND_UP(scratchSizeInBytes, D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT);
 
   m_resultSizeInBytes = info.ResultDataMaxSizeInBytes;
   m_scratchSizeInBytes = info.ScratchDataSizeInBytes;
@@ -210,10 +216,11 @@ void TopLevelASGenerator::Generate(
   D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags = m_flags;
   // The stored flags represent whether the AS has been built for updates or
   // not. If yes and an update is requested, the builder is told to only update
-  // the AS instead of fully rebuilding it
+  // the AS instead of fully rebuilding it. The flags of the original build
+  // must be kept when performing the update
   if (flags == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE && updateOnly)
   {
-    flags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE;
+    flags |= D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE;
   }
 
   // Sanity checks
@@ -0,0 +1,149 @@
+//
+// RT64
+//
+
+#ifndef RT64_MINIMAL
+
+#include "rt64_barrier_batcher.h"
+
+#include <algorithm>
+
+namespace {
+	ID3D12Resource *barrierResource(const D3D12_RESOURCE_BARRIER &barrier) {
+		switch (barrier.Type) {
+		case D3D12_RESOURCE_BARRIER_TYPE_TRANSITION:
+			return barrier.Transition.pResource;
+		case D3D12_RESOURCE_BARRIER_TYPE_UAV:
+			return barrier.UAV.pResource;
+		default:
+			return nullptr;
+		}
+	}
+};
+
+// Private
+
+RT64::BarrierBatcher::BarrierBatcher() {
+	mergedCount = 0;
+	flushedCount = 0;
+	flushCount = 0;
+}
+
+int RT64::BarrierBatcher::findLast(ID3D12Resource *resource) const {
+	for (int i = (int)(barriers.size()) - 1; i >= 0; i--) {
+		if (barrierResource(barriers[i]) == resource) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+int RT64::BarrierBatcher::findLastTransition(ID3D12Resource *resource) const {
+	for (int i = (int)(barriers.size()) - 1; i >= 0; i--) {
+		if ((barriers[i].Type == D3D12_RESOURCE_BARRIER_TYPE_TRANSITION) && (barriers[i].Transition.pResource == resource)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+bool RT64::BarrierBatcher::transition(ID3D12Resource *resource, D3D12_RESOURCE_STATES stateBefore, D3D12_RESOURCE_STATES stateAfter) {
+	assert(resource != nullptr);
+	assert(stateBefore != stateAfter);
+
+	const int lastTransition = findLastTransition(resource);
+	if ((lastTransition >= 0) && (barriers[lastTransition].Transition.StateAfter != stateBefore)) {
+		return false;
+	}
+
+	// The transitions can only be merged if no other barrier of the resource was added between them.
+	if ((lastTransition >= 0) && (findLast(resource) == lastTransition)) {
+		D3D12_RESOURCE_BARRIER &barrier = barriers[lastTransition];
+		barrier.Transition.StateAfter = stateAfter;
+		if (barrier.Transition.StateBefore == stateAfter) {
+			barriers.erase(barriers.begin() + lastTransition);
+		}
+
+		mergedCount++;
+		return true;
+	}
+
+	D3D12_RESOURCE_BARRIER barrier = {};
+	barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION;
+	barrier.Transition.pResource = resource;
+	barrier.Transition.StateBefore = stateBefore;
+	barrier.Transition.StateAfter = stateAfter;
+	barrier.Transition.Subresource = D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES;
+	barriers.push_back(barrier);
+	return true;
+}
+
+void RT64::BarrierBatcher::uav(ID3D12Resource *resource) {
+	assert(resource != nullptr);
+
+	const int last = findLast(resource);
+	if ((last >= 0) && (barriers[last].Type == D3D12_RESOURCE_BARRIER_TYPE_UAV)) {
+		mergedCount++;
+		return;
+	}
+
+	D3D12_RESOURCE_BARRIER barrier = {};
+	barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_UAV;
+	barrier.UAV.pResource = resource;
+	barriers.push_back(barrier);
+}
+
+void RT64::BarrierBatcher::discard(ID3D12Resource *resource) {
+	if (resource == nullptr) {
+		return;
+	}
+
+	barriers.erase(std::remove_if(barriers.begin(), barriers.end(), [resource](const D3D12_RESOURCE_BARRIER &barrier) {
+		return barrierResource(barrier) == resource;
+	}), barriers.end());
+}
+
+UINT RT64::BarrierBatcher::flush(ID3D12GraphicsCommandList *commandList) {
+	assert(commandList != nullptr);
+
+	const UINT barrierCount = (UINT)(barriers.size());
+	if (barrierCount == 0) {
+		return 0;
+	}
+
+	commandList->ResourceBarrier(barrierCount, barriers.data());
+	barriers.clear();
+	flushedCount += barrierCount;
+	flushCount++;
+	return barrierCount;
+}
+
+bool RT64::BarrierBatcher::getPendingState(ID3D12Resource *resource, D3D12_RESOURCE_STATES &state) const {
+	const int lastTransition = findLastTransition(resource);
+	if (lastTransition < 0) {
+		return false;
+	}
+
+	state = barriers[lastTransition].Transition.StateAfter;
+	return true;
+}
+
+const std::vector<D3D12_RESOURCE_BARRIER> &RT64::BarrierBatcher::getPendingBarriers() const {
+	return barriers;
+}
+
+unsigned int RT64::BarrierBatcher::getMergedCount() const {
+	return mergedCount;
+}
+
+unsigned int RT64::BarrierBatcher::getFlushedCount() const {
+	return flushedCount;
+}
+
+unsigned int RT64::BarrierBatcher::getFlushCount() const {
+	return flushCount;
+}
+
+#endif
@@ -0,0 +1,45 @@
+//
+// RT64
+//
+
+#pragma once
+
+#include "rt64_common.h"
+
+namespace RT64 {
+	// Accumulates barriers so the ones needed at the same point are recorded with a single call. A transition of a
+	// resource that already has a pending one is merged into it, and a pair that returns the resource to its original
+	// state is dropped. Repeated UAV barriers of the same resource are only kept once. The batcher doesn't depend on
+	// the device, so the tracking can be validated on its own.
+	class BarrierBatcher {
+	private:
+		std::vector<D3D12_RESOURCE_BARRIER> barriers;
+		unsigned int mergedCount;
+		unsigned int flushedCount;
+		unsigned int flushCount;
+
+		int findLast(ID3D12Resource *resource) const;
+		int findLastTransition(ID3D12Resource *resource) const;
+	public:
+		BarrierBatcher();
+
+		// Returns false if the transition doesn't start from the state the pending barriers leave the resource in.
+		// The barrier isn't added in that case.
+		bool transition(ID3D12Resource *resource, D3D12_RESOURCE_STATES stateBefore, D3D12_RESOURCE_STATES stateAfter);
+		void uav(ID3D12Resource *resource);
+
+		// Drops the pending barriers of a resource that is about to be released.
+		void discard(ID3D12Resource *resource);
+
+		// Records all the pending barriers in one call and returns how many there were.
+		UINT flush(ID3D12GraphicsCommandList *commandList);
+
+		// State the pending barriers leave the resource in. Returns false if there's no pending transition for it.
+		bool getPendingState(ID3D12Resource *resource, D3D12_RESOURCE_STATES &state) const;
+
+		const std::vector<D3D12_RESOURCE_BARRIER> &getPendingBarriers() const;
+		unsigned int getMergedCount() const;
+		unsigned int getFlushedCount() const;
+		unsigned int getFlushCount() const;
+	};
+};
@@ -0,0 +1,554 @@
+//
+// RT64
+//
+
+#ifndef RT64_MINIMAL
+
+#include <algorithm>
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <cstring>
+
+#include "rt64_block_compression.h"
+#include "rt64_workers.h"
+
+namespace {
+	typedef RT64::BlockCompressor::Format Format;
+
+	const int BlockRowsPerTask = 4;
+	const int PowerIterations = 8;
+	const float BC7Weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+	struct BitWriter {
+		uint8_t *output;
+		int position;
+
+		void write(uint32_t value, int bitCount) {
+			for (int i = 0; i < bitCount; i++, position++) {
+				if ((value >> i) & 1) {
+					output[position >> 3] |= (uint8_t)(1 << (position & 7));
+				}
+			}
+		}
+	};
+
+	struct BitReader {
+		const uint8_t *input;
+		int position;
+
+		uint32_t read(int bitCount) {
+			uint32_t value = 0;
+			for (int i = 0; i < bitCount; i++, position++) {
+				value |= (uint32_t)((input[position >> 3] >> (position & 7)) & 1) << i;
+			}
+
+			return value;
+		}
+	};
+
+	void loadBlock(const uint8_t *pixels, int width, int height, int blockX, int blockY, XMVECTOR block[16]) {
+		for (int y = 0; y < 4; y++) {
+			const int pixelY = std::min(blockY * 4 + y, height - 1);
+			for (int x = 0; x < 4; x++) {
+				const int pixelX = std::min(blockX * 4 + x, width - 1);
+				const uint8_t *pixel = &pixels[((size_t)(pixelY) * width + pixelX) * 4];
+				block[y * 4 + x] = XMVectorSet(pixel[0], pixel[1], pixel[2], pixel[3]);
+			}
+		}
+	}
+
+	inline XMVECTOR clampColor(FXMVECTOR color) {
+		return XMVectorClamp(color, XMVectorZero(), XMVectorReplicate(255.0f));
+	}
+
+	// Fits the line that goes through the pixels of the block. Only the channels in the mask are considered.
+	void fitEndpoints(const XMVECTOR block[16], FXMVECTOR mask, bool usePCA, XMVECTOR &e0, XMVECTOR &e1) {
+		XMVECTOR minColor = block[0];
+		XMVECTOR maxColor = block[0];
+		XMVECTOR mean = XMVectorZero();
+		for (int i = 0; i < 16; i++) {
+			minColor = XMVectorMin(minColor, block[i]);
+			maxColor = XMVectorMax(maxColor, block[i]);
+			mean = XMVectorAdd(mean, block[i]);
+		}
+
+		minColor = XMVectorMultiply(minColor, mask);
+		maxColor = XMVectorMultiply(maxColor, mask);
+		mean = XMVectorMultiply(XMVectorScale(mean, 1.0f / 16.0f), mask);
+		XMVECTOR axis = XMVectorSubtract(maxColor, minColor);
+		if (!usePCA || (XMVectorGetX(XMVector4LengthSq(axis)) < 1.0f)) {
+			e0 = minColor;
+			e1 = maxColor;
+			return;
+		}
+
+		// Principal axis of the covariance matrix with power iteration, starting from the bounding box diagonal.
+		XMVECTOR covariance[4] = { XMVectorZero(), XMVectorZero(), XMVectorZero(), XMVectorZero() };
+		for (int i = 0; i < 16; i++) {
+			const XMVECTOR d = XMVectorMultiply(XMVectorSubtract(block[i], mean), mask);
+			covariance[0] = XMVectorMultiplyAdd(d, XMVectorSplatX(d), covariance[0]);
+			covariance[1] = XMVectorMultiplyAdd(d, XMVectorSplatY(d), covariance[1]);
+			covariance[2] = XMVectorMultiplyAdd(d, XMVectorSplatZ(d), covariance[2]);
+			covariance[3] = XMVectorMultiplyAdd(d, XMVectorSplatW(d), covariance[3]);
+		}
+
+		axis = XMVector4Normalize(axis);
+		for (int i = 0; i < PowerIterations; i++) {
+			XMVECTOR nextAxis = XMVectorMultiply(covariance[0], XMVectorSplatX(axis));
+			nextAxis = XMVectorMultiplyAdd(covariance[1], XMVectorSplatY(axis), nextAxis);
+			nextAxis = XMVectorMultiplyAdd(covariance[2], XMVectorSplatZ(axis), nextAxis);
+			nextAxis = XMVectorMultiplyAdd(covariance[3], XMVectorSplatW(axis), nextAxis);
+			if (XMVectorGetX(XMVector4LengthSq(nextAxis)) < 1e-6f) {
+				break;
+			}
+
+			axis = XMVector4Normalize(nextAxis);
+		}
+
+		float minT = FLT_MAX;
+		float maxT = -FLT_MAX;
+		for (int i = 0; i < 16; i++) {
+			const float t = XMVectorGetX(XMVector4Dot(XMVectorSubtract(XMVectorMultiply(block[i], mask), mean), axis));
+			minT = std::min(minT, t);
+			maxT = std::max(maxT, t);
+		}
+
+		e0 = clampColor(XMVectorMultiplyAdd(axis, XMVectorReplicate(minT), mean));
+		e1 = clampColor(XMVectorMultiplyAdd(axis, XMVectorReplicate(maxT), mean));
+	}
+
+	// Picks the closest palette entry for every pixel and returns the total squared error.
+	float selectIndices(const XMVECTOR block[16], const XMVECTOR *palette, int paletteSize, FXMVECTOR mask, uint8_t indices[16]) {
+		float totalError = 0.0f;
+		for (int i = 0; i < 16; i++) {
+			float bestError = FLT_MAX;
+			for (int j = 0; j < paletteSize; j++) {
+				const float error = XMVectorGetX(XMVector4LengthSq(XMVectorMultiply(XMVectorSubtract(block[i], palette[j]), mask)));
+				if (error < bestError) {
+					bestError = error;
+					indices[i] = (uint8_t)(j);
+				}
+			}
+
+			totalError += bestError;
+		}
+
+		return totalError;
+	}
+
+	// Solves for the endpoints that minimize the error of the chosen indices with least squares.
+	// The weights give how far each palette entry is from the first endpoint to the second one.
+	bool refineEndpoints(const XMVECTOR block[16], const uint8_t indices[16], const float *weights, XMVECTOR &e0, XMVECTOR &e1) {
+		float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+		XMVECTOR ax = XMVectorZero();
+		XMVECTOR bx = XMVectorZero();
+		for (int i = 0; i < 16; i++) {
+			const float b = weights[indices[i]];
+			const float a = 1.0f - b;
+			aa += a * a;
+			ab += a * b;
+			bb += b * b;
+			ax = XMVectorMultiplyAdd(block[i], XMVectorReplicate(a), ax);
+			bx = XMVectorMultiplyAdd(block[i], XMVectorReplicate(b), bx);
+		}
+
+		const float determinant = aa * bb - ab * ab;
+		if (fabsf(determinant) < 1e-6f) {
+			return false;
+		}
+
+		const float invDeterminant = 1.0f / determinant;
+		e0 = clampColor(XMVectorScale(XMVectorSubtract(XMVectorScale(ax, bb), XMVectorScale(bx, ab)), invDeterminant));
+		e1 = clampColor(XMVectorScale(XMVectorSubtract(XMVectorScale(bx, aa), XMVectorScale(ax, ab)), invDeterminant));
+		return true;
+	}
+
+	uint16_t quantize565(FXMVECTOR color) {
+		XMFLOAT4A c;
+		XMStoreFloat4A(&c, color);
+		const uint16_t r = (uint16_t)(std::lround(c.x * 31.0f / 255.0f));
+		const uint16_t g = (uint16_t)(std::lround(c.y * 63.0f / 255.0f));
+		const uint16_t b = (uint16_t)(std::lround(c.z * 31.0f / 255.0f));
+		return (r << 11) | (g << 5) | b;
+	}
+
+	XMVECTOR expand565(uint16_t color) {
+		const int r = (color >> 11) & 0x1F;
+		const int g = (color >> 5) & 0x3F;
+		const int b = color & 0x1F;
+		return XMVectorSet((float)((r << 3) | (r >> 2)), (float)((g << 2) | (g >> 4)), (float)((b << 3) | (b >> 2)), 0.0f);
+	}
+
+	// BC1 color block. The endpoints are always ordered for the four color mode, as the alpha is stored separately
+	// on BC3 and BC1 is only used for opaque textures.
+	void encodeColorBlock(const XMVECTOR block[16], int quality, uint8_t *output) {
+		static const float Weights[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+		const XMVECTOR mask = XMVectorSet(1.0f, 1.0f, 1.0f, 0.0f);
+		XMVECTOR e0, e1;
+		fitEndpoints(block, mask, quality > 0, e0, e1);
+
+		uint16_t bestColors[2] = { 0, 0 };
+		uint8_t bestIndices[16] = {};
+		float bestError = FLT_MAX;
+		const int passCount = 1 + std::max(quality - 1, 0);
+		for (int pass = 0; pass < passCount; pass++) {
+			uint16_t c0 = quantize565(e0);
+			uint16_t c1 = quantize565(e1);
+			if (c0 < c1) {
+				std::swap(c0, c1);
+				std::swap(e0, e1);
+			}
+
+			uint8_t indices[16];
+			XMVECTOR palette[4];
+			palette[0] = expand565(c0);
+			palette[1] = expand565(c1);
+			palette[2] = XMVectorLerp(palette[0], palette[1], Weights[2]);
+			palette[3] = XMVectorLerp(palette[0], palette[1], Weights[3]);
+
+			// Equal endpoints would switch the block to the three color mode, so only the first entry is valid.
+			const float error = selectIndices(block, palette, (c0 == c1) ? 1 : 4, mask, indices);
+			if (error < bestError) {
+				bestError = error;
+				bestColors[0] = c0;
+				bestColors[1] = c1;
+				std::copy(indices, indices + 16, bestIndices);
+			}
+
+			if ((c0 == c1) || (error == 0.0f) || !refineEndpoints(block, indices, Weights, e0, e1)) {
+				break;
+			}
+		}
+
+		uint32_t indexBits = 0;
+		for (int i = 0; i < 16; i++) {
+			indexBits |= (uint32_t)(bestIndices[i]) << (i * 2);
+		}
+
+		output[0] = (uint8_t)(bestColors[0] & 0xFF);
+		output[1] = (uint8_t)(bestColors[0] >> 8);
+		output[2] = (uint8_t)(bestColors[1] & 0xFF);
+		output[3] = (uint8_t)(bestColors[1] >> 8);
+		memcpy(&output[4], &indexBits, sizeof(indexBits));
+	}
+
+	// BC3 alpha block with eight interpolated values between the minimum and the maximum alpha.
+	void encodeAlphaBlock(const XMVECTOR block[16], uint8_t *output) {
+		int alphas[16];
+		int minAlpha = 255;
+		int maxAlpha = 0;
+		for (int i = 0; i < 16; i++) {
+			alphas[i] = (int)(XMVectorGetW(block[i]));
+			minAlpha = std::min(minAlpha, alphas[i]);
+			maxAlpha = std::max(maxAlpha, alphas[i]);
+		}
+
+		output[0] = (uint8_t)(maxAlpha);
+		output[1] = (uint8_t)(minAlpha);
+
+		uint64_t indexBits = 0;
+		if (maxAlpha != minAlpha) {
+			int palette[8];
+			palette[0] = maxAlpha;
+			palette[1] = minAlpha;
+			for (int i = 1; i < 7; i++) {
+				palette[i + 1] = ((7 - i) * maxAlpha + i * minAlpha) / 7;
+			}
+
+			for (int i = 0; i < 16; i++) {
+				int bestIndex = 0;
+				int bestError = INT_MAX;
+				for (int j = 0; j < 8; j++) {
+					const int error = abs(alphas[i] - palette[j]);
+					if (error < bestError) {
+						bestError = error;
+						bestIndex = j;
+					}
+				}
+
+				indexBits |= (uint64_t)(bestIndex) << (i * 3);
+			}
+		}
+
+		for (int i = 0; i < 6; i++) {
+			output[2 + i] = (uint8_t)((indexBits >> (i * 8)) & 0xFF);
+		}
+	}
+
+	// BC7 endpoints have seven bits per channel and a shared lowest bit, so both options of the shared bit are tried.
+	XMVECTOR quantizeBC7Endpoint(FXMVECTOR endpoint, uint8_t channels[4], uint8_t &pBit) {
+		XMFLOAT4A e;
+		XMStoreFloat4A(&e, endpoint);
+		const float values[4] = { e.x, e.y, e.z, e.w };
+		float bestError = FLT_MAX;
+		for (uint8_t p = 0; p < 2; p++) {
+			uint8_t quantized[4];
+			float error = 0.0f;
+			for (int c = 0; c < 4; c++) {
+				quantized[c] = (uint8_t)(std::min(std::max(std::lround((values[c] - p) / 2.0f), 0L), 127L));
+				const float d = (float)(quantized[c] * 2 + p) - values[c];
+				error += d * d;
+			}
+
+			if (error < bestError) {
+				bestError = error;
+				pBit = p;
+				std::copy(quantized, quantized + 4, channels);
+			}
+		}
+
+		return XMVectorSet((float)(channels[0] * 2 + pBit), (float)(channels[1] * 2 + pBit), (float)(channels[2] * 2 + pBit), (float)(channels[3] * 2 + pBit));
+	}
+
+	// BC7 mode 6: a single RGBA subset with 4-bit indices. It's the mode that works best for most blocks.
+	void encodeBC7Block(const XMVECTOR block[16], int quality, uint8_t *output) {
+		float weights[16];
+		for (int i = 0; i < 16; i++) {
+			weights[i] = BC7Weights[i] / 64.0f;
+		}
+
+		const XMVECTOR mask = XMVectorSplatOne();
+		XMVECTOR e0, e1;
+		fitEndpoints(block, mask, quality > 0, e0, e1);
+
+		uint8_t bestChannels[2][4] = {};
+		uint8_t bestPBits[2] = {};
+		uint8_t bestIndices[16] = {};
+		float bestError = FLT_MAX;
+		const int passCount = 1 + std::max(quality - 1, 0);
+		for (int pass = 0; pass < passCount; pass++) {
+			uint8_t channels[2][4];
+			uint8_t pBits[2];
+			const XMVECTOR q0 = quantizeBC7Endpoint(e0, channels[0], pBits[0]);
+			const XMVECTOR q1 = quantizeBC7Endpoint(e1, channels[1], pBits[1]);
+
+			XMVECTOR palette[16];
+			for (int i = 0; i < 16; i++) {
+				const XMVECTOR sum = XMVectorAdd(XMVectorAdd(XMVectorScale(q0, 64.0f - BC7Weights[i]), XMVectorScale(q1, BC7Weights[i])), XMVectorReplicate(32.0f));
+				palette[i] = XMVectorFloor(XMVectorScale(sum, 1.0f / 64.0f));
+			}
+
+			uint8_t indices[16];
+			const float error = selectIndices(block, palette, 16, mask, indices);
+			if (error < bestError) {
+				bestError = error;
+				std::copy(&channels[0][0], &channels[0][0] + 8, &bestChannels[0][0]);
+				std::copy(pBits, pBits + 2, bestPBits);
+				std::copy(indices, indices + 16, bestIndices);
+			}
+
+			if ((error == 0.0f) || !refineEndpoints(block, indices, weights, e0, e1)) {
+				break;
+			}
+		}
+
+		// The highest bit of the first index is implied to be zero, so flip the endpoints if it's set.
+		if (bestIndices[0] >= 8) {
+			for (int c = 0; c < 4; c++) {
+				std::swap(bestChannels[0][c], bestChannels[1][c]);
+			}
+
+			std::swap(bestPBits[0], bestPBits[1]);
+			for (int i = 0; i < 16; i++) {
+				bestIndices[i] = 15 - bestIndices[i];
+			}
+		}
+
+		memset(output, 0, 16);
+		BitWriter writer = { output, 0 };
+		writer.write(1 << 6, 7);
+		for (int c = 0; c < 4; c++) {
+			writer.write(bestChannels[0][c], 7);
+			writer.write(bestChannels[1][c], 7);
+		}
+
+		writer.write(bestPBits[0], 1);
+		writer.write(bestPBits[1], 1);
+		writer.write(bestIndices[0], 3);
+		for (int i = 1; i < 16; i++) {
+			writer.write(bestIndices[i], 4);
+		}
+	}
+
+	void decodeColorBlock(const uint8_t *input, bool alphaBlock, uint8_t texels[16][4]) {
+		const uint16_t c0 = (uint16_t)(input[0] | (input[1] << 8));
+		const uint16_t c1 = (uint16_t)(input[2] | (input[3] << 8));
+		XMVECTOR palette[4];
+		palette[0] = expand565(c0);
+		palette[1] = expand565(c1);
+
+		// The color block of BC3 always uses the four color mode.
+		if (alphaBlock || (c0 > c1)) {
+			palette[2] = XMVectorLerp(palette[0], palette[1], 1.0f / 3.0f);
+			palette[3] = XMVectorLerp(palette[0], palette[1], 2.0f / 3.0f);
+		}
+		else {
+			palette[2] = XMVectorLerp(palette[0], palette[1], 0.5f);
+			palette[3] = XMVectorZero();
+		}
+
+		uint32_t indexBits;
+		memcpy(&indexBits, &input[4], sizeof(indexBits));
+		for (int i = 0; i < 16; i++) {
+			const uint32_t index = (indexBits >> (i * 2)) & 0x3;
+			XMFLOAT4A color;
+			XMStoreFloat4A(&color, XMVectorRound(palette[index]));
+			texels[i][0] = (uint8_t)(color.x);
+			texels[i][1] = (uint8_t)(color.y);
+			texels[i][2] = (uint8_t)(color.z);
+			texels[i][3] = (alphaBlock || (index < 3) || (c0 > c1)) ? 255 : 0;
+		}
+	}
+
+	void decodeAlphaBlock(const uint8_t *input, uint8_t texels[16][4]) {
+		const int a0 = input[0];
+		const int a1 = input[1];
+		int palette[8] = { a0, a1, 0, 0, 0, 0, 0, 255 };
+		if (a0 > a1) {
+			for (int i = 1; i < 7; i++) {
+				palette[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+			}
+		}
+		else {
+			for (int i = 1; i < 5; i++) {
+				palette[i + 1] = ((5 - i) * a0 + i * a1) / 5;
+			}
+		}
+
+		uint64_t indexBits = 0;
+		for (int i = 0; i < 6; i++) {
+			indexBits |= (uint64_t)(input[2 + i]) << (i * 8);
+		}
+
+		for (int i = 0; i < 16; i++) {
+			texels[i][3] = (uint8_t)(palette[(indexBits >> (i * 3)) & 0x7]);
+		}
+	}
+
+	// Only mode 6 is decoded, as it's the only one the encoder writes. Blocks of other modes are left black.
+	void decodeBC7Block(const uint8_t *input, uint8_t texels[16][4]) {
+		BitReader reader = { input, 0 };
+		if (reader.read(7) != (1 << 6)) {
+			memset(texels, 0, 16 * 4);
+			return;
+		}
+
+		uint32_t endpoints[2][4];
+		for (int c = 0; c < 4; c++) {
+			endpoints[0][c] = reader.read(7);
+			endpoints[1][c] = reader.read(7);
+		}
+
+		const uint32_t pBits[2] = { reader.read(1), reader.read(1) };
+		for (int e = 0; e < 2; e++) {
+			for (int c = 0; c < 4; c++) {
+				endpoints[e][c] = (endpoints[e][c] << 1) | pBits[e];
+			}
+		}
+
+		for (int i = 0; i < 16; i++) {
+			const int weight = (int)(BC7Weights[reader.read((i == 0) ? 3 : 4)]);
+			for (int c = 0; c < 4; c++) {
+				texels[i][c] = (uint8_t)(((64 - weight) * endpoints[0][c] + weight * endpoints[1][c] + 32) >> 6);
+			}
+		}
+	}
+};
+
+// Private
+
+DXGI_FORMAT RT64::BlockCompressor::getDXGIFormat(Format format) {
+	switch (format) {
+	case Format::BC1:
+		return DXGI_FORMAT_BC1_UNORM;
+	case Format::BC3:
+		return DXGI_FORMAT_BC3_UNORM;
+	case Format::BC7:
+	default:
+		return DXGI_FORMAT_BC7_UNORM;
+	}
+}
+
+uint32_t RT64::BlockCompressor::getBlockSize(Format format) {
+	return (format == Format::BC1) ? 8 : 16;
+}
+
+void RT64::BlockCompressor::compress(const uint8_t *pixels, int width, int height, Format format, int quality, WorkerPool *workerPool, std::vector<uint8_t> &output) {
+	assert(pixels != nullptr);
+	assert(workerPool != nullptr);
+
+	const uint32_t blockSize = getBlockSize(format);
+	const int blocksWide = (width + 3) / 4;
+	const int blocksHigh = (height + 3) / 4;
+	quality = std::min(std::max(quality, 0), MaxQuality);
+	output.resize((size_t)(blocksWide) * blocksHigh * blockSize);
+
+	const int taskCount = (blocksHigh + BlockRowsPerTask - 1) / BlockRowsPerTask;
+	workerPool->run(taskCount, [&](size_t taskIndex) {
+		const int rowBegin = (int)(taskIndex) * BlockRowsPerTask;
+		const int rowEnd = std::min(rowBegin + BlockRowsPerTask, blocksHigh);
+		XMVECTOR block[16];
+		for (int blockY = rowBegin; blockY < rowEnd; blockY++) {
+			for (int blockX = 0; blockX < blocksWide; blockX++) {
+				loadBlock(pixels, width, height, blockX, blockY, block);
+
+				uint8_t *blockOutput = &output[((size_t)(blockY) * blocksWide + blockX) * blockSize];
+				switch (format) {
+				case Format::BC1:
+					encodeColorBlock(block, quality, blockOutput);
+					break;
+				case Format::BC3:
+					encodeAlphaBlock(block, blockOutput);
+					encodeColorBlock(block, quality, blockOutput + 8);
+					break;
+				case Format::BC7:
+					encodeBC7Block(block, quality, blockOutput);
+					break;
+				}
+			}
+		}
+	});
+}
+
+void RT64::BlockCompressor::decompress(const uint8_t *blocks, size_t blockRowPitch, int width, int height, Format format, WorkerPool *workerPool, uint8_t *pixels) {
+	assert(blocks != nullptr);
+	assert(workerPool != nullptr);
+	assert(pixels != nullptr);
+
+	const uint32_t blockSize = getBlockSize(format);
+	const int blocksWide = (width + 3) / 4;
+	const int blocksHigh = (height + 3) / 4;
+	const int taskCount = (blocksHigh + BlockRowsPerTask - 1) / BlockRowsPerTask;
+	workerPool->run(taskCount, [&](size_t taskIndex) {
+		const int rowBegin = (int)(taskIndex) * BlockRowsPerTask;
+		const int rowEnd = std::min(rowBegin + BlockRowsPerTask, blocksHigh);
+		uint8_t texels[16][4];
+		for (int blockY = rowBegin; blockY < rowEnd; blockY++) {
+			for (int blockX = 0; blockX < blocksWide; blockX++) {
+				const uint8_t *blockInput = blocks + blockY * blockRowPitch + (size_t)(blockX) * blockSize;
+				switch (format) {
+				case Format::BC1:
+					decodeColorBlock(blockInput, false, texels);
+					break;
+				case Format::BC3:
+					decodeColorBlock(blockInput + 8, true, texels);
+					decodeAlphaBlock(blockInput, texels);
+					break;
+				case Format::BC7:
+					decodeBC7Block(blockInput, texels);
+					break;
+				}
+
+				// Partial blocks on the edges only write the texels that are inside the image.
+				const int texelsWide = std::min(4, width - blockX * 4);
+				const int texelsHigh = std::min(4, height - blockY * 4);
+				for (int y = 0; y < texelsHigh; y++) {
+					memcpy(&pixels[((size_t)(blockY * 4 + y) * width + blockX * 4) * 4], texels[y * 4], (size_t)(texelsWide) * 4);
+				}
+			}
+		}
+	});
+}
+
+#endif
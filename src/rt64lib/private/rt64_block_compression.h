@@ -0,0 +1,35 @@
+//
+// RT64
+//
+
+#pragma once
+
+#include "rt64_common.h"
+
+namespace RT64 {
+	class WorkerPool;
+
+	// CPU encoder for the BC1, BC3 and BC7 block compressed formats. The rows of blocks are split across the
+	// worker pool. The quality goes from 0, which only uses the bounding box of each block, up to MaxQuality,
+	// which fits the endpoints with PCA and refines them with several least squares passes.
+	class BlockCompressor {
+	public:
+		enum class Format {
+			BC1,
+			BC3,
+			BC7
+		};
+
+		static const int MaxQuality = 4;
+
+		static DXGI_FORMAT getDXGIFormat(Format format);
+		static uint32_t getBlockSize(Format format);
+
+		// Compresses an RGBA8 image. Partial blocks on the edges repeat the last row and column of the image.
+		static void compress(const uint8_t *pixels, int width, int height, Format format, int quality, WorkerPool *workerPool, std::vector<uint8_t> &output);
+
+		// Decodes the blocks written by compress() back into an RGBA8 image with rows of width * 4 bytes. Only the
+		// BC7 mode the encoder uses is supported.
+		static void decompress(const uint8_t *blocks, size_t blockRowPitch, int width, int height, Format format, WorkerPool *workerPool, uint8_t *pixels);
+	};
+};
@@ -0,0 +1,477 @@
+//
+// RT64
+//
+
+#ifndef RT64_MINIMAL
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include "rt64_bvh.h"
+#include "rt64_workers.h"
+
+namespace {
+	typedef RT64::BVH::Bounds Bounds;
+
+	const uint32_t BinCount = 16;
+	const uint32_t MaxLeafSize = 4;
+	const float TraversalCost = 1.0f;
+	const float IntersectionCost = 1.0f;
+
+	// Nodes with fewer primitives than this aren't worth handing to another thread.
+	const uint32_t MinSubtreeSize = 1024;
+	const uint32_t SubtreesPerThread = 4;
+	const uint32_t PrimitivesPerTask = 4096;
+
+	struct Bin {
+		Bounds bounds;
+		uint32_t count;
+	};
+
+	struct BuildContext {
+		const Bounds *primitiveBounds;
+		const float *primitiveCentroids;
+		uint32_t *primitiveIndices;
+	};
+
+	struct BuildTask {
+		uint32_t nodeIndex;
+		uint32_t begin;
+		uint32_t end;
+		uint32_t depth;
+	};
+
+	// Stores the bounds of the primitives in the node and makes it a leaf. Returns true and the partition point
+	// if splitting the node at the best binned SAH candidate is cheaper than intersecting all of its primitives.
+	bool processNode(const BuildContext &ctx, RT64::BVH::Node &node, uint32_t begin, uint32_t end, uint32_t depth, uint32_t &mid) {
+		Bounds bounds, centroidBounds;
+		bounds.reset();
+		centroidBounds.reset();
+		for (uint32_t i = begin; i < end; i++) {
+			const uint32_t p = ctx.primitiveIndices[i];
+			bounds.extend(ctx.primitiveBounds[p]);
+			centroidBounds.extend(&ctx.primitiveCentroids[p * 3]);
+		}
+
+		memcpy(node.boundsMin, bounds.min, sizeof(node.boundsMin));
+		memcpy(node.boundsMax, bounds.max, sizeof(node.boundsMax));
+		node.leftFirst = begin;
+		node.primitiveCount = end - begin;
+
+		const uint32_t count = end - begin;
+		if ((count <= MaxLeafSize) || ((depth + 1) >= RT64::BVH::MaxDepth)) {
+			return false;
+		}
+
+		// Bin the primitives along all three axes in a single pass.
+		Bin bins[3][BinCount];
+		float scale[3];
+		for (int axis = 0; axis < 3; axis++) {
+			const float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+			scale[axis] = (extent > 0.0f) ? (BinCount / extent) : 0.0f;
+			for (uint32_t b = 0; b < BinCount; b++) {
+				bins[axis][b].bounds.reset();
+				bins[axis][b].count = 0;
+			}
+		}
+
+		for (uint32_t i = begin; i < end; i++) {
+			const uint32_t p = ctx.primitiveIndices[i];
+			const Bounds &primitiveBounds = ctx.primitiveBounds[p];
+			const float *centroid = &ctx.primitiveCentroids[p * 3];
+			for (int axis = 0; axis < 3; axis++) {
+				const uint32_t b = std::min(BinCount - 1, static_cast<uint32_t>((centroid[axis] - centroidBounds.min[axis]) * scale[axis]));
+				bins[axis][b].bounds.extend(primitiveBounds);
+				bins[axis][b].count++;
+			}
+		}
+
+		float bestCost = FLT_MAX;
+		int bestAxis = -1;
+		uint32_t bestSplit = 0;
+		for (int axis = 0; axis < 3; axis++) {
+			if (scale[axis] <= 0.0f) {
+				continue;
+			}
+
+			// Sweep from the right to store the area and count of every right side, then from the left to evaluate the splits.
+			float rightArea[BinCount - 1];
+			uint32_t rightCount[BinCount - 1];
+			Bounds sweepBounds;
+			uint32_t sweepCount = 0;
+			sweepBounds.reset();
+			for (uint32_t b = BinCount - 1; b > 0; b--) {
+				sweepBounds.extend(bins[axis][b].bounds);
+				sweepCount += bins[axis][b].count;
+				rightArea[b - 1] = sweepBounds.halfArea();
+				rightCount[b - 1] = sweepCount;
+			}
+
+			sweepBounds.reset();
+			sweepCount = 0;
+			for (uint32_t b = 0; b < (BinCount - 1); b++) {
+				sweepBounds.extend(bins[axis][b].bounds);
+				sweepCount += bins[axis][b].count;
+				if ((sweepCount == 0) || (rightCount[b] == 0)) {
+					continue;
+				}
+
+				const float cost = sweepCount * sweepBounds.halfArea() + rightCount[b] * rightArea[b];
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = b;
+				}
+			}
+		}
+
+		if (bestAxis < 0) {
+			return false;
+		}
+
+		const float parentArea = bounds.halfArea();
+		const float splitCost = TraversalCost + ((parentArea > 0.0f) ? (IntersectionCost * bestCost / parentArea) : 0.0f);
+		const float leafCost = IntersectionCost * count;
+		if (splitCost >= leafCost) {
+			return false;
+		}
+
+		const float axisMin = centroidBounds.min[bestAxis];
+		const float axisScale = scale[bestAxis];
+		uint32_t *midPtr = std::partition(ctx.primitiveIndices + begin, ctx.primitiveIndices + end, [&](uint32_t p) {
+			const uint32_t b = std::min(BinCount - 1, static_cast<uint32_t>((ctx.primitiveCentroids[p * 3 + bestAxis] - axisMin) * axisScale));
+			return b <= bestSplit;
+		});
+
+		mid = static_cast<uint32_t>(midPtr - ctx.primitiveIndices);
+		return (mid > begin) && (mid < end);
+	}
+
+	void buildRecursive(const BuildContext &ctx, std::vector<RT64::BVH::Node> &nodes, uint32_t nodeIndex, uint32_t begin, uint32_t end, uint32_t depth) {
+		uint32_t mid;
+		if (!processNode(ctx, nodes[nodeIndex], begin, end, depth, mid)) {
+			return;
+		}
+
+		const uint32_t leftIndex = static_cast<uint32_t>(nodes.size());
+		nodes.resize(nodes.size() + 2);
+		nodes[nodeIndex].leftFirst = leftIndex;
+		nodes[nodeIndex].primitiveCount = 0;
+		buildRecursive(ctx, nodes, leftIndex, begin, mid, depth + 1);
+		buildRecursive(ctx, nodes, leftIndex + 1, mid, end, depth + 1);
+	}
+
+	void parallelFor(RT64::WorkerPool *workerPool, size_t taskCount, const std::function<void(size_t)> &function) {
+		if (workerPool != nullptr) {
+			workerPool->run(taskCount, function);
+		}
+		else {
+			for (size_t i = 0; i < taskCount; i++) {
+				function(i);
+			}
+		}
+	}
+
+	// Compute the bounds of all triangles. Triangles with indices out of range are left empty so they're discarded.
+	void computeTriangleBounds(const std::vector<uint8_t> &vertexData, int vertexCount, int vertexStride, const std::vector<unsigned int> &indexData, RT64::WorkerPool *workerPool, std::vector<Bounds> &triangleBounds) {
+		const uint32_t triangleCount = static_cast<uint32_t>(indexData.size() / 3);
+		triangleBounds.resize(triangleCount);
+		parallelFor(workerPool, (triangleCount + PrimitivesPerTask - 1) / PrimitivesPerTask, [&](size_t taskIndex) {
+			const uint32_t first = static_cast<uint32_t>(taskIndex) * PrimitivesPerTask;
+			const uint32_t last = std::min(first + PrimitivesPerTask, triangleCount);
+			for (uint32_t t = first; t < last; t++) {
+				const unsigned int *index3 = &indexData[t * 3];
+				Bounds &bounds = triangleBounds[t];
+				bounds.reset();
+				if ((index3[0] >= (unsigned int)(vertexCount)) || (index3[1] >= (unsigned int)(vertexCount)) || (index3[2] >= (unsigned int)(vertexCount))) {
+					continue;
+				}
+
+				for (int j = 0; j < 3; j++) {
+					float position[3];
+					memcpy(position, vertexData.data() + index3[j] * vertexStride, sizeof(position));
+					bounds.extend(position);
+				}
+			}
+		});
+	}
+};
+
+// Private
+
+RT64::BVH::BVH() { }
+
+RT64::BVH::~BVH() { }
+
+void RT64::BVH::build(const std::vector<uint8_t> &vertexData, int vertexCount, int vertexStride, const std::vector<unsigned int> &indexData, WorkerPool *workerPool) {
+	std::vector<Bounds> triangleBounds;
+	computeTriangleBounds(vertexData, vertexCount, vertexStride, indexData, workerPool, triangleBounds);
+	build(triangleBounds, workerPool);
+}
+
+void RT64::BVH::build(const std::vector<Bounds> &primitiveBounds, WorkerPool *workerPool) {
+	clear();
+
+	// Compute the centroids of all primitives.
+	BuildContext ctx;
+	const uint32_t inputCount = static_cast<uint32_t>(primitiveBounds.size());
+	std::vector<uint8_t> primitiveValid(inputCount);
+	std::vector<float> primitiveCentroids(inputCount * 3);
+	parallelFor(workerPool, (inputCount + PrimitivesPerTask - 1) / PrimitivesPerTask, [&](size_t taskIndex) {
+		const uint32_t first = static_cast<uint32_t>(taskIndex) * PrimitivesPerTask;
+		const uint32_t last = std::min(first + PrimitivesPerTask, inputCount);
+		for (uint32_t i = first; i < last; i++) {
+			const Bounds &bounds = primitiveBounds[i];
+			float *centroid = &primitiveCentroids[i * 3];
+			for (int j = 0; j < 3; j++) {
+				centroid[j] = (bounds.min[j] + bounds.max[j]) * 0.5f;
+			}
+
+			// Empty bounds and primitives with NaNs or infinities can't be hit and would break the binning.
+			const bool empty = (bounds.min[0] > bounds.max[0]) || (bounds.min[1] > bounds.max[1]) || (bounds.min[2] > bounds.max[2]);
+			primitiveValid[i] = !empty && std::isfinite(centroid[0]) && std::isfinite(centroid[1]) && std::isfinite(centroid[2]);
+		}
+	});
+
+	primitiveIndices.reserve(inputCount);
+	for (uint32_t i = 0; i < inputCount; i++) {
+		if (primitiveValid[i]) {
+			primitiveIndices.push_back(i);
+		}
+	}
+
+	if (primitiveIndices.empty()) {
+		return;
+	}
+
+	// Split the top of the tree on this thread until there are enough subtrees to keep all the workers busy.
+	// The root is padded with an unused node so every pair of siblings starts at an even index.
+	ctx.primitiveBounds = primitiveBounds.data();
+	ctx.primitiveCentroids = primitiveCentroids.data();
+	ctx.primitiveIndices = primitiveIndices.data();
+	const uint32_t primitiveCount = static_cast<uint32_t>(primitiveIndices.size());
+	const size_t targetSubtrees = ((workerPool != nullptr) ? workerPool->getThreadCount() : 1) * SubtreesPerThread;
+	nodes.reserve(primitiveCount * 2);
+	nodes.resize(2);
+	std::vector<BuildTask> queue = { { 0, 0, primitiveCount, 0 } };
+	std::vector<BuildTask> subtrees;
+	for (size_t q = 0; q < queue.size(); q++) {
+		const BuildTask task = queue[q];
+		const size_t pendingTasks = (queue.size() - q) + subtrees.size();
+		if ((workerPool == nullptr) || ((task.end - task.begin) <= MinSubtreeSize) || (pendingTasks >= targetSubtrees)) {
+			subtrees.push_back(task);
+			continue;
+		}
+
+		uint32_t mid;
+		if (!processNode(ctx, nodes[task.nodeIndex], task.begin, task.end, task.depth, mid)) {
+			continue;
+		}
+
+		const uint32_t leftIndex = static_cast<uint32_t>(nodes.size());
+		nodes.resize(nodes.size() + 2);
+		nodes[task.nodeIndex].leftFirst = leftIndex;
+		nodes[task.nodeIndex].primitiveCount = 0;
+		queue.push_back({ leftIndex, task.begin, mid, task.depth + 1 });
+		queue.push_back({ leftIndex + 1, mid, task.end, task.depth + 1 });
+	}
+
+	// Build the subtrees in parallel. They work on disjoint ranges of the primitive indices.
+	std::vector<std::vector<Node>> subtreeNodes(subtrees.size());
+	parallelFor(workerPool, subtrees.size(), [&](size_t i) {
+		const BuildTask &task = subtrees[i];
+		std::vector<Node> &local = subtreeNodes[i];
+		local.reserve((task.end - task.begin) * 2);
+		local.resize(2);
+		buildRecursive(ctx, local, 0, task.begin, task.end, task.depth);
+	});
+
+	// Append the subtrees in order. Their roots replace the placeholder nodes and the rest keeps the same parity.
+	for (size_t i = 0; i < subtrees.size(); i++) {
+		const std::vector<Node> &local = subtreeNodes[i];
+		const uint32_t offset = static_cast<uint32_t>(nodes.size()) - 2;
+		Node root = local[0];
+		if (!root.isLeaf()) {
+			root.leftFirst += offset;
+		}
+
+		nodes[subtrees[i].nodeIndex] = root;
+		for (size_t j = 2; j < local.size(); j++) {
+			Node node = local[j];
+			if (!node.isLeaf()) {
+				node.leftFirst += offset;
+			}
+
+			nodes.push_back(node);
+		}
+	}
+
+	nodes.shrink_to_fit();
+	collapse();
+}
+
+void RT64::BVH::refit(const std::vector<uint8_t> &vertexData, int vertexCount, int vertexStride, const std::vector<unsigned int> &indexData, WorkerPool *workerPool) {
+	std::vector<Bounds> triangleBounds;
+	computeTriangleBounds(vertexData, vertexCount, vertexStride, indexData, workerPool, triangleBounds);
+	refit(triangleBounds, workerPool);
+}
+
+void RT64::BVH::refit(const std::vector<Bounds> &primitiveBounds, WorkerPool *workerPool) {
+	if (nodes.empty()) {
+		return;
+	}
+
+	// The leaves are independent from each other, so they can be updated in parallel.
+	const uint32_t nodeCount = static_cast<uint32_t>(nodes.size());
+	const uint32_t primitiveCount = static_cast<uint32_t>(primitiveBounds.size());
+	parallelFor(workerPool, (nodeCount + PrimitivesPerTask - 1) / PrimitivesPerTask, [&](size_t taskIndex) {
+		const uint32_t first = static_cast<uint32_t>(taskIndex) * PrimitivesPerTask;
+		const uint32_t last = std::min(first + PrimitivesPerTask, nodeCount);
+		for (uint32_t i = first; i < last; i++) {
+			Node &node = nodes[i];
+			if (!node.isLeaf()) {
+				continue;
+			}
+
+			Bounds bounds;
+			bounds.reset();
+			for (uint32_t j = 0; j < node.primitiveCount; j++) {
+				const uint32_t p = primitiveIndices[node.leftFirst + j];
+				if (p < primitiveCount) {
+					bounds.extend(primitiveBounds[p]);
+				}
+			}
+
+			memcpy(node.boundsMin, bounds.min, sizeof(node.boundsMin));
+			memcpy(node.boundsMax, bounds.max, sizeof(node.boundsMax));
+		}
+	});
+
+	// Children are always stored after their parent, so walking the nodes backwards updates them bottom-up.
+	// The padding node next to the root is skipped.
+	for (uint32_t i = nodeCount - 1; i < nodeCount; i--) {
+		Node &node = nodes[i];
+		if (node.isLeaf() || (i == 1)) {
+			continue;
+		}
+
+		const Node &left = nodes[node.leftFirst];
+		const Node &right = nodes[node.leftFirst + 1];
+		for (int j = 0; j < 3; j++) {
+			node.boundsMin[j] = std::min(left.boundsMin[j], right.boundsMin[j]);
+			node.boundsMax[j] = std::max(left.boundsMax[j], right.boundsMax[j]);
+		}
+	}
+
+	collapse();
+}
+
+void RT64::BVH::collapse() {
+	wideNodes.clear();
+	if (nodes.empty()) {
+		return;
+	}
+
+	// Every wide node takes the children of a binary node and keeps opening the interior child with the largest
+	// area until it has four. A leaf at the root gets a wide node of its own with a single child.
+	wideNodes.reserve(nodes.size() / 2 + 1);
+	std::vector<std::pair<uint32_t, uint32_t>> queue = { { 0, 0 } };
+	wideNodes.emplace_back();
+	for (size_t q = 0; q < queue.size(); q++) {
+		const uint32_t wideIndex = queue[q].first;
+		const Node &source = nodes[queue[q].second];
+		uint32_t children[4];
+		uint32_t childCount = 0;
+		if (source.isLeaf()) {
+			children[childCount++] = queue[q].second;
+		}
+		else {
+			children[childCount++] = source.leftFirst;
+			children[childCount++] = source.leftFirst + 1;
+		}
+
+		while (childCount < 4) {
+			int bestChild = -1;
+			float bestArea = -1.0f;
+			for (uint32_t i = 0; i < childCount; i++) {
+				const Node &child = nodes[children[i]];
+				if (child.isLeaf()) {
+					continue;
+				}
+
+				Bounds bounds;
+				memcpy(bounds.min, child.boundsMin, sizeof(bounds.min));
+				memcpy(bounds.max, child.boundsMax, sizeof(bounds.max));
+				const float area = bounds.halfArea();
+				if (area > bestArea) {
+					bestArea = area;
+					bestChild = (int)(i);
+				}
+			}
+
+			if (bestChild < 0) {
+				break;
+			}
+
+			const uint32_t leftIndex = nodes[children[bestChild]].leftFirst;
+			children[bestChild] = leftIndex;
+			children[childCount++] = leftIndex + 1;
+		}
+
+		// Unused lanes get empty bounds, but they're also masked out by the child count.
+		WideNode wideNode;
+		for (uint32_t i = 0; i < 4; i++) {
+			for (int axis = 0; axis < 3; axis++) {
+				wideNode.boundsMin[axis][i] = FLT_MAX;
+				wideNode.boundsMax[axis][i] = -FLT_MAX;
+			}
+
+			wideNode.leftFirst[i] = 0;
+			wideNode.primitiveCount[i] = 0;
+		}
+
+		wideNode.childCount = childCount;
+		for (uint32_t i = 0; i < childCount; i++) {
+			const Node &child = nodes[children[i]];
+			for (int axis = 0; axis < 3; axis++) {
+				wideNode.boundsMin[axis][i] = child.boundsMin[axis];
+				wideNode.boundsMax[axis][i] = child.boundsMax[axis];
+			}
+
+			if (child.isLeaf()) {
+				wideNode.leftFirst[i] = child.leftFirst;
+				wideNode.primitiveCount[i] = child.primitiveCount;
+			}
+			else {
+				wideNode.leftFirst[i] = static_cast<uint32_t>(wideNodes.size());
+				queue.push_back({ wideNode.leftFirst[i], children[i] });
+				wideNodes.emplace_back();
+			}
+		}
+
+		wideNodes[wideIndex] = wideNode;
+	}
+
+	wideNodes.shrink_to_fit();
+}
+
+void RT64::BVH::clear() {
+	nodes.clear();
+	primitiveIndices.clear();
+	wideNodes.clear();
+}
+
+bool RT64::BVH::isEmpty() const {
+	return nodes.empty();
+}
+
+const std::vector<RT64::BVH::Node> &RT64::BVH::getNodes() const {
+	return nodes;
+}
+
+const std::vector<uint32_t> &RT64::BVH::getPrimitiveIndices() const {
+	return primitiveIndices;
+}
+
+#endif
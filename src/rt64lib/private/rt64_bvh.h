@@ -0,0 +1,207 @@
+//
+// RT64
+//
+
+#pragma once
+
+#include "rt64_common.h"
+
+#include <cfloat>
+
+namespace RT64 {
+	class WorkerPool;
+
+	// Bounding volume hierarchy built on the CPU with binned SAH. Used over the triangles of a mesh and over the instances of a scene.
+	// The binary tree is collapsed into four-wide nodes for the traversal, so every step tests four boxes with SIMD.
+	class BVH {
+	public:
+		// Deeper nodes are turned into leaves, which also bounds the traversal stack.
+		static const uint32_t MaxDepth = 64;
+
+		struct Bounds {
+			float min[3];
+			float max[3];
+
+			void reset() {
+				min[0] = min[1] = min[2] = FLT_MAX;
+				max[0] = max[1] = max[2] = -FLT_MAX;
+			}
+
+			void extend(const float p[3]) {
+				for (int i = 0; i < 3; i++) {
+					min[i] = std::min(min[i], p[i]);
+					max[i] = std::max(max[i], p[i]);
+				}
+			}
+
+			void extend(const Bounds &b) {
+				for (int i = 0; i < 3; i++) {
+					min[i] = std::min(min[i], b.min[i]);
+					max[i] = std::max(max[i], b.max[i]);
+				}
+			}
+
+			float halfArea() const {
+				float dx = max[0] - min[0];
+				float dy = max[1] - min[1];
+				float dz = max[2] - min[2];
+				return dx * dy + dy * dz + dz * dx;
+			}
+		};
+
+		// Interior nodes store the index of their first child in leftFirst and have a primitiveCount of zero.
+		// Leaves store the first entry of the primitive indices instead. Siblings are always stored next to
+		// each other starting at an even index, so both children usually share the same cache line.
+		struct alignas(32) Node {
+			float boundsMin[3];
+			uint32_t leftFirst;
+			float boundsMax[3];
+			uint32_t primitiveCount;
+
+			bool isLeaf() const {
+				return primitiveCount > 0;
+			}
+		};
+	private:
+		// Collapsed version of the binary tree that's used for the traversal. Every node stores up to four children with
+		// one lane per child, so a ray is tested against all of them at once. Interior children store the index of their
+		// wide node and leaves store their primitives the same way as the binary nodes. Unused lanes are always the last ones.
+		struct alignas(16) WideNode {
+			float boundsMin[3][4];
+			float boundsMax[3][4];
+			uint32_t leftFirst[4];
+			uint32_t primitiveCount[4];
+			uint32_t childCount;
+		};
+
+		std::vector<Node> nodes;
+		std::vector<uint32_t> primitiveIndices;
+		std::vector<WideNode> wideNodes;
+
+		void collapse();
+
+		// Slab test with one lane per child. Returns the mask of the children the ray enters inside [tMin, tMax].
+		static inline uint32_t intersectChildren(const WideNode &node, const XMVECTOR origin[3], const XMVECTOR invDirection[3], float tMin, float tMax, float tEntry[4]) {
+			XMVECTOR tNear = XMVectorReplicate(tMin);
+			XMVECTOR tFar = XMVectorReplicate(tMax);
+			for (int axis = 0; axis < 3; axis++) {
+				const XMVECTOR boundsMin = XMLoadFloat4A(reinterpret_cast<const XMFLOAT4A *>(node.boundsMin[axis]));
+				const XMVECTOR boundsMax = XMLoadFloat4A(reinterpret_cast<const XMFLOAT4A *>(node.boundsMax[axis]));
+				const XMVECTOR t0 = XMVectorMultiply(XMVectorSubtract(boundsMin, origin[axis]), invDirection[axis]);
+				const XMVECTOR t1 = XMVectorMultiply(XMVectorSubtract(boundsMax, origin[axis]), invDirection[axis]);
+				tNear = XMVectorMax(tNear, XMVectorMin(t0, t1));
+				tFar = XMVectorMin(tFar, XMVectorMax(t0, t1));
+			}
+
+			XMUINT4 hit;
+			XMStoreUInt4(&hit, XMVectorLessOrEqual(tNear, tFar));
+			XMStoreFloat4(reinterpret_cast<XMFLOAT4 *>(tEntry), tNear);
+
+			uint32_t mask = 0;
+			const uint32_t hits[4] = { hit.x, hit.y, hit.z, hit.w };
+			for (uint32_t i = 0; i < node.childCount; i++) {
+				mask |= (hits[i] != 0) ? (1U << i) : 0U;
+			}
+
+			return mask;
+		}
+	public:
+		BVH();
+		virtual ~BVH();
+		void build(const std::vector<uint8_t> &vertexData, int vertexCount, int vertexStride, const std::vector<unsigned int> &indexData, WorkerPool *workerPool);
+		void build(const std::vector<Bounds> &primitiveBounds, WorkerPool *workerPool);
+
+		// Updates the bounds of the nodes without changing the topology. The primitive count must match the last build.
+		// It's much cheaper than a build when primitives only move, but the tree gets worse the more they do.
+		void refit(const std::vector<uint8_t> &vertexData, int vertexCount, int vertexStride, const std::vector<unsigned int> &indexData, WorkerPool *workerPool);
+		void refit(const std::vector<Bounds> &primitiveBounds, WorkerPool *workerPool);
+
+		void clear();
+		bool isEmpty() const;
+		const std::vector<Node> &getNodes() const;
+		const std::vector<uint32_t> &getPrimitiveIndices() const;
+
+		// Visits the primitives of every leaf the ray goes through inside [tMin, tMax], nearest leaves first.
+		// The callback receives the primitive index and stops the traversal by returning true. It can also
+		// lower tMax to skip the nodes that are farther than the closest hit found so far.
+		template<typename Callback>
+		void traverse(const float origin[3], const float direction[3], float tMin, const float &tMax, Callback callback) const {
+			if (wideNodes.empty()) {
+				return;
+			}
+
+			const XMVECTOR originVector[3] = { XMVectorReplicate(origin[0]), XMVectorReplicate(origin[1]), XMVectorReplicate(origin[2]) };
+			const XMVECTOR invDirection[3] = { XMVectorReplicate(1.0f / direction[0]), XMVectorReplicate(1.0f / direction[1]), XMVectorReplicate(1.0f / direction[2]) };
+
+			// Every level of wide nodes leaves at most three more children on the stack, and there are half as many
+			// levels as in the binary tree.
+			struct StackEntry {
+				uint32_t leftFirst;
+				uint32_t primitiveCount;
+				float tEntry;
+			};
+
+			StackEntry stack[MaxDepth * 2];
+			uint32_t stackSize = 0;
+			uint32_t nodeIndex = 0;
+			while (true) {
+				const WideNode &node = wideNodes[nodeIndex];
+				float tEntry[4];
+				uint32_t mask = intersectChildren(node, originVector, invDirection, tMin, tMax, tEntry);
+
+				// Sort the children that were hit from the farthest to the nearest one.
+				uint32_t order[4];
+				uint32_t orderCount = 0;
+				while (mask != 0) {
+					const uint32_t lane = (mask & 1) ? 0 : ((mask & 2) ? 1 : ((mask & 4) ? 2 : 3));
+					mask &= ~(1U << lane);
+
+					uint32_t j = orderCount++;
+					while ((j > 0) && (tEntry[order[j - 1]] < tEntry[lane])) {
+						order[j] = order[j - 1];
+						j--;
+					}
+
+					order[j] = lane;
+				}
+
+				// Visit the primitives of the leaves right away, nearest first, and push the interior children.
+				for (uint32_t i = orderCount; i > 0; i--) {
+					const uint32_t lane = order[i - 1];
+					if (node.primitiveCount[lane] == 0) {
+						continue;
+					}
+
+					if (tEntry[lane] > tMax) {
+						continue;
+					}
+
+					const uint32_t *primitive = &primitiveIndices[node.leftFirst[lane]];
+					for (uint32_t j = 0; j < node.primitiveCount[lane]; j++) {
+						if (callback(primitive[j])) {
+							return;
+						}
+					}
+				}
+
+				for (uint32_t i = 0; i < orderCount; i++) {
+					const uint32_t lane = order[i];
+					if (node.primitiveCount[lane] == 0) {
+						stack[stackSize++] = { node.leftFirst[lane], 0, tEntry[lane] };
+					}
+				}
+
+				// Skip the nodes that start beyond the current tMax.
+				do {
+					if (stackSize == 0) {
+						return;
+					}
+
+					stackSize--;
+				} while (stack[stackSize].tEntry > tMax);
+
+				nodeIndex = stack[stackSize].leftFirst;
+			}
+		}
+	};
+};
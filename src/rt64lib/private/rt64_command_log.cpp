@@ -0,0 +1,58 @@
+//
+// RT64
+//
+
+#ifndef RT64_MINIMAL
+
+#include "rt64_command_log.h"
+
+// Private
+
+RT64::CommandLog::CommandLog() {
+	enabled = false;
+}
+
+void RT64::CommandLog::setEnabled(bool v) {
+	enabled = v;
+	if (!enabled) {
+		clear();
+	}
+}
+
+bool RT64::CommandLog::isEnabled() const {
+	return enabled;
+}
+
+void RT64::CommandLog::record(Type type, const void *resource, uint64_t size, uint32_t count) {
+	if (enabled) {
+		commands.push_back({ type, resource, size, count });
+	}
+}
+
+void RT64::CommandLog::endFrame() {
+	// Keep the commands of the frame that just finished available until the next one ends.
+	frameCommands.swap(commands);
+	commands.clear();
+}
+
+void RT64::CommandLog::clear() {
+	commands.clear();
+	frameCommands.clear();
+}
+
+const std::vector<RT64::CommandLog::Command> &RT64::CommandLog::getFrameCommands() const {
+	return frameCommands;
+}
+
+size_t RT64::CommandLog::countFrameCommands(Type type) const {
+	size_t count = 0;
+	for (const Command &command : frameCommands) {
+		if (command.type == type) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+#endif
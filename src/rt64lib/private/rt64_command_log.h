@@ -0,0 +1,44 @@
+//
+// RT64
+//
+
+#pragma once
+
+#include "rt64_common.h"
+
+namespace RT64 {
+	// Records the GPU work issued by the device so it can be inspected or benchmarked without presenting.
+	class CommandLog {
+	public:
+		enum class Type : int {
+			Allocation = RT64_COMMAND_ALLOCATION,
+			Barrier = RT64_COMMAND_BARRIER,
+			Copy = RT64_COMMAND_COPY,
+			Draw = RT64_COMMAND_DRAW,
+			DispatchRays = RT64_COMMAND_DISPATCH_RAYS,
+			BuildAS = RT64_COMMAND_BUILD_AS,
+			Submit = RT64_COMMAND_SUBMIT,
+			Wait = RT64_COMMAND_WAIT
+		};
+
+		struct Command {
+			Type type;
+			const void *resource;
+			uint64_t size;
+			uint32_t count;
+		};
+	private:
+		bool enabled;
+		std::vector<Command> commands;
+		std::vector<Command> frameCommands;
+	public:
+		CommandLog();
+		void setEnabled(bool v);
+		bool isEnabled() const;
+		void record(Type type, const void *resource, uint64_t size, uint32_t count);
+		void endFrame();
+		void clear();
+		const std::vector<Command> &getFrameCommands() const;
+		size_t countFrameCommands(Type type) const;
+	};
+};
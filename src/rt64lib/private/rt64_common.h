@@ -110,6 +110,10 @@ namespace RT64 {
 			return (d3dMaAllocation == nullptr);
 		}
 
+		inline D3D12MA::Allocation *GetAllocation() const {
+			return d3dMaAllocation;
+		}
+
 		void Release() {
 			if (!IsNull()) {
 				ID3D12Resource *d3dResource = d3dMaAllocation->GetResource();
@@ -125,6 +129,15 @@ namespace RT64 {
 		XMMATRIX objectToWorldNormal;
 	};
 
+	// Material as the shaders read it. The scale and offset of the textures inside their atlas pages are
+	// filled in by the library after the host's material.
+	struct InstanceMaterial {
+		RT64_MATERIAL material;
+		RT64_VECTOR4 diffuseTexScaleOffset;
+		RT64_VECTOR4 normalTexScaleOffset;
+		RT64_VECTOR4 specularTexScaleOffset;
+	};
+
 	struct AccelerationStructureBuffers {
 		AllocatedResource scratch;
 		UINT64 scratchSize;
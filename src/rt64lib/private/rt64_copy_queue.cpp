@@ -0,0 +1,148 @@
+//
+// RT64
+//
+
+#ifndef RT64_MINIMAL
+
+#include "rt64_copy_queue.h"
+
+#include "rt64_device.h"
+
+// Private
+
+RT64::CopyQueue::CopyQueue(Device *device) {
+	assert(device != nullptr);
+	this->device = device;
+	batchPending = false;
+	batchOverwrites = false;
+	submitCount = 0;
+	overwriteWaitCount = 0;
+
+	ID3D12Device8 *d3dDevice = device->getD3D12Device();
+	D3D12_COMMAND_QUEUE_DESC queueDesc = {};
+	queueDesc.Flags = D3D12_COMMAND_QUEUE_FLAG_NONE;
+	queueDesc.Type = D3D12_COMMAND_LIST_TYPE_COPY;
+	D3D12_CHECK(d3dDevice->CreateCommandQueue(&queueDesc, IID_PPV_ARGS(&d3dCommandQueue)));
+
+	D3D12_CHECK(d3dDevice->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(&d3dFence)));
+	batchFenceValue = 1;
+
+	d3dFenceEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+	if (d3dFenceEvent == nullptr) {
+		D3D12_CHECK(HRESULT_FROM_WIN32(GetLastError()));
+	}
+
+	// The list stays open, as the batch is recorded until the next submission.
+	D3D12_CHECK(d3dDevice->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_COPY, IID_PPV_ARGS(&d3dCommandAllocator)));
+	D3D12_CHECK(d3dDevice->CreateCommandList(0, D3D12_COMMAND_LIST_TYPE_COPY, d3dCommandAllocator, nullptr, IID_PPV_ARGS(&d3dCommandList)));
+}
+
+RT64::CopyQueue::~CopyQueue() {
+	wait(getSubmittedValue());
+
+	d3dCommandList->Release();
+	d3dCommandAllocator->Release();
+	for (PooledAllocator &pooledAllocator : allocatorPool) {
+		pooledAllocator.allocator->Release();
+	}
+
+	CloseHandle(d3dFenceEvent);
+	d3dFence->Release();
+	d3dCommandQueue->Release();
+}
+
+ID3D12CommandAllocator *RT64::CopyQueue::acquireAllocator() {
+	// The allocators are returned in the order they were submitted, so only the oldest one can be idle.
+	if (!allocatorPool.empty() && (allocatorPool.front().fenceValue <= getCompletedValue())) {
+		ID3D12CommandAllocator *allocator = allocatorPool.front().allocator;
+		allocatorPool.pop_front();
+		D3D12_CHECK(allocator->Reset());
+		return allocator;
+	}
+
+	ID3D12CommandAllocator *allocator = nullptr;
+	D3D12_CHECK(device->getD3D12Device()->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_COPY, IID_PPV_ARGS(&allocator)));
+	return allocator;
+}
+
+ID3D12GraphicsCommandList *RT64::CopyQueue::recordCommands() {
+	batchPending = true;
+	return d3dCommandList;
+}
+
+void RT64::CopyQueue::markOverwrite() {
+	batchOverwrites = true;
+}
+
+bool RT64::CopyQueue::hasPendingCopies() const {
+	return batchPending;
+}
+
+UINT64 RT64::CopyQueue::getBatchFenceValue() const {
+	return batchFenceValue;
+}
+
+UINT64 RT64::CopyQueue::submit(ID3D12Fence *directFence, UINT64 directFenceValue) {
+	if (!batchPending) {
+		return getSubmittedValue();
+	}
+
+	if (batchOverwrites && (directFenceValue > 0) && (directFence->GetCompletedValue() < directFenceValue)) {
+		d3dCommandQueue->Wait(directFence, directFenceValue);
+		device->getCommandLog()->record(CommandLog::Type::Wait, directFence, directFenceValue, 1);
+		overwriteWaitCount++;
+	}
+
+	D3D12_CHECK(d3dCommandList->Close());
+	ID3D12CommandList *pCopyList = { d3dCommandList };
+	d3dCommandQueue->ExecuteCommandLists(1, &pCopyList);
+	device->getCommandLog()->record(CommandLog::Type::Submit, d3dCommandList, 0, 1);
+
+	const UINT64 signaledValue = batchFenceValue;
+	D3D12_CHECK(d3dCommandQueue->Signal(d3dFence, signaledValue));
+	batchFenceValue++;
+	batchPending = false;
+	batchOverwrites = false;
+	submitCount++;
+
+	// Open the next batch with an allocator the queue is done with.
+	allocatorPool.push_back({ d3dCommandAllocator, signaledValue });
+	d3dCommandAllocator = acquireAllocator();
+	D3D12_CHECK(d3dCommandList->Reset(d3dCommandAllocator, nullptr));
+	return signaledValue;
+}
+
+void RT64::CopyQueue::wait(UINT64 fenceValue) {
+	assert(fenceValue < batchFenceValue);
+
+	if (d3dFence->GetCompletedValue() < fenceValue) {
+		D3D12_CHECK(d3dFence->SetEventOnCompletion(fenceValue, d3dFenceEvent));
+		WaitForSingleObjectEx(d3dFenceEvent, INFINITE, FALSE);
+	}
+}
+
+UINT64 RT64::CopyQueue::getCompletedValue() const {
+	return d3dFence->GetCompletedValue();
+}
+
+UINT64 RT64::CopyQueue::getSubmittedValue() const {
+	return batchFenceValue - 1;
+}
+
+ID3D12Fence *RT64::CopyQueue::getFence() const {
+	return d3dFence;
+}
+
+unsigned int RT64::CopyQueue::getSubmitCount() const {
+	return submitCount;
+}
+
+unsigned int RT64::CopyQueue::getOverwriteWaitCount() const {
+	return overwriteWaitCount;
+}
+
+size_t RT64::CopyQueue::getAllocatorCount() const {
+	return allocatorPool.size() + 1;
+}
+
+#endif
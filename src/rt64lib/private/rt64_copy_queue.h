@@ -0,0 +1,70 @@
+//
+// RT64
+//
+
+#pragma once
+
+#include "rt64_common.h"
+
+#include <deque>
+
+namespace RT64 {
+	class Device;
+
+	// Dedicated copy queue that runs the uploads of meshes and textures alongside the frames. The copies recorded
+	// between two submissions form a batch that signals the next value of the queue's own fence, and the direct
+	// queue only waits on that value when a resource of the batch is used by the frame. Resources that are copied
+	// to stay in the common state and rely on implicit promotion, so no barriers are needed on either queue. A batch
+	// that overwrites existing resources waits for the frames that were already submitted first, as they might
+	// still be reading the previous contents.
+	class CopyQueue {
+	private:
+		struct PooledAllocator {
+			ID3D12CommandAllocator *allocator;
+			UINT64 fenceValue;
+		};
+
+		Device *device;
+		ID3D12CommandQueue *d3dCommandQueue;
+		ID3D12GraphicsCommandList *d3dCommandList;
+		ID3D12CommandAllocator *d3dCommandAllocator;
+		std::deque<PooledAllocator> allocatorPool;
+		ID3D12Fence *d3dFence;
+		HANDLE d3dFenceEvent;
+		UINT64 batchFenceValue;
+		bool batchPending;
+		bool batchOverwrites;
+		unsigned int submitCount;
+		unsigned int overwriteWaitCount;
+
+		ID3D12CommandAllocator *acquireAllocator();
+	public:
+		CopyQueue(Device *device);
+		virtual ~CopyQueue();
+
+		// Command list of the open batch. Only copies can be recorded on it.
+		ID3D12GraphicsCommandList *recordCommands();
+
+		// The open batch writes to a resource that the submitted frames might still be reading.
+		void markOverwrite();
+
+		bool hasPendingCopies() const;
+
+		// Value the fence will reach once the copies recorded so far are finished.
+		UINT64 getBatchFenceValue() const;
+
+		// Submits the open batch and returns the value it signals. Overwriting batches make the queue wait until the
+		// direct fence reaches the given value first.
+		UINT64 submit(ID3D12Fence *directFence, UINT64 directFenceValue);
+
+		// Blocks until the fence reaches the value. The value must have been submitted already.
+		void wait(UINT64 fenceValue);
+
+		UINT64 getCompletedValue() const;
+		UINT64 getSubmittedValue() const;
+		ID3D12Fence *getFence() const;
+		unsigned int getSubmitCount() const;
+		unsigned int getOverwriteWaitCount() const;
+		size_t getAllocatorCount() const;
+	};
+};
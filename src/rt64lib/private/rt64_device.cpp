@@ -3,6 +3,7 @@
 //
 
 #include <cassert>
+#include <chrono>
 
 #include <dwmapi.h>
 
@@ -11,10 +12,18 @@
 #include "rt64_device.h"
 
 #ifndef RT64_MINIMAL
+#include "rt64_copy_queue.h"
 #include "rt64_inspector.h"
 #include "rt64_scene.h"
 #include "rt64_shader.h"
 #include "rt64_texture.h"
+#include "rt64_texture_atlas.h"
+#include "rt64_texture_cache.h"
+#include "rt64_texture_pack.h"
+#include "rt64_texture_residency.h"
+#include "rt64_texture_table.h"
+#include "rt64_upload_ring.h"
+#include "rt64_workers.h"
 
 #include "shaders/ComposePS.hlsl.h"
 #include "shaders/ComposeVS.hlsl.h"
@@ -32,21 +41,93 @@
 
 RT64::Device::Device(HWND hwnd) {
 	createDXGIFactory();
-	createRaytracingDevice();
+	createRaytracingDevice(false);
 
 #ifndef RT64_MINIMAL
 	assert(hwnd != 0);
 	this->hwnd = hwnd;
+	headless = false;
+	headlessWidth = 0;
+	headlessHeight = 0;
+
+	initialize();
+#endif
+}
+
+#ifndef RT64_MINIMAL
+
+RT64::Device::Device(int width, int height) {
+	assert((width > 0) && (height > 0));
+
+	// Headless devices can fall back to a software adapter, as they're meant to run without a display or a capable GPU.
+	createDXGIFactory();
+	createRaytracingDevice(true);
+
+	hwnd = 0;
+	headless = true;
+	headlessWidth = width;
+	headlessHeight = height;
+	commandLog.setEnabled(true);
+
+	initialize();
+}
+
+#endif
+
+RT64::Device::~Device() {
+#ifndef RT64_MINIMAL
+	// The frames in flight and the uploads might still be using the resources that are about to be released.
+	waitForGPU();
+	waitForCopies();
+
+	delete textureCache;
+	delete textureAtlas;
+	delete texturePack;
+	delete textureResidency;
+	delete textureTable;
+	delete uploadRing;
+	delete copyQueue;
+	delete workerPool;
+#endif
+
+	/* TODO: Re-enable once resources are properly released.
+	if (d3dAllocator != nullptr) {
+		d3dAllocator->Release();
+	}
+	*/
+}
+
+#ifndef RT64_MINIMAL
+
+void RT64::Device::initialize() {
 	d3dAllocator = nullptr;
+	d3dSwapChain = nullptr;
+	d3dRtvHeap = nullptr;
 	d3dCommandListOpen = true;
 	d3dRtStateObject = nullptr;
-	lastCommandQueueBarrierActive = false;
-	lastCopyQueueBarrierActive = false;
 	d3dRenderTargets[0] = nullptr;
 	d3dRenderTargets[1] = nullptr;
 	d3dRenderTargetReadbackRowWidth = 0;
 	d3dRtStateObjectDirty = false;
+	meshUploadCount = 0;
+	skippedMeshUploadCount = 0;
+	updateTime = 0.0f;
+	renderTime = 0.0f;
+	submitTime = 0.0f;
 	d3dTracerLibrary = nullptr;
+	workerPool = nullptr;
+	copyQueue = nullptr;
+	requiredCopyFenceValue = 0;
+	copyWaitCount = 0;
+	workerCommandListCount = 0;
+	uploadRing = nullptr;
+	textureTable = nullptr;
+	textureResidency = nullptr;
+	textureAtlas = nullptr;
+	textureCache = nullptr;
+	texturePack = nullptr;
+	textureCompressionMode = RT64_TEXTURE_COMPRESSION_NONE;
+	textureCompressionQuality = 0;
 	traceRayGenID = nullptr;
 	surfaceMissID = nullptr;
 	shadowMissID = nullptr;
@@ -58,17 +139,18 @@ RT64::Device::Device(HWND hwnd) {
 	loadAssets();
 	createDxcCompiler();
 	createRaytracingPipeline();
-#endif
-}
 
-RT64::Device::~Device() {
-	/* TODO: Re-enable once resources are properly released.
-	if (d3dAllocator != nullptr) {
-		d3dAllocator->Release();
-	}
-	*/
+	copyQueue = new CopyQueue(this);
+	uploadRing = new UploadRing(this);
+	textureTable = new TextureTable(this);
+	texturePack = new TexturePack(this);
+	textureResidency = new TextureResidency(this);
+	textureAtlas = new TextureAtlas(this);
+	textureCache = new TextureCache(this);
 }
 
+#endif
+
 void RT64::Device::createDXGIFactory() {
 	UINT dxgiFactoryFlags = 0;
 	dxgiFactory = nullptr;
@@ -86,7 +168,7 @@ void RT64::Device::createDXGIFactory() {
 	D3D12_CHECK(CreateDXGIFactory2(dxgiFactoryFlags, IID_PPV_ARGS(&dxgiFactory)));
 }
 
-void RT64::Device::createRaytracingDevice() {
+void RT64::Device::createRaytracingDevice(bool allowSoftware) {
 	d3dAdapter = nullptr;
 	d3dDevice = nullptr;
 
@@ -144,6 +226,34 @@ void RT64::Device::createRaytracingDevice() {
 		}
 	}
 
+	// Use the WARP adapter as the last resort if software adapters are allowed.
+	if ((d3dDevice == nullptr) && allowSoftware) {
+		HRESULT warpResult = dxgiFactory->EnumWarpAdapter(IID_PPV_ARGS(&d3dAdapter));
+		if (SUCCEEDED(warpResult)) {
+			HRESULT deviceResult = D3D12CreateDevice(d3dAdapter, D3D_FEATURE_LEVEL_12_1, IID_PPV_ARGS(&d3dDevice));
+			if (SUCCEEDED(deviceResult)) {
+				D3D12_FEATURE_DATA_D3D12_OPTIONS5 options5 = {};
+				HRESULT checkResult = d3dDevice->CheckFeatureSupport(D3D12_FEATURE_D3D12_OPTIONS5, &options5, sizeof(options5));
+				if (FAILED(checkResult) || (options5.RaytracingTier < D3D12_RAYTRACING_TIER_1_0)) {
+					ss << "WARP adapter: No raytracing support." << std::endl;
+					d3dDevice->Release();
+					d3dDevice = nullptr;
+				}
+			}
+			else {
+				ss << "WARP adapter: D3D12CreateDevice error code: " << std::hex << deviceResult << std::endl;
+			}
+
+			if (d3dDevice == nullptr) {
+				d3dAdapter->Release();
+				d3dAdapter = nullptr;
+			}
+		}
+		else {
+			ss << "WARP adapter: EnumWarpAdapter error code: " << std::hex << warpResult << std::endl;
+		}
+	}
+
 	// Only throw an exception if no device was detected.
 	if (d3dDevice == nullptr) {
 		throw std::runtime_error("Unable to detect a device capable of raytracing.\n" + ss.str());
@@ -153,10 +263,14 @@ void RT64::Device::createRaytracingDevice() {
 #ifndef RT64_MINIMAL
 
 void RT64::Device::updateSize() {
-	RECT rect;
-	GetClientRect(hwnd, &rect);
-	int newWidth = rect.right - rect.left;
-	int newHeight = rect.bottom - rect.top;
+	int newWidth = headlessWidth;
+	int newHeight = headlessHeight;
+	if (!headless) {
+		RECT rect;
+		GetClientRect(hwnd, &rect);
+		newWidth = rect.right - rect.left;
+		newHeight = rect.bottom - rect.top;
+	}
 
 	// Recrease the swap chain if the sizes have changed.
 	if (((newWidth != width) || (newHeight != height)) && (newWidth > 0) && (newHeight > 0)) {
@@ -167,6 +281,8 @@ void RT64::Device::updateSize() {
 		d3dScissorRect = CD3DX12_RECT(0, 0, static_cast<LONG>(width), static_cast<LONG>(height));
 
 		if (d3dSwapChain != nullptr) {
+			// The back buffers can't be resized while the frames in flight still use them.
+			waitForGPU();
 			releaseRTVs();
 			D3D12_CHECK(d3dSwapChain->ResizeBuffers(0, 0, 0, DXGI_FORMAT_UNKNOWN, 0));
 			createRTVs();
@@ -209,9 +325,17 @@ void RT64::Device::createRTVs() {
 
 	CD3DX12_CPU_DESCRIPTOR_HANDLE rtvHandle(d3dRtvHeap->GetCPUDescriptorHandleForHeapStart());
 
-	// Create a RTV for each frame.
+	// Create a RTV for each frame. Headless devices render to offscreen targets instead of the swap chain buffers.
 	for (UINT n = 0; n < FrameCount; n++) {
-		D3D12_CHECK(d3dSwapChain->GetBuffer(n, IID_PPV_ARGS(&d3dRenderTargets[n])));
+		if (headless) {
+			CD3DX12_HEAP_PROPERTIES heapProps(D3D12_HEAP_TYPE_DEFAULT);
+			CD3DX12_RESOURCE_DESC targetDesc = CD3DX12_RESOURCE_DESC::Tex2D(DXGI_FORMAT_R8G8B8A8_UNORM, width, height, 1, 1, 1, 0, D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET);
+			D3D12_CHECK(d3dDevice->CreateCommittedResource(&heapProps, D3D12_HEAP_FLAG_NONE, &targetDesc, D3D12_RESOURCE_STATE_PRESENT, nullptr, IID_PPV_ARGS(&d3dRenderTargets[n])));
+		}
+		else {
+			D3D12_CHECK(d3dSwapChain->GetBuffer(n, IID_PPV_ARGS(&d3dRenderTargets[n])));
+		}
+
 		d3dDevice->CreateRenderTargetView(d3dRenderTargets[n], nullptr, rtvHandle);
 		rtvHandle.Offset(1, d3dRtvDescriptorSize);
 	}
@@ -236,6 +360,72 @@ HWND RT64::Device::getHwnd() const {
 	return hwnd;
 }
 
+bool RT64::Device::isHeadless() const {
+	return headless;
+}
+
+RT64::CommandLog *RT64::Device::getCommandLog() {
+	return &commandLog;
+}
+
+RT64::BarrierBatcher *RT64::Device::getBarrierBatcher() {
+	return &barrierBatcher;
+}
+
+RT64::FrameScheduler *RT64::Device::getFrameScheduler() {
+	return &frameScheduler;
+}
+
+RT64::CopyQueue *RT64::Device::getCopyQueue() {
+	return copyQueue;
+}
+
+RT64::WorkerPool *RT64::Device::getWorkerPool() {
+	// The threads are only created once something needs to run work on the CPU.
+	if (workerPool == nullptr) {
+		workerPool = new WorkerPool();
+	}
+
+	return workerPool;
+}
+
+RT64::UploadRing *RT64::Device::getUploadRing() {
+	return uploadRing;
+}
+
+RT64::TextureTable *RT64::Device::getTextureTable() {
+	return textureTable;
+}
+
+RT64::TextureResidency *RT64::Device::getTextureResidency() {
+	return textureResidency;
+}
+
+RT64::TextureAtlas *RT64::Device::getTextureAtlas() {
+	return textureAtlas;
+}
+
+RT64::TextureCache *RT64::Device::getTextureCache() {
+	return textureCache;
+}
+
+RT64::TexturePack *RT64::Device::getTexturePack() {
+	return texturePack;
+}
+
+void RT64::Device::setTextureCompression(int mode, int quality) {
+	textureCompressionMode = mode;
+	textureCompressionQuality = std::min(std::max(quality, 0), RT64_TEXTURE_COMPRESSION_QUALITY_MAX);
+}
+
+int RT64::Device::getTextureCompressionMode() const {
+	return textureCompressionMode;
+}
+
+int RT64::Device::getTextureCompressionQuality() const {
+	return textureCompressionQuality;
+}
+
 ID3D12Device8 *RT64::Device::getD3D12Device() {
 	return d3dDevice;
 }
@@ -321,6 +511,7 @@ RT64::AllocatedResource RT64::Device::allocateResource(D3D12_HEAP_TYPE HeapType,
 	D3D12MA::Allocation *allocation = nullptr;
 	ID3D12Resource *resource = nullptr;
 	d3dAllocator->CreateResource(&allocationDesc, pDesc, InitialResourceState, pOptimizedClearValue, &allocation, IID_PPV_ARGS(&resource));
+	commandLog.record(CommandLog::Type::Allocation, resource, (allocation != nullptr) ? allocation->GetSize() : 0, 1);
 	return AllocatedResource(allocation);
 }
 
@@ -346,31 +537,84 @@ RT64::AllocatedResource RT64::Device::allocateBuffer(D3D12_HEAP_TYPE HeapType, u
 	D3D12MA::Allocation *allocation = nullptr;
 	ID3D12Resource *resource = nullptr;
 	d3dAllocator->CreateResource(&allocationDesc, &bufDesc, InitialResourceState, nullptr, &allocation, IID_PPV_ARGS(&resource));
+	commandLog.record(CommandLog::Type::Allocation, resource, size, 1);
 	return AllocatedResource(allocation);
 }
 
-void RT64::Device::setLastCommandQueueBarrier(const D3D12_RESOURCE_BARRIER &barrier) {
-	lastCommandQueueBarrier = barrier;
-	lastCommandQueueBarrierActive = true;
+void RT64::Device::queueTransition(ID3D12Resource *resource, D3D12_RESOURCE_STATES stateBefore, D3D12_RESOURCE_STATES stateAfter) {
+	if (!barrierBatcher.transition(resource, stateBefore, stateAfter)) {
+		throw std::runtime_error("The transition doesn't start from the state the pending barriers leave the resource in.");
+	}
+}
+
+void RT64::Device::queueUAVBarrier(ID3D12Resource *resource) {
+	barrierBatcher.uav(resource);
+}
+
+void RT64::Device::discardBarriers(ID3D12Resource *resource) {
+	barrierBatcher.discard(resource);
 }
 
-void RT64::Device::submitCommandQueueBarrier() {
-	if (lastCommandQueueBarrierActive) {
-		d3dCommandList->ResourceBarrier(1, &lastCommandQueueBarrier);
-		lastCommandQueueBarrierActive = false;
+void RT64::Device::submitBarriers() {
+	// The batch covers many resources, so it's logged as a single command without one.
+	const UINT barrierCount = barrierBatcher.flush(d3dCommandList);
+	if (barrierCount > 0) {
+		commandLog.record(CommandLog::Type::Barrier, nullptr, 0, barrierCount);
 	}
 }
 
-void RT64::Device::setLastCopyQueueBarrier(const D3D12_RESOURCE_BARRIER &barrier) {
-	lastCopyQueueBarrier = barrier;
-	lastCopyQueueBarrierActive = true;
+UINT RT64::Device::getFrameSlot() const {
+	return frameScheduler.getFrameSlot();
 }
 
-void RT64::Device::submitCopyQueueBarrier() {
-	if (lastCopyQueueBarrierActive) {
-		d3dCommandList->ResourceBarrier(1, &lastCopyQueueBarrier);
-		lastCopyQueueBarrierActive = false;
+void RT64::Device::retireResource(AllocatedResource &resource, UINT64 uploadFenceValue) {
+	// The next signal on the queue follows every command recorded so far. Requiring the upload makes that signal
+	// follow the pending copies to the resource as well.
+	if (!resource.IsNull()) {
+		requireUpload(uploadFenceValue);
 	}
+
+	discardBarriers(resource.Get());
+	frameScheduler.retire(resource, d3dFenceValue);
+	resource = AllocatedResource();
+}
+
+void RT64::Device::retireResource(AccelerationStructureBuffers &buffers) {
+	retireResource(buffers.scratch);
+	retireResource(buffers.result);
+	retireResource(buffers.instanceDesc);
+	buffers.scratchSize = buffers.resultSize = buffers.instanceDescSize = 0;
+}
+
+void RT64::Device::requireUpload(UINT64 copyFenceValue) {
+	if ((copyFenceValue > 0) && (copyFenceValue > copyQueue->getCompletedValue())) {
+		requiredCopyFenceValue = std::max(requiredCopyFenceValue, copyFenceValue);
+	}
+}
+
+void RT64::Device::submitCopies() {
+	// The allocations of the batch can be reused once the copy queue signals the value that follows it. Overwrites
+	// wait for the last value signaled on the direct queue, which follows every frame that was submitted.
+	if (copyQueue->hasPendingCopies()) {
+		uploadRing->retire(copyQueue->getBatchFenceValue());
+		copyQueue->submit(d3dFence, d3dFenceValue - 1);
+	}
+}
+
+void RT64::Device::waitForCopies() {
+	submitCopies();
+
+	const UINT64 submittedValue = copyQueue->getSubmittedValue();
+	if (copyQueue->getCompletedValue() < submittedValue) {
+		copyQueue->wait(submittedValue);
+		commandLog.record(CommandLog::Type::Wait, copyQueue->getFence(), submittedValue, 1);
+	}
+
+	uploadRing->reclaim(copyQueue->getCompletedValue());
+}
+
+unsigned int RT64::Device::getCopyWaitCount() const {
+	return copyWaitCount;
 }
 
 int RT64::Device::getWidth() const {
@@ -400,24 +644,33 @@ void RT64::Device::loadPipeline() {
 
 	D3D12_CHECK(d3dDevice->CreateCommandQueue(&queueDesc, IID_PPV_ARGS(&d3dCommandQueue)));
 
-	// Describe and create the swap chain.
-	DXGI_SWAP_CHAIN_DESC1 swapChainDesc = {};
-	swapChainDesc.BufferCount = FrameCount;
-	swapChainDesc.Width = width;
-	swapChainDesc.Height = height;
-	swapChainDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
-	swapChainDesc.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
-	swapChainDesc.SwapEffect = DXGI_SWAP_EFFECT_FLIP_DISCARD;
-	swapChainDesc.SampleDesc.Count = 1;
-
-	IDXGISwapChain1 *swapChain;
-	D3D12_CHECK(dxgiFactory->CreateSwapChainForHwnd(d3dCommandQueue, hwnd, &swapChainDesc, nullptr, nullptr, &swapChain));
-	d3dSwapChain = static_cast<IDXGISwapChain3 *>(swapChain);
-	d3dFrameIndex = d3dSwapChain->GetCurrentBackBufferIndex();
+	// Describe and create the swap chain. Headless devices have no window to present to.
+	if (headless) {
+		d3dFrameIndex = 0;
+	}
+	else {
+		DXGI_SWAP_CHAIN_DESC1 swapChainDesc = {};
+		swapChainDesc.BufferCount = FrameCount;
+		swapChainDesc.Width = width;
+		swapChainDesc.Height = height;
+		swapChainDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+		swapChainDesc.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
+		swapChainDesc.SwapEffect = DXGI_SWAP_EFFECT_FLIP_DISCARD;
+		swapChainDesc.SampleDesc.Count = 1;
+
+		IDXGISwapChain1 *swapChain;
+		D3D12_CHECK(dxgiFactory->CreateSwapChainForHwnd(d3dCommandQueue, hwnd, &swapChainDesc, nullptr, nullptr, &swapChain));
+		d3dSwapChain = static_cast<IDXGISwapChain3 *>(swapChain);
+		d3dFrameIndex = d3dSwapChain->GetCurrentBackBufferIndex();
+	}
 
 	createRTVs();
 
-	D3D12_CHECK(d3dDevice->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_DIRECT, IID_PPV_ARGS(&d3dCommandAllocator)));
+	// Every frame in flight records its commands on an allocator of its own, as an allocator can't be reset until the
+	// GPU is done with all the commands it holds.
+	for (UINT i = 0; i < FrameScheduler::FramesInFlight; i++) {
+		D3D12_CHECK(d3dDevice->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_DIRECT, IID_PPV_ARGS(&d3dCommandAllocators[i])));
+	}
 }
 
 void RT64::Device::loadAssets() {
@@ -541,7 +794,7 @@ void RT64::Device::loadAssets() {
 	}
 
 	// Create the command list.
-	D3D12_CHECK(d3dDevice->CreateCommandList(0, D3D12_COMMAND_LIST_TYPE_DIRECT, d3dCommandAllocator, nullptr, IID_PPV_ARGS(&d3dCommandList)));
+	D3D12_CHECK(d3dDevice->CreateCommandList(0, D3D12_COMMAND_LIST_TYPE_DIRECT, d3dCommandAllocators[frameScheduler.getFrameSlot()], nullptr, IID_PPV_ARGS(&d3dCommandList)));
 
 	// Create synchronization objects and wait until assets have been uploaded to the GPU.
 	D3D12_CHECK(d3dDevice->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(&d3dFence)));
@@ -669,21 +922,20 @@ ID3D12RootSignature *RT64::Device::createTracerSignature() {
 }
 
 void RT64::Device::preRender() {
-	// Submit and wait for execution if command list was open.
-	if (d3dCommandListOpen) {
-		submitCommandList();
+	// The commands recorded since the last frame are submitted along with this one. The list can only be closed if
+	// something submitted it without resetting it, so the allocator must be idle before it's reused.
+	if (!d3dCommandListOpen) {
 		waitForGPU();
+		resetCommandList();
 	}
 
-	resetCommandList();
-
 	// Set necessary state.
 	d3dCommandList->RSSetViewports(1, &d3dViewport);
 	d3dCommandList->RSSetScissorRects(1, &d3dScissorRect);
 
 	// Indicate that the back buffer will be used as a render target.
-	CD3DX12_RESOURCE_BARRIER transitionBarrier = CD3DX12_RESOURCE_BARRIER::Transition(d3dRenderTargets[d3dFrameIndex], D3D12_RESOURCE_STATE_PRESENT, D3D12_RESOURCE_STATE_RENDER_TARGET);
-	d3dCommandList->ResourceBarrier(1, &transitionBarrier);
+	queueTransition(d3dRenderTargets[d3dFrameIndex], D3D12_RESOURCE_STATE_PRESENT, D3D12_RESOURCE_STATE_RENDER_TARGET);
+	submitBarriers();
 
 	CD3DX12_CPU_DESCRIPTOR_HANDLE rtvHandle = getD3D12RTV();
 	d3dCommandList->OMSetRenderTargets(1, &rtvHandle, FALSE, nullptr);
@@ -694,29 +946,51 @@ void RT64::Device::preRender() {
 
 void RT64::Device::postRender(int vsyncInterval) {
 	// Indicate that the back buffer will now be used to present.
-	CD3DX12_RESOURCE_BARRIER transitionBarrier = CD3DX12_RESOURCE_BARRIER::Transition(d3dRenderTargets[d3dFrameIndex], D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_PRESENT);
-	d3dCommandList->ResourceBarrier(1, &transitionBarrier);
+	queueTransition(d3dRenderTargets[d3dFrameIndex], D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_PRESENT);
+	submitBarriers();
 
 	submitCommandList();
 
-	// Present the frame.
-	D3D12_CHECK(d3dSwapChain->Present(vsyncInterval, 0));
+	// Present the frame. Headless devices just rotate through their offscreen targets.
+	const UINT64 frameFenceValue = signalFence();
+	if (headless) {
+		d3dFrameIndex = (d3dFrameIndex + 1) % FrameCount;
+	}
+	else {
+		D3D12_CHECK(d3dSwapChain->Present(vsyncInterval, 0));
+		d3dFrameIndex = d3dSwapChain->GetCurrentBackBufferIndex();
+	}
 
-	waitForGPU();
-	d3dFrameIndex = d3dSwapChain->GetCurrentBackBufferIndex();
+	// Only wait for the GPU if it's still working on the last frame that used the next slot.
+	const UINT64 waitFenceValue = frameScheduler.endFrame(frameFenceValue, d3dFence->GetCompletedValue());
+	if (waitFenceValue > 0) {
+		waitForFence(waitFenceValue);
+	}
+	else {
+		collectResources();
+	}
 
 	// Leave command list open.
 	resetCommandList();
 }
 
 void RT64::Device::draw(int vsyncInterval) {
+	auto updateStart = std::chrono::steady_clock::now();
+
+	// Replace the textures whose replacements finished loading in the background.
+	texturePack->update();
+
+	// The raytracing pipeline is shared by all scenes, so their instances must be gathered again when the shader
+	// IDs change. Meshes and textures mark the instances that use them instead.
 	if (d3dRtStateObjectDirty) {
 		createRaytracingPipeline();
 		d3dRtStateObjectDirty = false;
+		for (Scene *scene : scenes) {
+			scene->markInstancesDirty();
+		}
 	}
 
-	submitCommandQueueBarrier();
-	submitCopyQueueBarrier();
+	submitBarriers();
 	
 	// Make sure that the size of the window is up to date.
 	updateSize();
@@ -726,7 +1000,11 @@ void RT64::Device::draw(int vsyncInterval) {
 		scene->update();
 	}
 
+	// Every view has copied the texture descriptors that changed by now to the heap of this frame slot.
+	textureTable->clearDirtySlots(frameScheduler.getFrameSlot());
+
 	// Render each scene.
+	auto renderStart = std::chrono::steady_clock::now();
 	preRender();
 
 	for (Scene *scene : scenes) {
@@ -739,8 +1017,10 @@ void RT64::Device::draw(int vsyncInterval) {
 
 	// Find mouse cursor position.
 	POINT cursorPos = {};
-	GetCursorPos(&cursorPos);
-	ScreenToClient(hwnd, &cursorPos);
+	if (!headless) {
+		GetCursorPos(&cursorPos);
+		ScreenToClient(hwnd, &cursorPos);
+	}
 
 	// Determine the active view (use the first available view for now).
 	View *activeView = nullptr;
@@ -759,7 +1039,19 @@ void RT64::Device::draw(int vsyncInterval) {
 		}
 	}
 
+	auto submitStart = std::chrono::steady_clock::now();
 	postRender(vsyncInterval);
+
+	auto submitEnd = std::chrono::steady_clock::now();
+	updateTime = std::chrono::duration<float, std::milli>(renderStart - updateStart).count();
+	renderTime = std::chrono::duration<float, std::milli>(submitStart - renderStart).count();
+	submitTime = std::chrono::duration<float, std::milli>(submitEnd - submitStart).count();
+
+	// The textures that weren't used can be evicted now, as their resources are only released once the frames
+	// that used them are done.
+	textureResidency->update();
+
+	commandLog.endFrame();
 }
 
 void RT64::Device::addScene(Scene *scene) {
@@ -788,6 +1080,35 @@ void RT64::Device::removeShader(Shader *shader) {
 	}
 }
 
+void RT64::Device::countMeshUpload(bool uploaded) {
+	if (uploaded) {
+		meshUploadCount++;
+	}
+	else {
+		skippedMeshUploadCount++;
+	}
+}
+
+unsigned int RT64::Device::getMeshUploadCount() const {
+	return meshUploadCount;
+}
+
+unsigned int RT64::Device::getSkippedMeshUploadCount() const {
+	return skippedMeshUploadCount;
+}
+
+float RT64::Device::getUpdateTime() const {
+	return updateTime;
+}
+
+float RT64::Device::getRenderTime() const {
+	return renderTime;
+}
+
+float RT64::Device::getSubmitTime() const {
+	return submitTime;
+}
+
 void RT64::Device::addInspector(Inspector* inspector) {
 	assert(inspector != nullptr);
 	inspectors.push_back(inspector);
@@ -799,9 +1120,15 @@ void RT64::Device::removeInspector(Inspector* inspector) {
 }
 
 void RT64::Device::resetCommandList() {
-	// Reset the command allocator.
+	// Reset the command allocator of the current frame slot.
+	ID3D12CommandAllocator *d3dCommandAllocator = d3dCommandAllocators[frameScheduler.getFrameSlot()];
 	d3dCommandAllocator->Reset();
 
+	// The worker lists were all submitted, so their allocators of the slot are done too.
+	for (WorkerCommandList &workerCommandList : workerCommandLists) {
+		workerCommandList.allocators[frameScheduler.getFrameSlot()]->Reset();
+	}
+
 	// Reset the command list.
 	d3dCommandList->Reset(d3dCommandAllocator, nullptr);
 
@@ -812,30 +1139,118 @@ void RT64::Device::submitCommandList() {
 	// Close the command list.
 	d3dCommandList->Close();
 
+	waitForRequiredUploads();
+
 	// Execute command list and signal on the fence when it's completed.
 	ID3D12CommandList *pGraphicsList = { d3dCommandList };
 	d3dCommandQueue->ExecuteCommandLists(1, &pGraphicsList);
+	commandLog.record(CommandLog::Type::Submit, d3dCommandList, 0, 1);
 
 	d3dCommandListOpen = false;
 }
 
-void RT64::Device::waitForGPU() {
-	// Schedule a signal command in the queue.
-	d3dCommandQueue->Signal(d3dFence, d3dFenceValue);
+void RT64::Device::waitForRequiredUploads() {
+	// The uploads run on the copy queue, so the lists only wait for the ones the recorded commands use.
+	if (copyQueue != nullptr) {
+		submitCopies();
+
+		// Batches that ended up empty are never signaled, but they didn't write anything either.
+		requiredCopyFenceValue = std::min(requiredCopyFenceValue, copyQueue->getSubmittedValue());
+		if (requiredCopyFenceValue > copyQueue->getCompletedValue()) {
+			d3dCommandQueue->Wait(copyQueue->getFence(), requiredCopyFenceValue);
+			commandLog.record(CommandLog::Type::Wait, copyQueue->getFence(), requiredCopyFenceValue, 1);
+			copyWaitCount++;
+		}
 
-	// Wait until the fence has been processed.
-	d3dFence->SetEventOnCompletion(d3dFenceValue, d3dFenceEvent);
-	WaitForSingleObjectEx(d3dFenceEvent, INFINITE, FALSE);
+		requiredCopyFenceValue = 0;
+	}
+}
+
+void RT64::Device::recordCommandLists(size_t listCount, const std::function<void(ID3D12GraphicsCommandList4 *, size_t)> &recordFunction) {
+	assert(d3dCommandListOpen);
+	if (listCount == 0) {
+		return;
+	}
 
-	// Increment the fence value.
+	// Every list needs allocators of its own, as they're recorded at the same time.
+	const UINT frameSlot = frameScheduler.getFrameSlot();
+	while (workerCommandLists.size() < listCount) {
+		WorkerCommandList workerCommandList;
+		for (UINT i = 0; i < FrameScheduler::FramesInFlight; i++) {
+			D3D12_CHECK(d3dDevice->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_DIRECT, IID_PPV_ARGS(&workerCommandList.allocators[i])));
+		}
+
+		D3D12_CHECK(d3dDevice->CreateCommandList(0, D3D12_COMMAND_LIST_TYPE_DIRECT, workerCommandList.allocators[frameSlot], nullptr, IID_PPV_ARGS(&workerCommandList.commandList)));
+		D3D12_CHECK(workerCommandList.commandList->Close());
+		workerCommandLists.push_back(workerCommandList);
+	}
+
+	getWorkerPool()->run(listCount, [this, frameSlot, &recordFunction](size_t listIndex) {
+		WorkerCommandList &workerCommandList = workerCommandLists[listIndex];
+		workerCommandList.commandList->Reset(workerCommandList.allocators[frameSlot], nullptr);
+		recordFunction(workerCommandList.commandList, listIndex);
+		workerCommandList.commandList->Close();
+	});
+
+	// The lists of a single submission run in order, so the worker lists go right after the commands recorded so
+	// far and before the ones recorded next.
+	d3dCommandList->Close();
+	waitForRequiredUploads();
+
+	std::vector<ID3D12CommandList *> commandLists = { d3dCommandList };
+	for (size_t i = 0; i < listCount; i++) {
+		commandLists.push_back(workerCommandLists[i].commandList);
+	}
+
+	d3dCommandQueue->ExecuteCommandLists((UINT)(commandLists.size()), commandLists.data());
+	commandLog.record(CommandLog::Type::Submit, d3dCommandList, 0, (uint32_t)(commandLists.size()));
+	workerCommandListCount += (unsigned int)(listCount);
+
+	// The list can be recorded again right away. Its allocator keeps the submitted commands until the slot is reset.
+	d3dCommandList->Reset(d3dCommandAllocators[frameSlot], nullptr);
+}
+
+unsigned int RT64::Device::getWorkerCommandListCount() const {
+	return workerCommandListCount;
+}
+
+UINT64 RT64::Device::signalFence() {
+	// Schedule a signal command in the queue and increment the fence value.
+	const UINT64 fenceValue = d3dFenceValue;
+	d3dCommandQueue->Signal(d3dFence, fenceValue);
 	d3dFenceValue++;
+	return fenceValue;
+}
+
+void RT64::Device::waitForFence(UINT64 fenceValue) {
+	// Wait until the fence has been processed.
+	if (d3dFence->GetCompletedValue() < fenceValue) {
+		d3dFence->SetEventOnCompletion(fenceValue, d3dFenceEvent);
+		WaitForSingleObjectEx(d3dFenceEvent, INFINITE, FALSE);
+	}
+
+	commandLog.record(CommandLog::Type::Wait, d3dFence, fenceValue, 1);
+
+	collectResources();
+}
+
+void RT64::Device::collectResources() {
+	// Release everything the finished commands were using. The upload ring follows the copy queue instead.
+	frameScheduler.collect(d3dFence->GetCompletedValue());
+	if (uploadRing != nullptr) {
+		uploadRing->reclaim(copyQueue->getCompletedValue());
+	}
+}
+
+void RT64::Device::waitForGPU() {
+	waitForFence(signalFence());
 }
 
 void RT64::Device::dumpRenderTarget(const std::string &path) {
 	ID3D12Resource *renderTarget = getD3D12RenderTarget();
 
-	CD3DX12_RESOURCE_BARRIER transitionBarrier = CD3DX12_RESOURCE_BARRIER::Transition(renderTarget, D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_COPY_SOURCE);
-	d3dCommandList->ResourceBarrier(1, &transitionBarrier);
+	queueTransition(renderTarget, D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_COPY_SOURCE);
+	submitBarriers();
 
 	D3D12_TEXTURE_COPY_LOCATION source = {};
 	source.pResource = renderTarget;
@@ -859,9 +1274,10 @@ void RT64::Device::dumpRenderTarget(const std::string &path) {
 	destination.Type = D3D12_TEXTURE_COPY_TYPE_PLACED_FOOTPRINT;
 
 	d3dCommandList->CopyTextureRegion(&destination, 0, 0, 0, &source, nullptr);
+	commandLog.record(CommandLog::Type::Copy, renderTarget, d3dRenderTargetReadbackRowWidth * height, 1);
 
-	transitionBarrier = CD3DX12_RESOURCE_BARRIER::Transition(renderTarget, D3D12_RESOURCE_STATE_COPY_SOURCE, D3D12_RESOURCE_STATE_RENDER_TARGET);
-	d3dCommandList->ResourceBarrier(1, &transitionBarrier);
+	queueTransition(renderTarget, D3D12_RESOURCE_STATE_COPY_SOURCE, D3D12_RESOURCE_STATE_RENDER_TARGET);
+	submitBarriers();
 
 	// Wait until the resource is actually copied.
 	submitCommandList();
@@ -923,4 +1339,94 @@ DLLEXPORT void RT64_DrawDevice(RT64_DEVICE *devicePtr, int vsyncInterval) {
 	RT64_CATCH_EXCEPTION();
 }
 
+DLLEXPORT RT64_DEVICE *RT64_CreateHeadlessDevice(int width, int height) {
+	try {
+		return (RT64_DEVICE *)(new RT64::Device(width, height));
+	}
+	RT64_CATCH_EXCEPTION();
+	return nullptr;
+}
+
+DLLEXPORT int RT64_GetDeviceCommandLog(RT64_DEVICE *devicePtr, RT64_COMMAND *commands, int maxCommands) {
+	assert(devicePtr != nullptr);
+	RT64::Device *device = (RT64::Device *)(devicePtr);
+	const auto &frameCommands = device->getCommandLog()->getFrameCommands();
+
+	// Return the total amount of commands recorded during the last frame so the caller can query the size first.
+	int commandCount = (int)(frameCommands.size());
+	if (commands != nullptr) {
+		int copyCount = std::min(commandCount, maxCommands);
+		for (int i = 0; i < copyCount; i++) {
+			commands[i].type = (int)(frameCommands[i].type);
+			commands[i].resource = frameCommands[i].resource;
+			commands[i].size = frameCommands[i].size;
+			commands[i].count = frameCommands[i].count;
+		}
+	}
+
+	return commandCount;
+}
+
+DLLEXPORT void RT64_SetDeviceTextureCompression(RT64_DEVICE *devicePtr, int mode, int quality) {
+	assert(devicePtr != nullptr);
+	RT64::Device *device = (RT64::Device *)(devicePtr);
+	device->setTextureCompression(mode, quality);
+}
+
+DLLEXPORT void RT64_SetDeviceTextureBudget(RT64_DEVICE *devicePtr, unsigned long long budget) {
+	assert(devicePtr != nullptr);
+	RT64::Device *device = (RT64::Device *)(devicePtr);
+	device->getTextureResidency()->setBudget(budget);
+}
+
+DLLEXPORT bool RT64_LoadTexturePack(RT64_DEVICE *devicePtr, const char *path) {
+	assert(devicePtr != nullptr);
+	assert(path != nullptr);
+	RT64::Device *device = (RT64::Device *)(devicePtr);
+	try {
+		device->getTexturePack()->load(path);
+		return true;
+	}
+	RT64_CATCH_EXCEPTION();
+	return false;
+}
+
+DLLEXPORT void RT64_UnloadTexturePack(RT64_DEVICE *devicePtr) {
+	assert(devicePtr != nullptr);
+	RT64::Device *device = (RT64::Device *)(devicePtr);
+	device->getTexturePack()->unload();
+}
+
+DLLEXPORT void RT64_GetDeviceTextureResidency(RT64_DEVICE *devicePtr, RT64_TEXTURE_RESIDENCY *residency) {
+	assert(devicePtr != nullptr);
+	assert(residency != nullptr);
+	RT64::Device *device = (RT64::Device *)(devicePtr);
+	RT64::TextureResidency *textureResidency = device->getTextureResidency();
+	residency->budget = textureResidency->getBudget();
+	residency->residentSize = textureResidency->getResidentSize();
+	residency->evictedCount = textureResidency->getEvictedCount();
+	residency->evictionCount = textureResidency->getEvictionCount();
+	residency->restoreCount = textureResidency->getRestoreCount();
+}
+
+DLLEXPORT void RT64_GetDeviceUploadRing(RT64_DEVICE *devicePtr, RT64_UPLOAD_RING *uploadRing) {
+	assert(devicePtr != nullptr);
+	assert(uploadRing != nullptr);
+	RT64::Device *device = (RT64::Device *)(devicePtr);
+	RT64::UploadRing *deviceUploadRing = device->getUploadRing();
+	uploadRing->size = deviceUploadRing->getSize();
+	uploadRing->usedSize = deviceUploadRing->getUsedSize();
+	uploadRing->peakSize = deviceUploadRing->getPeakSize();
+	uploadRing->flushCount = deviceUploadRing->getFlushCount();
+}
+
+DLLEXPORT void RT64_GetDeviceFrameTimes(RT64_DEVICE *devicePtr, RT64_FRAME_TIMES *frameTimes) {
+	assert(devicePtr != nullptr);
+	assert(frameTimes != nullptr);
+	RT64::Device *device = (RT64::Device *)(devicePtr);
+	frameTimes->updateTime = device->getUpdateTime();
+	frameTimes->renderTime = device->getRenderTime();
+	frameTimes->submitTime = device->getSubmitTime();
+}
+
 #endif
\ No newline at end of file
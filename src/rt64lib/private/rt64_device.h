@@ -6,7 +6,13 @@
 
 #include "rt64_common.h"
 
+#include <functional>
+
 #ifndef RT64_MINIMAL
+#include "rt64_barrier_batcher.h"
+#include "rt64_command_log.h"
+#include "rt64_frame_scheduler.h"
+
 #include "nv_helpers_dx12/BottomLevelASGenerator.h"
 #include "nv_helpers_dx12/RaytracingPipelineGenerator.h"
 #include "nv_helpers_dx12/RootSignatureGenerator.h"
@@ -14,10 +20,18 @@
 #endif
 
 namespace RT64 {
+	class CopyQueue;
 	class Scene;
 	class Shader;
 	class Inspector;
 	class Texture;
+	class TextureAtlas;
+	class TextureCache;
+	class TexturePack;
+	class TextureResidency;
+	class TextureTable;
+	class UploadRing;
+	class WorkerPool;
 
 	class Device {
 	private:
@@ -26,12 +40,20 @@ namespace RT64 {
 		IDXGIFactory4 *dxgiFactory;
 
 		void createDXGIFactory();
-		void createRaytracingDevice();
+		void createRaytracingDevice(bool allowSoftware);
 
 #ifndef RT64_MINIMAL
 		static const UINT FrameCount = 2;
 
+		struct WorkerCommandList {
+			ID3D12GraphicsCommandList4 *commandList;
+			ID3D12CommandAllocator *allocators[FrameScheduler::FramesInFlight];
+		};
+
 		HWND hwnd;
+		bool headless;
+		int headlessWidth;
+		int headlessHeight;
 		int width;
 		int height;
 		float aspectRatio;
@@ -52,7 +74,7 @@ namespace RT64 {
 		ID3D12Resource *d3dRenderTargets[FrameCount];
 		AllocatedResource d3dRenderTargetReadback;
 		UINT d3dRenderTargetReadbackRowWidth;
-		ID3D12CommandAllocator *d3dCommandAllocator;
+		ID3D12CommandAllocator *d3dCommandAllocators[FrameScheduler::FramesInFlight];
 		ID3D12DescriptorHeap *d3dRtvHeap;
 		ID3D12DescriptorHeap *d3dDsvHeap;
 		ID3D12RootSignature *d3dComposeRootSignature;
@@ -72,12 +94,31 @@ namespace RT64 {
 		ID3D12StateObject *d3dRtStateObject;
 		ID3D12StateObjectProperties *d3dRtStateObjectProps;
 		bool d3dRtStateObjectDirty;
-		D3D12_RESOURCE_BARRIER lastCommandQueueBarrier;
-		bool lastCommandQueueBarrierActive;
-		D3D12_RESOURCE_BARRIER lastCopyQueueBarrier;
-		bool lastCopyQueueBarrierActive;
+		unsigned int meshUploadCount;
+		unsigned int skippedMeshUploadCount;
+		float updateTime;
+		float renderTime;
+		float submitTime;
 		bool d3dCommandListOpen;
+		CommandLog commandLog;
+		BarrierBatcher barrierBatcher;
+		FrameScheduler frameScheduler;
+		CopyQueue *copyQueue;
+		UINT64 requiredCopyFenceValue;
+		unsigned int copyWaitCount;
+		std::vector<WorkerCommandList> workerCommandLists;
+		unsigned int workerCommandListCount;
+		WorkerPool *workerPool;
+		UploadRing *uploadRing;
+		TextureTable *textureTable;
+		TextureResidency *textureResidency;
+		TextureAtlas *textureAtlas;
+		TextureCache *textureCache;
+		TexturePack *texturePack;
+		int textureCompressionMode;
+		int textureCompressionQuality;
 
+		void initialize();
 		void updateSize();
 		void releaseRTVs();
 		void createRTVs();
@@ -88,9 +129,19 @@ namespace RT64 {
 		ID3D12RootSignature *createTracerSignature();
 		void preRender();
 		void postRender(int vsyncInterval);
+		UINT64 signalFence();
+		void waitForFence(UINT64 fenceValue);
+		void collectResources();
+		void waitForRequiredUploads();
 #endif
 	public:
 		Device(HWND hwnd);
+#ifndef RT64_MINIMAL
+		// Renders to offscreen targets instead of a window. It still needs the D3D12 runtime, and falls back to the
+		// WARP adapter when no GPU can raytrace, so it's meant for Windows machines without a display or a capable GPU.
+		// There's no backend without D3D12.
+		Device(int width, int height);
+#endif
 		virtual ~Device();
 #ifndef RT64_MINIMAL
 		void draw(int vsyncInterval);
@@ -98,9 +149,39 @@ namespace RT64 {
 		void removeScene(Scene *scene);
 		void addShader(Shader *shader);
 		void removeShader(Shader *shader);
+		void countMeshUpload(bool uploaded);
+
+		// Amount of mesh buffers that were uploaded or skipped because their contents didn't change.
+		unsigned int getMeshUploadCount() const;
+		unsigned int getSkippedMeshUploadCount() const;
+
+		// CPU time in milliseconds spent by the last frame updating the scenes, recording their commands and submitting
+		// them. Submitting includes the time spent waiting for the GPU to free a frame slot.
+		float getUpdateTime() const;
+		float getRenderTime() const;
+		float getSubmitTime() const;
+
 		void addInspector(Inspector* inspector);
 		void removeInspector(Inspector* inspector);
 		HWND getHwnd() const;
+		bool isHeadless() const;
+		CommandLog *getCommandLog();
+		BarrierBatcher *getBarrierBatcher();
+		FrameScheduler *getFrameScheduler();
+		CopyQueue *getCopyQueue();
+		WorkerPool *getWorkerPool();
+		UploadRing *getUploadRing();
+		TextureTable *getTextureTable();
+		TextureResidency *getTextureResidency();
+		TextureAtlas *getTextureAtlas();
+		TextureCache *getTextureCache();
+		TexturePack *getTexturePack();
+
+		// Block compression used for the textures created from now on. Textures that already exist keep their format.
+		void setTextureCompression(int mode, int quality);
+		int getTextureCompressionMode() const;
+		int getTextureCompressionQuality() const;
+
 		ID3D12Device8 *getD3D12Device();
 		ID3D12GraphicsCommandList4 *getD3D12CommandList();
 		ID3D12StateObject *getD3D12RtStateObject();
@@ -122,15 +203,51 @@ namespace RT64 {
 		CD3DX12_RECT getD3D12ScissorRect(); 
 		AllocatedResource allocateResource(D3D12_HEAP_TYPE HeapType, _In_  const D3D12_RESOURCE_DESC *pDesc, D3D12_RESOURCE_STATES InitialResourceState, _In_opt_  const D3D12_CLEAR_VALUE *pOptimizedClearValue, bool committed = false, bool shared = false);
 		AllocatedResource allocateBuffer(D3D12_HEAP_TYPE HeapType, uint64_t size, D3D12_RESOURCE_FLAGS flags, D3D12_RESOURCE_STATES InitialResourceState, bool committed = false, bool shared = false);
-		void setLastCommandQueueBarrier(const D3D12_RESOURCE_BARRIER &barrier);
-		void submitCommandQueueBarrier();
-		void setLastCopyQueueBarrier(const D3D12_RESOURCE_BARRIER &barrier);
-		void submitCopyQueueBarrier();
+
+		// Barriers are queued and recorded together on the next submission. The ones of resources created or updated
+		// outside of the frame are submitted once the frame starts, and the frame submits its own transitions
+		// right before the commands that need them.
+		void queueTransition(ID3D12Resource *resource, D3D12_RESOURCE_STATES stateBefore, D3D12_RESOURCE_STATES stateAfter);
+		void queueUAVBarrier(ID3D12Resource *resource);
+		void discardBarriers(ID3D12Resource *resource);
+		void submitBarriers();
+
+		// Slot of the frame being recorded. Resources that are rewritten every frame keep one copy per slot, and the
+		// copy of the current slot is no longer in use by the GPU.
+		UINT getFrameSlot() const;
+
+		// Releases a shared resource once the frames that were recorded up to this point are finished. The handle
+		// is cleared right away. Resources that were uploaded must pass the copy fence value of their last upload,
+		// so they're not released while the copy queue is still writing to them.
+		void retireResource(AllocatedResource &resource, UINT64 uploadFenceValue = 0);
+		void retireResource(AccelerationStructureBuffers &buffers);
+
+		// The commands recorded this frame use a resource that is written by the copy queue, so the next submission
+		// of the direct queue waits until the copy fence reaches the value. Values that were already reached are
+		// ignored, so the frames only wait for the uploads they actually use.
+		void requireUpload(UINT64 copyFenceValue);
+
+		// Submits the copies recorded so far, or blocks until every submitted copy is finished.
+		void submitCopies();
+		void waitForCopies();
+
+		// Amount of submissions of the direct queue that had to wait for the copy queue.
+		unsigned int getCopyWaitCount() const;
+
 		int getWidth() const;
 		int getHeight() const;
 		float getAspectRatio() const;
 		void resetCommandList();
 		void submitCommandList();
+
+		// Runs the function on the worker threads to record listCount command lists at the same time, and submits
+		// them in order after the commands recorded so far. The lists start without any state. The device command
+		// list is submitted along with them and reset, so the state the next commands rely on must be set again.
+		void recordCommandLists(size_t listCount, const std::function<void(ID3D12GraphicsCommandList4 *, size_t)> &recordFunction);
+
+		// Amount of command lists recorded by the worker threads since the device was created.
+		unsigned int getWorkerCommandListCount() const;
+
 		void waitForGPU();
 		void dumpRenderTarget(const std::string &path);
 #endif
@@ -0,0 +1,91 @@
+//
+// RT64
+//
+
+#ifndef RT64_MINIMAL
+
+#include "rt64_frame_scheduler.h"
+
+// Private
+
+RT64::FrameScheduler::FrameScheduler() {
+	frameSlot = 0;
+	frameCount = 0;
+	stallCount = 0;
+
+	for (UINT i = 0; i < FramesInFlight; i++) {
+		frameFenceValues[i] = 0;
+	}
+}
+
+RT64::FrameScheduler::~FrameScheduler() {
+	releaseAll();
+}
+
+UINT64 RT64::FrameScheduler::endFrame(UINT64 signaledFenceValue, UINT64 completedFenceValue) {
+	assert(signaledFenceValue > frameFenceValues[frameSlot]);
+
+	frameFenceValues[frameSlot] = signaledFenceValue;
+	frameSlot = (frameSlot + 1) % FramesInFlight;
+	frameCount++;
+
+	const UINT64 waitFenceValue = frameFenceValues[frameSlot];
+	if (waitFenceValue <= completedFenceValue) {
+		return 0;
+	}
+
+	stallCount++;
+	return waitFenceValue;
+}
+
+void RT64::FrameScheduler::retire(AllocatedResource resource, UINT64 fenceValue) {
+	if (resource.IsNull()) {
+		return;
+	}
+
+	// Fence values only grow, so the resources stay sorted by the order they can be released in.
+	assert(retiredResources.empty() || (retiredResources.back().fenceValue <= fenceValue));
+	retiredResources.push_back({ resource, fenceValue });
+}
+
+void RT64::FrameScheduler::releaseResource(AllocatedResource &resource) {
+	resource.Release();
+}
+
+void RT64::FrameScheduler::collect(UINT64 completedFenceValue) {
+	while (!retiredResources.empty() && (retiredResources.front().fenceValue <= completedFenceValue)) {
+		releaseResource(retiredResources.front().resource);
+		retiredResources.pop_front();
+	}
+}
+
+void RT64::FrameScheduler::releaseAll() {
+	for (RetiredResource &retiredResource : retiredResources) {
+		releaseResource(retiredResource.resource);
+	}
+
+	retiredResources.clear();
+}
+
+UINT RT64::FrameScheduler::getFrameSlot() const {
+	return frameSlot;
+}
+
+UINT64 RT64::FrameScheduler::getFrameFenceValue(UINT slot) const {
+	assert(slot < FramesInFlight);
+	return frameFenceValues[slot];
+}
+
+size_t RT64::FrameScheduler::getRetiredCount() const {
+	return retiredResources.size();
+}
+
+unsigned int RT64::FrameScheduler::getFrameCount() const {
+	return frameCount;
+}
+
+unsigned int RT64::FrameScheduler::getStallCount() const {
+	return stallCount;
+}
+
+#endif
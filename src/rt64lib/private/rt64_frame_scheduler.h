@@ -0,0 +1,59 @@
+//
+// RT64
+//
+
+#pragma once
+
+#include "rt64_common.h"
+
+#include <deque>
+
+namespace RT64 {
+	// Keeps track of the frames the GPU is still working on. Each frame slot owns the resources that are rewritten
+	// every frame, and a slot can only be recorded again once the fence value signaled after its last frame is
+	// reached. Shared resources that are replaced while frames are in flight are retired with the fence value that
+	// follows the commands that use them, and released once it's reached. The scheduler only deals with fence
+	// values, so it can be driven by a simulated fence as well.
+	class FrameScheduler {
+	public:
+		static const UINT FramesInFlight = 2;
+	private:
+		struct RetiredResource {
+			AllocatedResource resource;
+			UINT64 fenceValue;
+		};
+
+		UINT frameSlot;
+		UINT64 frameFenceValues[FramesInFlight];
+		std::deque<RetiredResource> retiredResources;
+		unsigned int frameCount;
+		unsigned int stallCount;
+	protected:
+		// Called for every retired resource once it can be released.
+		virtual void releaseResource(AllocatedResource &resource);
+	public:
+		FrameScheduler();
+		virtual ~FrameScheduler();
+
+		// Records the fence value signaled after the frame of the current slot and moves on to the next slot.
+		// Returns the fence value that must be waited on before the new slot can be recorded, or zero if the GPU
+		// already finished the last frame of the slot or the slot was never used.
+		UINT64 endFrame(UINT64 signaledFenceValue, UINT64 completedFenceValue);
+
+		// The resource is released once the fence value is completed. Null resources are ignored.
+		void retire(AllocatedResource resource, UINT64 fenceValue);
+
+		// Releases the retired resources whose fence value was completed.
+		void collect(UINT64 completedFenceValue);
+
+		// Releases all the retired resources. The GPU must be idle. Subclasses that override the release must call
+		// this before they're destroyed, as the destructor can only use the default one.
+		void releaseAll();
+
+		UINT getFrameSlot() const;
+		UINT64 getFrameFenceValue(UINT slot) const;
+		size_t getRetiredCount() const;
+		unsigned int getFrameCount() const;
+		unsigned int getStallCount() const;
+	};
+};
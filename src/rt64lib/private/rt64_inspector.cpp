@@ -6,8 +6,14 @@
 
 #include "rt64_inspector.h"
 
+#include "rt64_copy_queue.h"
 #include "rt64_device.h"
 #include "rt64_scene.h"
+#include "rt64_texture_atlas.h"
+#include "rt64_texture_cache.h"
+#include "rt64_texture_pack.h"
+#include "rt64_texture_residency.h"
+#include "rt64_upload_ring.h"
 #include "rt64_view.h"
 
 #include "im3d/im3d.h"
@@ -56,7 +62,7 @@ RT64::Inspector::Inspector(Device* device) {
     D3D12_CHECK(device->getD3D12Device()->CreateDescriptorHeap(&desc, IID_PPV_ARGS(&d3dSrvDescHeap)));
 
     ImGui_ImplWin32_Init(device->getHwnd());
-    ImGui_ImplDX12_Init(device->getD3D12Device(), 2, DXGI_FORMAT_R8G8B8A8_UNORM, d3dSrvDescHeap, d3dSrvDescHeap->GetCPUDescriptorHandleForHeapStart(), d3dSrvDescHeap->GetGPUDescriptorHandleForHeapStart());
+    ImGui_ImplDX12_Init(device->getD3D12Device(), FrameScheduler::FramesInFlight, DXGI_FORMAT_R8G8B8A8_UNORM, d3dSrvDescHeap, d3dSrvDescHeap->GetCPUDescriptorHandleForHeapStart(), d3dSrvDescHeap->GetGPUDescriptorHandleForHeapStart());
 
     device->addInspector(this);
 }
@@ -134,6 +140,45 @@ void RT64::Inspector::renderViewParams(View *view) {
     ImGui::DragInt("Resolution %", &resScale, 1, 1, 200);
     ImGui::Checkbox("NVIDIA OptiX Denoiser", &denoiser);
 
+    // Acceleration structure statistics.
+    ImGui::Text("TLAS rebuilds: %u", view->getTopLevelASRebuildCount());
+    ImGui::Text("TLAS refits: %u", view->getTopLevelASRefitCount());
+    ImGui::Text("SBT record writes: %u", view->getShaderTableWriteCount());
+    const RT64_RASTER_STATS &rasterStats = view->getRasterStats();
+    ImGui::Text("Raster draws: %u for %u instances (%u pipeline, %u root signature and %u mesh changes)", rasterStats.drawCount, rasterStats.instanceCount, rasterStats.pipelineChanges, rasterStats.rootSignatureChanges, rasterStats.meshChanges);
+    ImGui::Text("Mesh uploads: %u (skipped %u)", device->getMeshUploadCount(), device->getSkippedMeshUploadCount());
+
+    // Texture cache statistics.
+    TextureCache *textureCache = device->getTextureCache();
+    ImGui::Text("Texture cache: %u hits, %u misses", textureCache->getHitCount(), textureCache->getMissCount());
+    ImGui::Text("Texture cache saved: %.2f MB", textureCache->getBytesSaved() / (1024.0 * 1024.0));
+
+    TextureAtlas *textureAtlas = device->getTextureAtlas();
+    ImGui::Text("Texture atlas: %u textures in %u pages", textureAtlas->getRegionCount(), textureAtlas->getPageCount());
+
+    TextureResidency *textureResidency = device->getTextureResidency();
+    ImGui::Text("Texture residency: %.2f / %.2f MB", textureResidency->getResidentSize() / (1024.0 * 1024.0), textureResidency->getBudget() / (1024.0 * 1024.0));
+    ImGui::Text("Texture evictions: %u (restored %u, evicted now %u)", textureResidency->getEvictionCount(), textureResidency->getRestoreCount(), textureResidency->getEvictedCount());
+
+    BarrierBatcher *barrierBatcher = device->getBarrierBatcher();
+    ImGui::Text("Barriers: %u in %u batches (merged %u)", barrierBatcher->getFlushedCount(), barrierBatcher->getFlushCount(), barrierBatcher->getMergedCount());
+
+    UploadRing *uploadRing = device->getUploadRing();
+    ImGui::Text("Upload ring: %.2f / %.2f MB (peak %.2f MB, %u flushes)", uploadRing->getUsedSize() / (1024.0 * 1024.0), uploadRing->getSize() / (1024.0 * 1024.0), uploadRing->getPeakSize() / (1024.0 * 1024.0), uploadRing->getFlushCount());
+
+    CopyQueue *copyQueue = device->getCopyQueue();
+    ImGui::Text("Copy queue: %u batches (%u waited on frames, %zu allocators), frames waited on uploads %u times", copyQueue->getSubmitCount(), copyQueue->getOverwriteWaitCount(), copyQueue->getAllocatorCount(), device->getCopyWaitCount());
+
+    ImGui::Text("Worker command lists: %u", device->getWorkerCommandListCount());
+
+    FrameScheduler *frameScheduler = device->getFrameScheduler();
+    ImGui::Text("Frames in flight: %u (waited on %u of %u frames, %zu resources retired)", FrameScheduler::FramesInFlight, frameScheduler->getStallCount(), frameScheduler->getFrameCount(), frameScheduler->getRetiredCount());
+
+    TexturePack *texturePack = device->getTexturePack();
+    if (texturePack->isLoaded()) {
+        ImGui::Text("Texture pack: %u entries, %u replaced, %u loading", texturePack->getEntryCount(), texturePack->getReplacementCount(), texturePack->getPendingCount());
+    }
+
     // Dumping toggle.
     bool isDumping = !dumpPath.empty();
     if (ImGui::Button(isDumping ? "Stop dump" : "Dump frames")) {
@@ -6,7 +6,9 @@
 
 #include "../public/rt64.h"
 #include "rt64_instance.h"
+#include "rt64_mesh.h"
 #include "rt64_scene.h"
+#include "rt64_texture.h"
 
 // Private
 
@@ -26,16 +28,80 @@ RT64::Instance::Instance(Scene *scene) {
 	scissorRect = { 0, 0, 0, 0 };
 	viewportRect = { 0, 0, 0, 0 };
 	flags = 0;
+	dirtyMask = 0;
 
 	scene->addInstance(this);
 }
 
 RT64::Instance::~Instance() {
+	if (mesh != nullptr) {
+		mesh->removeInstance(this);
+	}
+
+	for (Texture *texture : { diffuseTexture, normalTexture, specularTexture }) {
+		if (texture != nullptr) {
+			texture->removeInstance(this);
+		}
+	}
+
 	scene->removeInstance(this);
 }
 
+void RT64::Instance::markDirty(unsigned int mask) {
+	// The scene only needs to know about the instance the first time it changes.
+	if (dirtyMask == 0) {
+		scene->markInstanceDirty(this);
+	}
+
+	dirtyMask |= mask;
+}
+
+void RT64::Instance::detachMesh(Mesh *mesh) {
+	if (this->mesh == mesh) {
+		this->mesh = nullptr;
+		markDirty(DirtyMesh);
+	}
+}
+
+void RT64::Instance::detachTexture(Texture *texture) {
+	for (Texture **current : { &diffuseTexture, &normalTexture, &specularTexture }) {
+		if (*current == texture) {
+			*current = nullptr;
+			markDirty(DirtyTextures);
+		}
+	}
+}
+
+void RT64::Instance::setTexture(Texture *&current, Texture *texture) {
+	if (current != texture) {
+		// The textures tell the instances that use them when their slots change.
+		if (current != nullptr) {
+			current->removeInstance(this);
+		}
+
+		if (texture != nullptr) {
+			texture->addInstance(this);
+		}
+
+		current = texture;
+		markDirty(DirtyTextures);
+	}
+}
+
 void RT64::Instance::setMesh(Mesh* mesh) {
-	this->mesh = mesh;
+	if (this->mesh != mesh) {
+		// The meshes tell the instances that use them when their buffers change.
+		if (this->mesh != nullptr) {
+			this->mesh->removeInstance(this);
+		}
+
+		if (mesh != nullptr) {
+			mesh->addInstance(this);
+		}
+
+		this->mesh = mesh;
+		markDirty(DirtyMesh);
+	}
 }
 
 RT64::Mesh* RT64::Instance::getMesh() const {
@@ -43,7 +109,10 @@ RT64::Mesh* RT64::Instance::getMesh() const {
 }
 
 void RT64::Instance::setMaterial(const RT64_MATERIAL &material) {
-	this->material = material;
+	if (memcmp(&this->material, &material, sizeof(RT64_MATERIAL)) != 0) {
+		this->material = material;
+		markDirty(DirtyMaterial);
+	}
 }
 
 const RT64_MATERIAL &RT64::Instance::getMaterial() const {
@@ -51,7 +120,10 @@ const RT64_MATERIAL &RT64::Instance::getMaterial() const {
 }
 
 void RT64::Instance::setShader(Shader *shader) {
-	this->shader = shader;
+	if (this->shader != shader) {
+		this->shader = shader;
+		markDirty(DirtyShader);
+	}
 }
 
 RT64::Shader *RT64::Instance::getShader() const {
@@ -59,7 +131,7 @@ RT64::Shader *RT64::Instance::getShader() const {
 }
 
 void RT64::Instance::setDiffuseTexture(Texture *texture) {
-	this->diffuseTexture = texture;
+	setTexture(diffuseTexture, texture);
 }
 
 RT64::Texture *RT64::Instance::getDiffuseTexture() const {
@@ -67,7 +139,7 @@ RT64::Texture *RT64::Instance::getDiffuseTexture() const {
 }
 
 void RT64::Instance::setNormalTexture(Texture* texture) {
-	this->normalTexture = texture;
+	setTexture(normalTexture, texture);
 }
 
 RT64::Texture* RT64::Instance::getNormalTexture() const {
@@ -75,7 +147,7 @@ RT64::Texture* RT64::Instance::getNormalTexture() const {
 }
 
 void RT64::Instance::setSpecularTexture(Texture* texture) {
-	this->specularTexture = texture;
+	setTexture(specularTexture, texture);
 }
 
 RT64::Texture* RT64::Instance::getSpecularTexture() const {
@@ -83,12 +155,17 @@ RT64::Texture* RT64::Instance::getSpecularTexture() const {
 }
 
 void RT64::Instance::setTransform(float m[4][4]) {
-	transform = XMMATRIX(
+	XMMATRIX newTransform = XMMATRIX(
 		m[0][0], m[0][1], m[0][2], m[0][3],
 		m[1][0], m[1][1], m[1][2], m[1][3],
 		m[2][0], m[2][1], m[2][2], m[2][3],
 		m[3][0], m[3][1], m[3][2], m[3][3]
 	);
+
+	if (memcmp(&transform, &newTransform, sizeof(XMMATRIX)) != 0) {
+		transform = newTransform;
+		markDirty(DirtyTransform);
+	}
 }
 
 XMMATRIX RT64::Instance::getTransform() const {
@@ -96,7 +173,10 @@ XMMATRIX RT64::Instance::getTransform() const {
 }
 
 void RT64::Instance::setScissorRect(const RT64_RECT &rect) {
-	scissorRect = rect;
+	if (memcmp(&scissorRect, &rect, sizeof(RT64_RECT)) != 0) {
+		scissorRect = rect;
+		markDirty(DirtyRects);
+	}
 }
 
 RT64_RECT RT64::Instance::getScissorRect() const {
@@ -108,7 +188,10 @@ bool RT64::Instance::hasScissorRect() const {
 }
 
 void RT64::Instance::setViewportRect(const RT64_RECT &rect) {
-	viewportRect = rect;
+	if (memcmp(&viewportRect, &rect, sizeof(RT64_RECT)) != 0) {
+		viewportRect = rect;
+		markDirty(DirtyRects);
+	}
 }
 
 RT64_RECT RT64::Instance::getViewportRect() const {
@@ -120,13 +203,24 @@ bool RT64::Instance::hasViewportRect() const {
 }
 
 void RT64::Instance::setFlags(int v) {
-	flags = v;
+	if (flags != (unsigned int)(v)) {
+		flags = v;
+		markDirty(DirtyFlags);
+	}
 }
 
 unsigned int RT64::Instance::getFlags() const {
 	return flags;
 }
 
+unsigned int RT64::Instance::getDirtyMask() const {
+	return dirtyMask;
+}
+
+void RT64::Instance::clearDirtyMask() {
+	dirtyMask = 0;
+}
+
 // Public
 
 DLLEXPORT RT64_INSTANCE *RT64_CreateInstance(RT64_SCENE *scenePtr) {
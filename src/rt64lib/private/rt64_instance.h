@@ -13,6 +13,19 @@ namespace RT64 {
 	class Texture;
 
 	class Instance {
+	public:
+		// Parts of the instance that changed since the last time the scene was updated.
+		static const unsigned int DirtyTransform = 0x1;
+		static const unsigned int DirtyMaterial = 0x2;
+		static const unsigned int DirtyMesh = 0x4;
+		static const unsigned int DirtyTextures = 0x8;
+		static const unsigned int DirtyShader = 0x10;
+		static const unsigned int DirtyFlags = 0x20;
+		static const unsigned int DirtyRects = 0x40;
+
+		// The buffers or the BLAS of the mesh were replaced, or the BLAS was only rebuilt in place.
+		static const unsigned int DirtyMeshBuffers = 0x80;
+		static const unsigned int DirtyMeshGeometry = 0x100;
 	private:
 		Scene *scene;
 		Mesh *mesh;
@@ -25,9 +38,17 @@ namespace RT64 {
 		RT64_RECT scissorRect;
 		RT64_RECT viewportRect;
 		unsigned int flags;
+		unsigned int dirtyMask;
+
+		void setTexture(Texture *&current, Texture *texture);
 	public:
 		Instance(Scene *scene);
 		virtual ~Instance();
+		void markDirty(unsigned int mask);
+
+		// Meshes and textures that are destroyed while the instance still uses them are removed from it.
+		void detachMesh(Mesh *mesh);
+		void detachTexture(Texture *texture);
 		void setMesh(Mesh *mesh);
 		Mesh *getMesh() const;
 		void setMaterial(const RT64_MATERIAL &material);
@@ -50,5 +71,7 @@ namespace RT64 {
 		bool hasViewportRect() const;
 		void setFlags(int v);
 		unsigned int getFlags() const;
+		unsigned int getDirtyMask() const;
+		void clearDirtyMask();
 	};
 };
\ No newline at end of file
@@ -5,11 +5,94 @@
 #ifndef RT64_MINIMAL
 
 #include "../public/rt64.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
+
 #include "rt64_mesh.h"
+#include "rt64_copy_queue.h"
 #include "rt64_device.h"
+#include "rt64_instance.h"
+#include "rt64_upload_ring.h"
+
+#include "xxhash/xxhash64.h"
+
+#if defined(_M_X64) || defined(__SSE2__)
+#	include <emmintrin.h>
+#	define RT64_MESH_SSE2
+#endif
+
+namespace {
+	const size_t SampleBlockSize = 16;
+
+	// Offset of one of the blocks sampled across a buffer. The first and the last blocks are always included.
+	inline size_t sampleBlockOffset(size_t size, size_t sampleSize, size_t block) {
+		const size_t blockCount = sampleSize / SampleBlockSize;
+		return (size - SampleBlockSize) * block / (blockCount - 1);
+	}
+
+	// Buffers smaller than the sample are copied and compared whole.
+	void copySample(const uint8_t *bytes, size_t size, uint8_t *sample, size_t sampleSize) {
+		if (size <= sampleSize) {
+			memcpy(sample, bytes, size);
+			return;
+		}
+
+		for (size_t i = 0; i < sampleSize / SampleBlockSize; i++) {
+			memcpy(sample + i * SampleBlockSize, bytes + sampleBlockOffset(size, sampleSize, i), SampleBlockSize);
+		}
+	}
+
+	bool sampleMatches(const uint8_t *bytes, size_t size, const uint8_t *sample, size_t sampleSize) {
+		if (size <= sampleSize) {
+			return memcmp(sample, bytes, size) == 0;
+		}
+
+#ifdef RT64_MESH_SSE2
+		__m128i difference = _mm_setzero_si128();
+		for (size_t i = 0; i < sampleSize / SampleBlockSize; i++) {
+			const __m128i a = _mm_loadu_si128((const __m128i *)(bytes + sampleBlockOffset(size, sampleSize, i)));
+			const __m128i b = _mm_loadu_si128((const __m128i *)(sample + i * SampleBlockSize));
+			difference = _mm_or_si128(difference, _mm_xor_si128(a, b));
+		}
+
+		return _mm_movemask_epi8(_mm_cmpeq_epi8(difference, _mm_setzero_si128())) == 0xFFFF;
+#else
+		for (size_t i = 0; i < sampleSize / SampleBlockSize; i++) {
+			if (memcmp(sample + i * SampleBlockSize, bytes + sampleBlockOffset(size, sampleSize, i), SampleBlockSize) != 0) {
+				return false;
+			}
+		}
+
+		return true;
+#endif
+	}
+};
 
 // Private
 
+bool RT64::Mesh::checkUnchanged(ContentCheck &check, const void *bytes, size_t size, bool sameLayout) {
+	// The contents can only match if the layout does. Otherwise, the samples are compared before the full hash.
+	const uint8_t *contentBytes = reinterpret_cast<const uint8_t *>(bytes);
+	const bool samplesMatch = sameLayout && sampleMatches(contentBytes, size, check.sample, ContentCheck::SampleSize);
+	copySample(contentBytes, size, check.sample, ContentCheck::SampleSize);
+
+	// Buffers that keep changing, like animated meshes, aren't hashed until their samples match again. The hash
+	// is missing then, so a buffer that stops changing is uploaded one more time before the uploads are skipped.
+	if (!samplesMatch && check.changing) {
+		check.hashValid = false;
+		return false;
+	}
+
+	const uint64_t hash = XXHash64::hash(bytes, size, 0);
+	const bool unchanged = samplesMatch && check.hashValid && (hash == check.hash);
+	check.hash = hash;
+	check.hashValid = true;
+	check.changing = !samplesMatch;
+	return unchanged;
+}
+
 RT64::Mesh::Mesh(Device *device, int flags) {
 	assert(device != nullptr);
 	this->device = device;
@@ -17,48 +100,62 @@ RT64::Mesh::Mesh(Device *device, int flags) {
 	vertexCount = 0;
 	indexCount = 0;
 	vertexStride = 0;
+	vertexCheck.hashValid = false;
+	vertexCheck.changing = false;
+	indexCheck.hashValid = false;
+	indexCheck.changing = false;
+	uploadFenceValue = 0;
+	boundsMin = { 0.0f, 0.0f, 0.0f };
+	boundsMax = { 0.0f, 0.0f, 0.0f };
+	bvhRebuild = false;
+	bvhRefit = false;
 }
 
 RT64::Mesh::~Mesh() {
-	vertexBuffer.Release();
-	vertexBufferUpload.Release();
-	indexBuffer.Release();
-	indexBufferUpload.Release();
-	d3dBottomLevelASBuffers.Release();
+	// Detaching doesn't go through removeInstance, so the list stays valid while it's iterated.
+	for (Instance *instance : instances) {
+		instance->detachMesh(this);
+	}
+
+	device->retireResource(vertexBuffer, uploadFenceValue);
+	device->retireResource(indexBuffer, uploadFenceValue);
+	device->retireResource(d3dBottomLevelASBuffers);
 }
 
-void RT64::Mesh::updateVertexBuffer(void *vertexArray, int vertexCount, int vertexStride) {
+bool RT64::Mesh::updateVertexBuffer(void *vertexArray, int vertexCount, int vertexStride) {
 	const UINT vertexBufferSize = vertexCount * vertexStride;
 
-	if (!vertexBuffer.IsNull() && (this->vertexCount != vertexCount)) {
-		vertexBuffer.Release();
-		vertexBufferUpload.Release();
+	// Hosts usually submit the same vertices every frame, so skip the upload if the contents didn't change.
+	const bool sameLayout = !vertexBuffer.IsNull() && (this->vertexCount == vertexCount) && (this->vertexStride == vertexStride);
+	if (checkUnchanged(vertexCheck, vertexArray, vertexBufferSize, sameLayout)) {
+		device->countMeshUpload(false);
+		return false;
+	}
+
+	device->countMeshUpload(true);
+
+	if (!vertexBuffer.IsNull() && !sameLayout) {
+		device->retireResource(vertexBuffer, uploadFenceValue);
 
 		// Discard the BLAS since it won't be compatible anymore even if it's updatable.
-		d3dBottomLevelASBuffers.Release();
+		device->retireResource(d3dBottomLevelASBuffers);
 	}
 
+	// The buffer stays in the common state, as it's promoted implicitly by the copy queue and the frames that read it.
+	CopyQueue *copyQueue = device->getCopyQueue();
 	if (vertexBuffer.IsNull()) {
-		CD3DX12_RESOURCE_DESC uploadBufferDesc = CD3DX12_RESOURCE_DESC::Buffer(vertexBufferSize);
-		vertexBufferUpload = device->allocateResource(D3D12_HEAP_TYPE_UPLOAD, &uploadBufferDesc, D3D12_RESOURCE_STATE_GENERIC_READ, nullptr);
-
 		CD3DX12_RESOURCE_DESC bufferDesc = CD3DX12_RESOURCE_DESC::Buffer(vertexBufferSize);
-		vertexBuffer = device->allocateResource(D3D12_HEAP_TYPE_DEFAULT, &bufferDesc, D3D12_RESOURCE_STATE_COPY_DEST, nullptr);
+		vertexBuffer = device->allocateResource(D3D12_HEAP_TYPE_DEFAULT, &bufferDesc, D3D12_RESOURCE_STATE_COMMON, nullptr);
+	}
+	else {
+		// The frames in flight might still read the buffer that is reused.
+		copyQueue->markOverwrite();
 	}
 
-	// Copy data to upload heap.
-	UINT8 *pDataBegin;
-	CD3DX12_RANGE readRange(0, 0);
-	D3D12_CHECK(vertexBufferUpload.Get()->Map(0, &readRange, reinterpret_cast<void**>(&pDataBegin)));
-	memcpy(pDataBegin, vertexArray, vertexBufferSize);
-	vertexBufferUpload.Get()->Unmap(0, nullptr);
-	
-	// Copy resource to the real default resource.
-	device->getD3D12CommandList()->CopyResource(vertexBuffer.Get(), vertexBufferUpload.Get());
-
-	// Wait for the resource to finish copying before switching to generic read.
-	CD3DX12_RESOURCE_BARRIER transition = CD3DX12_RESOURCE_BARRIER::Transition(vertexBuffer.Get(), D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_GENERIC_READ);
-	device->getD3D12CommandList()->ResourceBarrier(1, &transition);
+	// Place the data in the upload ring and copy it to the real default resource.
+	device->getUploadRing()->copyBuffer(vertexBuffer.Get(), vertexArray, vertexBufferSize);
+	device->getCommandLog()->record(CommandLog::Type::Copy, vertexBuffer.Get(), vertexBufferSize, 1);
+	uploadFenceValue = copyQueue->getBatchFenceValue();
 
 	// Configure vertex buffer view.
 	d3dVertexBufferView.BufferLocation = vertexBuffer.Get()->GetGPUVirtualAddress();
@@ -68,40 +165,72 @@ void RT64::Mesh::updateVertexBuffer(void *vertexArray, int vertexCount, int vert
 	// Store the new vertex count and stride.
 	this->vertexCount = vertexCount;
 	this->vertexStride = vertexStride;
+
+	// Only meshes in the raytracing scene can be traced on the CPU, so the others don't keep a copy of their vertices.
+	const uint8_t *vertexBytes = reinterpret_cast<const uint8_t *>(vertexArray);
+	if (flags & RT64_MESH_RAYTRACE_ENABLED) {
+		vertexData.assign(vertexBytes, vertexBytes + vertexBufferSize);
+	}
+
+	// Compute the bounds of the positions.
+	boundsMin = { FLT_MAX, FLT_MAX, FLT_MAX };
+	boundsMax = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	for (int i = 0; i < vertexCount; i++) {
+		const float *position = reinterpret_cast<const float *>(vertexBytes + i * vertexStride);
+		boundsMin = { std::min(boundsMin.x, position[0]), std::min(boundsMin.y, position[1]), std::min(boundsMin.z, position[2]) };
+		boundsMax = { std::max(boundsMax.x, position[0]), std::max(boundsMax.y, position[1]), std::max(boundsMax.z, position[2]) };
+	}
+
+	// The triangles stay the same when only the vertices move, so the BVH can be refit instead of built again.
+	if (sameLayout) {
+		bvhRefit = true;
+	}
+	else {
+		bvhRebuild = true;
+	}
+
+	// Reusing the buffer keeps the view the instances refer to, so they only need to know about new buffers.
+	if (!sameLayout) {
+		markInstancesDirty(Instance::DirtyMeshBuffers);
+	}
+
+	return true;
 }
 
-void RT64::Mesh::updateIndexBuffer(unsigned int *indexArray, int indexCount) {
+bool RT64::Mesh::updateIndexBuffer(unsigned int *indexArray, int indexCount) {
 	const UINT indexBufferSize = indexCount * sizeof(unsigned int);
 
-	if (!indexBuffer.IsNull() && (this->indexCount != indexCount)) {
-		indexBuffer.Release();
-		indexBufferUpload.Release();
+	// Same as the vertices, the upload is skipped if the indices didn't change.
+	const bool sameLayout = !indexBuffer.IsNull() && (this->indexCount == indexCount);
+	if (checkUnchanged(indexCheck, indexArray, indexBufferSize, sameLayout)) {
+		device->countMeshUpload(false);
+		return false;
+	}
+
+	device->countMeshUpload(true);
+
+	if (!indexBuffer.IsNull() && !sameLayout) {
+		device->retireResource(indexBuffer, uploadFenceValue);
 
 		// Discard the BLAS since it won't be compatible anymore even if it's updatable.
-		d3dBottomLevelASBuffers.Release();
+		device->retireResource(d3dBottomLevelASBuffers);
 	}
 
+	// The buffer stays in the common state, as it's promoted implicitly by the copy queue and the frames that read it.
+	CopyQueue *copyQueue = device->getCopyQueue();
 	if (indexBuffer.IsNull()) {
-		CD3DX12_RESOURCE_DESC uploadBufferDesc = CD3DX12_RESOURCE_DESC::Buffer(indexBufferSize);
-		indexBufferUpload = device->allocateResource(D3D12_HEAP_TYPE_UPLOAD, &uploadBufferDesc, D3D12_RESOURCE_STATE_GENERIC_READ, nullptr);
-
 		CD3DX12_RESOURCE_DESC bufferDesc = CD3DX12_RESOURCE_DESC::Buffer(indexBufferSize);
-		indexBuffer = device->allocateResource(D3D12_HEAP_TYPE_DEFAULT, &bufferDesc, D3D12_RESOURCE_STATE_COPY_DEST, nullptr);
+		indexBuffer = device->allocateResource(D3D12_HEAP_TYPE_DEFAULT, &bufferDesc, D3D12_RESOURCE_STATE_COMMON, nullptr);
+	}
+	else {
+		// The frames in flight might still read the buffer that is reused.
+		copyQueue->markOverwrite();
 	}
 
-	// Copy data to upload heap.
-	UINT8 *pDataBegin;
-	CD3DX12_RANGE readRange(0, 0);
-	D3D12_CHECK(indexBufferUpload.Get()->Map(0, &readRange, reinterpret_cast<void **>(&pDataBegin)));
-	memcpy(pDataBegin, indexArray, indexBufferSize);
-	indexBufferUpload.Get()->Unmap(0, nullptr);
-	
-	// Copy resource to the real default resource.
-	device->getD3D12CommandList()->CopyResource(indexBuffer.Get(), indexBufferUpload.Get());
-
-	// Wait for the resource to finish copying before switching to generic read.
-	CD3DX12_RESOURCE_BARRIER transition = CD3DX12_RESOURCE_BARRIER::Transition(indexBuffer.Get(), D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_GENERIC_READ);
-	device->getD3D12CommandList()->ResourceBarrier(1, &transition);
+	// Place the data in the upload ring and copy it to the real default resource.
+	device->getUploadRing()->copyBuffer(indexBuffer.Get(), indexArray, indexBufferSize);
+	device->getCommandLog()->record(CommandLog::Type::Copy, indexBuffer.Get(), indexBufferSize, 1);
+	uploadFenceValue = copyQueue->getBatchFenceValue();
 
 	// Configure index buffer view.
 	d3dIndexBufferView.BufferLocation = indexBuffer.Get()->GetGPUVirtualAddress();
@@ -109,27 +238,47 @@ void RT64::Mesh::updateIndexBuffer(unsigned int *indexArray, int indexCount) {
 	d3dIndexBufferView.SizeInBytes = indexBufferSize;
 
 	this->indexCount = indexCount;
+	if (flags & RT64_MESH_RAYTRACE_ENABLED) {
+		indexData.assign(indexArray, indexArray + indexCount);
+	}
+
+	bvhRebuild = true;
+	if (!sameLayout) {
+		markInstancesDirty(Instance::DirtyMeshBuffers);
+	}
+
+	return true;
 }
 
 void RT64::Mesh::updateBottomLevelAS() {
 	if (flags & RT64_MESH_RAYTRACE_ENABLED) {
+		// The build reads the vertex and index buffers, so the frame must wait for their upload.
+		device->requireUpload(uploadFenceValue);
+
 		// Create and store the bottom level AS buffers.
+		ID3D12Resource *previousResult = d3dBottomLevelASBuffers.result.Get();
 		createBottomLevelAS({ { getVertexBuffer(), getVertexCount() } }, { { getIndexBuffer(), getIndexCount() } });
 
-		// Submit this result as the last barrier for the command queue.
-		D3D12_RESOURCE_BARRIER barrier;
-		barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_UAV;
-		barrier.UAV.pResource = d3dBottomLevelASBuffers.result.Get();
-		barrier.Flags = D3D12_RESOURCE_BARRIER_FLAG_NONE;
-		device->setLastCommandQueueBarrier(barrier);
+		// The top level builds must wait for this result.
+		device->queueUAVBarrier(d3dBottomLevelASBuffers.result.Get());
+
+		// The instances must point the top level to a new BLAS, or only update it if the BLAS was updated in place.
+		const bool resultChanged = (d3dBottomLevelASBuffers.result.Get() != previousResult);
+		markInstancesDirty(resultChanged ? Instance::DirtyMeshBuffers : Instance::DirtyMeshGeometry);
+	}
+}
+
+void RT64::Mesh::markInstancesDirty(unsigned int mask) {
+	for (Instance *instance : instances) {
+		instance->markDirty(mask);
 	}
 }
 
 void RT64::Mesh::createBottomLevelAS(std::vector<std::pair<ID3D12Resource *, uint32_t>> vVertexBuffers, std::vector<std::pair<ID3D12Resource *, uint32_t>> vIndexBuffers) {
 	bool updatable = flags & RT64_MESH_RAYTRACE_UPDATABLE;
 	if (!updatable) {
-		// Release the previously stored AS buffers if there's any.
-		d3dBottomLevelASBuffers.Release();
+		// Retire the previously stored AS buffers if there's any, as the frames in flight might still trace them.
+		device->retireResource(d3dBottomLevelASBuffers);
 	}
 	
 	nv_helpers_dx12::BottomLevelASGenerator bottomLevelAS;
@@ -153,6 +302,23 @@ void RT64::Mesh::createBottomLevelAS(std::vector<std::pair<ID3D12Resource *, uin
 	}
 
 	bottomLevelAS.Generate(device->getD3D12CommandList(), d3dBottomLevelASBuffers.scratch.Get(), d3dBottomLevelASBuffers.result.Get(), (previousResult != nullptr), previousResult);
+	device->getCommandLog()->record(CommandLog::Type::BuildAS, d3dBottomLevelASBuffers.result.Get(), resultSizeInBytes, (UINT)(vVertexBuffers.size()));
+}
+
+UINT64 RT64::Mesh::getUploadFenceValue() const {
+	return uploadFenceValue;
+}
+
+void RT64::Mesh::addInstance(Instance *instance) {
+	assert(instance != nullptr);
+	instances.push_back(instance);
+}
+
+void RT64::Mesh::removeInstance(Instance *instance) {
+	auto it = std::find(instances.begin(), instances.end(), instance);
+	if (it != instances.end()) {
+		instances.erase(it);
+	}
 }
 
 ID3D12Resource *RT64::Mesh::getVertexBuffer() const {
@@ -167,6 +333,14 @@ int RT64::Mesh::getVertexCount() const {
 	return vertexCount;
 }
 
+int RT64::Mesh::getVertexStride() const {
+	return vertexStride;
+}
+
+const std::vector<uint8_t> &RT64::Mesh::getVertexData() const {
+	return vertexData;
+}
+
 ID3D12Resource *RT64::Mesh::getIndexBuffer() const {
 	return indexBuffer.Get();
 }
@@ -179,6 +353,33 @@ int RT64::Mesh::getIndexCount() const {
 	return indexCount;
 }
 
+const std::vector<unsigned int> &RT64::Mesh::getIndexData() const {
+	return indexData;
+}
+
+RT64_VECTOR3 RT64::Mesh::getBoundsMin() const {
+	return boundsMin;
+}
+
+RT64_VECTOR3 RT64::Mesh::getBoundsMax() const {
+	return boundsMax;
+}
+
+const RT64::BVH &RT64::Mesh::getBVH() {
+	// Meshes can be updated every frame, so the BVH is only built or refit when something needs to traverse it.
+	if (bvhRebuild) {
+		bvh.build(vertexData, vertexCount, vertexStride, indexData, device->getWorkerPool());
+	}
+	else if (bvhRefit) {
+		bvh.refit(vertexData, vertexCount, vertexStride, indexData, device->getWorkerPool());
+	}
+
+	bvhRebuild = false;
+	bvhRefit = false;
+
+	return bvh;
+}
+
 ID3D12Resource *RT64::Mesh::getBottomLevelASResult() const {
 	return d3dBottomLevelASBuffers.result.Get();
 }
@@ -197,9 +398,13 @@ DLLEXPORT void RT64_SetMesh(RT64_MESH *meshPtr, void *vertexArray, int vertexCou
 	assert(indexArray != nullptr);
 	assert(indexCount > 0);
 	RT64::Mesh *mesh = (RT64::Mesh *)(meshPtr);
-	mesh->updateVertexBuffer(vertexArray, vertexCount, vertexStride);
-	mesh->updateIndexBuffer(indexArray, indexCount);
-	mesh->updateBottomLevelAS();
+	const bool vertexUploaded = mesh->updateVertexBuffer(vertexArray, vertexCount, vertexStride);
+	const bool indexUploaded = mesh->updateIndexBuffer(indexArray, indexCount);
+
+	// The BLAS only needs to be built again when the geometry changed.
+	if (vertexUploaded || indexUploaded) {
+		mesh->updateBottomLevelAS();
+	}
 }
 
 DLLEXPORT void RT64_DestroyMesh(RT64_MESH * meshPtr) {
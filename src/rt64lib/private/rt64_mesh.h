@@ -5,38 +5,82 @@
 #pragma once
 
 #include "rt64_common.h"
+#include "rt64_bvh.h"
 
 namespace RT64 {
 	class Device;
+	class Instance;
 
 	class Mesh {
 	private:
+		// Tracks the contents of the last upload of a buffer. A few blocks sampled across the buffer are compared first,
+		// so buffers that change on every upload don't need to be hashed at all.
+		struct ContentCheck {
+			static const int SampleSize = 128;
+
+			uint8_t sample[SampleSize];
+			uint64_t hash;
+			bool hashValid;
+			bool changing;
+		};
+
 		Device *device;
 		AllocatedResource vertexBuffer;
-		AllocatedResource vertexBufferUpload;
 		D3D12_VERTEX_BUFFER_VIEW d3dVertexBufferView;
 		AllocatedResource indexBuffer;
-		AllocatedResource indexBufferUpload;
 		D3D12_INDEX_BUFFER_VIEW d3dIndexBufferView;
 		int vertexCount;
 		int vertexStride;
 		int indexCount;
+		ContentCheck vertexCheck;
+		ContentCheck indexCheck;
+		UINT64 uploadFenceValue;
+		std::vector<uint8_t> vertexData;
+		std::vector<unsigned int> indexData;
+		RT64_VECTOR3 boundsMin;
+		RT64_VECTOR3 boundsMax;
+		BVH bvh;
+		bool bvhRebuild;
+		bool bvhRefit;
 		RT64::AccelerationStructureBuffers d3dBottomLevelASBuffers;
 		int flags;
+		std::vector<Instance *> instances;
 
+		static bool checkUnchanged(ContentCheck &check, const void *bytes, size_t size, bool sameLayout);
+		void markInstancesDirty(unsigned int mask);
 		void createBottomLevelAS(std::vector<std::pair<ID3D12Resource *, uint32_t>> vVertexBuffers, std::vector<std::pair<ID3D12Resource *, uint32_t>> vIndexBuffers);
 	public:
 		Mesh(Device *device, int flags);
 		virtual ~Mesh();
-		void updateVertexBuffer(void *vertexArray, int vertexCount, int vertexStride);
+
+		// The update functions return false if the contents were the same as the last upload and nothing was done.
+		bool updateVertexBuffer(void *vertexArray, int vertexCount, int vertexStride);
+
 		ID3D12Resource *getVertexBuffer() const;
 		const D3D12_VERTEX_BUFFER_VIEW *getVertexBufferView() const;
 		int getVertexCount() const;
-		void updateIndexBuffer(unsigned int *indexArray, int indexCount);
+		int getVertexStride() const;
+
+		// CPU copies of the buffers. Only raytraced meshes keep them, as nothing else traces the mesh on the CPU.
+		const std::vector<uint8_t> &getVertexData() const;
+		bool updateIndexBuffer(unsigned int *indexArray, int indexCount);
 		ID3D12Resource *getIndexBuffer() const;
 		const D3D12_INDEX_BUFFER_VIEW *getIndexBufferView() const;
 		int getIndexCount() const;
+
+		// Same as the vertex data, it's empty unless the mesh is raytraced.
+		const std::vector<unsigned int> &getIndexData() const;
+		RT64_VECTOR3 getBoundsMin() const;
+		RT64_VECTOR3 getBoundsMax() const;
+		const BVH &getBVH();
 		void updateBottomLevelAS();
 		ID3D12Resource *getBottomLevelASResult() const;
+
+		// Copy fence value of the last upload to the vertex or index buffer.
+		UINT64 getUploadFenceValue() const;
+
+		// Instances that use the mesh. Only they are marked as dirty when the buffers or the BLAS change.
+		void addInstance(Instance *instance);
+		void removeInstance(Instance *instance);
 	};
 };
\ No newline at end of file
@@ -0,0 +1,327 @@
+//
+// RT64
+//
+
+#ifndef RT64_MINIMAL
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+
+#include "rt64_mipmaps.h"
+#include "rt64_workers.h"
+
+namespace {
+	typedef RT64::MipChain::Filter Filter;
+	typedef RT64::MipChain::Level Level;
+
+	const int RowsPerTask = 16;
+	const int MaxKernelTaps = 8;
+	const float KaiserAlpha = 4.0f;
+	const float KaiserWidth = 2.0f;
+	const float Pi = 3.14159265358979f;
+
+	// Cutout textures are assumed to be alpha tested at half the range.
+	const float AlphaReference = 127.5f;
+	const float MaxAlphaScale = 4.0f;
+	const int AlphaScaleSearchSteps = 10;
+
+	// Taps of a separable filter that halves the resolution. The taps of the destination pixel x start at
+	// the source pixel (2 * x + firstOffset).
+	struct Kernel {
+		int firstOffset;
+		int tapCount;
+		float weights[MaxKernelTaps];
+	};
+
+	float besselI0(float x) {
+		float sum = 1.0f;
+		float term = 1.0f;
+		for (int k = 1; k < 16; k++) {
+			const float f = x / (2.0f * k);
+			term *= f * f;
+			sum += term;
+		}
+
+		return sum;
+	}
+
+	Kernel createKernel(Filter filter) {
+		Kernel kernel = {};
+		if (filter == Filter::Box) {
+			kernel.firstOffset = 0;
+			kernel.tapCount = 2;
+			kernel.weights[0] = 0.5f;
+			kernel.weights[1] = 0.5f;
+			return kernel;
+		}
+
+		// Windowed sinc. The distances are measured in destination pixels from the center of the destination pixel.
+		kernel.firstOffset = -3;
+		kernel.tapCount = MaxKernelTaps;
+		float weightSum = 0.0f;
+		for (int i = 0; i < kernel.tapCount; i++) {
+			const float t = ((float)(kernel.firstOffset + i) - 0.5f) / 2.0f;
+			const float sinc = (t == 0.0f) ? 1.0f : sinf(Pi * t) / (Pi * t);
+			const float x = t / KaiserWidth;
+			const float window = besselI0(KaiserAlpha * sqrtf(std::max(1.0f - x * x, 0.0f))) / besselI0(KaiserAlpha);
+			kernel.weights[i] = sinc * window;
+			weightSum += kernel.weights[i];
+		}
+
+		for (int i = 0; i < kernel.tapCount; i++) {
+			kernel.weights[i] /= weightSum;
+		}
+
+		return kernel;
+	}
+
+	const Kernel &getKernel(Filter filter) {
+		static const Kernel BoxKernel = createKernel(Filter::Box);
+		static const Kernel KaiserKernel = createKernel(Filter::Kaiser);
+		return (filter == Filter::Box) ? BoxKernel : KaiserKernel;
+	}
+
+	inline XMVECTOR loadPixel(const uint8_t *pixel) {
+		return XMVectorSet(pixel[0], pixel[1], pixel[2], pixel[3]);
+	}
+
+	inline void storePixel(FXMVECTOR color, uint8_t *pixel) {
+		XMFLOAT4A rounded;
+		XMStoreFloat4A(&rounded, XMVectorRound(XMVectorClamp(color, XMVectorZero(), XMVectorReplicate(255.0f))));
+		pixel[0] = (uint8_t)(rounded.x);
+		pixel[1] = (uint8_t)(rounded.y);
+		pixel[2] = (uint8_t)(rounded.z);
+		pixel[3] = (uint8_t)(rounded.w);
+	}
+
+	bool isCutout(const Level &level) {
+		bool hasTransparency = false;
+		const size_t pixelCount = level.pixels.size() / 4;
+		for (size_t i = 0; i < pixelCount; i++) {
+			const uint8_t alpha = level.pixels[i * 4 + 3];
+			if ((alpha != 0) && (alpha != 255)) {
+				return false;
+			}
+
+			hasTransparency = hasTransparency || (alpha == 0);
+		}
+
+		return hasTransparency;
+	}
+
+	float computeAlphaCoverage(const Level &level, float alphaScale) {
+		size_t coveredCount = 0;
+		const size_t pixelCount = level.pixels.size() / 4;
+		for (size_t i = 0; i < pixelCount; i++) {
+			if ((level.pixels[i * 4 + 3] * alphaScale) > AlphaReference) {
+				coveredCount++;
+			}
+		}
+
+		return (float)(coveredCount) / (float)(std::max(pixelCount, (size_t)(1)));
+	}
+
+	inline int floorHalf(int value) {
+		return (value >= 0) ? (value / 2) : -((1 - value) / 2);
+	}
+
+	// Finds the range of the destination level that reads any of the dirty pixels in the range of the source level. The same
+	// kernel is used for both axes, so the destination pixel i reads the source pixels [2 * i + firstOffset, 2 * i + firstOffset + tapCount).
+	void getDependentRange(const Kernel &kernel, int srcBegin, int srcEnd, int dstSize, int &dstBegin, int &dstEnd) {
+		if (srcBegin >= srcEnd) {
+			dstBegin = 0;
+			dstEnd = 0;
+			return;
+		}
+
+		const int lastTap = kernel.firstOffset + kernel.tapCount - 1;
+		dstBegin = std::min(std::max(floorHalf(srcBegin - lastTap + 1), 0), dstSize);
+		dstEnd = std::min(std::max(floorHalf(srcEnd - 1 - kernel.firstOffset) + 1, dstBegin), dstSize);
+	}
+
+	// Searches for the alpha scale that gives the level the same coverage as the top level.
+	void scaleAlphaToCoverage(Level &level, float targetCoverage) {
+		float minScale = 0.0f;
+		float maxScale = MaxAlphaScale;
+		for (int i = 0; i < AlphaScaleSearchSteps; i++) {
+			const float midScale = (minScale + maxScale) * 0.5f;
+			if (computeAlphaCoverage(level, midScale) < targetCoverage) {
+				minScale = midScale;
+			}
+			else {
+				maxScale = midScale;
+			}
+		}
+
+		// The alpha values are discrete, so pick whichever side of the search ended up closer to the target.
+		const float minError = fabsf(computeAlphaCoverage(level, minScale) - targetCoverage);
+		const float maxError = fabsf(computeAlphaCoverage(level, maxScale) - targetCoverage);
+		const float alphaScale = (minError < maxError) ? minScale : maxScale;
+		const size_t pixelCount = level.pixels.size() / 4;
+		for (size_t i = 0; i < pixelCount; i++) {
+			uint8_t &alpha = level.pixels[i * 4 + 3];
+			alpha = (uint8_t)(std::min(std::round(alpha * alphaScale), 255.0f));
+		}
+	}
+};
+
+// Private
+
+RT64::MipChain::MipChain() {
+	filter = Filter::Box;
+	cutout = false;
+}
+
+RT64::MipChain::~MipChain() { }
+
+void RT64::MipChain::downsample(const Level &src, Level &dst, int rowBegin, int rowEnd, int columnBegin, int columnEnd, WorkerPool *workerPool) {
+	assert(workerPool != nullptr);
+
+	const Kernel &kernel = getKernel(filter);
+	dst.dirtyRowBegin = rowBegin;
+	dst.dirtyRowEnd = rowEnd;
+	dst.dirtyColumnBegin = columnBegin;
+	dst.dirtyColumnEnd = columnEnd;
+	if ((rowBegin >= rowEnd) || (columnBegin >= columnEnd)) {
+		return;
+	}
+
+	XMVECTOR weights[MaxKernelTaps];
+	for (int t = 0; t < kernel.tapCount; t++) {
+		weights[t] = XMVectorReplicate(kernel.weights[t]);
+	}
+
+	const int taskCount = (rowEnd - rowBegin + RowsPerTask - 1) / RowsPerTask;
+	workerPool->run(taskCount, [&](size_t taskIndex) {
+		// Every source row is used by several destination rows, so the filtered rows are kept in a ring
+		// indexed by their unclamped source row. The ring has one entry per tap of the kernel. Only the
+		// columns in the range are filtered, and they're the same for all the rows of the task.
+		std::vector<XMVECTOR> filteredRows((size_t)(kernel.tapCount) * dst.width);
+		int filteredRowKeys[MaxKernelTaps];
+		std::fill(filteredRowKeys, filteredRowKeys + MaxKernelTaps, INT_MIN);
+
+		auto getFilteredRow = [&](int unclampedRow) {
+			const int slot = ((unclampedRow % kernel.tapCount) + kernel.tapCount) % kernel.tapCount;
+			XMVECTOR *row = &filteredRows[(size_t)(slot) * dst.width];
+			if (filteredRowKeys[slot] != unclampedRow) {
+				const int srcRow = std::min(std::max(unclampedRow, 0), src.height - 1);
+				const uint8_t *srcPixels = &src.pixels[(size_t)(srcRow) * src.width * 4];
+				for (int x = columnBegin; x < columnEnd; x++) {
+					XMVECTOR sum = XMVectorZero();
+					for (int t = 0; t < kernel.tapCount; t++) {
+						const int srcX = std::min(std::max(2 * x + kernel.firstOffset + t, 0), src.width - 1);
+						sum = XMVectorMultiplyAdd(loadPixel(&srcPixels[srcX * 4]), weights[t], sum);
+					}
+
+					row[x] = sum;
+				}
+
+				filteredRowKeys[slot] = unclampedRow;
+			}
+
+			return row;
+		};
+
+		const int taskRowBegin = rowBegin + (int)(taskIndex) * RowsPerTask;
+		const int taskRowEnd = std::min(taskRowBegin + RowsPerTask, rowEnd);
+		const XMVECTOR *rows[MaxKernelTaps];
+		for (int y = taskRowBegin; y < taskRowEnd; y++) {
+			for (int t = 0; t < kernel.tapCount; t++) {
+				rows[t] = getFilteredRow(2 * y + kernel.firstOffset + t);
+			}
+
+			uint8_t *dstPixels = &dst.pixels[(size_t)(y) * dst.width * 4];
+			for (int x = columnBegin; x < columnEnd; x++) {
+				XMVECTOR sum = XMVectorZero();
+				for (int t = 0; t < kernel.tapCount; t++) {
+					sum = XMVectorMultiplyAdd(rows[t][x], weights[t], sum);
+				}
+
+				storePixel(sum, &dstPixels[x * 4]);
+			}
+		}
+	});
+}
+
+void RT64::MipChain::regenerate(WorkerPool *workerPool) {
+	levels[0].dirtyRowBegin = 0;
+	levels[0].dirtyRowEnd = levels[0].height;
+	levels[0].dirtyColumnBegin = 0;
+	levels[0].dirtyColumnEnd = levels[0].width;
+	cutout = isCutout(levels[0]);
+	const float coverage = cutout ? computeAlphaCoverage(levels[0], 1.0f) : 0.0f;
+	for (size_t i = 1; i < levels.size(); i++) {
+		downsample(levels[i - 1], levels[i], 0, levels[i].height, 0, levels[i].width, workerPool);
+		if (cutout) {
+			scaleAlphaToCoverage(levels[i], coverage);
+		}
+	}
+}
+
+void RT64::MipChain::generate(const uint8_t *pixels, int width, int height, Filter filter, WorkerPool *workerPool) {
+	assert(pixels != nullptr);
+	assert((width > 0) && (height > 0));
+
+	this->filter = filter;
+	levels.resize(countLevels(width, height));
+	levels[0].width = width;
+	levels[0].height = height;
+	levels[0].pixels.assign(pixels, pixels + (size_t)(width) * height * 4);
+	for (size_t i = 1; i < levels.size(); i++) {
+		levels[i].width = std::max(levels[i - 1].width / 2, 1);
+		levels[i].height = std::max(levels[i - 1].height / 2, 1);
+		levels[i].pixels.resize((size_t)(levels[i].width) * levels[i].height * 4);
+	}
+
+	regenerate(workerPool);
+}
+
+void RT64::MipChain::update(const uint8_t *pixels, int x, int y, int width, int height, int rowPitch, WorkerPool *workerPool) {
+	assert(pixels != nullptr);
+	assert(!levels.empty());
+
+	Level &top = levels[0];
+	assert((x >= 0) && (y >= 0) && ((x + width) <= top.width) && ((y + height) <= top.height));
+	for (int row = 0; row < height; row++) {
+		memcpy(&top.pixels[((size_t)(y + row) * top.width + x) * 4], pixels + (size_t)(row) * rowPitch, (size_t)(width) * 4);
+	}
+
+	if (cutout || isCutout(top)) {
+		regenerate(workerPool);
+		return;
+	}
+
+	top.dirtyRowBegin = y;
+	top.dirtyRowEnd = y + height;
+	top.dirtyColumnBegin = x;
+	top.dirtyColumnEnd = x + width;
+
+	const Kernel &kernel = getKernel(filter);
+	for (size_t i = 1; i < levels.size(); i++) {
+		const Level &src = levels[i - 1];
+		Level &dst = levels[i];
+		int rowBegin, rowEnd, columnBegin, columnEnd;
+		getDependentRange(kernel, src.dirtyRowBegin, src.dirtyRowEnd, dst.height, rowBegin, rowEnd);
+		getDependentRange(kernel, src.dirtyColumnBegin, src.dirtyColumnEnd, dst.width, columnBegin, columnEnd);
+		downsample(src, dst, rowBegin, rowEnd, columnBegin, columnEnd, workerPool);
+	}
+}
+
+const std::vector<RT64::MipChain::Level> &RT64::MipChain::getLevels() const {
+	return levels;
+}
+
+int RT64::MipChain::countLevels(int width, int height) {
+	int levelCount = 1;
+	int size = std::max(width, height);
+	while (size > 1) {
+		size /= 2;
+		levelCount++;
+	}
+
+	return levelCount;
+}
+
+#endif
@@ -0,0 +1,54 @@
+//
+// RT64
+//
+
+#pragma once
+
+#include "rt64_common.h"
+
+namespace RT64 {
+	class WorkerPool;
+
+	// Mip chain of an RGBA8 image generated on the CPU. Every level is downsampled from the previous one with a
+	// separable filter, and the rows of each level are split across the worker pool. Cutout textures keep the same
+	// alpha test coverage on every level so they don't fade away in the distance.
+	class MipChain {
+	public:
+		enum class Filter {
+			Box,
+			Kaiser
+		};
+
+		struct Level {
+			int width;
+			int height;
+			std::vector<uint8_t> pixels;
+
+			// Region that changed the last time the chain was generated or updated.
+			int dirtyRowBegin;
+			int dirtyRowEnd;
+			int dirtyColumnBegin;
+			int dirtyColumnEnd;
+		};
+	private:
+		std::vector<Level> levels;
+		Filter filter;
+		bool cutout;
+
+		void downsample(const Level &src, Level &dst, int rowBegin, int rowEnd, int columnBegin, int columnEnd, WorkerPool *workerPool);
+		void regenerate(WorkerPool *workerPool);
+	public:
+		MipChain();
+		MipChain(MipChain &&) = default;
+		virtual ~MipChain();
+		MipChain &operator=(MipChain &&) = default;
+		void generate(const uint8_t *pixels, int width, int height, Filter filter, WorkerPool *workerPool);
+
+		// Replaces a rectangle of the top level and only filters again the region of the other levels that depends on it.
+		// Cutout textures scale the alpha of whole levels, so their chain is always generated again.
+		void update(const uint8_t *pixels, int x, int y, int width, int height, int rowPitch, WorkerPool *workerPool);
+
+		const std::vector<Level> &getLevels() const;
+		static int countLevels(int width, int height);
+	};
+};
@@ -0,0 +1,1191 @@
+//
+// RT64
+//
+
+#ifndef RT64_MINIMAL
+
+#include "../public/rt64.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include "rt64_mesh.h"
+#include "rt64_reference_tracer.h"
+#include "rt64_scene_bvh.h"
+#include "rt64_shader.h"
+#include "rt64_texture.h"
+#include "rt64_workers.h"
+
+namespace {
+	// Must match the constants used by Tracer.hlsl and the generated hit groups.
+	const float Epsilon = 1e-6f;
+	const float Pi = 3.14159265f;
+	const float RayMinDistance = 1.0f;
+	const float RayMaxDistance = 100000.0f;
+	const unsigned int MaxLights = 32;
+	const float FullQualityAlpha = 0.999f;
+	const float GIMinimumAlpha = 0.25f;
+	const unsigned int MaxHitQueries = 16;
+	const float InstanceIdBias = 0.001f;
+
+	// The shadow hit groups always sample the top level.
+	const float TopLevelLODBias = -FLT_MAX;
+	const int TileSize = 16;
+
+	// Minimal vector types so the shading code can be read side by side with the HLSL.
+
+	struct float2 {
+		float x, y;
+	};
+
+	struct float3 {
+		float x, y, z;
+	};
+
+	struct float4 {
+		float x, y, z, w;
+
+		float3 rgb() const {
+			return { x, y, z };
+		}
+
+		void setRgb(const float3 &v) {
+			x = v.x;
+			y = v.y;
+			z = v.z;
+		}
+	};
+
+	inline float2 operator+(const float2 &a, const float2 &b) { return { a.x + b.x, a.y + b.y }; }
+	inline float2 operator-(const float2 &a, const float2 &b) { return { a.x - b.x, a.y - b.y }; }
+	inline float2 operator*(const float2 &a, float b) { return { a.x * b, a.y * b }; }
+	inline float3 operator+(const float3 &a, const float3 &b) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+	inline float3 operator-(const float3 &a, const float3 &b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+	inline float3 operator-(const float3 &a) { return { -a.x, -a.y, -a.z }; }
+	inline float3 operator*(const float3 &a, const float3 &b) { return { a.x * b.x, a.y * b.y, a.z * b.z }; }
+	inline float3 operator*(const float3 &a, float b) { return { a.x * b, a.y * b, a.z * b }; }
+	inline float3 operator/(const float3 &a, float b) { return { a.x / b, a.y / b, a.z / b }; }
+	inline float3 &operator+=(float3 &a, const float3 &b) { a = a + b; return a; }
+	inline float4 operator+(const float4 &a, const float4 &b) { return { a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w }; }
+	inline float4 operator-(const float4 &a, const float4 &b) { return { a.x - b.x, a.y - b.y, a.z - b.z, a.w - b.w }; }
+	inline float4 operator*(const float4 &a, const float4 &b) { return { a.x * b.x, a.y * b.y, a.z * b.z, a.w * b.w }; }
+	inline float4 operator*(const float4 &a, float b) { return { a.x * b, a.y * b, a.z * b, a.w * b }; }
+
+	inline float dot(const float2 &a, const float2 &b) { return a.x * b.x + a.y * b.y; }
+	inline float dot(const float3 &a, const float3 &b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+	inline float3 cross(const float3 &a, const float3 &b) { return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x }; }
+	inline float length(const float2 &a) { return sqrtf(dot(a, a)); }
+	inline float length(const float3 &a) { return sqrtf(dot(a, a)); }
+	inline float2 normalize(const float2 &a) { float l = length(a); return { a.x / l, a.y / l }; }
+	inline float3 normalize(const float3 &a) { return a / length(a); }
+	inline float saturate(float a) { return std::min(std::max(a, 0.0f), 1.0f); }
+	inline float3 saturate(const float3 &a) { return { saturate(a.x), saturate(a.y), saturate(a.z) }; }
+	inline float clamp(float a, float lo, float hi) { return std::min(std::max(a, lo), hi); }
+	inline float lerp(float a, float b, float t) { return a + (b - a) * t; }
+	inline float3 lerp(const float3 &a, const float3 &b, float t) { return a + (b - a) * t; }
+	inline float4 lerp(const float4 &a, const float4 &b, const float4 &t) { return a + (b - a) * t; }
+	inline float3 reflect(const float3 &i, const float3 &n) { return i - n * (2.0f * dot(n, i)); }
+	inline bool any(const float3 &a) { return (a.x != 0.0f) || (a.y != 0.0f) || (a.z != 0.0f); }
+
+	inline float3 refract(const float3 &i, const float3 &n, float eta) {
+		float cosi = dot(-i, n);
+		float cost2 = 1.0f - eta * eta * (1.0f - cosi * cosi);
+		float3 t = i * eta + n * (eta * cosi - sqrtf(fabsf(cost2)));
+		return (cost2 > 0.0f) ? t : float3{ 0.0f, 0.0f, 0.0f };
+	}
+
+	inline float3 toFloat3(const RT64_VECTOR3 &v) { return { v.x, v.y, v.z }; }
+	inline float4 toFloat4(const RT64_VECTOR4 &v) { return { v.x, v.y, v.z, v.w }; }
+	inline float3 toFloat3(FXMVECTOR v) { return { XMVectorGetX(v), XMVectorGetY(v), XMVectorGetZ(v) }; }
+	inline XMVECTOR toXMVector(const float3 &v, float w) { return XMVectorSet(v.x, v.y, v.z, w); }
+
+	inline uint32_t asuint(float v) {
+		uint32_t u;
+		memcpy(&u, &v, sizeof(u));
+		return u;
+	}
+
+	// Same conversions the GPU applies when writing to the hit buffers.
+	inline float toUnorm8(float v) { return nearbyintf(saturate(v) * 255.0f) / 255.0f; }
+	inline float toSnorm16(float v) { return nearbyintf(clamp(v, -1.0f, 1.0f) * 32767.0f) / 32767.0f; }
+
+	// Random.hlsli
+
+	uint32_t initRand(uint32_t val0, uint32_t val1, uint32_t backoff = 16) {
+		uint32_t v0 = val0, v1 = val1, s0 = 0;
+		for (uint32_t n = 0; n < backoff; n++) {
+			s0 += 0x9e3779b9;
+			v0 += ((v1 << 4) + 0xa341316c) ^ (v1 + s0) ^ ((v1 >> 5) + 0xc8013ea4);
+			v1 += ((v0 << 4) + 0xad90777d) ^ (v0 + s0) ^ ((v0 >> 5) + 0x7e95761e);
+		}
+
+		return v0;
+	}
+
+	inline float nextRand(uint32_t &s) {
+		s = (1664525u * s + 1013904223u);
+		return float(s & 0x00FFFFFF) / float(0x01000000);
+	}
+
+	float3 getPerpendicularVector(const float3 &u) {
+		float3 a = { fabsf(u.x), fabsf(u.y), fabsf(u.z) };
+		uint32_t xm = (((a.x - a.y) < 0) && ((a.x - a.z) < 0)) ? 1 : 0;
+		uint32_t ym = ((a.y - a.z) < 0) ? (1 ^ xm) : 0;
+		uint32_t zm = 1 ^ (xm | ym);
+		return cross(u, { float(xm), float(ym), float(zm) });
+	}
+
+	float3 getCosHemisphereSample(uint32_t &randSeed, const float3 &hitNorm) {
+		float randX = nextRand(randSeed);
+		float randY = nextRand(randSeed);
+		float3 bitangent = getPerpendicularVector(hitNorm);
+		float3 tangent = cross(bitangent, hitNorm);
+		float r = sqrtf(randX);
+		float phi = 2.0f * Pi * randY;
+		return tangent * (r * cosf(phi)) + bitangent * (r * sinf(phi)) + hitNorm * sqrtf(std::max(0.0f, 1.0f - randX));
+	}
+
+	struct TraceInstance {
+		const RT64::ReferenceTracer::Instance *desc;
+		ColorCombinerParams cc;
+		VertexLayout layout;
+		bool vertexUV;
+		bool normalMapEnabled;
+		bool specularMapEnabled;
+		XMMATRIX objectToWorldNormal;
+
+		TraceInstance(const RT64::ReferenceTracer::Instance *desc) :
+			desc(desc),
+			cc(desc->shader->getShaderId()),
+			layout(true, true, cc.useTextures[0] || cc.useTextures[1], cc.inputCount, cc.opt_alpha)
+		{
+			int shaderFlags = desc->shader->getFlags();
+			vertexUV = cc.useTextures[0] || cc.useTextures[1];
+			normalMapEnabled = (shaderFlags & RT64_SHADER_NORMAL_MAP_ENABLED) != 0;
+			specularMapEnabled = (shaderFlags & RT64_SHADER_SPECULAR_MAP_ENABLED) != 0;
+
+			// Same normal matrix as the one stored in the instance transforms buffer.
+			XMVECTOR det;
+			XMMATRIX upper3x3 = desc->transform;
+			upper3x3.r[0] = XMVectorSetW(upper3x3.r[0], 0.0f);
+			upper3x3.r[1] = XMVectorSetW(upper3x3.r[1], 0.0f);
+			upper3x3.r[2] = XMVectorSetW(upper3x3.r[2], 0.0f);
+			upper3x3.r[3] = XMVectorSet(0.0f, 0.0f, 0.0f, 1.0f);
+			objectToWorldNormal = XMMatrixTranspose(XMMatrixInverse(&det, upper3x3));
+		}
+	};
+
+	struct TraceScene {
+		std::vector<TraceInstance> instances;
+		RT64::SceneBVH sceneBVH;
+		const std::vector<RT64_LIGHT> *lights;
+		const RT64::ReferenceTracer::Params *params;
+		RT64_LIGHT ambientLight;
+	};
+
+	// One entry of the per-pixel k-buffer. Mirrors the layout of the hit buffers.
+	struct HitRecord {
+		float distance;
+		float4 color;
+		float3 normal;
+		float3 specular;
+		uint32_t instanceId;
+	};
+
+	struct HitCandidate {
+		float t;
+		float tval;
+		uint32_t instanceId;
+		uint32_t triangleIndex;
+		float u;
+		float v;
+	};
+
+	struct PixelContext {
+		const TraceScene *scene;
+		uint32_t launchIndex[2];
+		uint32_t launchDims[2];
+		float noiseMask;
+		HitRecord hits[MaxHitQueries];
+		std::vector<HitCandidate> candidates;
+	};
+
+	struct SurfaceAttributes {
+		float3 pos[3];
+		float3 vertexNormal;
+		float3 triangleNormal;
+		float2 uv[3];
+		float2 vertexUV;
+		float4 inputs[4];
+	};
+
+	struct CombinerInputs {
+		float4 inputs[4];
+		float4 texVal0;
+		float4 texVal1;
+	};
+
+	inline void loadFloats(const std::vector<uint8_t> &data, size_t offset, float *dst, int count) {
+		if ((offset + count * sizeof(float)) <= data.size()) {
+			memcpy(dst, data.data() + offset, count * sizeof(float));
+		}
+		else {
+			memset(dst, 0, count * sizeof(float));
+		}
+	}
+
+	// Mirrors getVertexData() from the shader generator.
+	void loadAttributes(const TraceInstance &inst, uint32_t triangleIndex, float u, float v, SurfaceAttributes &attr) {
+		const std::vector<uint8_t> &vertexData = inst.desc->mesh->getVertexData();
+		const std::vector<unsigned int> &indexData = inst.desc->mesh->getIndexData();
+		const VertexLayout &vl = inst.layout;
+		const float barycentrics[3] = { 1.0f - u - v, u, v };
+		size_t index3[3];
+		for (int i = 0; i < 3; i++) {
+			index3[i] = indexData[triangleIndex * 3 + i];
+		}
+
+		attr.vertexNormal = { 0.0f, 0.0f, 0.0f };
+		float3 norm[3];
+		for (int i = 0; i < 3; i++) {
+			loadFloats(vertexData, index3[i] * vl.vertexSize + vl.positionOffset, &attr.pos[i].x, 3);
+			loadFloats(vertexData, index3[i] * vl.vertexSize + vl.normalOffset, &norm[i].x, 3);
+			attr.vertexNormal += norm[i] * barycentrics[i];
+		}
+
+		attr.triangleNormal = -cross(attr.pos[2] - attr.pos[0], attr.pos[1] - attr.pos[0]);
+		attr.vertexNormal = any(attr.vertexNormal) ? normalize(attr.vertexNormal) : attr.triangleNormal;
+
+		attr.vertexUV = { 0.0f, 0.0f };
+		if (inst.vertexUV) {
+			for (int i = 0; i < 3; i++) {
+				loadFloats(vertexData, index3[i] * vl.vertexSize + vl.uvOffset, &attr.uv[i].x, 2);
+				attr.vertexUV = attr.vertexUV + attr.uv[i] * barycentrics[i];
+			}
+		}
+
+		const bool useAlpha = inst.cc.opt_alpha;
+		for (int i = 0; i < inst.cc.inputCount; i++) {
+			float4 input = { 0.0f, 0.0f, 0.0f, 0.0f };
+			for (int j = 0; j < 3; j++) {
+				float4 value = { 0.0f, 0.0f, 0.0f, 0.0f };
+				loadFloats(vertexData, index3[j] * vl.vertexSize + vl.inputOffset[i], &value.x, useAlpha ? 4 : 3);
+				input = input + value * barycentrics[j];
+			}
+
+			attr.inputs[i] = useAlpha ? input : float4{ input.x, input.y, input.z, 1.0f };
+		}
+	}
+
+	inline int addressTexel(int coord, int size, RT64::Shader::AddressingMode mode) {
+		switch (mode) {
+		case RT64::Shader::AddressingMode::Mirror: {
+			int period = size * 2;
+			int m = ((coord % period) + period) % period;
+			return (m < size) ? m : (period - 1 - m);
+		}
+		case RT64::Shader::AddressingMode::Clamp:
+			return std::min(std::max(coord, 0), size - 1);
+		default:
+		case RT64::Shader::AddressingMode::Wrap:
+			return ((coord % size) + size) % size;
+		}
+	}
+
+	inline float4 loadTexel(const uint8_t *pixels, int rowPitch, int x, int y) {
+		const uint8_t *texel = pixels + (size_t)(y) * rowPitch + x * 4;
+		return { texel[0] / 255.0f, texel[1] / 255.0f, texel[2] / 255.0f, texel[3] / 255.0f };
+	}
+
+	// Equivalent of SampleLevel(sampler, uv, level) with the static sampler generated for the shader on a single level.
+	float4 sampleTextureLevel(const RT64::Texture *texture, const RT64::Shader *shader, const float2 &uv, int level) {
+		// Textures that don't keep a CPU copy of their pixels can't be sampled, so they're treated as white.
+		int width, height, rowPitch;
+		const uint8_t *pixels = texture->getPixels(level, width, height, rowPitch);
+		if (pixels == nullptr) {
+			return { 1.0f, 1.0f, 1.0f, 1.0f };
+		}
+
+		const RT64::Shader::AddressingMode hAddr = shader->getHAddr();
+		const RT64::Shader::AddressingMode vAddr = shader->getVAddr();
+		if (shader->getFilter() == RT64::Shader::Filter::Linear) {
+			float fx = uv.x * width - 0.5f;
+			float fy = uv.y * height - 0.5f;
+			float x0 = floorf(fx);
+			float y0 = floorf(fy);
+			float tx = fx - x0;
+			float ty = fy - y0;
+			int ax = addressTexel((int)(x0), width, hAddr);
+			int bx = addressTexel((int)(x0) + 1, width, hAddr);
+			int ay = addressTexel((int)(y0), height, vAddr);
+			int by = addressTexel((int)(y0) + 1, height, vAddr);
+			float4 top = lerp(loadTexel(pixels, rowPitch, ax, ay), loadTexel(pixels, rowPitch, bx, ay), { tx, tx, tx, tx });
+			float4 bottom = lerp(loadTexel(pixels, rowPitch, ax, by), loadTexel(pixels, rowPitch, bx, by), { tx, tx, tx, tx });
+			return lerp(top, bottom, { ty, ty, ty, ty });
+		}
+		else {
+			int x = addressTexel((int)(floorf(uv.x * width)), width, hAddr);
+			int y = addressTexel((int)(floorf(uv.y * height)), height, vAddr);
+			return loadTexel(pixels, rowPitch, x, y);
+		}
+	}
+
+	// Mirrors textureLOD() from the shader generator followed by SampleLevel(sampler, uv, lod). The size of the top level
+	// is the size the GPU sees: the region for atlased textures and the standby copy for evicted ones. Linear filtering
+	// blends the two closest levels and point filtering picks the closest one.
+	float4 sampleTexture(const RT64::Texture *texture, const RT64::Shader *shader, const float2 &uv, float texLODBias) {
+		if ((texture == nullptr) || (texture->getWidth() <= 0) || (texture->getHeight() <= 0)) {
+			return { 0.0f, 0.0f, 0.0f, 0.0f };
+		}
+
+		int width, height, rowPitch;
+		const int levelCount = texture->getPixelLevelCount();
+		if (texture->getPixels(0, width, height, rowPitch) == nullptr) {
+			return { 1.0f, 1.0f, 1.0f, 1.0f };
+		}
+
+		const float lod = clamp(texLODBias + 0.5f * log2f((float)(width) * height), 0.0f, (float)(levelCount - 1));
+		if (shader->getFilter() == RT64::Shader::Filter::Linear) {
+			const int level = (int)(lod);
+			const float t = lod - level;
+			const float4 color = sampleTextureLevel(texture, shader, uv, level);
+			if (t <= 0.0f) {
+				return color;
+			}
+
+			return lerp(color, sampleTextureLevel(texture, shader, uv, level + 1), { t, t, t, t });
+		}
+		else {
+			return sampleTextureLevel(texture, shader, uv, (int)(lod + 0.5f));
+		}
+	}
+
+	// Mirrors rayConeLODBias() from the shader generator. The hit distance is the one before the distance bias.
+	float rayConeLODBias(const PixelContext &ctx, const TraceInstance &inst, const SurfaceAttributes &attr, float rayT, const float3 &worldRayDirection) {
+		const XMMATRIX &objectToWorld = inst.desc->transform;
+		float3 worldEdge1 = toFloat3(XMVector4Transform(toXMVector(attr.pos[1] - attr.pos[0], 0.0f), objectToWorld));
+		float3 worldEdge2 = toFloat3(XMVector4Transform(toXMVector(attr.pos[2] - attr.pos[0], 0.0f), objectToWorld));
+		float3 worldCross = cross(worldEdge1, worldEdge2);
+		float worldArea = std::max(length(worldCross), 1e-12f);
+		float uvArea = std::max(fabsf((attr.uv[1].x - attr.uv[0].x) * (attr.uv[2].y - attr.uv[0].y) - (attr.uv[2].x - attr.uv[0].x) * (attr.uv[1].y - attr.uv[0].y)), 1e-12f);
+		float projectionScale = XMVectorGetY(ctx.scene->params->projection.r[1]);
+		float coneWidth = rayT * 2.0f / (projectionScale * ctx.launchDims[1]);
+		float coneCosine = std::max(fabsf(dot(worldRayDirection, worldCross / worldArea)), 1e-3f);
+		return 0.5f * log2f(uvArea / worldArea) + log2f(coneWidth / coneCosine);
+	}
+
+	// Color combiner. Mirrors colorInput(), colorFormula(), alphaInput() and alphaFormula() from the shader generator.
+
+	float4 colorInput(int item, bool withAlpha, bool inputsHaveAlpha, bool hintSingleElement, const CombinerInputs &ci) {
+		switch (item) {
+		default:
+		case SHADER_0:
+			return withAlpha ? float4{ 0.0f, 0.0f, 0.0f, 0.0f } : float4{ 0.0f, 0.0f, 0.0f, 1.0f };
+		case SHADER_INPUT_1:
+		case SHADER_INPUT_2:
+		case SHADER_INPUT_3:
+		case SHADER_INPUT_4: {
+			const float4 &input = ci.inputs[item - SHADER_INPUT_1];
+			return (withAlpha || !inputsHaveAlpha) ? input : float4{ input.x, input.y, input.z, 1.0f };
+		}
+		case SHADER_TEXEL0:
+			return withAlpha ? ci.texVal0 : float4{ ci.texVal0.x, ci.texVal0.y, ci.texVal0.z, 1.0f };
+		case SHADER_TEXEL0A: {
+			const float a = ci.texVal0.w;
+			return (hintSingleElement || withAlpha) ? float4{ a, a, a, a } : float4{ a, a, a, 1.0f };
+		}
+		case SHADER_TEXEL1:
+			return withAlpha ? ci.texVal1 : float4{ ci.texVal1.x, ci.texVal1.y, ci.texVal1.z, 1.0f };
+		}
+	}
+
+	float4 colorFormula(const ColorCombinerParams &cc, bool withAlpha, bool inputsHaveAlpha, const CombinerInputs &ci) {
+		if (cc.do_single[0]) {
+			return colorInput(cc.c[0][3], withAlpha, inputsHaveAlpha, false, ci);
+		}
+		else if (cc.do_multiply[0]) {
+			return colorInput(cc.c[0][0], withAlpha, inputsHaveAlpha, false, ci) * colorInput(cc.c[0][2], withAlpha, inputsHaveAlpha, true, ci);
+		}
+		else if (cc.do_mix[0]) {
+			return lerp(colorInput(cc.c[0][1], withAlpha, inputsHaveAlpha, false, ci), colorInput(cc.c[0][0], withAlpha, inputsHaveAlpha, false, ci), colorInput(cc.c[0][2], withAlpha, inputsHaveAlpha, true, ci));
+		}
+		else {
+			float4 a = colorInput(cc.c[0][0], withAlpha, inputsHaveAlpha, false, ci);
+			float4 b = colorInput(cc.c[0][1], withAlpha, inputsHaveAlpha, false, ci);
+			float4 c = colorInput(cc.c[0][2], withAlpha, inputsHaveAlpha, true, ci);
+			float4 d = colorInput(cc.c[0][3], withAlpha, inputsHaveAlpha, false, ci);
+			return (a - b) * c.x + d;
+		}
+	}
+
+	float alphaInput(int item, const CombinerInputs &ci) {
+		switch (item) {
+		default:
+		case SHADER_0:
+			return 0.0f;
+		case SHADER_INPUT_1:
+		case SHADER_INPUT_2:
+		case SHADER_INPUT_3:
+		case SHADER_INPUT_4:
+			return ci.inputs[item - SHADER_INPUT_1].w;
+		case SHADER_TEXEL0:
+		case SHADER_TEXEL0A:
+			return ci.texVal0.w;
+		case SHADER_TEXEL1:
+			return ci.texVal1.w;
+		}
+	}
+
+	float alphaFormula(const ColorCombinerParams &cc, const CombinerInputs &ci) {
+		if (cc.do_single[1]) {
+			return alphaInput(cc.c[1][3], ci);
+		}
+		else if (cc.do_multiply[1]) {
+			return alphaInput(cc.c[1][0], ci) * alphaInput(cc.c[1][2], ci);
+		}
+		else if (cc.do_mix[1]) {
+			return lerp(alphaInput(cc.c[1][1], ci), alphaInput(cc.c[1][0], ci), alphaInput(cc.c[1][2], ci));
+		}
+		else {
+			return (alphaInput(cc.c[1][0], ci) - alphaInput(cc.c[1][1], ci)) * alphaInput(cc.c[1][2], ci) + alphaInput(cc.c[1][3], ci);
+		}
+	}
+
+	void fillCombinerInputs(const TraceInstance &inst, const SurfaceAttributes &attr, float texLODBias, CombinerInputs &ci) {
+		for (int i = 0; i < inst.cc.inputCount; i++) {
+			ci.inputs[i] = attr.inputs[i];
+		}
+
+		ci.texVal0 = { 0.0f, 0.0f, 0.0f, 0.0f };
+		if (inst.cc.useTextures[0]) {
+			ci.texVal0 = sampleTexture(inst.desc->diffuseTexture, inst.desc->shader, attr.vertexUV, texLODBias);
+		}
+
+		// TODO: Same placeholder as the hit groups.
+		ci.texVal1 = { 1.0f, 0.0f, 1.0f, 1.0f };
+	}
+
+	// Surface any hit shader.
+	void evaluateSurfaceHit(const PixelContext &ctx, const HitCandidate &candidate, const float3 &worldRayDirection, HitRecord &hit) {
+		const TraceInstance &inst = ctx.scene->instances[candidate.instanceId];
+		const ColorCombinerParams &cc = inst.cc;
+		const RT64_MATERIAL &material = inst.desc->material;
+		const float4 diffuseColorMix = toFloat4(material.diffuseColorMix);
+		SurfaceAttributes attr;
+		CombinerInputs ci;
+		loadAttributes(inst, candidate.triangleIndex, candidate.u, candidate.v, attr);
+		const float texLODBias = inst.vertexUV ? rayConeLODBias(ctx, inst, attr, candidate.t, worldRayDirection) : 0.0f;
+		fillCombinerInputs(inst, attr, texLODBias, ci);
+		if (cc.useTextures[0]) {
+			ci.texVal0.setRgb(lerp(ci.texVal0.rgb(), diffuseColorMix.rgb(), std::max(-diffuseColorMix.w, 0.0f)));
+		}
+
+		float4 resultColor;
+		if (!cc.color_alpha_same && cc.opt_alpha) {
+			resultColor = colorFormula(cc, false, true, ci);
+			resultColor.w = alphaFormula(cc, ci);
+		}
+		else {
+			resultColor = colorFormula(cc, cc.opt_alpha, cc.opt_alpha, ci);
+		}
+
+		resultColor.setRgb(lerp(resultColor.rgb(), diffuseColorMix.rgb(), std::max(diffuseColorMix.w, 0.0f)));
+		resultColor.w = clamp(material.solidAlphaMultiplier * resultColor.w, 0.0f, 1.0f);
+		if (cc.opt_noise) {
+			resultColor.w *= ctx.noiseMask;
+		}
+
+		float3 vertexNormal = attr.vertexNormal;
+		if (inst.vertexUV && inst.normalMapEnabled && (inst.desc->normalTexture != nullptr)) {
+			// Tangent and binormal computed the same way as the hit group.
+			float uva = attr.uv[1].x - attr.uv[0].x;
+			float uvb = attr.uv[2].x - attr.uv[0].x;
+			float uvc = attr.uv[1].y - attr.uv[0].y;
+			float uvd = attr.uv[2].y - attr.uv[0].y;
+			float uvk = uvb * uvc - uva * uvd;
+			float3 dpos1 = attr.pos[1] - attr.pos[0];
+			float3 dpos2 = attr.pos[2] - attr.pos[0];
+			float3 vertexTangent = { 0.0f, 0.0f, 0.0f };
+			if (uvk != 0) {
+				vertexTangent = normalize((dpos2 * uvc - dpos1 * uvd) / uvk);
+			}
+			else if (uva != 0) {
+				vertexTangent = normalize(dpos1 / uva);
+			}
+			else if (uvb != 0) {
+				vertexTangent = normalize(dpos2 / uvb);
+			}
+
+			float2 duv1 = attr.uv[1] - attr.uv[0];
+			float2 duv2 = attr.uv[2] - attr.uv[1];
+			float crz = (duv1.x * -duv2.y) - (-duv1.y * duv2.x);
+			float binormalMult = (crz < 0.0f) ? -1.0f : 1.0f;
+			float3 vertexBinormal = cross(vertexTangent, vertexNormal) * binormalMult;
+
+			float4 normalSample = sampleTexture(inst.desc->normalTexture, inst.desc->shader, attr.vertexUV * material.uvDetailScale, texLODBias + log2f(material.uvDetailScale));
+			float3 normalColor = normalSample.rgb() * 2.0f - float3{ 1.0f, 1.0f, 1.0f };
+			vertexNormal = normalize(vertexNormal * normalColor.z + vertexTangent * normalColor.x + vertexBinormal * normalColor.y);
+		}
+
+		vertexNormal = normalize(toFloat3(XMVector4Transform(toXMVector(vertexNormal, 0.0f), inst.objectToWorldNormal)));
+		float3 triangleNormal = normalize(toFloat3(XMVector4Transform(toXMVector(attr.triangleNormal, 0.0f), inst.objectToWorldNormal)));
+		if (dot(triangleNormal, worldRayDirection) > 0.0f) {
+			vertexNormal = -vertexNormal;
+		}
+
+		float3 vertexSpecular = { 1.0f, 1.0f, 1.0f };
+		if (inst.vertexUV && inst.specularMapEnabled && (inst.desc->specularTexture != nullptr)) {
+			vertexSpecular = sampleTexture(inst.desc->specularTexture, inst.desc->shader, attr.vertexUV * material.uvDetailScale, texLODBias + log2f(material.uvDetailScale)).rgb();
+		}
+
+		hit.distance = candidate.tval;
+		hit.color = { toUnorm8(resultColor.x), toUnorm8(resultColor.y), toUnorm8(resultColor.z), toUnorm8(resultColor.w) };
+		hit.normal = { toSnorm16(vertexNormal.x), toSnorm16(vertexNormal.y), toSnorm16(vertexNormal.z) };
+		hit.specular = { toUnorm8(vertexSpecular.x), toUnorm8(vertexSpecular.y), toUnorm8(vertexSpecular.z) };
+		hit.instanceId = candidate.instanceId & 0xFFFF;
+	}
+
+	// Shadow any hit shader. Only used by shaders with alpha.
+	float evaluateShadowAlpha(const PixelContext &ctx, const TraceInstance &inst, uint32_t triangleIndex, float u, float v) {
+		const ColorCombinerParams &cc = inst.cc;
+		SurfaceAttributes attr;
+		CombinerInputs ci;
+		loadAttributes(inst, triangleIndex, u, v, attr);
+		fillCombinerInputs(inst, attr, TopLevelLODBias, ci);
+
+		float resultAlpha;
+		if (!cc.color_alpha_same && cc.opt_alpha) {
+			resultAlpha = alphaFormula(cc, ci);
+		}
+		else {
+			resultAlpha = colorFormula(cc, cc.opt_alpha, cc.opt_alpha, ci).w;
+		}
+
+		resultAlpha = clamp(resultAlpha * inst.desc->material.shadowAlphaMultiplier, 0.0f, 1.0f);
+		if (cc.opt_noise) {
+			resultAlpha *= ctx.noiseMask;
+		}
+
+		return resultAlpha;
+	}
+
+	// Visits every triangle hit by the ray inside [tMin, tMax] until the callback returns true.
+	template<typename Callback>
+	void intersectScene(const TraceScene &scene, const float3 &origin, const float3 &direction, float tMin, float tMax, bool cullBackFaces, Callback callback) {
+		const float sceneOrigin[3] = { origin.x, origin.y, origin.z };
+		const float sceneDirection[3] = { direction.x, direction.y, direction.z };
+		scene.sceneBVH.intersect(sceneOrigin, sceneDirection, tMin, tMax, cullBackFaces, callback);
+	}
+
+	inline const RT64_MATERIAL &instanceMaterial(const PixelContext &ctx, uint32_t instanceId) {
+		return ctx.scene->instances[instanceId].desc->material;
+	}
+
+	inline const RT64_LIGHT &sceneLight(const PixelContext &ctx, uint32_t lightIndex) {
+		return (*ctx.scene->lights)[lightIndex];
+	}
+
+	inline uint32_t sceneLightCount(const PixelContext &ctx) {
+		return static_cast<uint32_t>(ctx.scene->lights->size());
+	}
+
+	inline float withoutDistanceBias(const PixelContext &ctx, float distance, uint32_t instanceId) {
+		return distance + (instanceId * InstanceIdBias) + instanceMaterial(ctx, instanceId).depthBias;
+	}
+
+	// Tracer.hlsl
+
+	float traceShadow(PixelContext &ctx, const float3 &rayOrigin, const float3 &rayDirection, float rayMinDist, float rayMaxDist) {
+		float shadowHit = 1.0f;
+		intersectScene(*ctx.scene, rayOrigin, rayDirection, rayMinDist, rayMaxDist, false, [&](uint32_t instanceId, uint32_t triangleIndex, float t, float u, float v) {
+			const TraceInstance &inst = ctx.scene->instances[instanceId];
+			if (inst.cc.opt_alpha) {
+				shadowHit = std::max(shadowHit - evaluateShadowAlpha(ctx, inst, triangleIndex, u, v), 0.0f);
+			}
+			else {
+				shadowHit = 0.0f;
+			}
+
+			return (shadowHit <= 0.0f);
+		});
+
+		return shadowHit;
+	}
+
+	float calculateLightIntensitySimple(const PixelContext &ctx, uint32_t l, const float3 &position, const float3 &normal) {
+		const RT64_LIGHT &light = sceneLight(ctx, l);
+		float3 lightPosition = toFloat3(light.position);
+		float lightRadius = light.attenuationRadius;
+		float lightAttenuation = light.attenuationExponent;
+		float lightDistance = length(position - lightPosition);
+		float3 lightDirection = normalize(lightPosition - position);
+		const float surfaceBiasDotOffset = 0.707106f;
+		float surfaceBias = std::max(dot(normal, lightDirection) + surfaceBiasDotOffset, 0.0f);
+		float sampleIntensityFactor = powf(std::max(1.0f - (lightDistance / lightRadius), 0.0f), lightAttenuation) * surfaceBias;
+		return sampleIntensityFactor * dot(toFloat3(light.diffuseColor), { 1.0f, 1.0f, 1.0f });
+	}
+
+	float3 computeLight(PixelContext &ctx, uint32_t lightIndex, const float3 &rayDirection, uint32_t instanceId, const float3 &position, const float3 &normal, const float3 &specular, bool checkShadows, uint32_t seed) {
+		const RT64_MATERIAL &material = instanceMaterial(ctx, instanceId);
+		const RT64_LIGHT &light = sceneLight(ctx, lightIndex);
+		const unsigned int softLightSamples = ctx.scene->params->softLightSamples;
+		float ignoreNormalFactor = material.ignoreNormalFactor;
+		float specularExponent = material.specularExponent;
+		float shadowRayBias = material.shadowRayBias;
+		float3 lightPosition = toFloat3(light.position);
+		float3 lightDirection = normalize(lightPosition - position);
+		float lightRadius = light.attenuationRadius;
+		float lightAttenuation = light.attenuationExponent;
+		float lightPointRadius = (softLightSamples > 0) ? light.pointRadius : 0.0f;
+		float3 perpX = cross(-lightDirection, { 0.0f, 1.0f, 0.0f });
+		if (!any(perpX)) {
+			perpX.x = 1.0f;
+		}
+
+		float3 perpY = cross(perpX, -lightDirection);
+		float shadowOffset = light.shadowOffset;
+		const uint32_t maxSamples = std::max(softLightSamples, 1U);
+		uint32_t samples = maxSamples;
+		float lLambertFactor = 0.0f;
+		float3 lSpecularityFactor = { 0.0f, 0.0f, 0.0f };
+		float lShadowFactor = 0.0f;
+		while (samples > 0) {
+			float sampleX = nextRand(seed);
+			float sampleY = nextRand(seed);
+			float2 sampleCoordinate = float2{ sampleX, sampleY } * 2.0f - float2{ 1.0f, 1.0f };
+			sampleCoordinate = normalize(sampleCoordinate) * saturate(length(sampleCoordinate));
+
+			float3 samplePosition = lightPosition + perpX * sampleCoordinate.x * lightPointRadius + perpY * sampleCoordinate.y * lightPointRadius;
+			float sampleDistance = length(position - samplePosition);
+			float3 sampleDirection = normalize(samplePosition - position);
+			float sampleIntensityFactor = powf(std::max(1.0f - (sampleDistance / lightRadius), 0.0f), lightAttenuation);
+			float3 reflectedLight = reflect(-sampleDirection, normal);
+			float NdotL = std::max(dot(normal, sampleDirection), 0.0f);
+			float sampleLambertFactor = lerp(NdotL, 1.0f, ignoreNormalFactor) * sampleIntensityFactor;
+			float sampleShadowFactor = 1.0f;
+			if (checkShadows) {
+				sampleShadowFactor = traceShadow(ctx, position, sampleDirection, RayMinDistance + shadowRayBias, (sampleDistance - shadowOffset));
+			}
+
+			float3 sampleSpecularityFactor = specular * powf(std::max(saturate(dot(reflectedLight, -rayDirection) * sampleIntensityFactor), 0.0f), specularExponent);
+			lLambertFactor += sampleLambertFactor / maxSamples;
+			lSpecularityFactor += sampleSpecularityFactor / (float)(maxSamples);
+			lShadowFactor += sampleShadowFactor / maxSamples;
+
+			samples--;
+		}
+
+		return (toFloat3(light.diffuseColor) * lLambertFactor + toFloat3(light.specularColor) * lSpecularityFactor) * lShadowFactor;
+	}
+
+	float3 computeLightsOrdered(PixelContext &ctx, const float3 &rayDirection, uint32_t instanceId, const float3 &position, const float3 &normal, const float3 &specular, uint32_t maxLights, bool checkShadows, uint32_t seed) {
+		float3 resultLight = { 0.0f, 0.0f, 0.0f };
+		uint32_t lightGroupMaskBits = instanceMaterial(ctx, instanceId).lightGroupMaskBits;
+		if (lightGroupMaskBits > 0) {
+			// Build an array of the n closest lights by measuring their intensity.
+			uint32_t sMaxLightCount = std::min(maxLights, MaxLights);
+			float sLightIntensityFactors[MaxLights + 1];
+			uint32_t sLightIndices[MaxLights + 1];
+			uint32_t sLightCount = 0;
+			uint32_t gLightCount = sceneLightCount(ctx);
+			for (uint32_t l = 1; l < gLightCount; l++) {
+				if (lightGroupMaskBits & sceneLight(ctx, l).groupBits) {
+					float lightIntensityFactor = calculateLightIntensitySimple(ctx, l, position, normal);
+					if (lightIntensityFactor > Epsilon) {
+						uint32_t hi = std::min(sLightCount, sMaxLightCount);
+						while ((hi > 0) && (lightIntensityFactor > sLightIntensityFactors[hi - 1])) {
+							sLightIntensityFactors[hi] = sLightIntensityFactors[hi - 1];
+							sLightIndices[hi] = sLightIndices[hi - 1];
+							hi--;
+						}
+
+						sLightIntensityFactors[hi] = lightIntensityFactor;
+						sLightIndices[hi] = l;
+						sLightCount++;
+					}
+				}
+			}
+
+			sLightCount = std::min(sLightCount, sMaxLightCount);
+			for (uint32_t s = 0; s < sLightCount; s++) {
+				resultLight += computeLight(ctx, sLightIndices[s], rayDirection, instanceId, position, normal, specular, checkShadows, seed + s);
+			}
+		}
+
+		return resultLight;
+	}
+
+	float3 computeLightsRandom(PixelContext &ctx, const float3 &rayDirection, uint32_t instanceId, const float3 &position, const float3 &normal, const float3 &specular, uint32_t maxLights, bool checkShadows, uint32_t seed) {
+		float3 resultLight = { 0.0f, 0.0f, 0.0f };
+		uint32_t lightGroupMaskBits = instanceMaterial(ctx, instanceId).lightGroupMaskBits;
+		if (lightGroupMaskBits > 0) {
+			uint32_t sLightCount = 0;
+			uint32_t sLightIndices[MaxLights + 1];
+			float sLightIntensities[MaxLights + 1];
+			float totalLightIntensity = 0.0f;
+			uint32_t gLightCount = sceneLightCount(ctx);
+			for (uint32_t l = 1; (l < gLightCount) && (sLightCount < MaxLights); l++) {
+				if (lightGroupMaskBits & sceneLight(ctx, l).groupBits) {
+					float lightIntensity = calculateLightIntensitySimple(ctx, l, position, normal);
+					if (lightIntensity > Epsilon) {
+						sLightIntensities[sLightCount] = lightIntensity;
+						sLightIndices[sLightCount] = l;
+						totalLightIntensity += lightIntensity;
+						sLightCount++;
+					}
+				}
+			}
+
+			float randomRange = totalLightIntensity;
+			uint32_t lLightCount = std::min(sLightCount, maxLights);
+			bool useProbability = lLightCount == 1;
+			for (uint32_t s = 0; s < lLightCount; s++) {
+				float r = nextRand(seed) * randomRange;
+				uint32_t chosen = 0;
+				float rLightIntensity = sLightIntensities[chosen];
+				while ((chosen < (sLightCount - 1)) && (r >= rLightIntensity)) {
+					chosen++;
+					rLightIntensity += sLightIntensities[chosen];
+				}
+
+				// Store and clear the light intensity from the array.
+				float cLightIntensity = sLightIntensities[chosen];
+				uint32_t cLightIndex = sLightIndices[chosen];
+				float invProbability = useProbability ? (randomRange / cLightIntensity) : 1.0f;
+				sLightIntensities[chosen] = 0.0f;
+				randomRange -= cLightIntensity;
+
+				// Compute and add the light.
+				resultLight += computeLight(ctx, cLightIndex, rayDirection, instanceId, position, normal, specular, checkShadows, seed + s) * invProbability;
+			}
+		}
+
+		return resultLight;
+	}
+
+	float4 computeFog(const PixelContext &ctx, uint32_t instanceId, const float3 &position) {
+		const RT64_MATERIAL &material = instanceMaterial(ctx, instanceId);
+		const RT64::ReferenceTracer::Params &params = *ctx.scene->params;
+		float4 fogColor = { material.fogColor.x, material.fogColor.y, material.fogColor.z, 0.0f };
+		XMVECTOR clipPos = XMVector4Transform(toXMVector(position, 1.0f), XMMatrixMultiply(params.view, params.projection));
+		float clipZ = XMVectorGetZ(clipPos);
+		float clipW = XMVectorGetW(clipPos);
+
+		// Values from the game are designed around -1 to 1 space.
+		clipZ = clipZ * 2.0f - clipW;
+
+		float winv = 1.0f / std::max(clipW, 0.001f);
+		const float DivisionFactor = 255.0f;
+		fogColor.w = std::min(std::max((clipZ * winv * material.fogMul + material.fogOffset) / DivisionFactor, 0.0f), 1.0f);
+		return fogColor;
+	}
+
+	float3 sampleBackgroundAsEnvMap(const float3 &rayDirection) {
+		// The raster background only exists on the GPU, so the reference tracer treats it as black.
+		return { 0.0f, 0.0f, 0.0f };
+	}
+
+	float3 mixAmbientAndGI(const PixelContext &ctx, const float3 &ambientLight, const float3 &resultGiLight) {
+		const float ambGIMixWeight = ctx.scene->params->ambGIMixWeight;
+		float lumAmb = dot(ambientLight, { 1.0f, 1.0f, 1.0f });
+		float lumGI = dot(resultGiLight, { 1.0f, 1.0f, 1.0f });
+
+		// Assign intensity based on weight configuration.
+		lumAmb = lumAmb * (1.0f - ambGIMixWeight);
+		lumGI = lumGI * ambGIMixWeight;
+
+		float invSum = 1.0f / std::max(lumAmb + lumGI, Epsilon);
+		return ambientLight * lumAmb * invSum + resultGiLight * lumGI * invSum;
+	}
+
+	float3 simpleShadeFromHits(PixelContext &ctx, uint32_t hitOffset, uint32_t hitCount, const float3 &rayOrigin, const float3 &rayDirection, bool checkShadows, uint32_t seed) {
+		const unsigned int giEnvBounces = ctx.scene->params->giEnvBounces;
+		const float3 ambientLight = toFloat3(ctx.scene->ambientLight.diffuseColor);
+		float3 bgColor = sampleBackgroundAsEnvMap(rayDirection);
+		float4 resColor = { 0.0f, 0.0f, 0.0f, 1.0f };
+		float3 simpleLightsResult = { 0.0f, 0.0f, 0.0f };
+		uint32_t maxSimpleLights = 1;
+		for (uint32_t hit = hitOffset; hit < hitCount; hit++) {
+			const HitRecord &hitRecord = ctx.hits[hit];
+			float4 hitColor = hitRecord.color;
+			float alphaContrib = (resColor.w * hitColor.w);
+			if (alphaContrib >= Epsilon) {
+				uint32_t instanceId = hitRecord.instanceId;
+				const RT64_MATERIAL &material = instanceMaterial(ctx, instanceId);
+				uint32_t lightGroupMaskBits = material.lightGroupMaskBits;
+				float3 vertexPosition = rayOrigin + rayDirection * withoutDistanceBias(ctx, hitRecord.distance, instanceId);
+				float3 vertexNormal = hitRecord.normal;
+				float3 specular = toFloat3(material.specularColor) * hitRecord.specular;
+				float3 resultLight = toFloat3(material.selfLight);
+				float3 resultGiLight = { 0.0f, 0.0f, 0.0f };
+
+				// Reuse the previous computed lights result if available.
+				if (lightGroupMaskBits > 0) {
+					if (maxSimpleLights > 0) {
+						simpleLightsResult = computeLightsOrdered(ctx, rayDirection, instanceId, vertexPosition, vertexNormal, specular, 1, checkShadows, seed + hit);
+						maxSimpleLights--;
+					}
+
+					// Do fake GI bounces by sampling the background as an environment map.
+					uint32_t giSamples = giEnvBounces;
+					uint32_t seedCopy = seed;
+					while (giSamples > 0) {
+						float3 bounceDir = getCosHemisphereSample(seedCopy, vertexNormal);
+						float bounceStrength = std::min(1.0f + bounceDir.y, 1.0f);
+						float3 bounceColor = sampleBackgroundAsEnvMap(bounceDir) * bounceStrength;
+						resultGiLight += bounceColor / (float)(giEnvBounces);
+						giSamples--;
+					}
+
+					resultLight += simpleLightsResult;
+				}
+
+				resultLight += mixAmbientAndGI(ctx, ambientLight, resultGiLight);
+				hitColor.setRgb(hitColor.rgb() * resultLight);
+
+				// Backwards alpha blending.
+				resColor.setRgb(resColor.rgb() + hitColor.rgb() * alphaContrib);
+				resColor.w *= (1.0f - hitColor.w);
+			}
+
+			if (resColor.w <= Epsilon) {
+				break;
+			}
+		}
+
+		return lerp(bgColor, saturate(resColor.rgb()), (1.0f - resColor.w));
+	}
+
+	// Orders ties by instance and triangle so the result is deterministic regardless of traversal order.
+	bool compareCandidates(const HitCandidate &a, const HitCandidate &b) {
+		if (a.tval != b.tval) {
+			return a.tval < b.tval;
+		}
+		else if (a.instanceId != b.instanceId) {
+			return a.instanceId < b.instanceId;
+		}
+		else {
+			return a.triangleIndex < b.triangleIndex;
+		}
+	}
+
+	// Fills the k-buffer from hitOffset onwards with the closest hits sorted by their biased distance.
+	uint32_t traceSurface(PixelContext &ctx, const float3 &rayOrigin, const float3 &rayDirection, float rayMinDist, float rayMaxDist, uint32_t rayHitOffset) {
+		const TraceScene &scene = *ctx.scene;
+		ctx.candidates.clear();
+		intersectScene(scene, rayOrigin, rayDirection, rayMinDist, rayMaxDist, true, [&](uint32_t instanceId, uint32_t triangleIndex, float t, float u, float v) {
+			float depthBias = scene.instances[instanceId].desc->material.depthBias;
+			float tval = t - (instanceId * InstanceIdBias) - depthBias;
+			ctx.candidates.push_back({ t, tval, instanceId, triangleIndex, u, v });
+			return false;
+		});
+
+		size_t freeSlots = (rayHitOffset < MaxHitQueries) ? (MaxHitQueries - rayHitOffset) : 0;
+		size_t keepCount = std::min(ctx.candidates.size(), freeSlots);
+		std::partial_sort(ctx.candidates.begin(), ctx.candidates.begin() + keepCount, ctx.candidates.end(), compareCandidates);
+		for (size_t i = 0; i < keepCount; i++) {
+			evaluateSurfaceHit(ctx, ctx.candidates[i], rayDirection, ctx.hits[rayHitOffset + i]);
+		}
+
+		return rayHitOffset + static_cast<uint32_t>(keepCount);
+	}
+
+	float3 traceSimple(PixelContext &ctx, const float3 &rayOrigin, const float3 &rayDirection, float rayMinDist, float rayMaxDist, uint32_t hitOffset, bool checkShadows, uint32_t seed) {
+		uint32_t hitCount = traceSurface(ctx, rayOrigin, rayDirection, rayMinDist, rayMaxDist, hitOffset);
+		return simpleShadeFromHits(ctx, hitOffset, std::min(hitCount, MaxHitQueries), rayOrigin, rayDirection, checkShadows, seed);
+	}
+
+	float fresnelReflectAmount(const float3 &normal, const float3 &incident, float reflectivity, float fresnelMultiplier) {
+		float ret = powf(clamp(1.0f + dot(normal, incident), Epsilon, 1.0f), 5.0f);
+		return reflectivity + ((1.0f - reflectivity) * ret * fresnelMultiplier);
+	}
+
+	float4 computeReflection(PixelContext &ctx, float reflectionFactor, float reflectionShineFactor, float reflectionFresnelFactor, const float3 &rayDirection, const float3 &position, const float3 &normal, uint32_t hitOffset, uint32_t seed) {
+		float3 reflectionDirection = reflect(rayDirection, normal);
+		float3 reflectionColor = traceSimple(ctx, position, reflectionDirection, RayMinDistance, RayMaxDistance, hitOffset, false, seed);
+		const float3 HighlightColor = { 1.0f, 1.05f, 1.2f };
+		const float3 ShadowColor = { 0.1f, 0.05f, 0.0f };
+		const float BlendingExponent = 3.0f;
+		reflectionColor = lerp(reflectionColor, HighlightColor, powf(std::max(reflectionDirection.y, 0.0f) * reflectionShineFactor, BlendingExponent));
+		reflectionColor = lerp(reflectionColor, ShadowColor, powf(std::max(-reflectionDirection.y, 0.0f) * reflectionShineFactor, BlendingExponent));
+		return { reflectionColor.x, reflectionColor.y, reflectionColor.z, fresnelReflectAmount(normal, rayDirection, reflectionFactor, reflectionFresnelFactor) };
+	}
+
+	void fullShadeFromHits(PixelContext &ctx, uint32_t hitCount, float3 rayOrigin, float3 rayDirection, uint32_t seed, RT64_VECTOR4 &output, RT64_VECTOR4 &albedo, RT64_VECTOR4 &normal) {
+		const RT64::ReferenceTracer::Params &params = *ctx.scene->params;
+		const float3 ambientLight = toFloat3(ctx.scene->ambientLight.diffuseColor);
+		float4 resColor = { 0.0f, 0.0f, 0.0f, 1.0f };
+		float4 finalAlbedo = { 0.0f, 0.0f, 0.0f, 0.0f };
+		float4 finalNormal = { 0.0f, 0.0f, 0.0f, 0.0f };
+		float3 simpleLightsResult = { 0.0f, 0.0f, 0.0f };
+		uint32_t maxRefractions = 1;
+		uint32_t maxSimpleLights = 1;
+		uint32_t maxFullLights = 1;
+		uint32_t maxGI = 1;
+		uint32_t maxSimpleLightSamples = std::min(params.maxLightSamples, 2U);
+		for (uint32_t hit = 0; hit < hitCount; hit++) {
+			const HitRecord &hitRecord = ctx.hits[hit];
+			uint32_t instanceId = hitRecord.instanceId;
+			const RT64_MATERIAL &material = instanceMaterial(ctx, instanceId);
+			float hitDistance = withoutDistanceBias(ctx, hitRecord.distance, instanceId);
+			seed += asuint(hitDistance);
+
+			float4 hitColor = hitRecord.color;
+			float3 vertexPosition = rayOrigin + rayDirection * hitDistance;
+			float3 vertexNormal = hitRecord.normal;
+			float3 vertexSpecular = hitRecord.specular;
+			float refractionFactor = material.refractionFactor;
+			float alphaContrib = (resColor.w * hitColor.w);
+			if (alphaContrib >= Epsilon) {
+				uint32_t lightGroupMaskBits = material.lightGroupMaskBits;
+				float3 resultLight = toFloat3(material.selfLight);
+				float3 resultGiLight = { 0.0f, 0.0f, 0.0f };
+				if (lightGroupMaskBits > 0) {
+					float3 specular = toFloat3(material.specularColor) * vertexSpecular;
+					bool solidColor = (hitColor.w >= FullQualityAlpha);
+					bool lastHit = (((hit + 1) >= hitCount) && (refractionFactor <= Epsilon));
+
+					// Full light sampling.
+					if ((maxFullLights > 0) && (solidColor || lastHit)) {
+						finalAlbedo = hitColor;
+						finalNormal = { vertexNormal.x, vertexNormal.y, vertexNormal.z, 0.0f };
+						resultLight += computeLightsRandom(ctx, rayDirection, instanceId, vertexPosition, vertexNormal, specular, params.maxLightSamples, true, seed);
+						maxFullLights--;
+					}
+					// Simple light sampling. Reuse previous result if calculated once already.
+					else {
+						if (maxSimpleLights > 0) {
+							simpleLightsResult += computeLightsRandom(ctx, rayDirection, instanceId, vertexPosition, vertexNormal, specular, maxSimpleLightSamples, true, seed);
+							maxSimpleLights--;
+						}
+
+						resultLight = simpleLightsResult;
+					}
+
+					// Global illumination.
+					bool alphaGIRequired = (alphaContrib >= GIMinimumAlpha);
+					if ((maxGI > 0) && (alphaGIRequired || lastHit)) {
+						uint32_t giSamples = params.giBounces;
+						uint32_t seedCopy = seed;
+						while (giSamples > 0) {
+							float3 bounceDir = getCosHemisphereSample(seedCopy, vertexNormal);
+							float3 bounceColor = traceSimple(ctx, vertexPosition, bounceDir, RayMinDistance, RayMaxDistance, hitCount, true, seed + giSamples);
+							resultGiLight += bounceColor / (float)(params.giBounces);
+							giSamples--;
+						}
+
+						maxGI--;
+					}
+
+					// Eye light.
+					float specularExponent = material.specularExponent;
+					float eyeLightLambertFactor = std::max(dot(vertexNormal, -rayDirection), 0.0f);
+					float3 eyeLightReflected = reflect(rayDirection, vertexNormal);
+					float3 eyeLightSpecularFactor = specular * powf(std::max(saturate(dot(eyeLightReflected, -rayDirection)), 0.0f), specularExponent);
+					const float3 eyeLightDiffuseColor = { 0.15f, 0.15f, 0.15f };
+					const float3 eyeLightSpecularColor = { 0.05f, 0.05f, 0.05f };
+					resultLight += (eyeLightDiffuseColor * eyeLightLambertFactor + eyeLightSpecularColor * eyeLightSpecularFactor);
+				}
+
+				resultLight += mixAmbientAndGI(ctx, ambientLight, resultGiLight);
+				hitColor.setRgb(hitColor.rgb() * resultLight);
+
+				// Add reflections.
+				float reflectionFactor = material.reflectionFactor;
+				if (reflectionFactor > Epsilon) {
+					float4 reflectionColor = computeReflection(ctx, reflectionFactor, material.reflectionShineFactor, material.reflectionFresnelFactor, rayDirection, vertexPosition, vertexNormal, hitCount, seed);
+					hitColor.setRgb(lerp(hitColor.rgb(), reflectionColor.rgb(), reflectionColor.w));
+				}
+
+				// Calculate the fog for the resulting color using the camera data if the option is enabled.
+				if (material.fogEnabled) {
+					float4 fogColor = computeFog(ctx, instanceId, vertexPosition);
+					hitColor.setRgb(lerp(hitColor.rgb(), fogColor.rgb(), fogColor.w));
+				}
+
+				// Backwards alpha blending.
+				resColor.setRgb(resColor.rgb() + hitColor.rgb() * alphaContrib);
+				resColor.w *= (1.0f - hitColor.w);
+			}
+
+			if (resColor.w <= Epsilon) {
+				break;
+			}
+
+			// Do refractions.
+			if ((refractionFactor > Epsilon) && (maxRefractions > 0)) {
+				float3 refractionDirection = refract(rayDirection, vertexNormal, refractionFactor);
+
+				// Perform another trace and fill the rest of the buffers.
+				hitCount = std::min(traceSurface(ctx, vertexPosition, refractionDirection, RayMinDistance, RayMaxDistance, hit + 1), MaxHitQueries);
+				rayOrigin = vertexPosition;
+				rayDirection = refractionDirection;
+				maxRefractions--;
+			}
+		}
+
+		output = { resColor.x, resColor.y, resColor.z, (1.0f - resColor.w) };
+		albedo = { finalAlbedo.x, finalAlbedo.y, finalAlbedo.z, finalAlbedo.w };
+		normal = { finalNormal.x, finalNormal.y, finalNormal.z, finalNormal.w };
+	}
+
+	// Same primary rays as TraceRayGen.
+	void computePrimaryRay(const RT64::ReferenceTracer::Params &params, int x, int y, int width, int height, float3 &rayOrigin, float3 &rayDirection) {
+		float dx = ((x + 0.5f) / width) * 2.0f - 1.0f;
+		float dy = ((y + 0.5f) / height) * 2.0f - 1.0f;
+		XMVECTOR target = XMVector4Transform(XMVectorSet(dx, -dy, 1.0f, 1.0f), params.projectionI);
+		rayOrigin = toFloat3(XMVector4Transform(XMVectorSet(0.0f, 0.0f, 0.0f, 1.0f), params.viewI));
+		rayDirection = toFloat3(XMVector4Transform(XMVectorSetW(target, 0.0f), params.viewI));
+	}
+};
+
+// Private
+
+struct RT64::ReferenceTracer::TraceData {
+	TraceScene scene;
+};
+
+RT64::ReferenceTracer::ReferenceTracer(WorkerPool *workerPool) {
+	assert(workerPool != nullptr);
+	this->workerPool = workerPool;
+	memset(&params, 0, sizeof(Params));
+	traceData = nullptr;
+}
+
+RT64::ReferenceTracer::~ReferenceTracer() {
+	delete traceData;
+}
+
+void RT64::ReferenceTracer::updateTraceData() {
+	if (traceData != nullptr) {
+		return;
+	}
+
+	traceData = new TraceData();
+	TraceScene &scene = traceData->scene;
+	scene.instances.reserve(instances.size());
+	for (size_t i = 0; i < instances.size(); i++) {
+		const Instance &instance = instances[i];
+		assert(instance.mesh != nullptr);
+		assert(instance.shader != nullptr);
+		scene.instances.emplace_back(&instance);
+		scene.sceneBVH.addInstance(instance.mesh, instance.transform, instance.cullDisable);
+	}
+
+	scene.sceneBVH.build();
+}
+
+void RT64::ReferenceTracer::setInstances(const std::vector<Instance> &instances) {
+	this->instances = instances;
+	delete traceData;
+	traceData = nullptr;
+}
+
+void RT64::ReferenceTracer::setLights(const std::vector<RT64_LIGHT> &lights) {
+	this->lights = lights;
+}
+
+void RT64::ReferenceTracer::setParams(const Params &params) {
+	this->params = params;
+}
+
+void RT64::ReferenceTracer::render(int width, int height, RT64_VECTOR4 *output, RT64_VECTOR4 *albedo, RT64_VECTOR4 *normal) {
+	assert(width > 0);
+	assert(height > 0);
+	assert(output != nullptr);
+
+	updateTraceData();
+	TraceScene &scene = traceData->scene;
+	scene.lights = &lights;
+	scene.params = &params;
+	memset(&scene.ambientLight, 0, sizeof(RT64_LIGHT));
+	if (!lights.empty()) {
+		scene.ambientLight = lights[0];
+	}
+
+	// Split the image in tiles and let every worker thread pick them up as they finish.
+	const int tilesX = (width + TileSize - 1) / TileSize;
+	const int tilesY = (height + TileSize - 1) / TileSize;
+	workerPool->run(tilesX * tilesY, [&](size_t tileIndex) {
+		const int tileX = (int)(tileIndex % tilesX) * TileSize;
+		const int tileY = (int)(tileIndex / tilesX) * TileSize;
+		const int tileEndX = std::min(tileX + TileSize, width);
+		const int tileEndY = std::min(tileY + TileSize, height);
+		PixelContext ctx;
+		ctx.scene = &scene;
+		ctx.launchDims[0] = width;
+		ctx.launchDims[1] = height;
+		for (int y = tileY; y < tileEndY; y++) {
+			for (int x = tileX; x < tileEndX; x++) {
+				ctx.launchIndex[0] = x;
+				ctx.launchIndex[1] = y;
+
+				// The noise in the hit groups only depends on the pixel and the frame.
+				uint32_t noiseSeed = initRand(x + y * width, params.frameCount, 16);
+				ctx.noiseMask = roundf(nextRand(noiseSeed));
+
+				float3 rayOrigin, rayDirection;
+				computePrimaryRay(params, x, y, width, height, rayOrigin, rayDirection);
+				uint32_t seed = initRand(x + y * width, params.randomSeed, 16);
+				uint32_t hitCount = traceSurface(ctx, rayOrigin, rayDirection, RayMinDistance, RayMaxDistance, 0);
+
+				const size_t pixelIndex = (size_t)(y) * width + x;
+				RT64_VECTOR4 pixelAlbedo, pixelNormal;
+				fullShadeFromHits(ctx, std::min(hitCount, MaxHitQueries), rayOrigin, rayDirection, seed, output[pixelIndex], pixelAlbedo, pixelNormal);
+				if (albedo != nullptr) {
+					albedo[pixelIndex] = pixelAlbedo;
+				}
+
+				if (normal != nullptr) {
+					normal[pixelIndex] = pixelNormal;
+				}
+			}
+		}
+	});
+}
+
+int RT64::ReferenceTracer::pick(int x, int y, int width, int height) {
+	assert(width > 0);
+	assert(height > 0);
+
+	updateTraceData();
+	TraceScene &scene = traceData->scene;
+	scene.lights = &lights;
+	scene.params = &params;
+
+	// Dithered surfaces are treated as solid so the result doesn't flicker between frames.
+	PixelContext ctx;
+	ctx.scene = &scene;
+	ctx.launchIndex[0] = x;
+	ctx.launchIndex[1] = y;
+	ctx.launchDims[0] = width;
+	ctx.launchDims[1] = height;
+	ctx.noiseMask = 1.0f;
+
+	// Find the first hit of the k-buffer, skipping the surfaces that are fully transparent.
+	float3 rayOrigin, rayDirection;
+	computePrimaryRay(params, x, y, width, height, rayOrigin, rayDirection);
+	HitCandidate closest;
+	bool closestFound = false;
+	intersectScene(scene, rayOrigin, rayDirection, RayMinDistance, RayMaxDistance, true, [&](uint32_t instanceId, uint32_t triangleIndex, float t, float u, float v) {
+		float depthBias = scene.instances[instanceId].desc->material.depthBias;
+		HitCandidate candidate = { t, t - (instanceId * InstanceIdBias) - depthBias, instanceId, triangleIndex, u, v };
+		if (closestFound && !compareCandidates(candidate, closest)) {
+			return false;
+		}
+
+		HitRecord hit;
+		evaluateSurfaceHit(ctx, candidate, rayDirection, hit);
+		if (hit.color.w >= Epsilon) {
+			closest = candidate;
+			closestFound = true;
+		}
+
+		return false;
+	});
+
+	return closestFound ? static_cast<int>(closest.instanceId) : -1;
+}
+
+#endif
@@ -0,0 +1,62 @@
+//
+// RT64
+//
+
+#pragma once
+
+#include "rt64_common.h"
+
+namespace RT64 {
+	class Mesh;
+	class Shader;
+	class Texture;
+	class WorkerPool;
+
+	// Renders a view on the CPU with the same shading model as Tracer.hlsl and the generated hit groups.
+	// It doesn't need a GPU, so it can be used for validation frames and offline renders.
+	class ReferenceTracer {
+	public:
+		struct Instance {
+			Mesh *mesh;
+			Shader *shader;
+			Texture *diffuseTexture;
+			Texture *normalTexture;
+			Texture *specularTexture;
+			XMMATRIX transform;
+			RT64_MATERIAL material;
+			bool cullDisable;
+		};
+
+		struct Params {
+			XMMATRIX view;
+			XMMATRIX projection;
+			XMMATRIX viewI;
+			XMMATRIX projectionI;
+			unsigned int randomSeed;
+			unsigned int softLightSamples;
+			unsigned int giBounces;
+			unsigned int giEnvBounces;
+			unsigned int maxLightSamples;
+			float ambGIMixWeight;
+			unsigned int frameCount;
+		};
+	private:
+		struct TraceData;
+
+		WorkerPool *workerPool;
+		std::vector<Instance> instances;
+		std::vector<RT64_LIGHT> lights;
+		Params params;
+		TraceData *traceData;
+
+		void updateTraceData();
+	public:
+		ReferenceTracer(WorkerPool *workerPool);
+		virtual ~ReferenceTracer();
+		void setInstances(const std::vector<Instance> &instances);
+		void setLights(const std::vector<RT64_LIGHT> &lights);
+		void setParams(const Params &params);
+		void render(int width, int height, RT64_VECTOR4 *output, RT64_VECTOR4 *albedo, RT64_VECTOR4 *normal);
+		int pick(int x, int y, int width, int height);
+	};
+};
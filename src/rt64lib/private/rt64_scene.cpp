@@ -6,6 +6,7 @@
 
 #include "../public/rt64.h"
 
+#include <algorithm>
 #include <map>
 #include <random>
 #include <set>
@@ -14,7 +15,15 @@
 
 #include "rt64_device.h"
 #include "rt64_instance.h"
+#include "rt64_mesh.h"
+#include "rt64_scene_bvh.h"
 #include "rt64_view.h"
+#include "rt64_workers.h"
+
+namespace {
+	// Rays are traced in batches of this size by each task of the worker pool.
+	const int RaysPerTask = 256;
+};
 
 // Private
 
@@ -22,14 +31,26 @@ RT64::Scene::Scene(Device *device) {
 	assert(device != nullptr);
 	this->device = device;
 	lightsBufferSize = 0;
+	lightsVersion = 0;
 	lightsCount = 0;
+	lightsDirty = false;
+	instancesDirty = true;
+	sceneBVHRebuild = true;
+	sceneBVHRefit = false;
+
+	for (UINT i = 0; i < FrameScheduler::FramesInFlight; i++) {
+		lightsBufferVersions[i] = 0;
+	}
+
 	device->addScene(this);
 }
 
 RT64::Scene::~Scene() {
 	device->removeScene(this);
 
-	lightsBuffer.Release();
+	for (UINT i = 0; i < FrameScheduler::FramesInFlight; i++) {
+		device->retireResource(lightsBuffers[i]);
+	}
 
 	for (int i = 0; i < views.size(); i++) {
 		delete views[i];
@@ -40,10 +61,88 @@ RT64::Scene::~Scene() {
 	}
 }
 
+void RT64::Scene::updateLightsBuffer() {
+	// Every frame slot has its own copy of the lights, which is brought up to date once the slot is recorded again.
+	const UINT frameSlot = device->getFrameSlot();
+	if ((lightsCount == 0) || (lightsBufferVersions[frameSlot] == lightsVersion)) {
+		return;
+	}
+
+	uint8_t *pData;
+	AllocatedResource &lightsBuffer = lightsBuffers[frameSlot];
+	D3D12_CHECK(lightsBuffer.Get()->Map(0, nullptr, (void **)&pData));
+	memcpy(pData, lights.data(), sizeof(RT64_LIGHT) * lightsCount);
+	lightsBuffer.Get()->Unmap(0, nullptr);
+	lightsBufferVersions[frameSlot] = lightsVersion;
+}
+
 void RT64::Scene::update() {
+	updateLightsBuffer();
+
 	for (View *view : views) {
 		view->update();
 	}
+
+	// Every view has seen the changes by now.
+	trackSceneBVHChanges();
+	for (Instance *instance : dirtyInstances) {
+		instance->clearDirtyMask();
+	}
+
+	dirtyInstances.clear();
+	instancesDirty = false;
+	lightsDirty = false;
+}
+
+void RT64::Scene::trackSceneBVHChanges() {
+	// The dirty instances are cleared once the views have seen them, so the BVH keeps its own state until the next trace.
+	if (instancesDirty) {
+		sceneBVHRebuild = true;
+	}
+
+	const unsigned int rebuildMask = Instance::DirtyMesh | Instance::DirtyMeshBuffers;
+	const unsigned int refitMask = Instance::DirtyTransform | Instance::DirtyFlags | Instance::DirtyMeshGeometry;
+	for (Instance *instance : dirtyInstances) {
+		const unsigned int dirtyMask = instance->getDirtyMask();
+		if (dirtyMask & rebuildMask) {
+			sceneBVHRebuild = true;
+		}
+		else if (dirtyMask & refitMask) {
+			sceneBVHRefit = true;
+		}
+	}
+}
+
+void RT64::Scene::updateSceneBVH() {
+	trackSceneBVHChanges();
+
+	// Only the instances that are in the raytracing scene can be hit. Changing the mesh can add or remove an instance.
+	if (sceneBVHRebuild) {
+		sceneBVH.clear();
+		sceneBVHInstances.clear();
+		for (Instance *instance : instances) {
+			Mesh *mesh = instance->getMesh();
+			if ((mesh == nullptr) || (mesh->getBottomLevelASResult() == nullptr)) {
+				continue;
+			}
+
+			sceneBVH.addInstance(mesh, instance->getTransform(), (instance->getFlags() & RT64_INSTANCE_DISABLE_BACKFACE_CULLING) != 0);
+			sceneBVHInstances.push_back(instance);
+		}
+
+		sceneBVH.build();
+	}
+	else if (sceneBVHRefit) {
+		for (size_t i = 0; i < sceneBVHInstances.size(); i++) {
+			Instance *instance = sceneBVHInstances[i];
+			sceneBVH.updateInstance(i, instance->getMesh(), instance->getTransform(), (instance->getFlags() & RT64_INSTANCE_DISABLE_BACKFACE_CULLING) != 0);
+		}
+
+		sceneBVH.refit();
+	}
+
+	sceneBVHRebuild = false;
+	sceneBVHRefit = false;
 }
 
 void RT64::Scene::render() {
@@ -61,6 +160,7 @@ void RT64::Scene::resize() {
 void RT64::Scene::addInstance(Instance *instance) {
 	assert(instance != nullptr);
 	instances.push_back(instance);
+	instancesDirty = true;
 }
 
 void RT64::Scene::removeInstance(Instance *instance) {
@@ -70,6 +170,30 @@ void RT64::Scene::removeInstance(Instance *instance) {
 	if (it != instances.end()) {
 		instances.erase(it);
 	}
+
+	auto dirtyIt = std::find(dirtyInstances.begin(), dirtyInstances.end(), instance);
+	if (dirtyIt != dirtyInstances.end()) {
+		dirtyInstances.erase(dirtyIt);
+	}
+
+	instancesDirty = true;
+}
+
+void RT64::Scene::markInstanceDirty(Instance *instance) {
+	assert(instance != nullptr);
+	dirtyInstances.push_back(instance);
+}
+
+void RT64::Scene::markInstancesDirty() {
+	instancesDirty = true;
+}
+
+bool RT64::Scene::areInstancesDirty() const {
+	return instancesDirty;
+}
+
+const std::vector<RT64::Instance *> &RT64::Scene::getDirtyInstances() const {
+	return dirtyInstances;
 }
 
 void RT64::Scene::addView(View *view) {
@@ -91,45 +215,93 @@ void RT64::Scene::setLights(RT64_LIGHT *lightArray, int lightCount) {
 	assert(lightCount > 0);
 	size_t newSize = ROUND_UP(sizeof(RT64_LIGHT) * lightCount, D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT);
 	if (newSize != lightsBufferSize) {
-		lightsBuffer.Release();
-		lightsBuffer = getDevice()->allocateBuffer(D3D12_HEAP_TYPE_UPLOAD, newSize, D3D12_RESOURCE_FLAG_NONE, D3D12_RESOURCE_STATE_GENERIC_READ);
+		for (UINT i = 0; i < FrameScheduler::FramesInFlight; i++) {
+			device->retireResource(lightsBuffers[i]);
+			lightsBuffers[i] = device->allocateBuffer(D3D12_HEAP_TYPE_UPLOAD, newSize, D3D12_RESOURCE_FLAG_NONE, D3D12_RESOURCE_STATE_GENERIC_READ);
+		}
+
 		lightsBufferSize = newSize;
+		lightsDirty = true;
 	}
 
-	uint8_t *pData;
-	size_t i = 0;
-	D3D12_CHECK(lightsBuffer.Get()->Map(0, nullptr, (void **)&pData));
+	// The views describe the buffer with the amount of lights.
+	if (lightsCount != lightCount) {
+		lightsDirty = true;
+	}
+
+	// Keep a CPU copy of the lights so they can be used by the reference tracer.
 	if (lightArray != nullptr) {
-		memcpy(pData, lightArray, sizeof(RT64_LIGHT) * lightCount);
+		lights.assign(lightArray, lightArray + lightCount);
 
 		// Modify light colors with flicker intensity if necessary.
-		while (i < lightCount) {
-			RT64_LIGHT *light = ((RT64_LIGHT *)(pData));
-			const float flickerIntensity = light->flickerIntensity;
+		for (RT64_LIGHT &light : lights) {
+			const float flickerIntensity = light.flickerIntensity;
 			if (flickerIntensity > 0.0) {
 				const float flickerMult = 1.0f + ((randomDistribution(randomEngine) * 2.0f - 1.0f) * flickerIntensity);
-				light->diffuseColor.x *= flickerMult;
-				light->diffuseColor.y *= flickerMult;
-				light->diffuseColor.z *= flickerMult;
+				light.diffuseColor.x *= flickerMult;
+				light.diffuseColor.y *= flickerMult;
+				light.diffuseColor.z *= flickerMult;
 			}
-
-			pData += sizeof(RT64_LIGHT);
-			i++;
 		}
 	}
+	else {
+		lights.resize(lightCount);
+	}
 
-	lightsBuffer.Get()->Unmap(0, nullptr);
+	// The buffers are written once the frame is updated, as the ones of the frames in flight are still in use.
 	lightsCount = lightCount;
+	lightsVersion++;
 }
 
 ID3D12Resource *RT64::Scene::getLightsBuffer() const {
-	return lightsBuffer.Get();
+	return lightsBuffers[device->getFrameSlot()].Get();
+}
+
+bool RT64::Scene::areLightsDirty() const {
+	return lightsDirty;
 }
 
 int RT64::Scene::getLightsCount() const {
 	return lightsCount;
 }
 
+const std::vector<RT64_LIGHT> &RT64::Scene::getLights() const {
+	return lights;
+}
+
+void RT64::Scene::traceRays(const RT64_RAY *rays, int rayCount, RT64_HIT *hits) {
+	updateSceneBVH();
+
+	auto traceRay = [&](const RT64_RAY &ray, RT64_HIT &hit) {
+		const float origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+		const float direction[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+		const bool anyHit = (ray.flags & RT64_RAY_ANY_HIT) != 0;
+		const bool cullBackFaces = (ray.flags & RT64_RAY_CULL_BACK_FACES) != 0;
+		float tMax = ray.maxDistance;
+		hit.instance = nullptr;
+		hit.triangleIndex = -1;
+		hit.barycentrics = { 0.0f, 0.0f };
+		hit.distance = ray.maxDistance;
+		sceneBVH.intersect(origin, direction, ray.minDistance, tMax, cullBackFaces, [&](uint32_t instanceIndex, uint32_t triangleIndex, float t, float u, float v) {
+			hit.instance = (RT64_INSTANCE *)(sceneBVHInstances[instanceIndex]);
+			hit.triangleIndex = (int)(triangleIndex);
+			hit.barycentrics = { u, v };
+			hit.distance = t;
+			tMax = t;
+			return anyHit;
+		});
+	};
+
+	const size_t taskCount = (rayCount + RaysPerTask - 1) / RaysPerTask;
+	device->getWorkerPool()->run(taskCount, [&](size_t taskIndex) {
+		const int rayStart = (int)(taskIndex) * RaysPerTask;
+		const int rayEnd = std::min(rayStart + RaysPerTask, rayCount);
+		for (int i = rayStart; i < rayEnd; i++) {
+			traceRay(rays[i], hits[i]);
+		}
+	});
+}
+
 const std::vector<RT64::Instance *> &RT64::Scene::getInstances() const {
 	return instances;
 }
@@ -150,6 +322,14 @@ DLLEXPORT void RT64_SetSceneLights(RT64_SCENE *scenePtr, RT64_LIGHT *lightArray,
 	scene->setLights(lightArray, lightCount);
 }
 
+DLLEXPORT void RT64_TraceRays(RT64_SCENE *scenePtr, RT64_RAY *rayArray, int rayCount, RT64_HIT *hitArray) {
+	assert(scenePtr != nullptr);
+	assert((rayArray != nullptr) || (rayCount == 0));
+	assert((hitArray != nullptr) || (rayCount == 0));
+	RT64::Scene *scene = (RT64::Scene *)(scenePtr);
+	scene->traceRays(rayArray, rayCount, hitArray);
+}
+
 DLLEXPORT void RT64_DestroyScene(RT64_SCENE *scenePtr) {
 	delete (RT64::Scene *)(scenePtr);
 }
@@ -5,6 +5,8 @@
 #pragma once
 
 #include "rt64_common.h"
+#include "rt64_frame_scheduler.h"
+#include "rt64_scene_bvh.h"
 
 namespace RT64 {
 	class Device;
@@ -16,10 +18,24 @@ namespace RT64 {
 	private:
 		Device *device;
 		std::vector<Instance *> instances;
+		std::vector<Instance *> dirtyInstances;
+		bool instancesDirty;
 		std::vector<View *> views;
-		AllocatedResource lightsBuffer;
+		AllocatedResource lightsBuffers[FrameScheduler::FramesInFlight];
+		uint64_t lightsBufferVersions[FrameScheduler::FramesInFlight];
 		size_t lightsBufferSize;
+		uint64_t lightsVersion;
 		int lightsCount;
+		std::vector<RT64_LIGHT> lights;
+		bool lightsDirty;
+		SceneBVH sceneBVH;
+		std::vector<Instance *> sceneBVHInstances;
+		bool sceneBVHRebuild;
+		bool sceneBVHRefit;
+
+		void updateLightsBuffer();
+		void trackSceneBVHChanges();
+		void updateSceneBVH();
 	public:
 		Scene(Device *device);
 		virtual ~Scene();
@@ -28,9 +44,21 @@ namespace RT64 {
 		void resize();
 		void setLights(RT64_LIGHT *lightArray, int lightCount);
 		int getLightsCount() const;
+		const std::vector<RT64_LIGHT> &getLights() const;
+
+		// Traces the rays on the CPU against the raytraced instances. The BVH of the instances is kept between calls and
+		// is only built again when instances are added, removed or change their mesh. Other changes only refit it.
+		void traceRays(const RT64_RAY *rays, int rayCount, RT64_HIT *hits);
+
+		// Buffer of the current frame slot.
 		ID3D12Resource *getLightsBuffer() const;
+		bool areLightsDirty() const;
 		void addInstance(Instance *instance);
 		void removeInstance(Instance *instance);
+		void markInstanceDirty(Instance *instance);
+		void markInstancesDirty();
+		bool areInstancesDirty() const;
+		const std::vector<Instance *> &getDirtyInstances() const;
 		void addView(View *view);
 		void removeView(View *view);
 		const std::vector<View *> &getViews() const;
@@ -0,0 +1,68 @@
+//
+// RT64
+//
+
+#ifndef RT64_MINIMAL
+
+#include "rt64_scene_bvh.h"
+
+// Private
+
+RT64::SceneBVH::SceneBVH() { }
+
+RT64::SceneBVH::~SceneBVH() { }
+
+void RT64::SceneBVH::clear() {
+	instances.clear();
+	instanceBounds.clear();
+	instanceBVH.clear();
+}
+
+void RT64::SceneBVH::setInstance(size_t index, Mesh *mesh, const XMMATRIX &transform, bool cullDisable) {
+	assert(mesh != nullptr);
+
+	XMVECTOR det;
+	Instance &instance = instances[index];
+	instance.mesh = mesh;
+	instance.bvh = &mesh->getBVH();
+	instance.worldToObject = XMMatrixInverse(&det, transform);
+	instance.cullDisable = cullDisable;
+
+	// Transform the corners of the mesh's bounds to get the bounds of the instance in world space.
+	const RT64_VECTOR3 boundsMin = mesh->getBoundsMin();
+	const RT64_VECTOR3 boundsMax = mesh->getBoundsMax();
+	BVH::Bounds &bounds = instanceBounds[index];
+	bounds.reset();
+	for (int c = 0; c < 8; c++) {
+		XMVECTOR corner = XMVectorSet((c & 1) ? boundsMax.x : boundsMin.x, (c & 2) ? boundsMax.y : boundsMin.y, (c & 4) ? boundsMax.z : boundsMin.z, 1.0f);
+		corner = XMVector4Transform(corner, transform);
+		const float worldCorner[3] = { XMVectorGetX(corner), XMVectorGetY(corner), XMVectorGetZ(corner) };
+		bounds.extend(worldCorner);
+	}
+}
+
+void RT64::SceneBVH::addInstance(Mesh *mesh, const XMMATRIX &transform, bool cullDisable) {
+	instances.emplace_back();
+	instanceBounds.emplace_back();
+	setInstance(instances.size() - 1, mesh, transform, cullDisable);
+}
+
+void RT64::SceneBVH::updateInstance(size_t index, Mesh *mesh, const XMMATRIX &transform, bool cullDisable) {
+	assert(index < instances.size());
+	setInstance(index, mesh, transform, cullDisable);
+}
+
+void RT64::SceneBVH::build() {
+	// Scenes rarely have enough instances to make a parallel build worth it.
+	instanceBVH.build(instanceBounds, nullptr);
+}
+
+void RT64::SceneBVH::refit() {
+	instanceBVH.refit(instanceBounds, nullptr);
+}
+
+size_t RT64::SceneBVH::getInstanceCount() const {
+	return instances.size();
+}
+
+#endif
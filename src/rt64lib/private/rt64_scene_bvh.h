@@ -0,0 +1,118 @@
+//
+// RT64
+//
+
+#pragma once
+
+#include "rt64_common.h"
+#include "rt64_bvh.h"
+#include "rt64_mesh.h"
+
+namespace RT64 {
+	// Two level BVH over a set of instances and the BVHs of their meshes. Rays are intersected in the object space
+	// of every instance like DXR does, so the distances are the same as RayTCurrent() on the GPU.
+	class SceneBVH {
+	public:
+		struct Instance {
+			const Mesh *mesh;
+			const BVH *bvh;
+			XMMATRIX worldToObject;
+			bool cullDisable;
+		};
+	private:
+		std::vector<Instance> instances;
+		std::vector<BVH::Bounds> instanceBounds;
+		BVH instanceBVH;
+
+		void setInstance(size_t index, Mesh *mesh, const XMMATRIX &transform, bool cullDisable);
+	public:
+		SceneBVH();
+		virtual ~SceneBVH();
+		void clear();
+		void addInstance(Mesh *mesh, const XMMATRIX &transform, bool cullDisable);
+		void build();
+
+		// Changes an instance without changing the order of the others. The BVH of the instances must be refit
+		// before tracing again. It also brings the BVH of the mesh up to date if its vertices changed.
+		void updateInstance(size_t index, Mesh *mesh, const XMMATRIX &transform, bool cullDisable);
+		void refit();
+		size_t getInstanceCount() const;
+
+		// Moller-Trumbore. Clockwise triangles are front facing, so a negative determinant is a back face.
+		static inline bool intersectTriangle(const float origin[3], const float direction[3], const float p0[3], const float p1[3], const float p2[3], bool cullBackFaces, float &t, float &u, float &v) {
+			const float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+			const float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+			const float pvec[3] = { direction[1] * e2[2] - direction[2] * e2[1], direction[2] * e2[0] - direction[0] * e2[2], direction[0] * e2[1] - direction[1] * e2[0] };
+			const float det = e1[0] * pvec[0] + e1[1] * pvec[1] + e1[2] * pvec[2];
+			if ((det == 0.0f) || (cullBackFaces && (det < 0.0f))) {
+				return false;
+			}
+
+			const float invDet = 1.0f / det;
+			const float tvec[3] = { origin[0] - p0[0], origin[1] - p0[1], origin[2] - p0[2] };
+			u = (tvec[0] * pvec[0] + tvec[1] * pvec[1] + tvec[2] * pvec[2]) * invDet;
+			if ((u < 0.0f) || (u > 1.0f)) {
+				return false;
+			}
+
+			const float qvec[3] = { tvec[1] * e1[2] - tvec[2] * e1[1], tvec[2] * e1[0] - tvec[0] * e1[2], tvec[0] * e1[1] - tvec[1] * e1[0] };
+			v = (direction[0] * qvec[0] + direction[1] * qvec[1] + direction[2] * qvec[2]) * invDet;
+			if ((v < 0.0f) || ((u + v) > 1.0f)) {
+				return false;
+			}
+
+			t = (e2[0] * qvec[0] + e2[1] * qvec[1] + e2[2] * qvec[2]) * invDet;
+			return true;
+		}
+
+		// Visits every triangle hit by the ray inside [tMin, tMax] until the callback returns true. The callback
+		// receives the instance index, the triangle index, the distance and the barycentrics of the hit. It can
+		// lower tMax to only look for closer hits from then on.
+		template<typename Callback>
+		void intersect(const float origin[3], const float direction[3], float tMin, float &tMax, bool cullBackFaces, Callback callback) const {
+			const XMVECTOR worldOrigin = XMVectorSet(origin[0], origin[1], origin[2], 1.0f);
+			const XMVECTOR worldDirection = XMVectorSet(direction[0], direction[1], direction[2], 0.0f);
+			bool stop = false;
+			instanceBVH.traverse(origin, direction, tMin, tMax, [&](uint32_t instanceIndex) {
+				const Instance &inst = instances[instanceIndex];
+				const XMVECTOR o = XMVector4Transform(worldOrigin, inst.worldToObject);
+				const XMVECTOR d = XMVector4Transform(worldDirection, inst.worldToObject);
+				const float objectOrigin[3] = { XMVectorGetX(o), XMVectorGetY(o), XMVectorGetZ(o) };
+				const float objectDirection[3] = { XMVectorGetX(d), XMVectorGetY(d), XMVectorGetZ(d) };
+				const uint8_t *vertexData = inst.mesh->getVertexData().data();
+				const unsigned int *indexData = inst.mesh->getIndexData().data();
+				const size_t indexCount = inst.mesh->getIndexData().size();
+				const unsigned int vertexCount = static_cast<unsigned int>(inst.mesh->getVertexCount());
+				const size_t vertexStride = inst.mesh->getVertexStride();
+				const bool cull = cullBackFaces && !inst.cullDisable;
+				inst.bvh->traverse(objectOrigin, objectDirection, tMin, tMax, [&](uint32_t triangleIndex) {
+					// The mesh might've been updated after its BVH was built.
+					const size_t indexOffset = triangleIndex * 3;
+					if ((indexOffset + 2) >= indexCount) {
+						return false;
+					}
+
+					const unsigned int *index3 = &indexData[indexOffset];
+					if ((index3[0] >= vertexCount) || (index3[1] >= vertexCount) || (index3[2] >= vertexCount)) {
+						return false;
+					}
+
+					float p0[3], p1[3], p2[3];
+					memcpy(p0, vertexData + index3[0] * vertexStride, sizeof(p0));
+					memcpy(p1, vertexData + index3[1] * vertexStride, sizeof(p1));
+					memcpy(p2, vertexData + index3[2] * vertexStride, sizeof(p2));
+
+					float t, u, v;
+					if (!intersectTriangle(objectOrigin, objectDirection, p0, p1, p2, cull, t, u, v) || (t < tMin) || (t > tMax)) {
+						return false;
+					}
+
+					stop = callback(instanceIndex, triangleIndex, t, u, v);
+					return stop;
+				});
+
+				return stop;
+			});
+		}
+	};
+};
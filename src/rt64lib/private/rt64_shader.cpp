@@ -7,92 +7,20 @@
 
 #include "rt64_device.h"
 #include "rt64_shader_hlsli.h"
+#include "rt64_texture_atlas.h"
 
 #include "utf8conv/utf8conv.h"
 
 // Private
 
-enum {
-	SHADER_0,
-	SHADER_INPUT_1,
-	SHADER_INPUT_2,
-	SHADER_INPUT_3,
-	SHADER_INPUT_4,
-	SHADER_TEXEL0,
-	SHADER_TEXEL0A,
-	SHADER_TEXEL1
-};
-
-#define SHADER_OPT_ALPHA (1 << 24)
-#define SHADER_OPT_NOISE (1 << 27)
-
-struct ColorCombinerParams {
-	int c[2][4];
-	int inputCount = 0;
-	bool useTextures[2] = { false, false };
-	int do_single[2];
-	int do_multiply[2];
-	int do_mix[2];
-	int color_alpha_same;
-	int opt_alpha;
-	int opt_noise;
-
-	ColorCombinerParams(int shaderId) {
-		for (int i = 0; i < 4; i++) {
-			c[0][i] = (shaderId >> (i * 3)) & 7;
-			c[1][i] = (shaderId >> (12 + i * 3)) & 7;
-		}
-
-		for (int i = 0; i < 2; i++) {
-			for (int j = 0; j < 4; j++) {
-				if (c[i][j] >= SHADER_INPUT_1 && c[i][j] <= SHADER_INPUT_4) {
-					if (c[i][j] > inputCount) {
-						inputCount = c[i][j];
-					}
-				}
-				if (c[i][j] == SHADER_TEXEL0 || c[i][j] == SHADER_TEXEL0A) {
-					useTextures[0] = true;
-				}
-				if (c[i][j] == SHADER_TEXEL1) {
-					useTextures[1] = true;
-				}
-			}
-		}
-
-		do_single[0] = c[0][2] == 0;
-		do_single[1] = c[1][2] == 0;
-		do_multiply[0] = c[0][1] == 0 && c[0][3] == 0;
-		do_multiply[1] = c[1][1] == 0 && c[1][3] == 0;
-		do_mix[0] = c[0][1] == c[0][3];
-		do_mix[1] = c[1][1] == c[1][3];
-
-		color_alpha_same = (shaderId & 0xfff) == ((shaderId >> 12) & 0xfff);
-		opt_alpha = (shaderId & SHADER_OPT_ALPHA) != 0;
-		opt_noise = (shaderId & SHADER_OPT_NOISE) != 0;
-	}
-};
-
-struct VertexLayout {
-	int vertexSize = 0;
-	int positionOffset = 0;
-	int normalOffset = 0;
-	int uvOffset = 0;
-	int inputOffset[4] = { 0,0,0,0 };
-
-	VertexLayout(bool vertexPosition, bool vertexNormal, bool vertexUV, int inputCount, bool useAlpha) {
-		positionOffset = vertexSize; if (vertexPosition) vertexSize += 16;
-		normalOffset = vertexSize; if (vertexNormal) vertexSize += 12;
-		uvOffset = vertexSize; if (vertexUV) vertexSize += 8;
-		for (int i = 0; i < inputCount; i++) {
-			inputOffset[i] = vertexSize;
-			vertexSize += useAlpha ? 16 : 12;
-		}
-	}
-};
-
 RT64::Shader::Shader(Device *device, unsigned int shaderId, Filter filter, AddressingMode hAddr, AddressingMode vAddr, int flags) {
 	assert(device != nullptr);
 	this->device = device;
+	this->shaderId = shaderId;
+	this->filter = filter;
+	this->hAddr = hAddr;
+	this->vAddr = vAddr;
+	this->flags = flags;
 
 	bool normalMapEnabled = flags & RT64_SHADER_NORMAL_MAP_ENABLED;
 	bool specularMapEnabled = flags & RT64_SHADER_SPECULAR_MAP_ENABLED;
@@ -224,7 +152,55 @@ void transformVertexNormal(std::stringstream &ss) {
 }
 
 void incTextures(std::stringstream &ss) {
-	SS("Texture2D<float4> gTextures[512] : register(t7);");
+	SS("Texture2D<float4> gTextures[] : register(t7);");
+}
+
+std::string atlasAddressing(RT64::Shader::AddressingMode addr, const std::string &coord, const std::string &halfTexel) {
+	switch (addr) {
+	case RT64::Shader::AddressingMode::Mirror:
+		return "clamp(1.0f - abs(frac(" + coord + " * 0.5f) * 2.0f - 1.0f), " + halfTexel + ", 1.0f - " + halfTexel + ")";
+	case RT64::Shader::AddressingMode::Clamp:
+		return "clamp(" + coord + ", " + halfTexel + ", 1.0f - " + halfTexel + ")";
+	default:
+	case RT64::Shader::AddressingMode::Wrap:
+		return "frac(" + coord + ")";
+	}
+}
+
+// Textures packed in an atlas can't rely on the addressing mode of the sampler, so it's applied to the coordinates
+// before they're moved into the region of the texture. Textures outside the atlas use a scale of one.
+void incAtlasUV(std::stringstream &ss, RT64::Shader::AddressingMode hAddr, RT64::Shader::AddressingMode vAddr) {
+	SS("static const float AtlasPageSize = " + std::to_string(RT64::TextureAtlas::PageSize) + ".0f;");
+	SS("static const float AtlasMaxLOD = " + std::to_string(RT64::TextureAtlas::MaxLOD) + ".0f;");
+	SS("float2 atlasUV(float2 uv, float4 scaleOffset) {");
+	SS("    if (scaleOffset.x >= 1.0f) {");
+	SS("        return uv;");
+	SS("    }");
+	SS("    float2 halfTexel = 0.5f / (scaleOffset.xy * AtlasPageSize);");
+	SS("    uv.x = " + atlasAddressing(hAddr, "uv.x", "halfTexel.x") + ";");
+	SS("    uv.y = " + atlasAddressing(vAddr, "uv.y", "halfTexel.y") + ";");
+	SS("    return uv * scaleOffset.xy + scaleOffset.zw;");
+	SS("}");
+}
+
+// Ray cone texture LOD from "Improved Shader and Texture Level of Detail Using Ray Cones" (Akenine-Moller et al. 2021).
+// The cone uses the spread angle of the camera rays, so it's only an estimate for the bounces.
+void rayConeLODBias(std::stringstream &ss) {
+	SS("    float3 worldEdge1 = mul(instanceTransforms[instanceId].objectToWorld, float4(pos1 - pos0, 0.0f)).xyz;");
+	SS("    float3 worldEdge2 = mul(instanceTransforms[instanceId].objectToWorld, float4(pos2 - pos0, 0.0f)).xyz;");
+	SS("    float3 worldCross = cross(worldEdge1, worldEdge2);");
+	SS("    float worldArea = max(length(worldCross), 1e-12f);");
+	SS("    float uvArea = max(abs((uv1.x - uv0.x) * (uv2.y - uv0.y) - (uv2.x - uv0.x) * (uv1.y - uv0.y)), 1e-12f);");
+	SS("    float coneWidth = RayTCurrent() * 2.0f / (projection[1][1] * resolution.y);");
+	SS("    float coneCosine = max(abs(dot(WorldRayDirection(), worldCross / worldArea)), 1e-3f);");
+	SS("    float texLODBias = 0.5f * log2(uvArea / worldArea) + log2(coneWidth / coneCosine);");
+}
+
+void textureLOD(std::stringstream &ss, const std::string &name, const std::string &indent, const std::string &extraBias) {
+	SS(indent + "uint " + name + "Width, " + name + "Height;");
+	SS(indent + "gTextures[NonUniformResourceIndex(" + name + "TexIndex)].GetDimensions(" + name + "Width, " + name + "Height);");
+	SS(indent + "float " + name + "LOD = texLODBias + 0.5f * log2(float(" + name + "Width * " + name + "Height) * " + name + "ScaleOffset.x * " + name + "ScaleOffset.y)" + extraBias + ";");
+	SS(indent + "if (" + name + "ScaleOffset.x < 1.0f) { " + name + "LOD = min(" + name + "LOD, AtlasMaxLOD); }");
 }
 
 std::string colorInput(int item, bool with_alpha, bool inputs_have_alpha, bool hint_single_element) {
@@ -347,6 +323,7 @@ void RT64::Shader::generateRasterGroup(unsigned int shaderId, Filter filter, Add
 	if (cc.useTextures[0]) {
 		SS("SamplerState gTextureSampler : register(s" + std::to_string(samplerRegisterIndex) + ");");
 		incTextures(ss);
+		incAtlasUV(ss, hAddr, vAddr);
 	}
 
 	// Vertex shader.
@@ -360,8 +337,10 @@ void RT64::Shader::generateRasterGroup(unsigned int shaderId, Filter filter, Add
 		const std::string floatNumber = cc.opt_alpha ? "4" : "3";
 		SS("    in float" + floatNumber + " iInput" + std::to_string(i + 1) + " : COLOR" + std::to_string(i) + ",");
 	}
+	SS("    in uint iInstanceId : SV_InstanceID,");
 	SS("    out float4 oPosition : SV_POSITION,");
 	SS("    out float3 oNormal : NORMAL,");
+	SS("    out nointerpolation uint oInstanceId : INSTANCE,");
 	if (vertexUV) {
 		SS("    out float2 oUV : TEXCOORD" + std::string((cc.inputCount > 0) ? "," : ""));
 	}
@@ -371,6 +350,7 @@ void RT64::Shader::generateRasterGroup(unsigned int shaderId, Filter filter, Add
 	SS(") {");
 	SS("    oPosition = iPosition;");
 	SS("    oNormal = iNormal;");
+	SS("    oInstanceId = iInstanceId;");
 	if (vertexUV) {
 		SS("    oUV = iUV;");
 	}
@@ -383,6 +363,7 @@ void RT64::Shader::generateRasterGroup(unsigned int shaderId, Filter filter, Add
 	SS("void " + pixelShaderName + "(");
 	SS("    in float4 vertexPosition : SV_POSITION,");
 	SS("    in float3 vertexNormal : NORMAL,");
+	SS("    in nointerpolation uint vertexInstanceId : INSTANCE,");
 	if (vertexUV) {
 		SS("    in float2 vertexUV : TEXCOORD,");
 	}
@@ -391,11 +372,24 @@ void RT64::Shader::generateRasterGroup(unsigned int shaderId, Filter filter, Add
 	}
 	SS("    out float4 resultColor : SV_TARGET");
 	SS(") {");
-	SS("    int instanceId = NonUniformResourceIndex(instanceIndex);");
+	// Runs of instances drawn together only set the index of the first one, the rest are offset from it.
+	SS("    int instanceId = NonUniformResourceIndex(instanceIndex + (int)(vertexInstanceId));");
 
 	if (cc.useTextures[0]) {
+		// The gradients come from the coordinates before the addressing, so the wrapped edges of atlased textures
+		// don't pick the smallest level. Atlased textures can't go past the levels that don't mix their neighbors.
 		SS("    int diffuseTexIndex = instanceMaterials[instanceId].diffuseTexIndex;");
-		SS("    float4 texVal0 = gTextures[diffuseTexIndex].SampleLevel(gTextureSampler, vertexUV, 0);");
+		SS("    float4 diffuseScaleOffset = instanceMaterials[instanceId].diffuseTexScaleOffset;");
+		SS("    float2 diffuseDX = ddx(vertexUV) * diffuseScaleOffset.xy;");
+		SS("    float2 diffuseDY = ddy(vertexUV) * diffuseScaleOffset.xy;");
+		SS("    if (diffuseScaleOffset.x < 1.0f) {");
+		SS("        float maxGradient = exp2(AtlasMaxLOD) / AtlasPageSize;");
+		SS("        float gradient = max(max(length(diffuseDX), length(diffuseDY)), 1e-12f);");
+		SS("        float gradientScale = min(maxGradient / gradient, 1.0f);");
+		SS("        diffuseDX *= gradientScale;");
+		SS("        diffuseDY *= gradientScale;");
+		SS("    }");
+		SS("    float4 texVal0 = gTextures[diffuseTexIndex].SampleGrad(gTextureSampler, atlasUV(vertexUV, diffuseScaleOffset), diffuseDX, diffuseDY);");
 	}
 
 	if (cc.useTextures[1]) {
@@ -483,6 +477,7 @@ void RT64::Shader::generateSurfaceHitGroup(unsigned int shaderId, Filter filter,
 	if (cc.useTextures[0]) {
 		SS("SamplerState gTextureSampler : register(s" + std::to_string(samplerRegisterIndex) + ");");
 		incTextures(ss);
+		incAtlasUV(ss, hAddr, vAddr);
 	}
 
 	SS("[shader(\"anyhit\")]");
@@ -495,9 +490,15 @@ void RT64::Shader::generateSurfaceHitGroup(unsigned int shaderId, Filter filter,
 	bool vertexUV = cc.useTextures[0] || cc.useTextures[1];
 	getVertexData(ss, true, true, vertexUV, cc.inputCount, cc.opt_alpha, vertexUV && normalMapEnabled);
 
+	if (vertexUV) {
+		rayConeLODBias(ss);
+	}
+
 	if (cc.useTextures[0]) {
 		SS("    int diffuseTexIndex = instanceMaterials[instanceId].diffuseTexIndex;");
-		SS("    float4 texVal0 = gTextures[diffuseTexIndex].SampleLevel(gTextureSampler, vertexUV, 0);");
+		SS("    float4 diffuseScaleOffset = instanceMaterials[instanceId].diffuseTexScaleOffset;");
+		textureLOD(ss, "diffuse", "    ", "");
+		SS("    float4 texVal0 = gTextures[NonUniformResourceIndex(diffuseTexIndex)].SampleLevel(gTextureSampler, atlasUV(vertexUV, diffuseScaleOffset), diffuseLOD);");
 		SS("    texVal0.rgb = lerp(texVal0.rgb, diffuseColorMix.rgb, max(-diffuseColorMix.a, 0.0f));");
 	}
 
@@ -528,7 +529,9 @@ void RT64::Shader::generateSurfaceHitGroup(unsigned int shaderId, Filter filter,
 		SS("    int normalTexIndex = instanceMaterials[instanceId].normalTexIndex;");
 		SS("    if (normalTexIndex >= 0) {");
 		SS("        float uvDetailScale = instanceMaterials[instanceId].uvDetailScale;");
-		SS("        float3 normalColor = gTextures[normalTexIndex].SampleLevel(gTextureSampler, vertexUV * uvDetailScale, 0).xyz;");
+		SS("        float4 normalScaleOffset = instanceMaterials[instanceId].normalTexScaleOffset;");
+		textureLOD(ss, "normal", "        ", " + log2(uvDetailScale)");
+		SS("        float3 normalColor = gTextures[NonUniformResourceIndex(normalTexIndex)].SampleLevel(gTextureSampler, atlasUV(vertexUV * uvDetailScale, normalScaleOffset), normalLOD).xyz;");
 		SS("        normalColor = (normalColor * 2.0f) - 1.0f;");
 		SS("        float3 newNormal = normalize(vertexNormal * normalColor.z + vertexTangent * normalColor.x + vertexBinormal * normalColor.y);");
 		SS("        vertexNormal = newNormal;");
@@ -542,7 +545,9 @@ void RT64::Shader::generateSurfaceHitGroup(unsigned int shaderId, Filter filter,
 		SS("    int specularTexIndex = instanceMaterials[instanceId].specularTexIndex;");
 		SS("    if (specularTexIndex >= 0) {");
 		SS("        float uvDetailScale = instanceMaterials[instanceId].uvDetailScale;");
-		SS("        vertexSpecular = gTextures[specularTexIndex].SampleLevel(gTextureSampler, vertexUV * uvDetailScale, 0).rgb;");
+		SS("        float4 specularScaleOffset = instanceMaterials[instanceId].specularTexScaleOffset;");
+		textureLOD(ss, "specular", "        ", " + log2(uvDetailScale)");
+		SS("        vertexSpecular = gTextures[NonUniformResourceIndex(specularTexIndex)].SampleLevel(gTextureSampler, atlasUV(vertexUV * uvDetailScale, specularScaleOffset), specularLOD).rgb;");
 		SS("    }");
 	}
 
@@ -608,6 +613,7 @@ void RT64::Shader::generateShadowHitGroup(unsigned int shaderId, Filter filter,
 	if (cc.useTextures[0]) {
 		SS("SamplerState gTextureSampler : register(s" + std::to_string(samplerRegisterIndex) + ");");
 		incTextures(ss);
+		incAtlasUV(ss, hAddr, vAddr);
 	}
 	
 	SS("[shader(\"anyhit\")]");
@@ -621,7 +627,8 @@ void RT64::Shader::generateShadowHitGroup(unsigned int shaderId, Filter filter,
 
 		if (cc.useTextures[0]) {
 			SS("    int diffuseTexIndex = instanceMaterials[instanceId].diffuseTexIndex;");
-			SS("    float4 texVal0 = gTextures[diffuseTexIndex].SampleLevel(gTextureSampler, vertexUV, 0);");
+			SS("    float4 diffuseScaleOffset = instanceMaterials[instanceId].diffuseTexScaleOffset;");
+			SS("    float4 texVal0 = gTextures[NonUniformResourceIndex(diffuseTexIndex)].SampleLevel(gTextureSampler, atlasUV(vertexUV, diffuseScaleOffset), 0);");
 		}
 
 		if (cc.useTextures[1]) {
@@ -686,7 +693,7 @@ ID3D12RootSignature *RT64::Shader::generateRasterRootSignature(Filter filter, Ad
 	rsc.AddRootParameter(D3D12_ROOT_PARAMETER_TYPE_32BIT_CONSTANTS, 0);
 	heapRanges.push_back({ SRV_INDEX(instanceTransforms), 1, 0, D3D12_DESCRIPTOR_RANGE_TYPE_SRV, HEAP_INDEX(instanceTransforms) });
 	heapRanges.push_back({ SRV_INDEX(instanceMaterials), 1, 0, D3D12_DESCRIPTOR_RANGE_TYPE_SRV, HEAP_INDEX(instanceMaterials) });
-	heapRanges.push_back({ SRV_INDEX(gTextures), 512, 0, D3D12_DESCRIPTOR_RANGE_TYPE_SRV, HEAP_INDEX(gTextures) });
+	heapRanges.push_back({ SRV_INDEX(gTextures), UINT_MAX, 0, D3D12_DESCRIPTOR_RANGE_TYPE_SRV, HEAP_INDEX(gTextures) });
 	rsc.AddHeapRangesParameter(heapRanges);
 
 	D3D12_STATIC_SAMPLER_DESC samplerDesc;
@@ -710,8 +717,10 @@ ID3D12RootSignature *RT64::Shader::generateHitRootSignature(Filter filter, Addre
 
 	heapRanges.push_back({ SRV_INDEX(instanceTransforms), 1, 0, D3D12_DESCRIPTOR_RANGE_TYPE_SRV, HEAP_INDEX(instanceTransforms) });
 	heapRanges.push_back({ SRV_INDEX(instanceMaterials), 1, 0, D3D12_DESCRIPTOR_RANGE_TYPE_SRV, HEAP_INDEX(instanceMaterials) });
-	heapRanges.push_back({ SRV_INDEX(gTextures), 512, 0, D3D12_DESCRIPTOR_RANGE_TYPE_SRV, HEAP_INDEX(gTextures) });
 	heapRanges.push_back({ CBV_INDEX(ViewParams), 1, 0, D3D12_DESCRIPTOR_RANGE_TYPE_CBV, HEAP_INDEX(ViewParams) });
+
+	// The texture table is unbounded, so it must be the last range.
+	heapRanges.push_back({ SRV_INDEX(gTextures), UINT_MAX, 0, D3D12_DESCRIPTOR_RANGE_TYPE_SRV, HEAP_INDEX(gTextures) });
 	rsc.AddHeapRangesParameter(heapRanges);
 
 	D3D12_STATIC_SAMPLER_DESC samplerDesc;
@@ -774,6 +783,26 @@ bool RT64::Shader::hasHitGroups() const {
 	return (surfaceHitGroup.blob != nullptr) || (shadowHitGroup.blob != nullptr);
 }
 
+unsigned int RT64::Shader::getShaderId() const {
+	return shaderId;
+}
+
+RT64::Shader::Filter RT64::Shader::getFilter() const {
+	return filter;
+}
+
+RT64::Shader::AddressingMode RT64::Shader::getHAddr() const {
+	return hAddr;
+}
+
+RT64::Shader::AddressingMode RT64::Shader::getVAddr() const {
+	return vAddr;
+}
+
+int RT64::Shader::getFlags() const {
+	return flags;
+}
+
 // Public
 
 RT64::Shader::Filter convertFilter(unsigned int filter) {
@@ -6,6 +6,85 @@
 
 #include "rt64_common.h"
 
+// Color combiner decoding and vertex layout shared by the shader generator and the CPU tracer.
+enum {
+	SHADER_0,
+	SHADER_INPUT_1,
+	SHADER_INPUT_2,
+	SHADER_INPUT_3,
+	SHADER_INPUT_4,
+	SHADER_TEXEL0,
+	SHADER_TEXEL0A,
+	SHADER_TEXEL1
+};
+
+#define SHADER_OPT_ALPHA (1 << 24)
+#define SHADER_OPT_NOISE (1 << 27)
+
+struct ColorCombinerParams {
+	int c[2][4];
+	int inputCount = 0;
+	bool useTextures[2] = { false, false };
+	int do_single[2];
+	int do_multiply[2];
+	int do_mix[2];
+	int color_alpha_same;
+	int opt_alpha;
+	int opt_noise;
+
+	ColorCombinerParams(int shaderId) {
+		for (int i = 0; i < 4; i++) {
+			c[0][i] = (shaderId >> (i * 3)) & 7;
+			c[1][i] = (shaderId >> (12 + i * 3)) & 7;
+		}
+
+		for (int i = 0; i < 2; i++) {
+			for (int j = 0; j < 4; j++) {
+				if (c[i][j] >= SHADER_INPUT_1 && c[i][j] <= SHADER_INPUT_4) {
+					if (c[i][j] > inputCount) {
+						inputCount = c[i][j];
+					}
+				}
+				if (c[i][j] == SHADER_TEXEL0 || c[i][j] == SHADER_TEXEL0A) {
+					useTextures[0] = true;
+				}
+				if (c[i][j] == SHADER_TEXEL1) {
+					useTextures[1] = true;
+				}
+			}
+		}
+
+		do_single[0] = c[0][2] == 0;
+		do_single[1] = c[1][2] == 0;
+		do_multiply[0] = c[0][1] == 0 && c[0][3] == 0;
+		do_multiply[1] = c[1][1] == 0 && c[1][3] == 0;
+		do_mix[0] = c[0][1] == c[0][3];
+		do_mix[1] = c[1][1] == c[1][3];
+
+		color_alpha_same = (shaderId & 0xfff) == ((shaderId >> 12) & 0xfff);
+		opt_alpha = (shaderId & SHADER_OPT_ALPHA) != 0;
+		opt_noise = (shaderId & SHADER_OPT_NOISE) != 0;
+	}
+};
+
+struct VertexLayout {
+	int vertexSize = 0;
+	int positionOffset = 0;
+	int normalOffset = 0;
+	int uvOffset = 0;
+	int inputOffset[4] = { 0,0,0,0 };
+
+	VertexLayout(bool vertexPosition, bool vertexNormal, bool vertexUV, int inputCount, bool useAlpha) {
+		positionOffset = vertexSize; if (vertexPosition) vertexSize += 16;
+		normalOffset = vertexSize; if (vertexNormal) vertexSize += 12;
+		uvOffset = vertexSize; if (vertexUV) vertexSize += 8;
+		for (int i = 0; i < inputCount; i++) {
+			inputOffset[i] = vertexSize;
+			vertexSize += useAlpha ? 16 : 12;
+		}
+	}
+};
+
 namespace RT64 {
 	class Device;
 
@@ -41,6 +120,11 @@ namespace RT64 {
 		};
 	private:
 		Device *device;
+		unsigned int shaderId;
+		Filter filter;
+		AddressingMode hAddr;
+		AddressingMode vAddr;
+		int flags;
 		RasterGroup rasterGroup;
 		HitGroup surfaceHitGroup;
 		HitGroup shadowHitGroup;
@@ -61,5 +145,10 @@ namespace RT64 {
 		HitGroup &getShadowHitGroup();
 		bool hasRasterGroup() const;
 		bool hasHitGroups() const;
+		unsigned int getShaderId() const;
+		Filter getFilter() const;
+		AddressingMode getHAddr() const;
+		AddressingMode getVAddr() const;
+		int getFlags() const;
 	};
 };
\ No newline at end of file
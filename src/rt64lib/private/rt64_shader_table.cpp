@@ -0,0 +1,130 @@
+//
+// RT64
+//
+
+#ifndef RT64_MINIMAL
+
+#include "rt64_shader_table.h"
+
+#include <algorithm>
+
+#include "rt64_device.h"
+
+namespace {
+	const uint32_t MinRecordCapacity = 64;
+};
+
+// Private
+
+RT64::ShaderTable::ShaderTable(Device *device) {
+	assert(device != nullptr);
+	this->device = device;
+	bufferData = nullptr;
+	recordCapacity = 0;
+	rayGenCount = 0;
+	missCount = 0;
+	hitGroupCount = 0;
+	writeCount = 0;
+}
+
+RT64::ShaderTable::~ShaderTable() {
+	if (bufferData != nullptr) {
+		buffer.Get()->Unmap(0, nullptr);
+	}
+
+	buffer.Release();
+}
+
+void RT64::ShaderTable::setRecord(uint32_t recordIndex, const void *programId, const uint64_t *arguments, uint32_t argumentCount) {
+	assert(recordIndex < (rayGenCount + missCount + hitGroupCount));
+	assert(programId != nullptr);
+	assert(argumentCount <= MaxArguments);
+
+	uint8_t record[RecordSize] = {};
+	memcpy(record, programId, D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES);
+	memcpy(record + D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES, arguments, argumentCount * sizeof(uint64_t));
+
+	// Only write to the buffer if the record is different from what's already there.
+	uint8_t *storedRecord = &records[recordIndex * RecordSize];
+	if (memcmp(storedRecord, record, RecordSize) != 0) {
+		memcpy(storedRecord, record, RecordSize);
+		memcpy(bufferData + recordIndex * RecordSize, record, RecordSize);
+		writeCount++;
+	}
+}
+
+void RT64::ShaderTable::resize(uint32_t rayGenCount, uint32_t missCount, uint32_t hitGroupCount) {
+	const uint32_t recordCount = rayGenCount + missCount + hitGroupCount;
+
+	// The hit groups move to a different offset if the other sections change size, so none of the records can be kept.
+	if ((this->rayGenCount != rayGenCount) || (this->missCount != missCount)) {
+		std::fill(records.begin(), records.end(), 0);
+	}
+
+	if (recordCount > recordCapacity) {
+		uint32_t newCapacity = std::max(recordCapacity, MinRecordCapacity);
+		while (newCapacity < recordCount) {
+			newCapacity *= 2;
+		}
+
+		if (bufferData != nullptr) {
+			buffer.Get()->Unmap(0, nullptr);
+			bufferData = nullptr;
+		}
+
+		buffer.Release();
+		buffer = device->allocateBuffer(D3D12_HEAP_TYPE_UPLOAD, newCapacity * RecordSize, D3D12_RESOURCE_FLAG_NONE, D3D12_RESOURCE_STATE_GENERIC_READ);
+
+		// Upload heaps can stay mapped for as long as the buffer is alive.
+		CD3DX12_RANGE readRange(0, 0);
+		D3D12_CHECK(buffer.Get()->Map(0, &readRange, reinterpret_cast<void **>(&bufferData)));
+		records.resize(newCapacity * RecordSize, 0);
+
+		// The new buffer starts with the same records the previous one had.
+		memcpy(bufferData, records.data(), records.size());
+		recordCapacity = newCapacity;
+	}
+
+	this->rayGenCount = rayGenCount;
+	this->missCount = missCount;
+	this->hitGroupCount = hitGroupCount;
+}
+
+void RT64::ShaderTable::setRayGenRecord(uint32_t index, const void *programId, const uint64_t *arguments, uint32_t argumentCount) {
+	assert(index < rayGenCount);
+	setRecord(index, programId, arguments, argumentCount);
+}
+
+void RT64::ShaderTable::setMissRecord(uint32_t index, const void *programId, const uint64_t *arguments, uint32_t argumentCount) {
+	assert(index < missCount);
+	setRecord(rayGenCount + index, programId, arguments, argumentCount);
+}
+
+void RT64::ShaderTable::setHitGroupRecord(uint32_t index, const void *programId, const uint64_t *arguments, uint32_t argumentCount) {
+	assert(index < hitGroupCount);
+	setRecord(rayGenCount + missCount + index, programId, arguments, argumentCount);
+}
+
+void RT64::ShaderTable::fillDispatchRaysDesc(D3D12_DISPATCH_RAYS_DESC &desc) const {
+	assert(!buffer.IsNull());
+
+	const D3D12_GPU_VIRTUAL_ADDRESS bufferAddress = buffer.Get()->GetGPUVirtualAddress();
+	desc.RayGenerationShaderRecord.StartAddress = bufferAddress;
+	desc.RayGenerationShaderRecord.SizeInBytes = RecordSize * rayGenCount;
+	desc.MissShaderTable.StartAddress = bufferAddress + RecordSize * rayGenCount;
+	desc.MissShaderTable.SizeInBytes = RecordSize * missCount;
+	desc.MissShaderTable.StrideInBytes = RecordSize;
+	desc.HitGroupTable.StartAddress = bufferAddress + RecordSize * (rayGenCount + missCount);
+	desc.HitGroupTable.SizeInBytes = RecordSize * hitGroupCount;
+	desc.HitGroupTable.StrideInBytes = RecordSize;
+}
+
+ID3D12Resource *RT64::ShaderTable::getBuffer() const {
+	return buffer.Get();
+}
+
+uint32_t RT64::ShaderTable::getWriteCount() const {
+	return writeCount;
+}
+
+#endif
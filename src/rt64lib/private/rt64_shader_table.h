@@ -0,0 +1,44 @@
+//
+// RT64
+//
+
+#pragma once
+
+#include "rt64_common.h"
+
+namespace RT64 {
+	class Device;
+
+	// Shader binding table that stays in the same upload buffer between frames. Records are only written to the
+	// buffer when their contents change, and the buffer grows geometrically when more hit groups are needed.
+	// Every record has the same size, so the ray generation, miss and hit group sections are laid out back to back.
+	class ShaderTable {
+	public:
+		static const uint32_t MaxArguments = 3;
+		static const uint32_t RecordSize = ROUND_UP(D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES + MaxArguments * sizeof(uint64_t), D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT);
+	private:
+		Device *device;
+		AllocatedResource buffer;
+		uint8_t *bufferData;
+		uint32_t recordCapacity;
+		std::vector<uint8_t> records;
+		uint32_t rayGenCount;
+		uint32_t missCount;
+		uint32_t hitGroupCount;
+		uint32_t writeCount;
+
+		void setRecord(uint32_t recordIndex, const void *programId, const uint64_t *arguments, uint32_t argumentCount);
+	public:
+		ShaderTable(Device *device);
+		virtual ~ShaderTable();
+		void resize(uint32_t rayGenCount, uint32_t missCount, uint32_t hitGroupCount);
+		void setRayGenRecord(uint32_t index, const void *programId, const uint64_t *arguments, uint32_t argumentCount);
+		void setMissRecord(uint32_t index, const void *programId, const uint64_t *arguments, uint32_t argumentCount);
+		void setHitGroupRecord(uint32_t index, const void *programId, const uint64_t *arguments, uint32_t argumentCount);
+		void fillDispatchRaysDesc(D3D12_DISPATCH_RAYS_DESC &desc) const;
+		ID3D12Resource *getBuffer() const;
+
+		// Amount of records that were written to the buffer since the table was created.
+		uint32_t getWriteCount() const;
+	};
+};
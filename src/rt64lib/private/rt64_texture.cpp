@@ -8,133 +8,730 @@
 
 #include "rt64_texture.h"
 
+#include <algorithm>
+
+#include "rt64_block_compression.h"
+#include "rt64_copy_queue.h"
 #include "rt64_device.h"
+#include "rt64_instance.h"
+#include "rt64_texture_atlas.h"
+#include "rt64_texture_cache.h"
+#include "rt64_texture_decoder.h"
+#include "rt64_texture_pack.h"
+#include "rt64_texture_residency.h"
+#include "rt64_texture_table.h"
+#include "rt64_upload_ring.h"
+
+namespace {
+	const int BlockDimension = 4;
+
+	// Largest level kept on the GPU while a texture is evicted.
+	const int StandbySize = 32;
+
+	bool isRectOpaque(const uint8_t *pixels, int width, int height, int rowPitch) {
+		for (int y = 0; y < height; y++) {
+			const uint8_t *row = pixels + (size_t)(y) * rowPitch;
+			for (int x = 0; x < width; x++) {
+				if (row[x * 4 + 3] != 255) {
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+};
 
 // Private
 
-RT64::Texture::Texture(Device *device, const void *bytes, int width, int height, int stride) {
-	assert(bytes != nullptr);
+RT64::Texture::Texture(Device *device, const void *bytes, int width, int height, int stride, MipChain::Filter mipFilter, bool evictable, bool rectUpdates) {
+	assert(device != nullptr);
 
 	this->device = device;
-	currentIndex = -1;
-
-	UINT rowWidth, rowPadding;
-	CalculateTextureRowWidthPadding(width, stride, rowWidth, rowPadding);
-
-	{
-		// Describe the texture
-		D3D12_RESOURCE_DESC textureDesc = {};
-		textureDesc.Width = width;
-		textureDesc.Height = height;
-		textureDesc.MipLevels = 1;
-		textureDesc.DepthOrArraySize = 1;
-		textureDesc.SampleDesc.Count = 1;
-		textureDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
-		textureDesc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
-
-		// Create the texture resource
-		texture = device->allocateResource(D3D12_HEAP_TYPE_DEFAULT, &textureDesc, D3D12_RESOURCE_STATE_COPY_DEST, nullptr);
-
-		// Describe the resource
-		D3D12_RESOURCE_DESC resourceDesc = {};
-		resourceDesc.Width = (rowWidth * height);
-		resourceDesc.Height = 1;
-		resourceDesc.DepthOrArraySize = 1;
-		resourceDesc.MipLevels = 1;
-		resourceDesc.SampleDesc.Count = 1;
-		resourceDesc.Format = DXGI_FORMAT_UNKNOWN;
-		resourceDesc.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
-		resourceDesc.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
-
-		// Create the upload heap
-		textureUpload = device->allocateResource(D3D12_HEAP_TYPE_UPLOAD, &resourceDesc, D3D12_RESOURCE_STATE_GENERIC_READ, nullptr);
-	}
-
-	// Upload texture.
-	{
-		// Copy the pixel data to the upload heap resource
-		UINT8* pData;
-		textureUpload.Get()->Map(0, nullptr, reinterpret_cast<void**>(&pData));
-
-		if (rowPadding == 0) {
-			memcpy(pData, bytes, width * height * stride);
+	this->width = 0;
+	this->height = 0;
+	this->stride = 0;
+	this->mipFilter = mipFilter;
+	this->evictable = evictable;
+	this->rectUpdates = rectUpdates;
+	format = DXGI_FORMAT_UNKNOWN;
+	mipLevels = 0;
+	uploadSize = 0;
+	uploadFenceValue = 0;
+	encodedFormat = BlockCompressor::Format::BC7;
+	lastUsedFrame = 0;
+	evicted = false;
+	opaque = true;
+	atlased = false;
+	atlasRegion = {};
+
+	loadData(bytes, width, height, stride);
+	slot = atlased ? device->getTextureAtlas()->getSlot(atlasRegion) : device->getTextureTable()->addTexture(this);
+
+	if (evictable) {
+		device->getTextureResidency()->addTexture(this);
+	}
+}
+
+RT64::Texture::~Texture() {
+	// Detaching doesn't go through removeInstance, so the list stays valid while it's iterated.
+	for (Instance *instance : instances) {
+		instance->detachTexture(this);
+	}
+
+	device->getTexturePack()->cancel(this);
+
+	if (evictable) {
+		device->getTextureResidency()->removeTexture(this);
+	}
+
+	if (atlased) {
+		device->getTextureAtlas()->release(atlasRegion);
+	}
+	else {
+		device->getTextureTable()->removeTexture(slot);
+	}
+
+	device->retireResource(texture, uploadFenceValue);
+	device->retireResource(standbyTexture, uploadFenceValue);
+}
+
+bool RT64::Texture::loadData(const void *bytes, int width, int height, int stride, MipChain *generatedChain) {
+	assert(bytes != nullptr);
+	assert((width > 0) && (height > 0));
+
+	const bool layoutChanged = (width != this->width) || (height != this->height) || (stride != this->stride);
+	this->width = width;
+	this->height = height;
+	this->stride = stride;
+
+	// Small textures are packed into the atlas instead of getting resources of their own, unless the atlas is full.
+	const uint8_t *pixelBytes = reinterpret_cast<const uint8_t *>(bytes);
+	TextureAtlas *textureAtlas = device->getTextureAtlas();
+	if (TextureAtlas::isTextureSupported(width, height, stride)) {
+		if (atlased && !layoutChanged) {
+			textureAtlas->write(atlasRegion, pixelBytes, width * stride);
+			return false;
+		}
+
+		if (atlased) {
+			textureAtlas->release(atlasRegion);
+			atlased = false;
+		}
+
+		if (textureAtlas->allocate(width, height, atlasRegion)) {
+			releaseResources();
+			releasePixels();
+			atlased = true;
+			textureAtlas->write(atlasRegion, pixelBytes, width * stride);
+			return true;
+		}
+	}
+
+	if (atlased) {
+		textureAtlas->release(atlasRegion);
+		atlased = false;
+	}
+
+	// Generate the full mip chain for RGBA8 textures. Other layouts only get the top level.
+	if (stride == 4) {
+		opaque = isRectOpaque(pixelBytes, width, height, width * stride);
+		if (generatedChain != nullptr) {
+			mipChain = std::move(*generatedChain);
 		}
 		else {
-			for (int row = 0; row < height; row++) {
-				memcpy(pData, (unsigned char *)(bytes) + row * width * stride, width * stride);
-				pData += rowWidth;
+			mipChain.generate(pixelBytes, width, height, mipFilter, device->getWorkerPool());
+		}
+
+		pixels.clear();
+	}
+	else {
+		pixels.assign(pixelBytes, pixelBytes + width * height * stride);
+	}
+
+	const bool recreated = upload(layoutChanged);
+	if (!needsPixels()) {
+		releasePixels();
+	}
+
+	return recreated;
+}
+
+void RT64::Texture::releaseResources() {
+	// The frames in flight might still use the resources, so they're only released once those are done.
+	device->retireResource(texture, uploadFenceValue);
+	device->retireResource(standbyTexture, uploadFenceValue);
+
+	std::vector<uint8_t>().swap(encodedData);
+	std::vector<uint8_t>().swap(evictedPixels);
+	std::vector<MipChain::Level>().swap(standbyLevels);
+	evicted = false;
+	format = DXGI_FORMAT_UNKNOWN;
+	mipLevels = 0;
+}
+
+void RT64::Texture::createResources(DXGI_FORMAT format, UINT mipLevels) {
+	releaseResources();
+
+	this->format = format;
+	this->mipLevels = mipLevels;
+	footprints.resize(mipLevels);
+	rowCounts.resize(mipLevels);
+	rowSizes.resize(mipLevels);
+
+	// Describe the texture
+	D3D12_RESOURCE_DESC textureDesc = {};
+	textureDesc.Width = width;
+	textureDesc.Height = height;
+	textureDesc.MipLevels = mipLevels;
+	textureDesc.DepthOrArraySize = 1;
+	textureDesc.SampleDesc.Count = 1;
+	textureDesc.Format = format;
+	textureDesc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
+
+	// Create the texture resource. It stays in the common state, as it's promoted implicitly by the copy queue and
+	// the frames that read it.
+	texture = device->allocateResource(D3D12_HEAP_TYPE_DEFAULT, &textureDesc, D3D12_RESOURCE_STATE_COMMON, nullptr);
+
+	// The footprints describe the layout of the encoded copy of compressed textures.
+	uploadSize = 0;
+	device->getD3D12Device()->GetCopyableFootprints(&textureDesc, 0, mipLevels, 0, footprints.data(), rowCounts.data(), rowSizes.data(), &uploadSize);
+}
+
+bool RT64::Texture::upload(bool layoutChanged) {
+	const bool hasMipChain = (stride == 4);
+	const UINT requiredMipLevels = hasMipChain ? (UINT)(mipChain.getLevels().size()) : 1;
+
+	// Block compression works on 4x4 blocks, so it's only used when the top level is made of whole blocks. The smaller
+	// levels are padded by the encoder as required by the format.
+	const int compressionMode = device->getTextureCompressionMode();
+	const bool compressTexture = hasMipChain && (compressionMode != RT64_TEXTURE_COMPRESSION_NONE) && ((width % BlockDimension) == 0) && ((height % BlockDimension) == 0);
+	BlockCompressor::Format blockFormat = BlockCompressor::Format::BC7;
+	DXGI_FORMAT requiredFormat = DXGI_FORMAT_R8G8B8A8_UNORM;
+	if (compressTexture) {
+		if (compressionMode == RT64_TEXTURE_COMPRESSION_BC1_BC3) {
+			blockFormat = opaque ? BlockCompressor::Format::BC1 : BlockCompressor::Format::BC3;
+		}
+
+		requiredFormat = BlockCompressor::getDXGIFormat(blockFormat);
+	}
+
+	const bool recreateResources = texture.IsNull() || layoutChanged || (requiredFormat != format) || (requiredMipLevels != mipLevels);
+	if (recreateResources) {
+		createResources(requiredFormat, requiredMipLevels);
+	}
+
+	// Block compressed textures that keep a CPU copy keep their encoded levels too, as encoding them again would be
+	// too slow to restore them after an eviction. The others don't need either once the upload is done.
+	const bool keepEncodedData = compressTexture && needsPixels();
+	if (keepEncodedData && recreateResources) {
+		encodedData.resize(uploadSize);
+		encodedFormat = blockFormat;
+	}
+
+	beginCopies(!recreateResources);
+
+	// Place the changed region of every level in the upload ring and copy it to the texture.
+	UploadRing *uploadRing = device->getUploadRing();
+	const uint32_t blockSize = BlockCompressor::getBlockSize(blockFormat);
+	std::vector<uint8_t> regionPixels;
+	std::vector<uint8_t> compressedBlocks;
+	UINT64 copySize = 0;
+	UINT copyCount = 0;
+	for (UINT i = 0; i < mipLevels; i++) {
+		const uint8_t *levelBytes = pixels.data();
+		int levelWidth = width;
+		int levelHeight = height;
+		int rowBegin = 0;
+		int rowEnd = height;
+		int columnBegin = 0;
+		int columnEnd = width;
+		if (hasMipChain) {
+			const MipChain::Level &level = mipChain.getLevels()[i];
+			levelBytes = level.pixels.data();
+			levelWidth = level.width;
+			levelHeight = level.height;
+			if (!recreateResources) {
+				rowBegin = level.dirtyRowBegin;
+				rowEnd = level.dirtyRowEnd;
+				columnBegin = level.dirtyColumnBegin;
+				columnEnd = level.dirtyColumnEnd;
+			}
+			else {
+				rowEnd = level.height;
+				columnEnd = level.width;
 			}
 		}
 
-		textureUpload.Get()->Unmap(0, nullptr);
-
-		// Describe the upload heap resource location for the copy
-		D3D12_SUBRESOURCE_FOOTPRINT subresource = {};
-		subresource.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
-		subresource.Width = width;
-		subresource.Height = height;
-		subresource.RowPitch = rowWidth;
-		subresource.Depth = 1;
-
-		D3D12_PLACED_SUBRESOURCE_FOOTPRINT footprint = {};
-		footprint.Offset = 0;
-		//footprint.Offset = texture.offset;
-		footprint.Footprint = subresource;
-		
-		D3D12_TEXTURE_COPY_LOCATION source = {};
-		source.pResource = textureUpload.Get();
-		source.PlacedFootprint = footprint;
-		source.Type = D3D12_TEXTURE_COPY_TYPE_PLACED_FOOTPRINT;
-
-		// Describe the default heap resource location for the copy
-		D3D12_TEXTURE_COPY_LOCATION destination = {};
-		destination.pResource = texture.Get();
-		destination.SubresourceIndex = 0;
-		destination.Type = D3D12_TEXTURE_COPY_TYPE_SUBRESOURCE_INDEX;
-
-		// Reset the command list.
-		auto d3dCommandList = device->getD3D12CommandList();
-		
-		// Copy the buffer resource from the upload heap to the texture resource on the default heap.
-		d3dCommandList->CopyTextureRegion(&destination, 0, 0, 0, &source, nullptr);
-		
-		// Transition the texture to a shader resource.
-		D3D12_RESOURCE_BARRIER barrier = {};
-		barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION;
-		barrier.Transition.pResource = texture.Get();
-		barrier.Transition.StateBefore = D3D12_RESOURCE_STATE_COPY_DEST;
-		barrier.Transition.StateAfter = D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE;
-		barrier.Transition.Subresource = D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES;
-		device->setLastCopyQueueBarrier(barrier);
+		if ((rowBegin >= rowEnd) || (columnBegin >= columnEnd)) {
+			continue;
+		}
+
+		const DXGI_FORMAT levelFormat = footprints[i].Footprint.Format;
+		if (compressTexture) {
+			// The rows of a compressed level are rows of blocks, so the region is extended to whole blocks.
+			const int blockRowBegin = rowBegin / BlockDimension;
+			const int blockRowEnd = (rowEnd + BlockDimension - 1) / BlockDimension;
+			const int blockColumnBegin = columnBegin / BlockDimension;
+			const int blockColumnEnd = (columnEnd + BlockDimension - 1) / BlockDimension;
+			const int pixelRowBegin = blockRowBegin * BlockDimension;
+			const int pixelColumnBegin = blockColumnBegin * BlockDimension;
+			const int regionWidth = std::min(blockColumnEnd * BlockDimension, levelWidth) - pixelColumnBegin;
+			const int regionHeight = std::min(blockRowEnd * BlockDimension, levelHeight) - pixelRowBegin;
+			regionPixels.resize((size_t)(regionWidth) * regionHeight * 4);
+			for (int row = 0; row < regionHeight; row++) {
+				memcpy(&regionPixels[(size_t)(row) * regionWidth * 4], levelBytes + ((size_t)(pixelRowBegin + row) * levelWidth + pixelColumnBegin) * 4, (size_t)(regionWidth) * 4);
+			}
+
+			BlockCompressor::compress(regionPixels.data(), regionWidth, regionHeight, blockFormat, device->getTextureCompressionQuality(), device->getWorkerPool(), compressedBlocks);
+
+			const size_t blockRowSize = (size_t)(blockColumnEnd - blockColumnBegin) * blockSize;
+			if (keepEncodedData) {
+				const UINT rowPitch = footprints[i].Footprint.RowPitch;
+				UINT8 *levelData = encodedData.data() + footprints[i].Offset;
+				for (int row = blockRowBegin; row < blockRowEnd; row++) {
+					memcpy(levelData + row * rowPitch + blockColumnBegin * blockSize, compressedBlocks.data() + (row - blockRowBegin) * blockRowSize, blockRowSize);
+				}
+			}
+
+			const UINT regionRight = std::min((UINT)(blockColumnEnd * BlockDimension), footprints[i].Footprint.Width);
+			const UINT regionBottom = std::min((UINT)(blockRowEnd * BlockDimension), footprints[i].Footprint.Height);
+			uploadRing->copyTextureRows(texture.Get(), i, pixelColumnBegin, pixelRowBegin, levelFormat, regionRight - pixelColumnBegin, regionBottom - pixelRowBegin, compressedBlocks.data(), blockRowSize, blockRowSize, blockRowEnd - blockRowBegin);
+			copySize += (blockRowEnd - blockRowBegin) * blockRowSize;
+		}
+		else {
+			const size_t levelRowSize = (size_t)(levelWidth) * stride;
+			const size_t spanOffset = (size_t)(columnBegin) * stride;
+			const size_t spanSize = (size_t)(columnEnd - columnBegin) * stride;
+			const uint8_t *spanBytes = levelBytes + rowBegin * levelRowSize + spanOffset;
+			uploadRing->copyTextureRows(texture.Get(), i, columnBegin, rowBegin, levelFormat, columnEnd - columnBegin, rowEnd - rowBegin, spanBytes, levelRowSize, spanSize, rowEnd - rowBegin);
+			copySize += (rowEnd - rowBegin) * spanSize;
+		}
+
+		copyCount++;
 	}
+
+	endCopies(copySize, copyCount);
+
+	return recreateResources;
 }
 
-RT64::Texture::~Texture() {
-	texture.Release();
-	textureUpload.Release();
+bool RT64::Texture::needsPixels() const {
+	// Evicted textures are restored from the CPU copy, and rect updates need the rest of the chain to filter the levels again.
+	return rectUpdates || (evictable && (stride == 4) && (std::max(width, height) > StandbySize));
+}
+
+void RT64::Texture::releasePixels() {
+	mipChain = MipChain();
+	std::vector<uint8_t>().swap(pixels);
+}
+
+void RT64::Texture::beginCopies(bool overwrite) {
+	// The frames in flight might still read the texture that already existed.
+	if (overwrite) {
+		device->getCopyQueue()->markOverwrite();
+	}
+}
+
+void RT64::Texture::endCopies(UINT64 copySize, UINT copyCount) {
+	device->getCommandLog()->record(CommandLog::Type::Copy, texture.Get(), copySize, copyCount);
+	if (copyCount > 0) {
+		uploadFenceValue = device->getCopyQueue()->getBatchFenceValue();
+	}
+}
+
+void RT64::Texture::createStandby() {
+	// Keep the smallest levels of the chain, starting from the first one that fits in the standby size.
+	const std::vector<MipChain::Level> &levels = mipChain.getLevels();
+	size_t firstLevel = 0;
+	while (((firstLevel + 1) < levels.size()) && (std::max(levels[firstLevel].width, levels[firstLevel].height) > StandbySize)) {
+		firstLevel++;
+	}
+
+	// The CPU keeps a copy of them too, so the tracers sample the same levels as the GPU while the texture is evicted.
+	standbyLevels.assign(levels.begin() + firstLevel, levels.end());
+
+	const UINT standbyLevelCount = (UINT)(standbyLevels.size());
+	D3D12_RESOURCE_DESC textureDesc = {};
+	textureDesc.Width = standbyLevels[0].width;
+	textureDesc.Height = standbyLevels[0].height;
+	textureDesc.MipLevels = standbyLevelCount;
+	textureDesc.DepthOrArraySize = 1;
+	textureDesc.SampleDesc.Count = 1;
+	textureDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+	textureDesc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
+	standbyTexture = device->allocateResource(D3D12_HEAP_TYPE_DEFAULT, &textureDesc, D3D12_RESOURCE_STATE_COMMON, nullptr);
+
+	UploadRing *uploadRing = device->getUploadRing();
+	UINT64 standbySize = 0;
+	for (UINT i = 0; i < standbyLevelCount; i++) {
+		const MipChain::Level &level = standbyLevels[i];
+		const size_t levelRowSize = (size_t)(level.width) * 4;
+		uploadRing->copyTextureRows(standbyTexture.Get(), i, 0, 0, textureDesc.Format, level.width, level.height, level.pixels.data(), levelRowSize, levelRowSize, level.height);
+		standbySize += levelRowSize * level.height;
+	}
+
+	device->getCommandLog()->record(CommandLog::Type::Copy, standbyTexture.Get(), standbySize, standbyLevelCount);
+	uploadFenceValue = device->getCopyQueue()->getBatchFenceValue();
+}
+
+void RT64::Texture::restoreMipChain() {
+	// Generate the chain again from the top level kept while the texture was evicted. Compressed textures decode it
+	// from their encoded levels, which are the same pixels the GPU samples.
+	WorkerPool *workerPool = device->getWorkerPool();
+	if (!evictedPixels.empty()) {
+		mipChain.generate(evictedPixels.data(), width, height, mipFilter, workerPool);
+		std::vector<uint8_t>().swap(evictedPixels);
+	}
+	else {
+		std::vector<uint8_t> topPixels((size_t)(width) * height * 4);
+		BlockCompressor::decompress(encodedData.data() + footprints[0].Offset, footprints[0].Footprint.RowPitch, width, height, encodedFormat, workerPool, topPixels.data());
+		mipChain.generate(topPixels.data(), width, height, mipFilter, workerPool);
+	}
+}
+
+void RT64::Texture::updateSlot(bool wasAtlased, bool changed) {
+	// Moving a texture changes the slot or the scale and offset the materials use, so the instances that use it
+	// must write their materials again.
+	TextureTable *textureTable = device->getTextureTable();
+	if (atlased) {
+		if (!wasAtlased) {
+			textureTable->removeTexture(slot);
+		}
+
+		if (changed) {
+			slot = device->getTextureAtlas()->getSlot(atlasRegion);
+			for (Instance *instance : instances) {
+				instance->markDirty(Instance::DirtyTextures);
+			}
+		}
+	}
+	else if (wasAtlased) {
+		slot = textureTable->addTexture(this);
+		for (Instance *instance : instances) {
+			instance->markDirty(Instance::DirtyTextures);
+		}
+	}
+	else if (changed) {
+		textureTable->updateTexture(slot);
+	}
+}
+
+void RT64::Texture::setData(const void *bytes, int width, int height, int stride) {
+	// The replacement from the texture pack was meant for the previous contents.
+	device->getTexturePack()->cancel(this);
+
+	const bool wasAtlased = atlased;
+	updateSlot(wasAtlased, loadData(bytes, width, height, stride));
+}
+
+void RT64::Texture::setRect(const void *bytes, int x, int y, int width, int height, int rowPitch) {
+	assert(bytes != nullptr);
+
+	// The host's rect might be meant for a different size than the texture has now, like when a texture pack
+	// replaced it, so it's clipped before anything is written.
+	const int clippedLeft = std::max(x, 0);
+	const int clippedTop = std::max(y, 0);
+	const int clippedRight = (int)(std::min((int64_t)(x) + width, (int64_t)(this->width)));
+	const int clippedBottom = (int)(std::min((int64_t)(y) + height, (int64_t)(this->height)));
+	if ((stride != 4) || (clippedLeft >= clippedRight) || (clippedTop >= clippedBottom)) {
+		return;
+	}
+
+	device->getTexturePack()->cancel(this);
+
+	const uint8_t *rectBytes = reinterpret_cast<const uint8_t *>(bytes) + (size_t)(clippedTop - y) * rowPitch + (size_t)(clippedLeft - x) * 4;
+	x = clippedLeft;
+	y = clippedTop;
+	width = clippedRight - clippedLeft;
+	height = clippedBottom - clippedTop;
+	if (atlased) {
+		// The page keeps the only copy of the pixels, so the rect is placed on top of the pixels read back from it.
+		const size_t textureRowSize = (size_t)(this->width) * 4;
+		std::vector<uint8_t> texturePixels;
+		copyPixels(texturePixels);
+		for (int row = 0; row < height; row++) {
+			memcpy(&texturePixels[(y + row) * textureRowSize + (size_t)(x) * 4], rectBytes + (size_t)(row) * rowPitch, (size_t)(width) * 4);
+		}
+
+		device->getTextureAtlas()->write(atlasRegion, texturePixels.data(), (int)(textureRowSize));
+		return;
+	}
+
+	// Evicted textures only have their top level or their encoded levels, so the chain is generated first. The upload
+	// restores the texture.
+	if (evicted && mipChain.getLevels().empty()) {
+		restoreMipChain();
+	}
+
+	// Otherwise, the chain must have been kept since the texture was created to be able to update only a part of it.
+	rectUpdates = true;
+	if (mipChain.getLevels().empty()) {
+		assert(false && "The texture didn't keep the CPU copy required by rect updates.");
+		return;
+	}
+
+	// Opacity is only tracked conservatively, as BC3 can store opaque textures too.
+	opaque = opaque && isRectOpaque(rectBytes, width, height, rowPitch);
+	mipChain.update(rectBytes, x, y, width, height, rowPitch, device->getWorkerPool());
+	updateSlot(false, upload(false));
+}
+
+void RT64::Texture::setMipChain(MipChain &generatedChain) {
+	assert(!generatedChain.getLevels().empty());
+
+	const MipChain::Level &topLevel = generatedChain.getLevels()[0];
+	const bool wasAtlased = atlased;
+	updateSlot(wasAtlased, loadData(topLevel.pixels.data(), topLevel.width, topLevel.height, 4, &generatedChain));
+}
+
+bool RT64::Texture::canEvict() const {
+	// Textures that fit in the standby size wouldn't free anything.
+	return evictable && !evicted && !atlased && (stride == 4) && !texture.IsNull() && (std::max(width, height) > StandbySize);
+}
+
+void RT64::Texture::evict() {
+	assert(canEvict());
+
+	// Only the smallest levels stay on the GPU. On the CPU, compressed textures keep their encoded levels and the
+	// others keep their top level as it is, so the rest of the chain can be dropped and generated again exactly.
+	// Encoding the top level instead would lose some of its detail on every eviction. Textures with rect updates
+	// keep the whole chain, as the next update only filters again the region it replaces.
+	device->retireResource(texture, uploadFenceValue);
+	createStandby();
+	if (!rectUpdates) {
+		if (encodedData.empty()) {
+			const std::vector<uint8_t> &topPixels = mipChain.getLevels()[0].pixels;
+			evictedPixels.assign(topPixels.begin(), topPixels.end());
+		}
+
+		releasePixels();
+	}
+
+	evicted = true;
+	device->getTextureTable()->updateTexture(slot);
+}
+
+void RT64::Texture::restore() {
+	assert(evicted);
+
+	device->retireResource(standbyTexture, uploadFenceValue);
+	std::vector<MipChain::Level>().swap(standbyLevels);
+	evicted = false;
+
+	if (mipChain.getLevels().empty()) {
+		restoreMipChain();
+	}
+
+	// Compressed textures upload their encoded copy as it is, the others upload the mip chain again.
+	if (!encodedData.empty()) {
+		// Creating the resources clears the encoded data, so it's moved out first.
+		std::vector<uint8_t> restoredData;
+		restoredData.swap(encodedData);
+		createResources(format, mipLevels);
+		encodedData.swap(restoredData);
+
+		UploadRing *uploadRing = device->getUploadRing();
+		for (UINT i = 0; i < mipLevels; i++) {
+			const D3D12_PLACED_SUBRESOURCE_FOOTPRINT &footprint = footprints[i];
+			uploadRing->copyTextureRows(texture.Get(), i, 0, 0, footprint.Footprint.Format, footprint.Footprint.Width, footprint.Footprint.Height, encodedData.data() + footprint.Offset, footprint.Footprint.RowPitch, rowSizes[i], rowCounts[i]);
+		}
+
+		endCopies(uploadSize, mipLevels);
+	}
+	else {
+		upload(true);
+	}
+
+	device->getTextureTable()->updateTexture(slot);
+}
+
+bool RT64::Texture::isEvicted() const {
+	return evicted;
+}
+
+UINT64 RT64::Texture::getResidentSize() const {
+	return texture.IsNull() ? 0 : uploadSize;
+}
+
+void RT64::Texture::setLastUsedFrame(uint64_t frame) {
+	lastUsedFrame = frame;
+}
+
+uint64_t RT64::Texture::getLastUsedFrame() const {
+	return lastUsedFrame;
+}
+
+RT64::Device *RT64::Texture::getDevice() const {
+	return device;
 }
 
 ID3D12Resource *RT64::Texture::getTexture() {
-	return texture.Get();
+	return evicted ? standbyTexture.Get() : texture.Get();
+}
+
+UINT64 RT64::Texture::getUploadFenceValue() const {
+	return atlased ? device->getTextureAtlas()->getUploadFenceValue(atlasRegion) : uploadFenceValue;
+}
+
+uint32_t RT64::Texture::getSlot() const {
+	return slot;
+}
+
+RT64_VECTOR4 RT64::Texture::getScaleOffset() const {
+	return atlased ? device->getTextureAtlas()->getScaleOffset(atlasRegion) : RT64_VECTOR4{ 1.0f, 1.0f, 0.0f, 0.0f };
+}
+
+bool RT64::Texture::isAtlased() const {
+	return atlased;
+}
+
+void RT64::Texture::addInstance(Instance *instance) {
+	assert(instance != nullptr);
+	instances.push_back(instance);
+}
+
+void RT64::Texture::removeInstance(Instance *instance) {
+	auto it = std::find(instances.begin(), instances.end(), instance);
+	if (it != instances.end()) {
+		instances.erase(it);
+	}
+}
+
+int RT64::Texture::getWidth() const {
+	return width;
 }
 
-void RT64::Texture::setCurrentIndex(int v) {
-	currentIndex = v;
+int RT64::Texture::getHeight() const {
+	return height;
+}
+
+int RT64::Texture::getStride() const {
+	return stride;
+}
+
+RT64::MipChain::Filter RT64::Texture::getMipFilter() const {
+	return mipFilter;
+}
+
+int RT64::Texture::getPixelLevelCount() const {
+	if (atlased) {
+		return TextureAtlas::MaxLOD + 1;
+	}
+	else if (stride != 4) {
+		return 0;
+	}
+	else {
+		return (int)(evicted ? standbyLevels.size() : mipChain.getLevels().size());
+	}
+}
+
+const uint8_t *RT64::Texture::getPixels(int level, int &width, int &height, int &rowPitch) const {
+	if (atlased) {
+		return device->getTextureAtlas()->getPixels(atlasRegion, level, width, height, rowPitch);
+	}
+
+	const std::vector<MipChain::Level> &levels = evicted ? standbyLevels : mipChain.getLevels();
+	if ((stride != 4) || (level < 0) || (level >= (int)(levels.size()))) {
+		width = height = rowPitch = 0;
+		return nullptr;
+	}
+
+	width = levels[level].width;
+	height = levels[level].height;
+	rowPitch = levels[level].width * 4;
+	return levels[level].pixels.data();
 }
 
-int RT64::Texture::getCurrentIndex() const {
-	return currentIndex;
+bool RT64::Texture::copyPixels(std::vector<uint8_t> &dst) const {
+	if (stride != 4) {
+		return false;
+	}
+
+	const size_t rowSize = (size_t)(width) * 4;
+	const uint8_t *srcPixels = nullptr;
+	int srcRowPitch = (int)(rowSize);
+	if (atlased) {
+		int levelWidth, levelHeight;
+		srcPixels = device->getTextureAtlas()->getPixels(atlasRegion, 0, levelWidth, levelHeight, srcRowPitch);
+	}
+	else if (!mipChain.getLevels().empty()) {
+		srcPixels = mipChain.getLevels()[0].pixels.data();
+	}
+	else if (!evictedPixels.empty()) {
+		srcPixels = evictedPixels.data();
+	}
+	else if (evicted && !encodedData.empty()) {
+		dst.resize(rowSize * height);
+		BlockCompressor::decompress(encodedData.data() + footprints[0].Offset, footprints[0].Footprint.RowPitch, width, height, encodedFormat, device->getWorkerPool(), dst.data());
+		return true;
+	}
+	else {
+		return false;
+	}
+
+	dst.resize(rowSize * height);
+	for (int row = 0; row < height; row++) {
+		memcpy(&dst[row * rowSize], srcPixels + (size_t)(row) * srcRowPitch, rowSize);
+	}
+
+	return true;
 }
 
 // Public
 
 DLLEXPORT RT64_TEXTURE *RT64_CreateTextureFromRGBA8(RT64_DEVICE *devicePtr, const void *bytes, int width, int height, int stride) {
 	RT64::Device *device = (RT64::Device *)(devicePtr);
-	return (RT64_TEXTURE *)(new RT64::Texture(device, bytes, width, height, stride));
+	return (RT64_TEXTURE *)(device->getTextureCache()->acquire(bytes, width, height, stride));
+}
+
+DLLEXPORT RT64_TEXTURE *RT64_CreateTextureFromFormat(RT64_DEVICE *devicePtr, const void *bytes, int width, int height, int rowPitch, int format, const void *tlut, int tlutFormat) {
+	RT64::Device *device = (RT64::Device *)(devicePtr);
+	std::vector<uint8_t> decodedBytes;
+	RT64::TextureDecoder::decode(bytes, width, height, rowPitch, format, tlut, tlutFormat, decodedBytes);
+	return (RT64_TEXTURE *)(device->getTextureCache()->acquire(decodedBytes.data(), width, height, 4));
+}
+
+DLLEXPORT RT64_TEXTURE *RT64_SetTextureData(RT64_TEXTURE *texturePtr, const void *bytes, int width, int height, int stride) {
+	assert(texturePtr != nullptr);
+	RT64::Texture *texture = (RT64::Texture *)(texturePtr);
+	RT64::Device *device = texture->getDevice();
+
+	// Textures shared with other handles can't change, so the caller gets its own texture instead.
+	if (!device->getTextureCache()->detach(texture)) {
+		return (RT64_TEXTURE *)(new RT64::Texture(device, bytes, width, height, stride));
+	}
+
+	texture->setData(bytes, width, height, stride);
+	return texturePtr;
+}
+
+DLLEXPORT RT64_TEXTURE *RT64_SetTextureRect(RT64_TEXTURE *texturePtr, const void *bytes, int x, int y, int width, int height, int rowPitch) {
+	assert(texturePtr != nullptr);
+	RT64::Texture *texture = (RT64::Texture *)(texturePtr);
+	RT64::Device *device = texture->getDevice();
+
+	// Textures without a CPU copy ignore rect updates anyway, so they're left as they are. This must be checked before
+	// detaching, as detaching a shared texture releases the reference of the caller.
+	if (texture->getPixelLevelCount() == 0) {
+		return texturePtr;
+	}
+
+	// Textures shared with other handles can't change, so the caller gets its own copy instead. The other handles
+	// still hold a reference, so the texture can be read after detaching.
+	if (!device->getTextureCache()->detach(texture)) {
+		std::vector<uint8_t> texturePixels;
+		texture->copyPixels(texturePixels);
+		texture = new RT64::Texture(device, texturePixels.data(), texture->getWidth(), texture->getHeight(), 4, texture->getMipFilter(), true, true);
+	}
+
+	texture->setRect(bytes, x, y, width, height, rowPitch);
+	return (RT64_TEXTURE *)(texture);
 }
 
 DLLEXPORT void RT64_DestroyTexture(RT64_TEXTURE *texturePtr) {
-	delete (RT64::Texture *)(texturePtr);
+	RT64::Texture *texture = (RT64::Texture *)(texturePtr);
+	texture->getDevice()->getTextureCache()->release(texture);
 }
 
-#endif
\ No newline at end of file
+#endif
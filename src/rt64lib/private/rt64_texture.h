@@ -5,21 +5,121 @@
 #pragma once
 
 #include "rt64_common.h"
+#include "rt64_block_compression.h"
+#include "rt64_mipmaps.h"
+#include "rt64_texture_atlas.h"
 
 namespace RT64 {
 	class Device;
+	class Instance;
 
 	class Texture {
 	private:
 		Device *device;
 		AllocatedResource texture;
-		AllocatedResource textureUpload;
-		int currentIndex;
+		uint32_t slot;
+		int width;
+		int height;
+		int stride;
+		DXGI_FORMAT format;
+		UINT mipLevels;
+		std::vector<D3D12_PLACED_SUBRESOURCE_FOOTPRINT> footprints;
+		std::vector<UINT> rowCounts;
+		std::vector<UINT64> rowSizes;
+		MipChain::Filter mipFilter;
+		MipChain mipChain;
+		std::vector<uint8_t> pixels;
+		bool opaque;
+		bool atlased;
+		TextureAtlas::Region atlasRegion;
+		AllocatedResource standbyTexture;
+		std::vector<uint8_t> encodedData;
+		BlockCompressor::Format encodedFormat;
+		std::vector<uint8_t> evictedPixels;
+		std::vector<MipChain::Level> standbyLevels;
+		UINT64 uploadSize;
+		UINT64 uploadFenceValue;
+		uint64_t lastUsedFrame;
+		bool evictable;
+		bool evicted;
+		bool rectUpdates;
+		std::vector<Instance *> instances;
+
+		bool loadData(const void *bytes, int width, int height, int stride, MipChain *generatedChain = nullptr);
+		void releaseResources();
+		void createResources(DXGI_FORMAT format, UINT mipLevels);
+		bool upload(bool layoutChanged);
+		bool needsPixels() const;
+		void releasePixels();
+		void beginCopies(bool overwrite);
+		void endCopies(UINT64 copySize, UINT copyCount);
+		void createStandby();
+		void restoreMipChain();
+		void updateSlot(bool wasAtlased, bool changed);
 	public:
-		Texture(Device *device, const void *bytes, int width, int height, int stride);
+		// Only textures that can be evicted or that expect rect updates keep a CPU copy of their pixels after the upload.
+		// Atlased textures use the copy of their page instead.
+		Texture(Device *device, const void *bytes, int width, int height, int stride, MipChain::Filter mipFilter = MipChain::Filter::Kaiser, bool evictable = true, bool rectUpdates = false);
 		virtual ~Texture();
+
+		// Replaces the contents of the texture. The existing resources are kept unless the size, the stride
+		// or the format of the texture changes.
+		void setData(const void *bytes, int width, int height, int stride);
+
+		// Replaces a rectangle of an RGBA8 texture and only uploads the region of every level that depends on it.
+		// The rectangle is clipped to the texture, and nothing is done for other layouts or if nothing is left.
+		void setRect(const void *bytes, int x, int y, int width, int height, int rowPitch);
+
+		// Replaces the contents of the texture with a mip chain that was already generated. The chain is moved
+		// into the texture.
+		void setMipChain(MipChain &generatedChain);
+
+		// Evicting releases the resource and keeps a small copy of the lowest levels in its place until the texture
+		// is restored. In the meantime, the CPU keeps the encoded levels of block compressed textures and the top level
+		// of the others, so restoring them is lossless. The resources are retired, so neither needs to wait for the GPU.
+		bool canEvict() const;
+		void evict();
+		void restore();
+		bool isEvicted() const;
+
+		// Size of the resource while it's resident. Evicted and atlased textures don't count.
+		UINT64 getResidentSize() const;
+
+		void setLastUsedFrame(uint64_t frame);
+		uint64_t getLastUsedFrame() const;
+
+		Device *getDevice() const;
 		ID3D12Resource *getTexture();
-		void setCurrentIndex(int v);
-		int getCurrentIndex() const;
+
+		// Copy fence value of the last upload to the resources of the texture, or to its atlas page.
+		UINT64 getUploadFenceValue() const;
+
+		// Index of the texture in the bindless texture table. Small textures share the slot of their atlas page,
+		// and the slot only changes when an update moves the texture to another page or in or out of the atlas.
+		uint32_t getSlot() const;
+
+		// Scale and offset of the texture inside its atlas page. Textures outside the atlas use the identity.
+		RT64_VECTOR4 getScaleOffset() const;
+
+		bool isAtlased() const;
+
+		// Instances that use the texture. Only they are marked as dirty when the slot or the atlas region changes.
+		void addInstance(Instance *instance);
+		void removeInstance(Instance *instance);
+
+		int getWidth() const;
+		int getHeight() const;
+		int getStride() const;
+		MipChain::Filter getMipFilter() const;
+
+		// Levels of the CPU copy of an RGBA8 texture, matching the levels the GPU samples. Evicted textures return the
+		// levels of their standby copy, and atlased textures the levels of their region in the page up to MaxLOD.
+		// The count is zero and the pixels are null if the texture doesn't keep a CPU copy.
+		int getPixelLevelCount() const;
+		const uint8_t *getPixels(int level, int &width, int &height, int &rowPitch) const;
+
+		// Copies the full top level of an RGBA8 texture, decoding it if the texture is evicted. Returns false if the
+		// texture doesn't keep a CPU copy of its pixels.
+		bool copyPixels(std::vector<uint8_t> &dst) const;
 	};
-};
\ No newline at end of file
+};
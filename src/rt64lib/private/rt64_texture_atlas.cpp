@@ -0,0 +1,242 @@
+//
+// RT64
+//
+
+#ifndef RT64_MINIMAL
+
+#define STB_RECT_PACK_IMPLEMENTATION
+#include "rt64_texture_atlas.h"
+
+#include <algorithm>
+#include <climits>
+
+#include "rt64_device.h"
+#include "rt64_texture.h"
+
+namespace {
+	// The packer works in cells of Gutter texels so every region stays aligned to the grid of the mipmaps.
+	const int CellSize = RT64::TextureAtlas::Gutter;
+	const int PageCells = RT64::TextureAtlas::PageSize / CellSize;
+
+	inline int countCells(int size) {
+		return (size + CellSize - 1) / CellSize + 2;
+	}
+
+	inline int wrapCoordinate(int value, int size) {
+		return ((value % size) + size) % size;
+	}
+};
+
+// Private
+
+RT64::TextureAtlas::TextureAtlas(Device *device) {
+	assert(device != nullptr);
+	this->device = device;
+}
+
+RT64::TextureAtlas::~TextureAtlas() {
+	for (Page *page : pages) {
+		if (page != nullptr) {
+			delete page->texture;
+			delete page;
+		}
+	}
+}
+
+RT64::TextureAtlas::Page *RT64::TextureAtlas::createPage(uint32_t &pageIndex) {
+	// The indices of freed pages are reused, so the regions of the other pages keep theirs.
+	auto it = std::find(pages.begin(), pages.end(), nullptr);
+	if ((it == pages.end()) && (pages.size() >= MaxPages)) {
+		return nullptr;
+	}
+
+	std::vector<uint8_t> emptyPixels((size_t)(PageSize) * PageSize * 4, 0);
+	Page *page = new Page();
+	// Pages hold many textures at once, so they always stay resident. Every write is a rect update.
+	page->texture = new Texture(device, emptyPixels.data(), PageSize, PageSize, 4, MipChain::Filter::Box, false, true);
+	page->nodes.resize(PageCells);
+	page->regionCount = 0;
+	stbrp_init_target(&page->packer, PageCells, PageCells, page->nodes.data(), (int)(page->nodes.size()));
+	if (it != pages.end()) {
+		*it = page;
+		pageIndex = (uint32_t)(it - pages.begin());
+	}
+	else {
+		pages.push_back(page);
+		pageIndex = (uint32_t)(pages.size() - 1);
+	}
+
+	return page;
+}
+
+bool RT64::TextureAtlas::packRegion(Page *page, Region &region) {
+	stbrp_rect rect = {};
+	rect.w = (stbrp_coord)(region.cellWidth);
+	rect.h = (stbrp_coord)(region.cellHeight);
+	if (!stbrp_pack_rects(&page->packer, &rect, 1)) {
+		return false;
+	}
+
+	region.x = (rect.x + 1) * CellSize;
+	region.y = (rect.y + 1) * CellSize;
+	return true;
+}
+
+bool RT64::TextureAtlas::reuseRegion(Region &region) {
+	// Pick the released region that wastes the least room out of all the pages.
+	Page *bestPage = nullptr;
+	size_t bestIndex = 0;
+	int bestArea = INT_MAX;
+	for (Page *page : pages) {
+		if (page == nullptr) {
+			continue;
+		}
+
+		for (size_t i = 0; i < page->freeRegions.size(); i++) {
+			const Region &freeRegion = page->freeRegions[i];
+			const int area = freeRegion.cellWidth * freeRegion.cellHeight;
+			if ((freeRegion.cellWidth >= region.cellWidth) && (freeRegion.cellHeight >= region.cellHeight) && (area < bestArea)) {
+				bestPage = page;
+				bestIndex = i;
+				bestArea = area;
+			}
+		}
+	}
+
+	if (bestPage == nullptr) {
+		return false;
+	}
+
+	const Region &freeRegion = bestPage->freeRegions[bestIndex];
+	region.page = freeRegion.page;
+	region.x = freeRegion.x;
+	region.y = freeRegion.y;
+	region.cellWidth = freeRegion.cellWidth;
+	region.cellHeight = freeRegion.cellHeight;
+	bestPage->freeRegions.erase(bestPage->freeRegions.begin() + bestIndex);
+	bestPage->regionCount++;
+	return true;
+}
+
+bool RT64::TextureAtlas::isTextureSupported(int width, int height, int stride) {
+	return (stride == 4) && (width > 0) && (height > 0) && (width <= MaxTextureSize) && (height <= MaxTextureSize);
+}
+
+bool RT64::TextureAtlas::allocate(int width, int height, Region &region) {
+	assert(isTextureSupported(width, height, 4));
+
+	region.width = width;
+	region.height = height;
+	region.cellWidth = countCells(width);
+	region.cellHeight = countCells(height);
+	if (reuseRegion(region)) {
+		return true;
+	}
+
+	for (uint32_t i = 0; i < (uint32_t)(pages.size()); i++) {
+		if ((pages[i] != nullptr) && packRegion(pages[i], region)) {
+			region.page = i;
+			pages[i]->regionCount++;
+			return true;
+		}
+	}
+
+	// An empty page always has room for a supported texture.
+	Page *page = createPage(region.page);
+	if (page == nullptr) {
+		return false;
+	}
+
+	packRegion(page, region);
+	page->regionCount++;
+	return true;
+}
+
+void RT64::TextureAtlas::release(const Region &region) {
+	assert(region.page < pages.size());
+
+	Page *page = pages[region.page];
+	assert(page != nullptr);
+	assert(page->regionCount > 0);
+	if (--page->regionCount > 0) {
+		page->freeRegions.push_back(region);
+		return;
+	}
+
+	// The last page is kept, so textures that are created and destroyed over and over don't create a new page every time.
+	if (getPageCount() > 1) {
+		delete page->texture;
+		delete page;
+		pages[region.page] = nullptr;
+	}
+	else {
+		page->freeRegions.clear();
+		stbrp_init_target(&page->packer, PageCells, PageCells, page->nodes.data(), (int)(page->nodes.size()));
+	}
+}
+
+void RT64::TextureAtlas::write(const Region &region, const uint8_t *pixels, int rowPitch) {
+	assert(region.page < pages.size());
+	assert(pixels != nullptr);
+
+	const int regionWidth = region.width + Gutter * 2;
+	const int regionHeight = region.height + Gutter * 2;
+	regionPixels.resize((size_t)(regionWidth) * regionHeight * 4);
+	for (int y = 0; y < regionHeight; y++) {
+		const uint8_t *srcRow = pixels + (size_t)(wrapCoordinate(y - Gutter, region.height)) * rowPitch;
+		uint8_t *dstRow = &regionPixels[(size_t)(y) * regionWidth * 4];
+		for (int x = 0; x < regionWidth; x++) {
+			memcpy(&dstRow[x * 4], &srcRow[wrapCoordinate(x - Gutter, region.width) * 4], 4);
+		}
+	}
+
+	pages[region.page]->texture->setRect(regionPixels.data(), region.x - Gutter, region.y - Gutter, regionWidth, regionHeight, regionWidth * 4);
+}
+
+const uint8_t *RT64::TextureAtlas::getPixels(const Region &region, int level, int &width, int &height, int &rowPitch) const {
+	assert(region.page < pages.size());
+
+	int pageWidth, pageHeight;
+	const uint8_t *pagePixels = ((level >= 0) && (level <= MaxLOD)) ? pages[region.page]->texture->getPixels(level, pageWidth, pageHeight, rowPitch) : nullptr;
+	if (pagePixels == nullptr) {
+		width = height = rowPitch = 0;
+		return nullptr;
+	}
+
+	// The regions are aligned to the grid of the levels, so they keep the same position on every one of them.
+	width = std::max(region.width >> level, 1);
+	height = std::max(region.height >> level, 1);
+	return pagePixels + (size_t)(region.y >> level) * rowPitch + (size_t)(region.x >> level) * 4;
+}
+
+uint32_t RT64::TextureAtlas::getSlot(const Region &region) const {
+	assert(region.page < pages.size());
+	return pages[region.page]->texture->getSlot();
+}
+
+UINT64 RT64::TextureAtlas::getUploadFenceValue(const Region &region) const {
+	assert(region.page < pages.size());
+	return pages[region.page]->texture->getUploadFenceValue();
+}
+
+RT64_VECTOR4 RT64::TextureAtlas::getScaleOffset(const Region &region) const {
+	const float invPageSize = 1.0f / PageSize;
+	return { region.width * invPageSize, region.height * invPageSize, region.x * invPageSize, region.y * invPageSize };
+}
+
+unsigned int RT64::TextureAtlas::getPageCount() const {
+	return (unsigned int)(pages.size() - std::count(pages.begin(), pages.end(), nullptr));
+}
+
+unsigned int RT64::TextureAtlas::getRegionCount() const {
+	unsigned int regionCount = 0;
+	for (const Page *page : pages) {
+		if (page != nullptr) {
+			regionCount += page->regionCount;
+		}
+	}
+
+	return regionCount;
+}
+
+#endif
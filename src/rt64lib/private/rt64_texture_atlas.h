@@ -0,0 +1,87 @@
+//
+// RT64
+//
+
+#pragma once
+
+#include "rt64_common.h"
+
+#include "imgui/imstb_rectpack.h"
+
+namespace RT64 {
+	class Device;
+	class Texture;
+
+	// Packs small RGBA8 textures into shared pages, so they don't need a descriptor and an allocation of their own.
+	// Every texture is surrounded by a gutter that repeats its opposite edges, which gives the right neighbors when
+	// the shaders wrap the coordinates. Clamp and mirror addressing keep the coordinates half a texel away from the
+	// edges instead. The pages use a box filter for their mipmaps and place every texture on a grid of Gutter texels,
+	// so the levels up to MaxLOD never mix texels from different textures.
+	class TextureAtlas {
+	public:
+		struct Region {
+			uint32_t page;
+			int x;
+			int y;
+			int width;
+			int height;
+
+			// Room taken in the page in cells of Gutter texels, including the gutter. Regions that reuse the room of
+			// a released one keep its size, which can be larger than what the texture needs.
+			int cellWidth;
+			int cellHeight;
+		};
+
+		static const int PageSize = 1024;
+		static const int MaxTextureSize = 64;
+		static const int MaxLOD = 2;
+		static const int Gutter = 1 << MaxLOD;
+
+		// Textures get resources of their own once every page is full and there are this many.
+		static const int MaxPages = 16;
+	private:
+		// The skyline packer can't free single rectangles, so the released regions of a page are kept in a list and
+		// reused by the textures that fit in them. Pages are freed once all of their regions are released.
+		struct Page {
+			Texture *texture;
+			stbrp_context packer;
+			std::vector<stbrp_node> nodes;
+			std::vector<Region> freeRegions;
+			unsigned int regionCount;
+		};
+
+		Device *device;
+		std::vector<Page *> pages;
+		std::vector<uint8_t> regionPixels;
+
+		Page *createPage(uint32_t &pageIndex);
+		bool packRegion(Page *page, Region &region);
+		bool reuseRegion(Region &region);
+	public:
+		TextureAtlas(Device *device);
+		virtual ~TextureAtlas();
+		static bool isTextureSupported(int width, int height, int stride);
+
+		// Returns false if there's no room left and there are already MaxPages pages.
+		bool allocate(int width, int height, Region &region);
+		void release(const Region &region);
+
+		// Writes the pixels of the texture and its gutter into the page.
+		void write(const Region &region, const uint8_t *pixels, int rowPitch);
+
+		// Pixels of a level of the texture in the CPU copy of its page. The textures don't keep a copy of their own.
+		// Levels past MaxLOD would mix the texture with its neighbors, so they return null.
+		const uint8_t *getPixels(const Region &region, int level, int &width, int &height, int &rowPitch) const;
+
+		uint32_t getSlot(const Region &region) const;
+
+		// Copy fence value of the last write to the page of the region.
+		UINT64 getUploadFenceValue(const Region &region) const;
+
+		// Scale and offset that map the coordinates of the texture to the coordinates of its page.
+		RT64_VECTOR4 getScaleOffset(const Region &region) const;
+
+		unsigned int getPageCount() const;
+		unsigned int getRegionCount() const;
+	};
+};
@@ -0,0 +1,112 @@
+//
+// RT64
+//
+
+#ifndef RT64_MINIMAL
+
+#include "rt64_texture_cache.h"
+
+#include "rt64_device.h"
+#include "rt64_texture.h"
+#include "rt64_texture_pack.h"
+
+#include "xxhash/xxhash64.h"
+
+// Private
+
+RT64::TextureCache::TextureCache(Device *device) {
+	assert(device != nullptr);
+	this->device = device;
+	hitCount = 0;
+	missCount = 0;
+	bytesSaved = 0;
+}
+
+RT64::TextureCache::~TextureCache() { }
+
+RT64::Texture *RT64::TextureCache::acquire(const void *bytes, int width, int height, int stride) {
+	assert(bytes != nullptr);
+
+	const uint64_t byteCount = (uint64_t)(width) * height * stride;
+	Key key;
+	key.hash = XXHash64::hash(bytes, byteCount, 0);
+	key.width = width;
+	key.height = height;
+	key.stride = stride;
+
+	auto it = entries.find(key);
+	if (it != entries.end()) {
+		it->second.refCount++;
+		hitCount++;
+		bytesSaved += byteCount;
+		return it->second.texture;
+	}
+
+	Entry entry;
+	entry.texture = new Texture(device, bytes, width, height, stride);
+	entry.refCount = 1;
+
+	// The texture pack is looked up with the same hash. The original pixels are used until the replacement is loaded.
+	if (stride == 4) {
+		device->getTexturePack()->queueReplacement(entry.texture, key.hash, width, height);
+	}
+
+	entries[key] = entry;
+	textureKeys[entry.texture] = key;
+	missCount++;
+	return entry.texture;
+}
+
+void RT64::TextureCache::release(Texture *texture) {
+	assert(texture != nullptr);
+
+	auto keyIt = textureKeys.find(texture);
+	if (keyIt == textureKeys.end()) {
+		delete texture;
+		return;
+	}
+
+	auto entryIt = entries.find(keyIt->second);
+	assert(entryIt != entries.end());
+	if (--entryIt->second.refCount > 0) {
+		return;
+	}
+
+	entries.erase(entryIt);
+	textureKeys.erase(keyIt);
+	delete texture;
+}
+
+bool RT64::TextureCache::detach(Texture *texture) {
+	assert(texture != nullptr);
+
+	auto keyIt = textureKeys.find(texture);
+	if (keyIt == textureKeys.end()) {
+		return true;
+	}
+
+	auto entryIt = entries.find(keyIt->second);
+	assert(entryIt != entries.end());
+	if (entryIt->second.refCount > 1) {
+		entryIt->second.refCount--;
+		return false;
+	}
+
+	entries.erase(entryIt);
+	textureKeys.erase(keyIt);
+	return true;
+}
+
+unsigned int RT64::TextureCache::getHitCount() const {
+	return hitCount;
+}
+
+unsigned int RT64::TextureCache::getMissCount() const {
+	return missCount;
+}
+
+uint64_t RT64::TextureCache::getBytesSaved() const {
+	return bytesSaved;
+}
+
+#endif
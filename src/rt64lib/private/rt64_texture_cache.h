@@ -0,0 +1,66 @@
+//
+// RT64
+//
+
+#pragma once
+
+#include "rt64_common.h"
+
+#include <unordered_map>
+
+namespace RT64 {
+	class Device;
+	class Texture;
+
+	// Shares the textures created with the same contents. Hosts like emulators tend to upload the same pixels
+	// as new textures over and over, so every texture is looked up by the hash of its pixels and its layout
+	// first. The cache holds a reference count for each texture and only destroys it once the last one is released.
+	// Textures that were detached to be updated are no longer shared and are destroyed on their first release.
+	class TextureCache {
+	private:
+		struct Key {
+			uint64_t hash;
+			int width;
+			int height;
+			int stride;
+
+			bool operator==(const Key &k) const {
+				return (hash == k.hash) && (width == k.width) && (height == k.height) && (stride == k.stride);
+			}
+		};
+
+		struct KeyHasher {
+			size_t operator()(const Key &k) const {
+				// The pixel hash is already well distributed, so the layout only needs to be mixed in.
+				return (size_t)(k.hash ^ ((uint64_t)(k.width) << 40) ^ ((uint64_t)(k.height) << 16) ^ (uint64_t)(k.stride));
+			}
+		};
+
+		struct Entry {
+			Texture *texture;
+			unsigned int refCount;
+		};
+
+		Device *device;
+		std::unordered_map<Key, Entry, KeyHasher> entries;
+		std::unordered_map<Texture *, Key> textureKeys;
+		unsigned int hitCount;
+		unsigned int missCount;
+		uint64_t bytesSaved;
+	public:
+		TextureCache(Device *device);
+		virtual ~TextureCache();
+		Texture *acquire(const void *bytes, int width, int height, int stride);
+		void release(Texture *texture);
+
+		// Removes the texture from the cache so its contents can be changed. Textures that are still shared with other
+		// handles can't be removed, so the reference of the caller is released instead and false is returned.
+		bool detach(Texture *texture);
+
+		unsigned int getHitCount() const;
+		unsigned int getMissCount() const;
+
+		// Size of the pixels that didn't have to be uploaded again because the texture was already in the cache.
+		uint64_t getBytesSaved() const;
+	};
+};
@@ -0,0 +1,269 @@
+//
+// RT64
+//
+
+#ifndef RT64_MINIMAL
+
+#include "../public/rt64.h"
+
+#include "rt64_texture_decoder.h"
+
+#if defined(_M_X64) || defined(__SSE2__)
+#	include <emmintrin.h>
+#	define RT64_TEXTURE_DECODER_SSE2
+#endif
+
+namespace {
+	inline uint32_t packRGBA(uint32_t r, uint32_t g, uint32_t b, uint32_t a) {
+		return r | (g << 8) | (b << 16) | (a << 24);
+	}
+
+	inline uint16_t readBE16(const uint8_t *bytes) {
+		return (uint16_t)((bytes[0] << 8) | bytes[1]);
+	}
+
+	inline uint32_t expand5(uint32_t value) {
+		return (value << 3) | (value >> 2);
+	}
+
+	inline uint32_t readNibble(const uint8_t *row, int x) {
+		const uint8_t byte = row[x >> 1];
+		return (x & 1) ? (byte & 0xF) : (byte >> 4);
+	}
+
+	uint32_t decodeRGBA16(uint16_t value) {
+		return packRGBA(expand5((value >> 11) & 0x1F), expand5((value >> 6) & 0x1F), expand5((value >> 1) & 0x1F), (value & 0x1) ? 0xFF : 0x00);
+	}
+
+	uint32_t decodeIA16(uint16_t value) {
+		const uint32_t i = value >> 8;
+		return packRGBA(i, i, i, value & 0xFF);
+	}
+
+	uint32_t decodeTexel(int format, const uint8_t *row, int x, const uint32_t *palette) {
+		switch (format) {
+		case RT64_TEXTURE_FORMAT_RGBA32:
+			return packRGBA(row[x * 4 + 0], row[x * 4 + 1], row[x * 4 + 2], row[x * 4 + 3]);
+		case RT64_TEXTURE_FORMAT_RGBA16:
+			return decodeRGBA16(readBE16(&row[x * 2]));
+		case RT64_TEXTURE_FORMAT_IA16:
+			return decodeIA16(readBE16(&row[x * 2]));
+		case RT64_TEXTURE_FORMAT_IA8: {
+			const uint32_t i = (row[x] >> 4) * 0x11;
+			const uint32_t a = (row[x] & 0xF) * 0x11;
+			return packRGBA(i, i, i, a);
+		}
+		case RT64_TEXTURE_FORMAT_IA4: {
+			const uint32_t nibble = readNibble(row, x);
+			const uint32_t i3 = nibble >> 1;
+			const uint32_t i = (i3 << 5) | (i3 << 2) | (i3 >> 1);
+			return packRGBA(i, i, i, (nibble & 0x1) ? 0xFF : 0x00);
+		}
+		case RT64_TEXTURE_FORMAT_I8:
+			return row[x] * 0x01010101U;
+		case RT64_TEXTURE_FORMAT_I4:
+			return readNibble(row, x) * 0x11111111U;
+		case RT64_TEXTURE_FORMAT_CI4:
+			return palette[readNibble(row, x)];
+		case RT64_TEXTURE_FORMAT_CI8:
+			return palette[row[x]];
+		default:
+			return 0;
+		}
+	}
+
+#ifdef RT64_TEXTURE_DECODER_SSE2
+	// Writes 16 pixels from their intensity and alpha bytes.
+	inline void storeIntensityAlpha(__m128i i, __m128i a, uint32_t *dst) {
+		const __m128i iiLow = _mm_unpacklo_epi8(i, i);
+		const __m128i iiHigh = _mm_unpackhi_epi8(i, i);
+		const __m128i iaLow = _mm_unpacklo_epi8(i, a);
+		const __m128i iaHigh = _mm_unpackhi_epi8(i, a);
+		_mm_storeu_si128((__m128i *)(dst + 0), _mm_unpacklo_epi16(iiLow, iaLow));
+		_mm_storeu_si128((__m128i *)(dst + 4), _mm_unpackhi_epi16(iiLow, iaLow));
+		_mm_storeu_si128((__m128i *)(dst + 8), _mm_unpacklo_epi16(iiHigh, iaHigh));
+		_mm_storeu_si128((__m128i *)(dst + 12), _mm_unpackhi_epi16(iiHigh, iaHigh));
+	}
+
+	// Splits 16 bytes into the 32 nibbles they hold, in the order of the pixels.
+	inline void splitNibbles(__m128i bytes, __m128i &first, __m128i &second) {
+		const __m128i nibbleMask = _mm_set1_epi8(0x0F);
+		const __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibbleMask);
+		const __m128i low = _mm_and_si128(bytes, nibbleMask);
+		first = _mm_unpacklo_epi8(high, low);
+		second = _mm_unpackhi_epi8(high, low);
+	}
+
+	inline __m128i expandNibbles(__m128i nibbles) {
+		return _mm_or_si128(nibbles, _mm_slli_epi16(nibbles, 4));
+	}
+
+	inline void storeIA4(__m128i nibbles, uint32_t *dst) {
+		const __m128i i3 = _mm_and_si128(_mm_srli_epi16(nibbles, 1), _mm_set1_epi8(0x07));
+		const __m128i i = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(i3, 5), _mm_slli_epi16(i3, 2)), _mm_and_si128(_mm_srli_epi16(i3, 1), _mm_set1_epi8(0x03)));
+		const __m128i a = _mm_sub_epi8(_mm_setzero_si128(), _mm_and_si128(nibbles, _mm_set1_epi8(0x01)));
+		storeIntensityAlpha(i, a, dst);
+	}
+
+	// Decodes as many pixels of the row as possible with SSE2 and returns the amount of pixels that were decoded.
+	int decodeRowSSE2(int format, const uint8_t *row, int width, uint32_t *dst) {
+		int x = 0;
+		switch (format) {
+		case RT64_TEXTURE_FORMAT_RGBA16: {
+			const __m128i mask5 = _mm_set1_epi16(0x1F);
+			const __m128i maskAlpha = _mm_set1_epi16(0x1);
+			const __m128i maskByte = _mm_set1_epi16(0xFF);
+			for (; (x + 8) <= width; x += 8) {
+				__m128i v = _mm_loadu_si128((const __m128i *)(row + x * 2));
+				v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+
+				const __m128i r = _mm_and_si128(_mm_srli_epi16(v, 11), mask5);
+				const __m128i g = _mm_and_si128(_mm_srli_epi16(v, 6), mask5);
+				const __m128i b = _mm_and_si128(_mm_srli_epi16(v, 1), mask5);
+				const __m128i a = _mm_and_si128(_mm_sub_epi16(_mm_setzero_si128(), _mm_and_si128(v, maskAlpha)), maskByte);
+				const __m128i r8 = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+				const __m128i g8 = _mm_or_si128(_mm_slli_epi16(g, 3), _mm_srli_epi16(g, 2));
+				const __m128i b8 = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+				const __m128i rg = _mm_or_si128(r8, _mm_slli_epi16(g8, 8));
+				const __m128i ba = _mm_or_si128(b8, _mm_slli_epi16(a, 8));
+				_mm_storeu_si128((__m128i *)(dst + x + 0), _mm_unpacklo_epi16(rg, ba));
+				_mm_storeu_si128((__m128i *)(dst + x + 4), _mm_unpackhi_epi16(rg, ba));
+			}
+
+			break;
+		}
+		case RT64_TEXTURE_FORMAT_IA16: {
+			const __m128i maskByte = _mm_set1_epi16(0xFF);
+			for (; (x + 16) <= width; x += 16) {
+				const __m128i v0 = _mm_loadu_si128((const __m128i *)(row + x * 2));
+				const __m128i v1 = _mm_loadu_si128((const __m128i *)(row + x * 2 + 16));
+				const __m128i i = _mm_packus_epi16(_mm_and_si128(v0, maskByte), _mm_and_si128(v1, maskByte));
+				const __m128i a = _mm_packus_epi16(_mm_srli_epi16(v0, 8), _mm_srli_epi16(v1, 8));
+				storeIntensityAlpha(i, a, dst + x);
+			}
+
+			break;
+		}
+		case RT64_TEXTURE_FORMAT_IA8: {
+			const __m128i nibbleMask = _mm_set1_epi8(0x0F);
+			for (; (x + 16) <= width; x += 16) {
+				const __m128i v = _mm_loadu_si128((const __m128i *)(row + x));
+				const __m128i i = expandNibbles(_mm_and_si128(_mm_srli_epi16(v, 4), nibbleMask));
+				const __m128i a = expandNibbles(_mm_and_si128(v, nibbleMask));
+				storeIntensityAlpha(i, a, dst + x);
+			}
+
+			break;
+		}
+		case RT64_TEXTURE_FORMAT_IA4:
+			for (; (x + 32) <= width; x += 32) {
+				__m128i first, second;
+				splitNibbles(_mm_loadu_si128((const __m128i *)(row + x / 2)), first, second);
+				storeIA4(first, dst + x);
+				storeIA4(second, dst + x + 16);
+			}
+
+			break;
+		case RT64_TEXTURE_FORMAT_I8:
+			for (; (x + 16) <= width; x += 16) {
+				const __m128i i = _mm_loadu_si128((const __m128i *)(row + x));
+				storeIntensityAlpha(i, i, dst + x);
+			}
+
+			break;
+		case RT64_TEXTURE_FORMAT_I4:
+			for (; (x + 32) <= width; x += 32) {
+				__m128i first, second;
+				splitNibbles(_mm_loadu_si128((const __m128i *)(row + x / 2)), first, second);
+				first = expandNibbles(first);
+				second = expandNibbles(second);
+				storeIntensityAlpha(first, first, dst + x);
+				storeIntensityAlpha(second, second, dst + x + 16);
+			}
+
+			break;
+		default:
+			break;
+		}
+
+		return x;
+	}
+#endif
+};
+
+// Private
+
+bool RT64::TextureDecoder::isFormatSupported(int format) {
+	return (format >= RT64_TEXTURE_FORMAT_RGBA32) && (format <= RT64_TEXTURE_FORMAT_CI8);
+}
+
+bool RT64::TextureDecoder::isPaletteFormat(int format) {
+	return (format == RT64_TEXTURE_FORMAT_CI4) || (format == RT64_TEXTURE_FORMAT_CI8);
+}
+
+int RT64::TextureDecoder::getPaletteSize(int format) {
+	switch (format) {
+	case RT64_TEXTURE_FORMAT_CI4:
+		return 16;
+	case RT64_TEXTURE_FORMAT_CI8:
+		return 256;
+	default:
+		return 0;
+	}
+}
+
+void RT64::TextureDecoder::decode(const void *bytes, int width, int height, int rowPitch, int format, const void *tlut, int tlutFormat, std::vector<uint8_t> &output) {
+	assert(bytes != nullptr);
+	assert(isFormatSupported(format));
+	assert(!isPaletteFormat(format) || (tlut != nullptr));
+
+	// The palette is converted once, so the pixels only need a table lookup.
+	uint32_t palette[256] = {};
+	const int paletteSize = getPaletteSize(format);
+	const uint8_t *tlutBytes = reinterpret_cast<const uint8_t *>(tlut);
+	for (int i = 0; i < paletteSize; i++) {
+		const uint16_t entry = readBE16(&tlutBytes[i * 2]);
+		palette[i] = (tlutFormat == RT64_TEXTURE_TLUT_IA16) ? decodeIA16(entry) : decodeRGBA16(entry);
+	}
+
+	// Every CI4 byte holds two pixels, so its lookup table returns both of them at once.
+	uint64_t palettePairs[256];
+	if (format == RT64_TEXTURE_FORMAT_CI4) {
+		for (int i = 0; i < 256; i++) {
+			palettePairs[i] = (uint64_t)(palette[i >> 4]) | ((uint64_t)(palette[i & 0xF]) << 32);
+		}
+	}
+
+	output.resize((size_t)(width) * height * 4);
+	const uint8_t *srcBytes = reinterpret_cast<const uint8_t *>(bytes);
+	for (int y = 0; y < height; y++) {
+		const uint8_t *row = srcBytes + (size_t)(y) * rowPitch;
+		uint32_t *dst = reinterpret_cast<uint32_t *>(&output[(size_t)(y) * width * 4]);
+		int x = 0;
+		if (format == RT64_TEXTURE_FORMAT_RGBA32) {
+			memcpy(dst, row, (size_t)(width) * 4);
+			continue;
+		}
+		else if (format == RT64_TEXTURE_FORMAT_CI4) {
+			for (; (x + 2) <= width; x += 2) {
+				memcpy(&dst[x], &palettePairs[row[x >> 1]], sizeof(uint64_t));
+			}
+		}
+		else if (format == RT64_TEXTURE_FORMAT_CI8) {
+			for (; x < width; x++) {
+				dst[x] = palette[row[x]];
+			}
+		}
+#ifdef RT64_TEXTURE_DECODER_SSE2
+		else {
+			x = decodeRowSSE2(format, row, width, dst);
+		}
+#endif
+
+		for (; x < width; x++) {
+			dst[x] = decodeTexel(format, row, x, palette);
+		}
+	}
+}
+
+#endif
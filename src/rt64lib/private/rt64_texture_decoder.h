@@ -0,0 +1,22 @@
+//
+// RT64
+//
+
+#pragma once
+
+#include "rt64_common.h"
+
+namespace RT64 {
+	// Converts the native texture formats of the N64 to RGBA8. The source rows are in the big endian layout used by
+	// the console, and the palette of the CI formats is read from the TLUT with the given format.
+	class TextureDecoder {
+	public:
+		static bool isFormatSupported(int format);
+		static bool isPaletteFormat(int format);
+
+		// Amount of palette entries read from the TLUT, or 0 if the format doesn't use one.
+		static int getPaletteSize(int format);
+
+		static void decode(const void *bytes, int width, int height, int rowPitch, int format, const void *tlut, int tlutFormat, std::vector<uint8_t> &output);
+	};
+};
@@ -0,0 +1,271 @@
+//
+// RT64
+//
+
+#ifndef RT64_MINIMAL
+
+#include "rt64_texture_pack.h"
+
+#include <algorithm>
+
+#include "rt64_device.h"
+#include "rt64_texture.h"
+#include "rt64_workers.h"
+
+#include "utf8conv/utf8conv.h"
+
+// Private
+
+RT64::TexturePack::TexturePack(Device *device) {
+	assert(device != nullptr);
+	this->device = device;
+	fileHandle = INVALID_HANDLE_VALUE;
+	mappingHandle = nullptr;
+	mappedData = nullptr;
+	entries = nullptr;
+	entryCount = 0;
+	activeJob = nullptr;
+	stopping = false;
+	replacementCount = 0;
+}
+
+RT64::TexturePack::~TexturePack() {
+	unload();
+}
+
+const RT64::TexturePack::FileEntry *RT64::TexturePack::findEntry(uint64_t hash, int width, int height) const {
+	const FileEntry *entriesEnd = entries + entryCount;
+	const FileEntry *it = std::lower_bound(entries, entriesEnd, hash, [](const FileEntry &entry, uint64_t hash) {
+		return entry.hash < hash;
+	});
+
+	// Different layouts of the same pixels share the hash, so every entry with it must be checked.
+	for (; (it != entriesEnd) && (it->hash == hash); it++) {
+		if ((it->width == (uint32_t)(width)) && (it->height == (uint32_t)(height))) {
+			return it;
+		}
+	}
+
+	return nullptr;
+}
+
+std::string RT64::TexturePack::validate(uint64_t fileSize) const {
+	if (fileSize < sizeof(FileHeader)) {
+		return "The file is too small.";
+	}
+
+	const FileHeader *header = reinterpret_cast<const FileHeader *>(mappedData);
+	if (header->magic != Magic) {
+		return "The file is not a texture pack.";
+	}
+
+	if (header->version != Version) {
+		return "Version " + std::to_string(header->version) + " is not supported.";
+	}
+
+	if ((uint64_t)(header->entryCount) * sizeof(FileEntry) > (fileSize - sizeof(FileHeader))) {
+		return "The index doesn't fit in the file.";
+	}
+
+	// Only the index is checked, so loading a pack doesn't depend on the size of the pixels it holds.
+	const FileEntry *fileEntries = reinterpret_cast<const FileEntry *>(mappedData + sizeof(FileHeader));
+	for (uint32_t i = 0; i < header->entryCount; i++) {
+		const FileEntry &entry = fileEntries[i];
+		if ((i > 0) && (fileEntries[i - 1].hash > entry.hash)) {
+			return "The index is not sorted by hash.";
+		}
+
+		const uint64_t pixelSize = (uint64_t)(entry.replacementWidth) * entry.replacementHeight * 4;
+		if ((entry.replacementWidth == 0) || (entry.replacementHeight == 0) || (entry.offset > fileSize) || (pixelSize > (fileSize - entry.offset))) {
+			return "Entry " + std::to_string(i) + " is out of bounds.";
+		}
+	}
+
+	return std::string();
+}
+
+void RT64::TexturePack::loaderLoop() {
+	// The mip chains are generated on this thread alone, so the loader never waits for the pool of the device.
+	WorkerPool loaderPool(1);
+	std::unique_lock<std::mutex> lock(jobMutex);
+	while (true) {
+		jobCondition.wait(lock, [this]() { return stopping || !pendingJobs.empty(); });
+		if (stopping) {
+			return;
+		}
+
+		Job *job = pendingJobs.front();
+		pendingJobs.pop_front();
+		activeJob = job;
+		lock.unlock();
+
+		// Reading the pixels is what pages the replacement in from the mapping.
+		const FileEntry *entry = job->entry;
+		job->mipChain.generate(mappedData + entry->offset, (int)(entry->replacementWidth), (int)(entry->replacementHeight), MipChain::Filter::Kaiser, &loaderPool);
+
+		lock.lock();
+		activeJob = nullptr;
+		if (job->texture != nullptr) {
+			finishedJobs.push_back(job);
+		}
+		else {
+			delete job;
+		}
+	}
+}
+
+void RT64::TexturePack::load(const std::string &path) {
+	unload();
+
+	fileHandle = CreateFileW(win32::Utf8ToUtf16(path).c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		throw std::runtime_error("Unable to open the texture pack " + path + ".");
+	}
+
+	LARGE_INTEGER fileSize = {};
+	GetFileSizeEx(fileHandle, &fileSize);
+	mappingHandle = CreateFileMappingW(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mappingHandle != nullptr) {
+		mappedData = reinterpret_cast<const uint8_t *>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+	}
+
+	if (mappedData == nullptr) {
+		unload();
+		throw std::runtime_error("Unable to map the texture pack " + path + ".");
+	}
+
+	const std::string error = validate((uint64_t)(fileSize.QuadPart));
+	if (!error.empty()) {
+		unload();
+		throw std::runtime_error("Invalid texture pack " + path + ". " + error);
+	}
+
+	entryCount = reinterpret_cast<const FileHeader *>(mappedData)->entryCount;
+	entries = reinterpret_cast<const FileEntry *>(mappedData + sizeof(FileHeader));
+	stopping = false;
+	loaderThread = std::thread(&TexturePack::loaderLoop, this);
+}
+
+void RT64::TexturePack::unload() {
+	if (loaderThread.joinable()) {
+		{
+			std::unique_lock<std::mutex> lock(jobMutex);
+			stopping = true;
+		}
+
+		jobCondition.notify_one();
+		loaderThread.join();
+	}
+
+	// The textures keep their original pixels if their replacements didn't finish loading.
+	for (Job *job : pendingJobs) {
+		delete job;
+	}
+
+	for (Job *job : finishedJobs) {
+		delete job;
+	}
+
+	pendingJobs.clear();
+	finishedJobs.clear();
+
+	if (mappedData != nullptr) {
+		UnmapViewOfFile(mappedData);
+		mappedData = nullptr;
+	}
+
+	if (mappingHandle != nullptr) {
+		CloseHandle(mappingHandle);
+		mappingHandle = nullptr;
+	}
+
+	if (fileHandle != INVALID_HANDLE_VALUE) {
+		CloseHandle(fileHandle);
+		fileHandle = INVALID_HANDLE_VALUE;
+	}
+
+	entries = nullptr;
+	entryCount = 0;
+}
+
+bool RT64::TexturePack::isLoaded() const {
+	return (entries != nullptr);
+}
+
+bool RT64::TexturePack::queueReplacement(Texture *texture, uint64_t hash, int width, int height) {
+	assert(texture != nullptr);
+	if (!isLoaded()) {
+		return false;
+	}
+
+	const FileEntry *entry = findEntry(hash, width, height);
+	if (entry == nullptr) {
+		return false;
+	}
+
+	Job *job = new Job();
+	job->texture = texture;
+	job->entry = entry;
+
+	{
+		std::unique_lock<std::mutex> lock(jobMutex);
+		pendingJobs.push_back(job);
+	}
+
+	jobCondition.notify_one();
+	return true;
+}
+
+void RT64::TexturePack::cancel(Texture *texture) {
+	assert(texture != nullptr);
+	if (!isLoaded()) {
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(jobMutex);
+	auto removeJobs = [texture](Job *job) {
+		if (job->texture == texture) {
+			delete job;
+			return true;
+		}
+
+		return false;
+	};
+
+	pendingJobs.erase(std::remove_if(pendingJobs.begin(), pendingJobs.end(), removeJobs), pendingJobs.end());
+	finishedJobs.erase(std::remove_if(finishedJobs.begin(), finishedJobs.end(), removeJobs), finishedJobs.end());
+
+	// The job being loaded is discarded by the loader once it's done with it.
+	if ((activeJob != nullptr) && (activeJob->texture == texture)) {
+		activeJob->texture = nullptr;
+	}
+}
+
+void RT64::TexturePack::update() {
+	std::vector<Job *> readyJobs;
+	{
+		std::unique_lock<std::mutex> lock(jobMutex);
+		readyJobs.swap(finishedJobs);
+	}
+
+	for (Job *job : readyJobs) {
+		job->texture->setMipChain(job->mipChain);
+		replacementCount++;
+		delete job;
+	}
+}
+
+unsigned int RT64::TexturePack::getEntryCount() const {
+	return entryCount;
+}
+
+unsigned int RT64::TexturePack::getPendingCount() {
+	std::unique_lock<std::mutex> lock(jobMutex);
+	return (unsigned int)(pendingJobs.size() + finishedJobs.size() + ((activeJob != nullptr) ? 1 : 0));
+}
+
+unsigned int RT64::TexturePack::getReplacementCount() const {
+	return replacementCount;
+}
+
+#endif
@@ -0,0 +1,93 @@
+//
+// RT64
+//
+
+#pragma once
+
+#include "rt64_common.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "rt64_mipmaps.h"
+
+namespace RT64 {
+	class Device;
+	class Texture;
+
+	// Replacements for the textures created by the host, looked up by the hash of their original pixels. A pack is a
+	// single file mapped into memory: a header, the index of the entries sorted by hash and the RGBA8 pixels of every
+	// replacement. Loading a pack only validates its index, and the pixels are read straight from the mapping by a
+	// background thread that also generates their mip chain. Textures keep their original pixels until the
+	// replacement is ready, and the replacements that finished loading are applied at the start of every frame.
+	class TexturePack {
+	public:
+		static const uint32_t Magic = 0x4B505452;
+		static const uint32_t Version = 1;
+
+		struct FileHeader {
+			uint32_t magic;
+			uint32_t version;
+			uint32_t entryCount;
+			uint32_t reserved;
+		};
+
+		// The hash is the XXH64 of the original RGBA8 pixels with a seed of zero, the same one the texture cache uses.
+		// Textures created from N64 formats are hashed after decoding them. The offset of the pixels is relative to
+		// the start of the file, and the rows of the replacement are tightly packed.
+		struct FileEntry {
+			uint64_t hash;
+			uint32_t width;
+			uint32_t height;
+			uint32_t replacementWidth;
+			uint32_t replacementHeight;
+			uint64_t offset;
+		};
+	private:
+		struct Job {
+			Texture *texture;
+			const FileEntry *entry;
+			MipChain mipChain;
+		};
+
+		Device *device;
+		HANDLE fileHandle;
+		HANDLE mappingHandle;
+		const uint8_t *mappedData;
+		const FileEntry *entries;
+		uint32_t entryCount;
+		std::thread loaderThread;
+		std::mutex jobMutex;
+		std::condition_variable jobCondition;
+		std::deque<Job *> pendingJobs;
+		std::vector<Job *> finishedJobs;
+		Job *activeJob;
+		bool stopping;
+		unsigned int replacementCount;
+
+		const FileEntry *findEntry(uint64_t hash, int width, int height) const;
+		std::string validate(uint64_t fileSize) const;
+		void loaderLoop();
+	public:
+		TexturePack(Device *device);
+		virtual ~TexturePack();
+		void load(const std::string &path);
+		void unload();
+		bool isLoaded() const;
+
+		// Queues the replacement of the texture if the pack has one for its pixels.
+		bool queueReplacement(Texture *texture, uint64_t hash, int width, int height);
+
+		// Drops the replacement queued for the texture, if any.
+		void cancel(Texture *texture);
+
+		// Replaces the textures whose replacements finished loading.
+		void update();
+
+		unsigned int getEntryCount() const;
+		unsigned int getPendingCount();
+		unsigned int getReplacementCount() const;
+	};
+};
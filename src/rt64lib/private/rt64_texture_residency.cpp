@@ -0,0 +1,120 @@
+//
+// RT64
+//
+
+#ifndef RT64_MINIMAL
+
+#include "rt64_texture_residency.h"
+
+#include <algorithm>
+
+#include "rt64_device.h"
+#include "rt64_texture.h"
+
+// Private
+
+RT64::TextureResidency::TextureResidency(Device *device) {
+	assert(device != nullptr);
+	this->device = device;
+	budget = 0;
+	frameIndex = 0;
+	evictionCount = 0;
+	restoreCount = 0;
+}
+
+RT64::TextureResidency::~TextureResidency() { }
+
+void RT64::TextureResidency::addTexture(Texture *texture) {
+	assert(texture != nullptr);
+	texture->setLastUsedFrame(frameIndex);
+	textures.push_back(texture);
+}
+
+void RT64::TextureResidency::removeTexture(Texture *texture) {
+	assert(texture != nullptr);
+	textures.erase(std::remove(textures.begin(), textures.end(), texture), textures.end());
+}
+
+void RT64::TextureResidency::touch(Texture *texture) {
+	if (texture != nullptr) {
+		texture->setLastUsedFrame(frameIndex);
+	}
+}
+
+void RT64::TextureResidency::update() {
+	// Restore the evicted textures that were used during this frame.
+	UINT64 residentSize = 0;
+	for (Texture *texture : textures) {
+		if (texture->isEvicted() && (texture->getLastUsedFrame() == frameIndex)) {
+			texture->restore();
+			restoreCount++;
+		}
+
+		residentSize += texture->getResidentSize();
+	}
+
+	// Evict the least recently used textures until the budget is met. The textures used during this frame are
+	// never evicted, so the budget can be exceeded if a single frame needs more than that.
+	if ((budget > 0) && (residentSize > budget)) {
+		std::vector<Texture *> candidates;
+		for (Texture *texture : textures) {
+			if (texture->canEvict() && (texture->getLastUsedFrame() < frameIndex)) {
+				candidates.push_back(texture);
+			}
+		}
+
+		std::sort(candidates.begin(), candidates.end(), [](const Texture *a, const Texture *b) {
+			return a->getLastUsedFrame() < b->getLastUsedFrame();
+		});
+
+		for (Texture *texture : candidates) {
+			if (residentSize <= budget) {
+				break;
+			}
+
+			residentSize -= texture->getResidentSize();
+			texture->evict();
+			evictionCount++;
+		}
+	}
+
+	frameIndex++;
+}
+
+void RT64::TextureResidency::setBudget(UINT64 budget) {
+	this->budget = budget;
+}
+
+UINT64 RT64::TextureResidency::getBudget() const {
+	return budget;
+}
+
+UINT64 RT64::TextureResidency::getResidentSize() const {
+	UINT64 residentSize = 0;
+	for (const Texture *texture : textures) {
+		residentSize += texture->getResidentSize();
+	}
+
+	return residentSize;
+}
+
+unsigned int RT64::TextureResidency::getEvictedCount() const {
+	unsigned int evictedCount = 0;
+	for (const Texture *texture : textures) {
+		if (texture->isEvicted()) {
+			evictedCount++;
+		}
+	}
+
+	return evictedCount;
+}
+
+unsigned int RT64::TextureResidency::getEvictionCount() const {
+	return evictionCount;
+}
+
+unsigned int RT64::TextureResidency::getRestoreCount() const {
+	return restoreCount;
+}
+
+#endif
@@ -0,0 +1,45 @@
+//
+// RT64
+//
+
+#pragma once
+
+#include "rt64_common.h"
+
+namespace RT64 {
+	class Device;
+	class Texture;
+
+	// Keeps the textures with resources of their own under a memory budget. Views mark the textures their instances
+	// use every frame, and once the frame is done the least recently used ones are evicted until the budget is met.
+	// Evicted textures keep a small copy of their lowest levels on the GPU, so an instance that uses them again
+	// samples that copy for a frame while the texture is restored.
+	class TextureResidency {
+	private:
+		Device *device;
+		std::vector<Texture *> textures;
+		UINT64 budget;
+		uint64_t frameIndex;
+		unsigned int evictionCount;
+		unsigned int restoreCount;
+	public:
+		TextureResidency(Device *device);
+		virtual ~TextureResidency();
+		void addTexture(Texture *texture);
+		void removeTexture(Texture *texture);
+		void touch(Texture *texture);
+
+		// Restores the textures that were used during the frame and evicts the others if the budget is exceeded.
+		// Must be called once the frame is submitted. Evicted resources are retired until the frames in flight are done.
+		void update();
+
+		// Budget in bytes. Zero disables the eviction.
+		void setBudget(UINT64 budget);
+		UINT64 getBudget() const;
+
+		UINT64 getResidentSize() const;
+		unsigned int getEvictedCount() const;
+		unsigned int getEvictionCount() const;
+		unsigned int getRestoreCount() const;
+	};
+};
@@ -0,0 +1,175 @@
+//
+// RT64
+//
+
+#ifndef RT64_MINIMAL
+
+#include "rt64_texture_table.h"
+
+#include <algorithm>
+
+#include "rt64_device.h"
+#include "rt64_texture.h"
+
+namespace {
+	const uint32_t MinCapacity = 256;
+};
+
+// Private
+
+RT64::TextureTable::TextureTable(Device *device) {
+	assert(device != nullptr);
+	this->device = device;
+	descriptorHeap = nullptr;
+	descriptorSize = device->getD3D12Device()->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+	capacity = 0;
+	grow(MinCapacity);
+}
+
+RT64::TextureTable::~TextureTable() {
+	if (descriptorHeap != nullptr) {
+		descriptorHeap->Release();
+	}
+}
+
+D3D12_CPU_DESCRIPTOR_HANDLE RT64::TextureTable::getDescriptorHandle(uint32_t slot) const {
+	D3D12_CPU_DESCRIPTOR_HANDLE handle = descriptorHeap->GetCPUDescriptorHandleForHeapStart();
+	handle.ptr += (SIZE_T)(slot) * descriptorSize;
+	return handle;
+}
+
+void RT64::TextureTable::writeDescriptor(uint32_t slot) {
+	// Free slots get a null descriptor so stale indices sample black instead of a released resource.
+	D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
+	srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+	srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+	srvDesc.Texture2D.MostDetailedMip = 0;
+	srvDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+	srvDesc.Texture2D.MipLevels = 1;
+
+	ID3D12Resource *resource = (textures[slot] != nullptr) ? textures[slot]->getTexture() : nullptr;
+	if (resource != nullptr) {
+		const D3D12_RESOURCE_DESC resourceDesc = resource->GetDesc();
+		srvDesc.Format = resourceDesc.Format;
+		srvDesc.Texture2D.MipLevels = resourceDesc.MipLevels;
+	}
+
+	device->getD3D12Device()->CreateShaderResourceView(resource, &srvDesc, getDescriptorHandle(slot));
+	markSlotDirty(slot);
+}
+
+void RT64::TextureTable::markSlotDirty(uint32_t slot) {
+	for (UINT i = 0; i < FrameScheduler::FramesInFlight; i++) {
+		if (!dirtySlotFlags[i][slot]) {
+			dirtySlotFlags[i][slot] = true;
+			dirtySlots[i].push_back(slot);
+		}
+	}
+}
+
+void RT64::TextureTable::grow(uint32_t minCapacity) {
+	uint32_t newCapacity = std::max(capacity, MinCapacity);
+	while (newCapacity < minCapacity) {
+		newCapacity *= 2;
+	}
+
+	ID3D12Device8 *d3dDevice = device->getD3D12Device();
+	ID3D12DescriptorHeap *newHeap = nv_helpers_dx12::CreateDescriptorHeap(d3dDevice, newCapacity, D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV, false);
+	if (descriptorHeap != nullptr) {
+		const uint32_t slotCount = getSlotCount();
+		if (slotCount > 0) {
+			d3dDevice->CopyDescriptorsSimple(slotCount, newHeap->GetCPUDescriptorHandleForHeapStart(), descriptorHeap->GetCPUDescriptorHandleForHeapStart(), D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+		}
+
+		descriptorHeap->Release();
+	}
+
+	descriptorHeap = newHeap;
+	capacity = newCapacity;
+}
+
+uint32_t RT64::TextureTable::addTexture(Texture *texture) {
+	assert(texture != nullptr);
+
+	uint32_t slot;
+	if (!freeSlots.empty()) {
+		slot = freeSlots.back();
+		freeSlots.pop_back();
+		textures[slot] = texture;
+	}
+	else {
+		slot = (uint32_t)(textures.size());
+		if (slot >= capacity) {
+			grow(slot + 1);
+		}
+
+		textures.push_back(texture);
+		for (std::vector<bool> &frameDirtySlotFlags : dirtySlotFlags) {
+			frameDirtySlotFlags.push_back(false);
+		}
+	}
+
+	writeDescriptor(slot);
+	return slot;
+}
+
+void RT64::TextureTable::removeTexture(uint32_t slot) {
+	assert(slot < textures.size());
+	assert(textures[slot] != nullptr);
+	textures[slot] = nullptr;
+	freeSlots.push_back(slot);
+	writeDescriptor(slot);
+}
+
+void RT64::TextureTable::updateTexture(uint32_t slot) {
+	assert(slot < textures.size());
+	assert(textures[slot] != nullptr);
+	writeDescriptor(slot);
+}
+
+void RT64::TextureTable::copyAllDescriptors(ID3D12DescriptorHeap *dstHeap, uint32_t dstOffset) const {
+	assert(dstHeap != nullptr);
+	const uint32_t slotCount = getSlotCount();
+	if (slotCount == 0) {
+		return;
+	}
+
+	D3D12_CPU_DESCRIPTOR_HANDLE dstHandle = dstHeap->GetCPUDescriptorHandleForHeapStart();
+	dstHandle.ptr += (SIZE_T)(dstOffset) * descriptorSize;
+	device->getD3D12Device()->CopyDescriptorsSimple(slotCount, dstHandle, descriptorHeap->GetCPUDescriptorHandleForHeapStart(), D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+}
+
+void RT64::TextureTable::copyDirtyDescriptors(ID3D12DescriptorHeap *dstHeap, uint32_t dstOffset, UINT frameSlot) const {
+	assert(dstHeap != nullptr);
+	assert(frameSlot < FrameScheduler::FramesInFlight);
+	const D3D12_CPU_DESCRIPTOR_HANDLE dstStart = dstHeap->GetCPUDescriptorHandleForHeapStart();
+	for (uint32_t slot : dirtySlots[frameSlot]) {
+		D3D12_CPU_DESCRIPTOR_HANDLE dstHandle = dstStart;
+		dstHandle.ptr += (SIZE_T)(dstOffset + slot) * descriptorSize;
+		device->getD3D12Device()->CopyDescriptorsSimple(1, dstHandle, getDescriptorHandle(slot), D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+	}
+}
+
+void RT64::TextureTable::clearDirtySlots(UINT frameSlot) {
+	assert(frameSlot < FrameScheduler::FramesInFlight);
+	for (uint32_t slot : dirtySlots[frameSlot]) {
+		dirtySlotFlags[frameSlot][slot] = false;
+	}
+
+	dirtySlots[frameSlot].clear();
+}
+
+bool RT64::TextureTable::hasDirtySlots(UINT frameSlot) const {
+	assert(frameSlot < FrameScheduler::FramesInFlight);
+	return !dirtySlots[frameSlot].empty();
+}
+
+uint32_t RT64::TextureTable::getCapacity() const {
+	return capacity;
+}
+
+uint32_t RT64::TextureTable::getSlotCount() const {
+	return (uint32_t)(textures.size());
+}
+
+#endif
@@ -0,0 +1,58 @@
+//
+// RT64
+//
+
+#pragma once
+
+#include "rt64_common.h"
+#include "rt64_frame_scheduler.h"
+
+namespace RT64 {
+	class Device;
+	class Texture;
+
+	// Bindless table with the descriptors of every texture created on a device. Textures keep the same slot for
+	// their whole lifetime and freed slots are reused, so materials can refer to them by index directly. The
+	// descriptors live in a CPU only heap that grows geometrically, and views copy them into their own shader
+	// visible heaps. Each frame slot has its own copies of those heaps, so the slots that changed are tracked per
+	// frame slot, and only those need to be copied again when the frame slot is recorded.
+	class TextureTable {
+	private:
+		Device *device;
+		ID3D12DescriptorHeap *descriptorHeap;
+		UINT descriptorSize;
+		uint32_t capacity;
+		std::vector<Texture *> textures;
+		std::vector<uint32_t> freeSlots;
+		std::vector<uint32_t> dirtySlots[FrameScheduler::FramesInFlight];
+		std::vector<bool> dirtySlotFlags[FrameScheduler::FramesInFlight];
+
+		D3D12_CPU_DESCRIPTOR_HANDLE getDescriptorHandle(uint32_t slot) const;
+		void writeDescriptor(uint32_t slot);
+		void markSlotDirty(uint32_t slot);
+		void grow(uint32_t minCapacity);
+	public:
+		TextureTable(Device *device);
+		virtual ~TextureTable();
+		uint32_t addTexture(Texture *texture);
+		void removeTexture(uint32_t slot);
+
+		// Writes the descriptor of the slot again after its texture recreated its resource.
+		void updateTexture(uint32_t slot);
+
+		// Copies every slot into the destination heap, starting at the given offset.
+		void copyAllDescriptors(ID3D12DescriptorHeap *dstHeap, uint32_t dstOffset) const;
+
+		// Copies only the slots that changed since the dirty slots of the frame slot were last cleared.
+		void copyDirtyDescriptors(ID3D12DescriptorHeap *dstHeap, uint32_t dstOffset, UINT frameSlot) const;
+
+		void clearDirtySlots(UINT frameSlot);
+		bool hasDirtySlots(UINT frameSlot) const;
+
+		// Amount of slots the shader visible heaps must have room for.
+		uint32_t getCapacity() const;
+
+		// Amount of slots that are in use or were used at some point, so the slots after it are always empty.
+		uint32_t getSlotCount() const;
+	};
+};
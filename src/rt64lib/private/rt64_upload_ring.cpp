@@ -0,0 +1,196 @@
+//
+// RT64
+//
+
+#ifndef RT64_MINIMAL
+
+#include "rt64_upload_ring.h"
+
+#include "rt64_copy_queue.h"
+#include "rt64_device.h"
+
+namespace {
+	inline UINT64 alignUp(UINT64 value, UINT64 alignment) {
+		return ((value + alignment - 1) / alignment) * alignment;
+	}
+};
+
+// Private
+
+RT64::UploadRing::UploadRing(Device *device, UINT64 size) {
+	assert(device != nullptr);
+	assert((size % D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT) == 0);
+
+	this->device = device;
+	this->size = size;
+	head = 0;
+	tail = 0;
+	dedicatedSize = 0;
+	peakSize = 0;
+	flushCount = 0;
+
+	// The buffer stays mapped for its whole lifetime, which is allowed for upload heaps.
+	buffer = device->allocateBuffer(D3D12_HEAP_TYPE_UPLOAD, size, D3D12_RESOURCE_FLAG_NONE, D3D12_RESOURCE_STATE_GENERIC_READ);
+	CD3DX12_RANGE readRange(0, 0);
+	D3D12_CHECK(buffer.Get()->Map(0, &readRange, reinterpret_cast<void **>(&mappedData)));
+}
+
+RT64::UploadRing::~UploadRing() {
+	buffer.Get()->Unmap(0, nullptr);
+	buffer.Release();
+
+	for (DedicatedBuffer &dedicatedBuffer : dedicatedBuffers) {
+		dedicatedBuffer.buffer.Release();
+	}
+}
+
+RT64::UploadRing::Allocation RT64::UploadRing::allocateDedicated(UINT64 allocationSize) {
+	DedicatedBuffer dedicatedBuffer;
+	dedicatedBuffer.buffer = device->allocateBuffer(D3D12_HEAP_TYPE_UPLOAD, allocationSize, D3D12_RESOURCE_FLAG_NONE, D3D12_RESOURCE_STATE_GENERIC_READ);
+	dedicatedBuffer.size = allocationSize;
+	dedicatedBuffer.fenceValue = 0;
+	dedicatedBuffers.push_back(dedicatedBuffer);
+	dedicatedSize += allocationSize;
+	peakSize = std::max(peakSize, getUsedSize());
+
+	// Dedicated buffers are only written once, so they're never unmapped.
+	Allocation allocation;
+	CD3DX12_RANGE readRange(0, 0);
+	allocation.resource = dedicatedBuffer.buffer.Get();
+	allocation.offset = 0;
+	D3D12_CHECK(allocation.resource->Map(0, &readRange, reinterpret_cast<void **>(&allocation.data)));
+	return allocation;
+}
+
+void RT64::UploadRing::makeRoom() {
+	// Waiting for the copy queue reclaims every allocation that was already submitted. If there are none, the space
+	// is used by the copies that are still being recorded, which are submitted first. The frames keep running on
+	// the direct queue in the meantime.
+	if (batches.empty()) {
+		flushCount++;
+	}
+
+	device->waitForCopies();
+}
+
+RT64::UploadRing::Allocation RT64::UploadRing::allocate(UINT64 allocationSize, UINT64 alignment) {
+	assert(allocationSize > 0);
+	assert((alignment > 0) && ((size % alignment) == 0));
+
+	if (allocationSize > size) {
+		return allocateDedicated(allocationSize);
+	}
+
+	for (;;) {
+		// Start from the beginning of the buffer when nothing is in use, so an allocation never waits for an empty ring.
+		if ((head == tail) && batches.empty()) {
+			head = 0;
+			tail = 0;
+		}
+
+		// Allocations can't cross the end of the buffer, so they skip to the next lap instead.
+		UINT64 begin = alignUp(head, alignment);
+		if (((begin % size) + allocationSize) > size) {
+			begin = alignUp(head, size);
+		}
+
+		if ((begin + allocationSize - tail) <= size) {
+			head = begin + allocationSize;
+			peakSize = std::max(peakSize, getUsedSize());
+
+			Allocation allocation;
+			allocation.resource = buffer.Get();
+			allocation.offset = begin % size;
+			allocation.data = mappedData + allocation.offset;
+			return allocation;
+		}
+
+		makeRoom();
+	}
+}
+
+void RT64::UploadRing::copyBuffer(ID3D12Resource *destination, const void *bytes, UINT64 byteCount) {
+	assert(destination != nullptr);
+	assert(bytes != nullptr);
+
+	Allocation allocation = allocate(byteCount, D3D12_RAW_UAV_SRV_BYTE_ALIGNMENT);
+	memcpy(allocation.data, bytes, byteCount);
+	device->getCopyQueue()->recordCommands()->CopyBufferRegion(destination, 0, allocation.resource, allocation.offset, byteCount);
+}
+
+void RT64::UploadRing::copyTextureRows(ID3D12Resource *destination, UINT subresource, UINT x, UINT y, DXGI_FORMAT format, UINT width, UINT height, const uint8_t *bytes, size_t srcRowPitch, size_t rowSize, UINT rowCount) {
+	assert(destination != nullptr);
+	assert(bytes != nullptr);
+
+	const UINT rowPitch = (UINT)(alignUp(rowSize, D3D12_TEXTURE_DATA_PITCH_ALIGNMENT));
+	Allocation allocation = allocate((UINT64)(rowPitch) * rowCount, D3D12_TEXTURE_DATA_PLACEMENT_ALIGNMENT);
+	for (UINT row = 0; row < rowCount; row++) {
+		memcpy(allocation.data + (size_t)(row) * rowPitch, bytes + row * srcRowPitch, rowSize);
+	}
+
+	D3D12_TEXTURE_COPY_LOCATION source = {};
+	source.pResource = allocation.resource;
+	source.PlacedFootprint.Offset = allocation.offset;
+	source.PlacedFootprint.Footprint.Format = format;
+	source.PlacedFootprint.Footprint.Width = width;
+	source.PlacedFootprint.Footprint.Height = height;
+	source.PlacedFootprint.Footprint.Depth = 1;
+	source.PlacedFootprint.Footprint.RowPitch = rowPitch;
+	source.Type = D3D12_TEXTURE_COPY_TYPE_PLACED_FOOTPRINT;
+
+	D3D12_TEXTURE_COPY_LOCATION target = {};
+	target.pResource = destination;
+	target.SubresourceIndex = subresource;
+	target.Type = D3D12_TEXTURE_COPY_TYPE_SUBRESOURCE_INDEX;
+	device->getCopyQueue()->recordCommands()->CopyTextureRegion(&target, x, y, 0, &source, nullptr);
+}
+
+void RT64::UploadRing::retire(UINT64 fenceValue) {
+	const UINT64 batchBegin = batches.empty() ? tail : batches.back().end;
+	if (head > batchBegin) {
+		batches.push_back({ head, fenceValue });
+	}
+
+	for (DedicatedBuffer &dedicatedBuffer : dedicatedBuffers) {
+		if (dedicatedBuffer.fenceValue == 0) {
+			dedicatedBuffer.fenceValue = fenceValue;
+		}
+	}
+}
+
+void RT64::UploadRing::reclaim(UINT64 completedFenceValue) {
+	while (!batches.empty() && (batches.front().fenceValue <= completedFenceValue)) {
+		tail = batches.front().end;
+		batches.pop_front();
+	}
+
+	auto it = dedicatedBuffers.begin();
+	while (it != dedicatedBuffers.end()) {
+		if ((it->fenceValue != 0) && (it->fenceValue <= completedFenceValue)) {
+			dedicatedSize -= it->size;
+			it->buffer.Release();
+			it = dedicatedBuffers.erase(it);
+		}
+		else {
+			it++;
+		}
+	}
+}
+
+UINT64 RT64::UploadRing::getSize() const {
+	return size;
+}
+
+UINT64 RT64::UploadRing::getUsedSize() const {
+	return (head - tail) + dedicatedSize;
+}
+
+UINT64 RT64::UploadRing::getPeakSize() const {
+	return peakSize;
+}
+
+unsigned int RT64::UploadRing::getFlushCount() const {
+	return flushCount;
+}
+
+#endif
@@ -0,0 +1,81 @@
+//
+// RT64
+//
+
+#pragma once
+
+#include "rt64_common.h"
+
+#include <deque>
+
+namespace RT64 {
+	class Device;
+
+	// Persistently mapped upload buffer that every buffer and texture upload sub-allocates its staging memory from.
+	// The copies are recorded on the copy queue. The allocations made between two submissions of the queue are
+	// tagged with the fence value that follows them, and their space is reclaimed once the copy queue reaches it.
+	// When the ring runs out of space the pending copies are submitted and waited on. Uploads that are larger than
+	// the whole ring get a buffer of their own that is released the same way.
+	class UploadRing {
+	public:
+		struct Allocation {
+			ID3D12Resource *resource;
+			UINT64 offset;
+			UINT8 *data;
+		};
+
+		static const UINT64 DefaultSize = 32 * 1024 * 1024;
+	private:
+		struct Batch {
+			UINT64 end;
+			UINT64 fenceValue;
+		};
+
+		struct DedicatedBuffer {
+			AllocatedResource buffer;
+			UINT64 size;
+			UINT64 fenceValue;
+		};
+
+		Device *device;
+		AllocatedResource buffer;
+		UINT8 *mappedData;
+		UINT64 size;
+
+		// Positions only grow, so the space in use is always the difference between them.
+		UINT64 head;
+		UINT64 tail;
+		std::deque<Batch> batches;
+		std::vector<DedicatedBuffer> dedicatedBuffers;
+		UINT64 dedicatedSize;
+		UINT64 peakSize;
+		unsigned int flushCount;
+
+		Allocation allocateDedicated(UINT64 allocationSize);
+		void makeRoom();
+	public:
+		UploadRing(Device *device, UINT64 size = DefaultSize);
+		virtual ~UploadRing();
+
+		// The memory can be written right away and stays valid until the commands that read it are finished.
+		Allocation allocate(UINT64 allocationSize, UINT64 alignment);
+
+		// Places the data in the ring and records a copy of it to the start of the buffer.
+		void copyBuffer(ID3D12Resource *destination, const void *bytes, UINT64 byteCount);
+
+		// Places rowCount rows of rowSize bytes in the ring and records a copy of them to the subresource, starting
+		// at x and y. Width and height are in texels, and the rows are rows of blocks for compressed formats.
+		void copyTextureRows(ID3D12Resource *destination, UINT subresource, UINT x, UINT y, DXGI_FORMAT format, UINT width, UINT height, const uint8_t *bytes, size_t srcRowPitch, size_t rowSize, UINT rowCount);
+
+		// Tags the allocations made since the last submission with the copy fence value that will be signaled after them.
+		void retire(UINT64 fenceValue);
+
+		// Frees the space of the allocations whose copy fence value was reached.
+		void reclaim(UINT64 completedFenceValue);
+
+		UINT64 getSize() const;
+		UINT64 getUsedSize() const;
+		UINT64 getPeakSize() const;
+		unsigned int getFlushCount() const;
+	};
+};
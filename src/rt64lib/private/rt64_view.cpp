@@ -6,16 +6,23 @@
 
 #include "../public/rt64.h"
 
+#include <algorithm>
+#include <cfloat>
 #include <map>
 #include <set>
+#include <tuple>
 
 #include "rt64_denoiser.h"
 #include "rt64_device.h"
 #include "rt64_instance.h"
 #include "rt64_mesh.h"
+#include "rt64_reference_tracer.h"
 #include "rt64_scene.h"
 #include "rt64_shader.h"
+#include "rt64_shader_table.h"
 #include "rt64_texture.h"
+#include "rt64_texture_residency.h"
+#include "rt64_texture_table.h"
 #include "rt64_view.h"
 
 #include "im3d/im3d.h"
@@ -23,6 +30,45 @@
 
 namespace {
 	const int MaxQueries = 16 + 1;
+
+	// Raster draws are only split across worker threads when every command list gets at least this many of them,
+	// as smaller lists cost more to set up and submit than they save.
+	const size_t MinDrawsPerCommandList = 512;
+
+	int getTextureSlot(const RT64::Texture *texture) {
+		return (texture != nullptr) ? (int)(texture->getSlot()) : -1;
+	}
+
+	RT64_VECTOR4 getTextureScaleOffset(const RT64::Texture *texture) {
+		return (texture != nullptr) ? texture->getScaleOffset() : RT64_VECTOR4{ 1.0f, 1.0f, 0.0f, 0.0f };
+	}
+
+	void setMaterialTextures(RT64_MATERIAL &material, RT64_VECTOR4 texScaleOffsets[3], const RT64::Instance *instance) {
+		material.diffuseTexIndex = getTextureSlot(instance->getDiffuseTexture());
+		material.normalTexIndex = getTextureSlot(instance->getNormalTexture());
+		material.specularTexIndex = getTextureSlot(instance->getSpecularTexture());
+		texScaleOffsets[0] = getTextureScaleOffset(instance->getDiffuseTexture());
+		texScaleOffsets[1] = getTextureScaleOffset(instance->getNormalTexture());
+		texScaleOffsets[2] = getTextureScaleOffset(instance->getSpecularTexture());
+	}
+
+	void storeInstanceTransforms(const XMMATRIX &transform, RT64::InstanceTransforms &dst) {
+		// Store world transform.
+		dst.objectToWorld = transform;
+
+		// Store matrix to transform normal.
+		XMMATRIX upper3x3 = transform;
+		upper3x3.r[0].m128_f32[3] = 0.f;
+		upper3x3.r[1].m128_f32[3] = 0.f;
+		upper3x3.r[2].m128_f32[3] = 0.f;
+		upper3x3.r[3].m128_f32[0] = 0.f;
+		upper3x3.r[3].m128_f32[1] = 0.f;
+		upper3x3.r[3].m128_f32[2] = 0.f;
+		upper3x3.r[3].m128_f32[3] = 1.f;
+
+		XMVECTOR det;
+		dst.objectToWorldNormal = XMMatrixTranspose(XMMatrixInverse(&det, upper3x3));
+	}
 };
 
 // Private
@@ -30,15 +76,13 @@ namespace {
 RT64::View::View(Scene *scene) {
 	assert(scene != nullptr);
 	this->scene = scene;
-	descriptorHeap = nullptr;
-	descriptorHeapEntryCount = 0;
-	composeHeap = nullptr;
-	sbtStorageSize = 0;
-	activeInstancesBufferTransformsSize = 0;
-	activeInstancesBufferMaterialsSize = 0;
+	instancesVersion = 0;
+	descriptorsVersion = 0;
+	shaderTableVersion = 0;
 	viewParamsBufferData.randomSeed = 0;
 	viewParamsBufferData.softLightSamples = 0;
 	viewParamsBufferData.giBounces = 0;
+	viewParamsBufferData.giEnvBounces = 0;
 	viewParamsBufferData.maxLightSamples = 12;
 	viewParamsBufferData.ambGIMixWeight = 0.8f;
 	viewParamsBufferData.frameCount = 0;
@@ -51,11 +95,29 @@ RT64::View::View(Scene *scene) {
 	denoiserEnabled = false;
 	denoiser = nullptr;
 	perspectiveControlActive = false;
-	im3dVertexCount = 0;
-	rtHitInstanceIdReadbackUpdated = false;
+	pickTracer = nullptr;
+	pickTracerDirty = true;
+	instancesDirty = true;
+	topLevelASRebuildCount = 0;
+	topLevelASRefitCount = 0;
+	rasterStats = {};
 	scissorApplied = false;
 	viewportApplied = false;
 
+	for (FrameResources &frame : frames) {
+		frame.descriptorHeap = nullptr;
+		frame.descriptorHeapEntryCount = 0;
+		frame.composeHeap = nullptr;
+		frame.shaderTable = new ShaderTable(scene->getDevice());
+		frame.instanceTransformsSize = 0;
+		frame.instanceMaterialsSize = 0;
+		frame.topLevelASInstanceDescsSize = 0;
+		frame.im3dVertexCount = 0;
+		frame.instancesVersion = 0;
+		frame.descriptorsVersion = 0;
+		frame.shaderTableVersion = 0;
+	}
+
 	createOutputBuffers();
 	createViewParamsBuffer();
 
@@ -63,16 +125,42 @@ RT64::View::View(Scene *scene) {
 }
 
 RT64::View::~View() {
+	// The heaps and shader tables of the frames in flight can't be retired, so they must be finished first.
+	Device *device = scene->getDevice();
+	device->waitForGPU();
+
 	delete denoiser;
+	delete pickTracer;
+
+	for (FrameResources &frame : frames) {
+		if (frame.descriptorHeap != nullptr) {
+			frame.descriptorHeap->Release();
+		}
+
+		if (frame.composeHeap != nullptr) {
+			frame.composeHeap->Release();
+		}
+
+		delete frame.shaderTable;
+		frame.viewParamBufferResource.Release();
+		frame.instanceTransforms.Release();
+		frame.instanceMaterials.Release();
+		frame.topLevelASInstanceDescs.Release();
+		frame.im3dVertexBuffer.Release();
+	}
 
 	scene->removeView(this);
 
 	releaseOutputBuffers();
+	device->retireResource(topLevelASBuffers);
 }
 
 void RT64::View::createOutputBuffers() {
 	releaseOutputBuffers();
 
+	// The descriptors and the rects of the instances depend on the size of the output.
+	instancesDirty = true;
+
 	outputRtvDescriptorSize = scene->getDevice()->getD3D12Device()->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_RTV);
 	int screenWidth = scene->getDevice()->getWidth();
 	int screenHeight = scene->getDevice()->getHeight();
@@ -121,7 +209,6 @@ void RT64::View::createOutputBuffers() {
 	rtHitNormal = scene->getDevice()->allocateBuffer(D3D12_HEAP_TYPE_DEFAULT, hitCountBufferSizeAll * 8, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
 	rtHitSpecular = scene->getDevice()->allocateBuffer(D3D12_HEAP_TYPE_DEFAULT, hitCountBufferSizeAll * 4, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
 	rtHitInstanceId = scene->getDevice()->allocateBuffer(D3D12_HEAP_TYPE_DEFAULT, hitCountBufferSizeAll * 2, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
-	rtHitInstanceIdReadback = scene->getDevice()->allocateBuffer(D3D12_HEAP_TYPE_READBACK, hitCountBufferSizeOne * 2, D3D12_RESOURCE_FLAG_NONE, D3D12_RESOURCE_STATE_COPY_DEST);
 
 	// Create the RTVs for the raster resources.
 	D3D12_DESCRIPTOR_HEAP_DESC rtvHeapDesc = {};
@@ -140,88 +227,109 @@ void RT64::View::createOutputBuffers() {
 }
 
 void RT64::View::releaseOutputBuffers() {
-	rasterBg.Release();
-	rtOutput.Release();
-	rtAlbedo.Release();
-	rtNormal.Release();
-	rtHitDistance.Release();
-	rtHitColor.Release();
-	rtHitNormal.Release();
-	rtHitSpecular.Release();
-	rtHitInstanceId.Release();
-}
-
-void RT64::View::createInstanceTransformsBuffer() {
+	Device *device = scene->getDevice();
+	device->retireResource(rasterBg);
+	device->retireResource(rtOutput);
+	device->retireResource(rtAlbedo);
+	device->retireResource(rtNormal);
+	device->retireResource(rtHitDistance);
+	device->retireResource(rtHitColor);
+	device->retireResource(rtHitNormal);
+	device->retireResource(rtHitSpecular);
+	device->retireResource(rtHitInstanceId);
+}
+
+RT64::View::FrameResources &RT64::View::getFrameResources() {
+	return frames[scene->getDevice()->getFrameSlot()];
+}
+
+bool RT64::View::createInstanceTransformsBuffer(FrameResources &frame) {
 	uint32_t totalInstances = static_cast<uint32_t>(rtInstances.size() + rasterBgInstances.size() + rasterFgInstances.size());
 	uint32_t newBufferSize = ROUND_UP(totalInstances * sizeof(InstanceTransforms), D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT);
-	if (activeInstancesBufferTransformsSize != newBufferSize) {
-		activeInstancesBufferTransforms.Release();
-		activeInstancesBufferTransforms = scene->getDevice()->allocateBuffer(D3D12_HEAP_TYPE_UPLOAD, newBufferSize, D3D12_RESOURCE_FLAG_NONE, D3D12_RESOURCE_STATE_GENERIC_READ);
-		activeInstancesBufferTransformsSize = newBufferSize;
+	if (frame.instanceTransformsSize != newBufferSize) {
+		scene->getDevice()->retireResource(frame.instanceTransforms);
+		frame.instanceTransforms = scene->getDevice()->allocateBuffer(D3D12_HEAP_TYPE_UPLOAD, newBufferSize, D3D12_RESOURCE_FLAG_NONE, D3D12_RESOURCE_STATE_GENERIC_READ);
+		frame.instanceTransformsSize = newBufferSize;
+		return true;
 	}
+
+	return false;
 }
 
-void RT64::View::updateInstanceTransformsBuffer() {
-	InstanceTransforms *current = nullptr;
+void RT64::View::updateInstanceTransformsBuffer(FrameResources &frame, const std::vector<uint32_t> *slots) {
+	InstanceTransforms *transforms = nullptr;
 	CD3DX12_RANGE readRange(0, 0);
 
-	D3D12_CHECK(activeInstancesBufferTransforms.Get()->Map(0, &readRange, reinterpret_cast<void **>(&current)));
-
-	for (const RenderInstance &inst : rtInstances) {
-		// Store world transform.
-		current->objectToWorld = inst.transform;
-
-		// Store matrix to transform normal.
-		XMMATRIX upper3x3 = current->objectToWorld;
-		upper3x3.r[0].m128_f32[3] = 0.f;
-		upper3x3.r[1].m128_f32[3] = 0.f;
-		upper3x3.r[2].m128_f32[3] = 0.f;
-		upper3x3.r[3].m128_f32[0] = 0.f;
-		upper3x3.r[3].m128_f32[1] = 0.f;
-		upper3x3.r[3].m128_f32[2] = 0.f;
-		upper3x3.r[3].m128_f32[3] = 1.f;
+	D3D12_CHECK(frame.instanceTransforms.Get()->Map(0, &readRange, reinterpret_cast<void **>(&transforms)));
 
-		XMVECTOR det;
-		current->objectToWorldNormal = XMMatrixTranspose(XMMatrixInverse(&det, upper3x3));
-
-		current++;
+	// Only the raytraced instances are stored in the transforms buffer.
+	if (slots != nullptr) {
+		for (uint32_t slot : *slots) {
+			if (slot < rtInstances.size()) {
+				storeInstanceTransforms(rtInstances[slot].transform, transforms[slot]);
+			}
+		}
+	}
+	else {
+		for (const RenderInstance &inst : rtInstances) {
+			storeInstanceTransforms(inst.transform, *transforms);
+			transforms++;
+		}
 	}
 
-	activeInstancesBufferTransforms.Get()->Unmap(0, nullptr);
+	frame.instanceTransforms.Get()->Unmap(0, nullptr);
 }
 
-void RT64::View::createInstanceMaterialsBuffer() {
+bool RT64::View::createInstanceMaterialsBuffer(FrameResources &frame) {
 	uint32_t totalInstances = static_cast<uint32_t>(rtInstances.size() + rasterBgInstances.size() + rasterFgInstances.size());
-	uint32_t newBufferSize = ROUND_UP(totalInstances * sizeof(RT64_MATERIAL), D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT);
-	if (activeInstancesBufferMaterialsSize != newBufferSize) {
-		activeInstancesBufferMaterials.Release();
-		activeInstancesBufferMaterials = scene->getDevice()->allocateBuffer(D3D12_HEAP_TYPE_UPLOAD, newBufferSize, D3D12_RESOURCE_FLAG_NONE, D3D12_RESOURCE_STATE_GENERIC_READ);
-		activeInstancesBufferMaterialsSize = newBufferSize;
+	uint32_t newBufferSize = ROUND_UP(totalInstances * sizeof(InstanceMaterial), D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT);
+	if (frame.instanceMaterialsSize != newBufferSize) {
+		scene->getDevice()->retireResource(frame.instanceMaterials);
+		frame.instanceMaterials = scene->getDevice()->allocateBuffer(D3D12_HEAP_TYPE_UPLOAD, newBufferSize, D3D12_RESOURCE_FLAG_NONE, D3D12_RESOURCE_STATE_GENERIC_READ);
+		frame.instanceMaterialsSize = newBufferSize;
+		return true;
 	}
+
+	return false;
 }
 
-void RT64::View::updateInstanceMaterialsBuffer() {
-	RT64_MATERIAL *current = nullptr;
+void RT64::View::updateInstanceMaterialsBuffer(FrameResources &frame, const std::vector<uint32_t> *slots) {
+	// The host's material is followed by the scale and offset of the textures inside their atlas pages.
+	auto storeMaterial = [](const RenderInstance &renderInstance, InstanceMaterial &dst) {
+		dst.material = renderInstance.material;
+		dst.diffuseTexScaleOffset = renderInstance.texScaleOffsets[0];
+		dst.normalTexScaleOffset = renderInstance.texScaleOffsets[1];
+		dst.specularTexScaleOffset = renderInstance.texScaleOffsets[2];
+	};
+
+	InstanceMaterial *materials = nullptr;
 	CD3DX12_RANGE readRange(0, 0);
 
-	D3D12_CHECK(activeInstancesBufferMaterials.Get()->Map(0, &readRange, reinterpret_cast<void **>(&current)));
+	D3D12_CHECK(frame.instanceMaterials.Get()->Map(0, &readRange, reinterpret_cast<void **>(&materials)));
 
-	for (const RenderInstance &inst : rtInstances) {
-		*current = inst.material;
-		current++;
+	if (slots != nullptr) {
+		for (uint32_t slot : *slots) {
+			storeMaterial(getRenderInstance(slot), materials[slot]);
+		}
 	}
+	else {
+		for (const RenderInstance &inst : rtInstances) {
+			storeMaterial(inst, *materials);
+			materials++;
+		}
 
-	for (const RenderInstance &inst : rasterBgInstances) {
-		*current = inst.material;
-		current++;
-	}
+		for (const RenderInstance &inst : rasterBgInstances) {
+			storeMaterial(inst, *materials);
+			materials++;
+		}
 
-	for (const RenderInstance& inst : rasterFgInstances) {
-		*current = inst.material;
-		current++;
+		for (const RenderInstance& inst : rasterFgInstances) {
+			storeMaterial(inst, *materials);
+			materials++;
+		}
 	}
 
-	activeInstancesBufferMaterials.Get()->Unmap(0, nullptr);
+	frame.instanceMaterials.Get()->Unmap(0, nullptr);
 }
 
 void RT64::View::createTopLevelAS(const std::vector<RenderInstance>& rtInstances) {
@@ -233,6 +341,16 @@ void RT64::View::createTopLevelAS(const std::vector<RenderInstance>& rtInstances
 		topLevelASGenerator.AddInstance(rtInstances[i].bottomLevelAS, rtInstances[i].transform, static_cast<UINT>(i), static_cast<UINT>(2 * i), rtInstances[i].flags);
 	}
 
+	// Refit the current AS instead of building it again if possible. Refitting keeps the hierarchy from the last
+	// build, so it's only done while the instances use the same bottom level AS and flags and haven't moved
+	// farther than their own size from where they were when it was built.
+	bool refit = !topLevelASBuffers.result.IsNull() && (topLevelASInstances.size() == rtInstances.size());
+	for (size_t i = 0; refit && (i < rtInstances.size()); i++) {
+		const TopLevelASInstance &builtInstance = topLevelASInstances[i];
+		const XMVECTOR offset = XMVectorSubtract(rtInstances[i].transform.r[3], XMLoadFloat3(&builtInstance.position));
+		refit = (builtInstance.bottomLevelAS == rtInstances[i].bottomLevelAS) && (builtInstance.flags == rtInstances[i].flags) && (XMVectorGetX(XMVector3Length(offset)) <= builtInstance.radius);
+	}
+
 	// As for the bottom-level AS, the building the AS requires some scratch
 	// space to store temporary data in addition to the actual AS. In the case
 	// of the top-level AS, the instance descriptors also need to be stored in
@@ -242,51 +360,81 @@ void RT64::View::createTopLevelAS(const std::vector<RenderInstance>& rtInstances
 	UINT64 scratchSize, resultSize, instanceDescsSize;
 	topLevelASGenerator.ComputeASBufferSizes(scene->getDevice()->getD3D12Device(), true, &scratchSize, &resultSize, &instanceDescsSize);
 	
-	// Release the previous buffers and reallocate them if they're not big enough.
-	if ((topLevelASBuffers.scratchSize < scratchSize) || (topLevelASBuffers.resultSize < resultSize) || (topLevelASBuffers.instanceDescSize < instanceDescsSize)) {
-		topLevelASBuffers.Release();
+	// Retire the previous buffers and reallocate them if they're not big enough. The frames in flight might still
+	// trace the previous AS, and the descriptors of every frame slot must point to the new one.
+	Device *device = scene->getDevice();
+	if ((topLevelASBuffers.scratchSize < scratchSize) || (topLevelASBuffers.resultSize < resultSize)) {
+		device->retireResource(topLevelASBuffers);
 
 		// Create the scratch and result buffers. Since the build is all done on
 		// GPU, those can be allocated on the default heap
-		topLevelASBuffers.scratch = scene->getDevice()->allocateBuffer(D3D12_HEAP_TYPE_DEFAULT, scratchSize, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
-		topLevelASBuffers.result = scene->getDevice()->allocateBuffer(D3D12_HEAP_TYPE_DEFAULT, resultSize, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_RAYTRACING_ACCELERATION_STRUCTURE);
-
-		// The buffer describing the instances: ID, shader binding information,
-		// matrices ... Those will be copied into the buffer by the helper through
-		// mapping, so the buffer has to be allocated on the upload heap.
-		topLevelASBuffers.instanceDesc = scene->getDevice()->allocateBuffer(D3D12_HEAP_TYPE_UPLOAD, instanceDescsSize, D3D12_RESOURCE_FLAG_NONE, D3D12_RESOURCE_STATE_GENERIC_READ);
-
+		topLevelASBuffers.scratch = device->allocateBuffer(D3D12_HEAP_TYPE_DEFAULT, scratchSize, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+		topLevelASBuffers.result = device->allocateBuffer(D3D12_HEAP_TYPE_DEFAULT, resultSize, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_RAYTRACING_ACCELERATION_STRUCTURE);
 		topLevelASBuffers.scratchSize = scratchSize;
 		topLevelASBuffers.resultSize = resultSize;
-		topLevelASBuffers.instanceDescSize = instanceDescsSize;
+		descriptorsVersion++;
+		refit = false;
+	}
+
+	// The buffer describing the instances: ID, shader binding information,
+	// matrices ... Those will be copied into the buffer by the helper through
+	// mapping, so the buffer has to be allocated on the upload heap. The CPU
+	// writes it, so every frame slot has its own.
+	FrameResources &frame = getFrameResources();
+	if (frame.topLevelASInstanceDescsSize < instanceDescsSize) {
+		device->retireResource(frame.topLevelASInstanceDescs);
+		frame.topLevelASInstanceDescs = device->allocateBuffer(D3D12_HEAP_TYPE_UPLOAD, instanceDescsSize, D3D12_RESOURCE_FLAG_NONE, D3D12_RESOURCE_STATE_GENERIC_READ);
+		frame.topLevelASInstanceDescsSize = instanceDescsSize;
 	}
 
 	// After all the buffers are allocated, or if only an update is required, we can build the acceleration structure. 
 	// Note that in the case of the update we also pass the existing AS as the 'previous' AS, so that it can be refitted in place.
-	topLevelASGenerator.Generate(scene->getDevice()->getD3D12CommandList(), topLevelASBuffers.scratch.Get(), topLevelASBuffers.result.Get(), topLevelASBuffers.instanceDesc.Get(), false, topLevelASBuffers.result.Get());
-}
-
-void RT64::View::createShaderResourceHeap() {
-	assert(usedTextures.size() <= 512);
-
-	uint32_t entryCount = ((uint32_t)(HeapIndices::MAX) - 1) + (uint32_t)(usedTextures.size());
+	topLevelASGenerator.Generate(device->getD3D12CommandList(), topLevelASBuffers.scratch.Get(), topLevelASBuffers.result.Get(), frame.topLevelASInstanceDescs.Get(), refit, topLevelASBuffers.result.Get());
+	if (refit) {
+		topLevelASRefitCount++;
+	}
+	else {
+		// Store the state of the instances used to decide if the next updates can be refits.
+		topLevelASInstances.resize(rtInstances.size());
+		for (size_t i = 0; i < rtInstances.size(); i++) {
+			const RenderInstance &rtInstance = rtInstances[i];
+			const RT64_VECTOR3 boundsMin = rtInstance.instance->getMesh()->getBoundsMin();
+			const RT64_VECTOR3 boundsMax = rtInstance.instance->getMesh()->getBoundsMax();
+
+			// Transform every corner of the mesh's bounds, as the two extremes alone don't bound a rotated box.
+			XMVECTOR worldMin = XMVectorReplicate(FLT_MAX);
+			XMVECTOR worldMax = XMVectorReplicate(-FLT_MAX);
+			for (int c = 0; c < 8; c++) {
+				XMVECTOR corner = XMVectorSet((c & 1) ? boundsMax.x : boundsMin.x, (c & 2) ? boundsMax.y : boundsMin.y, (c & 4) ? boundsMax.z : boundsMin.z, 1.0f);
+				corner = XMVector3Transform(corner, rtInstance.transform);
+				worldMin = XMVectorMin(worldMin, corner);
+				worldMax = XMVectorMax(worldMax, corner);
+			}
 
-	// Recreate descriptor heap to be bigger if necessary.
-	if (descriptorHeapEntryCount < entryCount) {
-		if (descriptorHeap != nullptr) {
-			descriptorHeap->Release();
-			descriptorHeap = nullptr;
+			TopLevelASInstance &builtInstance = topLevelASInstances[i];
+			builtInstance.bottomLevelAS = rtInstance.bottomLevelAS;
+			builtInstance.flags = rtInstance.flags;
+			XMStoreFloat3(&builtInstance.position, rtInstance.transform.r[3]);
+			builtInstance.radius = 0.5f * XMVectorGetX(XMVector3Length(XMVectorSubtract(worldMax, worldMin)));
 		}
 
-		descriptorHeap = nv_helpers_dx12::CreateDescriptorHeap(scene->getDevice()->getD3D12Device(), entryCount, D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV, true);
-		descriptorHeapEntryCount = entryCount;
+		topLevelASRebuildCount++;
 	}
 
+	device->getCommandLog()->record(CommandLog::Type::BuildAS, topLevelASBuffers.result.Get(), resultSize, (UINT)(rtInstances.size()));
+}
+
+uint32_t RT64::View::getRequiredDescriptorHeapEntryCount() const {
+	// The heap has room for every slot of the texture table after the view's own descriptors.
+	return (uint32_t)(HEAP_INDEX(gTextures)) + scene->getDevice()->getTextureTable()->getCapacity();
+}
+
+void RT64::View::createShaderResourceHeap(FrameResources &frame) {
 	const UINT handleIncrement = scene->getDevice()->getD3D12Device()->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
 
 	// Get a handle to the heap memory on the CPU side, to be able to write the
 	// descriptors directly
-	D3D12_CPU_DESCRIPTOR_HANDLE handle = descriptorHeap->GetCPUDescriptorHandleForHeapStart();
+	D3D12_CPU_DESCRIPTOR_HANDLE handle = frame.descriptorHeap->GetCPUDescriptorHandleForHeapStart();
 
 	// UAV for output buffer.
 	D3D12_UNORDERED_ACCESS_VIEW_DESC uavDesc = {};
@@ -354,7 +502,7 @@ void RT64::View::createShaderResourceHeap() {
 
 	// Describe and create a constant buffer view for the camera
 	D3D12_CONSTANT_BUFFER_VIEW_DESC cbvDesc = {};
-	cbvDesc.BufferLocation = viewParamBufferResource.Get()->GetGPUVirtualAddress();
+	cbvDesc.BufferLocation = frame.viewParamBufferResource.Get()->GetGPUVirtualAddress();
 	cbvDesc.SizeInBytes = viewParamsBufferSize;
 	scene->getDevice()->getD3D12Device()->CreateConstantBufferView(&cbvDesc, handle);
 	handle.ptr += handleIncrement;
@@ -381,7 +529,7 @@ void RT64::View::createShaderResourceHeap() {
 	srvDesc.Buffer.NumElements = static_cast<UINT>(rtInstances.size() + rasterBgInstances.size() + rasterFgInstances.size());
 	srvDesc.Buffer.StructureByteStride = sizeof(InstanceTransforms);
 	srvDesc.Buffer.Flags = D3D12_BUFFER_SRV_FLAG_NONE;
-	scene->getDevice()->getD3D12Device()->CreateShaderResourceView(activeInstancesBufferTransforms.Get(), &srvDesc, handle);
+	scene->getDevice()->getD3D12Device()->CreateShaderResourceView(frame.instanceTransforms.Get(), &srvDesc, handle);
 	handle.ptr += handleIncrement;
 
 	// Describe the properties buffer per instance.
@@ -390,25 +538,18 @@ void RT64::View::createShaderResourceHeap() {
 	srvDesc.ViewDimension = D3D12_SRV_DIMENSION_BUFFER;
 	srvDesc.Buffer.FirstElement = 0;
 	srvDesc.Buffer.NumElements = static_cast<UINT>(rtInstances.size() + rasterBgInstances.size() + rasterFgInstances.size());
-	srvDesc.Buffer.StructureByteStride = sizeof(RT64_MATERIAL);
+	srvDesc.Buffer.StructureByteStride = sizeof(InstanceMaterial);
 	srvDesc.Buffer.Flags = D3D12_BUFFER_SRV_FLAG_NONE;
-	scene->getDevice()->getD3D12Device()->CreateShaderResourceView(activeInstancesBufferMaterials.Get(), &srvDesc, handle);
+	scene->getDevice()->getD3D12Device()->CreateShaderResourceView(frame.instanceMaterials.Get(), &srvDesc, handle);
 	handle.ptr += handleIncrement;
 
-	// Add the texture SRV.
-	for (size_t i = 0; i < usedTextures.size(); i++) {
-		scene->getDevice()->getD3D12Device()->CreateShaderResourceView(usedTextures[i]->getTexture(), &textureSRVDesc, handle);
-		usedTextures[i]->setCurrentIndex(-1);
-		handle.ptr += handleIncrement;
-	}
-
 	{
 		// Create the heap for the compose shader.
-		if (composeHeap == nullptr) {
-			composeHeap = nv_helpers_dx12::CreateDescriptorHeap(scene->getDevice()->getD3D12Device(), 1, D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV, true);
+		if (frame.composeHeap == nullptr) {
+			frame.composeHeap = nv_helpers_dx12::CreateDescriptorHeap(scene->getDevice()->getD3D12Device(), 1, D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV, true);
 		}
 
-		D3D12_CPU_DESCRIPTOR_HANDLE handle = composeHeap->GetCPUDescriptorHandleForHeapStart();
+		D3D12_CPU_DESCRIPTOR_HANDLE handle = frame.composeHeap->GetCPUDescriptorHandleForHeapStart();
 
 		// SRV for denoised texture.
 		{
@@ -424,68 +565,46 @@ void RT64::View::createShaderResourceHeap() {
 	}
 }
 
-void RT64::View::createShaderBindingTable() {
-	// The SBT helper class collects calls to Add*Program.  If called several
-	// times, the helper must be emptied before re-adding shaders.
-	sbtHelper.Reset();
+void RT64::View::createShaderBindingTable(FrameResources &frame) {
+	// One ray generation, two misses and two hit groups per instance. The table keeps the records from the
+	// previous update, so only the ones for instances whose shader, mesh or position in the list changed
+	// are actually written.
+	ShaderTable *shaderTable = frame.shaderTable;
+	shaderTable->resize(1, 2, static_cast<uint32_t>(rtInstances.size() * 2));
 
 	// The pointer to the beginning of the heap is the only parameter required by
 	// shaders without root parameters
-	D3D12_GPU_DESCRIPTOR_HANDLE srvUavHeapHandle = descriptorHeap->GetGPUDescriptorHandleForHeapStart();
-	
-	// The helper treats both root parameter pointers and heap pointers as void*,
-	// while DX12 uses the
-	// D3D12_GPU_DESCRIPTOR_HANDLE to define heap pointers. The pointer in this
-	// struct is a UINT64, which then has to be reinterpreted as a pointer.
-	auto heapPointer = reinterpret_cast<UINT64 *>(srvUavHeapHandle.ptr);
+	const uint64_t heapPointer = frame.descriptorHeap->GetGPUDescriptorHandleForHeapStart().ptr;
 
 	// The ray generation only uses heap data.
-	sbtHelper.AddRayGenerationProgram(scene->getDevice()->getTraceRayGenID(), { heapPointer });
+	shaderTable->setRayGenRecord(0, scene->getDevice()->getTraceRayGenID(), &heapPointer, 1);
 	
 	// Miss shaders don't use any external data.
-	sbtHelper.AddMissProgram(scene->getDevice()->getSurfaceMissID(), {});
-	sbtHelper.AddMissProgram(scene->getDevice()->getShadowMissID(), {});
+	shaderTable->setMissRecord(0, scene->getDevice()->getSurfaceMissID(), nullptr, 0);
+	shaderTable->setMissRecord(1, scene->getDevice()->getShadowMissID(), nullptr, 0);
 
 	// Add the vertex buffers from all the meshes used by the instances to the hit group.
-	for (const RenderInstance &rtInstance :rtInstances) {
-		const auto &surfaceHitGroup = rtInstance.shader->getSurfaceHitGroup();
-		sbtHelper.AddHitGroup(surfaceHitGroup.id, {
-			(void *)(rtInstance.vertexBufferView->BufferLocation),
-			(void *)(rtInstance.indexBufferView->BufferLocation),
-			heapPointer
-		});
-		
-		const auto &shadowHitGroup = rtInstance.shader->getShadowHitGroup();
-		sbtHelper.AddHitGroup(shadowHitGroup.id, {
-			(void*)(rtInstance.vertexBufferView->BufferLocation),
-			(void*)(rtInstance.indexBufferView->BufferLocation),
+	for (size_t i = 0; i < rtInstances.size(); i++) {
+		const RenderInstance &rtInstance = rtInstances[i];
+		const uint64_t arguments[] = {
+			rtInstance.vertexBufferView->BufferLocation,
+			rtInstance.indexBufferView->BufferLocation,
 			heapPointer
-		});
-	}
-	
-	// Compute the size of the SBT given the number of shaders and their parameters.
-	uint32_t sbtSize = sbtHelper.ComputeSBTSize();
-	if (sbtStorageSize < sbtSize) {
-		// Release previously allocated SBT storage.
-		sbtStorage.Release();
+		};
 
-		// Create the SBT on the upload heap. This is required as the helper will use
-		// mapping to write the SBT contents. After the SBT compilation it could be
-		// copied to the default heap for performance.
-		sbtStorage = scene->getDevice()->allocateBuffer(D3D12_HEAP_TYPE_UPLOAD, sbtSize, D3D12_RESOURCE_FLAG_NONE, D3D12_RESOURCE_STATE_GENERIC_READ);
-		sbtStorageSize = sbtSize;
+		shaderTable->setHitGroupRecord(static_cast<uint32_t>(2 * i), rtInstance.shader->getSurfaceHitGroup().id, arguments, _countof(arguments));
+		shaderTable->setHitGroupRecord(static_cast<uint32_t>(2 * i + 1), rtInstance.shader->getShadowHitGroup().id, arguments, _countof(arguments));
 	}
-
-	// Compile the SBT from the shader and parameters info
-	sbtHelper.Generate(sbtStorage.Get(), scene->getDevice()->getD3D12RtStateObjectProperties());
 }
 
 void RT64::View::createViewParamsBuffer() {
 	viewParamsBufferSize = ROUND_UP(4 * sizeof(XMMATRIX) + 8, D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT);
-	viewParamBufferResource = scene->getDevice()->allocateBuffer(D3D12_HEAP_TYPE_UPLOAD, viewParamsBufferSize, D3D12_RESOURCE_FLAG_NONE, D3D12_RESOURCE_STATE_GENERIC_READ);
+	for (FrameResources &frame : frames) {
+		frame.viewParamBufferResource = scene->getDevice()->allocateBuffer(D3D12_HEAP_TYPE_UPLOAD, viewParamsBufferSize, D3D12_RESOURCE_FLAG_NONE, D3D12_RESOURCE_STATE_GENERIC_READ);
+	}
 }
 
-void RT64::View::updateViewParamsBuffer() {
+void RT64::View::updateViewParamsBuffer(FrameResources &frame) {
 	assert(fovRadians > 0.0f);
 
 	// Previous view and projection matrices.
@@ -508,54 +627,150 @@ void RT64::View::updateViewParamsBuffer() {
 	
 	// Copy the camera buffer data to the resource.
 	uint8_t *pData;
-	D3D12_CHECK(viewParamBufferResource.Get()->Map(0, nullptr, (void **)&pData));
+	D3D12_CHECK(frame.viewParamBufferResource.Get()->Map(0, nullptr, (void **)&pData));
 	memcpy(pData, &viewParamsBufferData, sizeof(ViewParamsBuffer));
-	viewParamBufferResource.Get()->Unmap(0, nullptr);
+	frame.viewParamBufferResource.Get()->Unmap(0, nullptr);
 }
 
-void RT64::View::update() {
-	if (rtScale != resolutionScale) {
-		rtScale = std::max(std::min(resolutionScale, 2.0f), 0.01f);
-		resolutionScale = rtScale;
-		createOutputBuffers();
+void RT64::View::updateRenderInstanceRects(RenderInstance &renderInstance, unsigned int screenHeight) {
+	const Instance *instance = renderInstance.instance;
+	if (instance->hasScissorRect()) {
+		RT64_RECT rect = instance->getScissorRect();
+		renderInstance.scissorRect.left = rect.x;
+		renderInstance.scissorRect.top = screenHeight - rect.y - rect.h;
+		renderInstance.scissorRect.right = rect.x + rect.w;
+		renderInstance.scissorRect.bottom = screenHeight - rect.y;
+	}
+	else {
+		renderInstance.scissorRect = CD3DX12_RECT(0, 0, 0, 0);
+	}
+
+	if (instance->hasViewportRect()) {
+		RT64_RECT rect = instance->getViewportRect();
+		renderInstance.viewport = CD3DX12_VIEWPORT(
+			static_cast<float>(rect.x),
+			static_cast<float>(screenHeight - rect.y - rect.h),
+			static_cast<float>(rect.w),
+			static_cast<float>(rect.h)
+		);
+	}
+	else {
+		renderInstance.viewport = CD3DX12_VIEWPORT(0.0f, 0.0f, 0.0f, 0.0f);
+	}
+}
+
+RT64::View::RenderInstance &RT64::View::getRenderInstance(uint32_t slot) {
+	if (slot < rtInstances.size()) {
+		return rtInstances[slot];
+	}
+
+	slot -= (uint32_t)(rtInstances.size());
+	if (slot < rasterBgInstances.size()) {
+		return rasterBgInstances[slot];
+	}
+
+	slot -= (uint32_t)(rasterBgInstances.size());
+	return rasterFgInstances[slot];
+}
+
+void RT64::View::sortRasterInstances(std::vector<RenderInstance> &rasterInstances) {
+	// Only the runs of instances that can be reordered are sorted. Every other instance stays where it is and
+	// splits the runs around it. The sort is stable, so instances with the same state keep the order of the host.
+	// The mesh goes before the textures, as the textures are read from the materials and don't prevent instancing.
+	auto stateLess = [](const RenderInstance &a, const RenderInstance &b) {
+		auto stateKey = [](const RenderInstance &r) {
+			return std::make_tuple(reinterpret_cast<uintptr_t>(r.shader), reinterpret_cast<uintptr_t>(r.vertexBufferView), r.material.diffuseTexIndex, r.material.normalTexIndex, r.material.specularTexIndex);
+		};
+
+		return stateKey(a) < stateKey(b);
+	};
+
+	auto isUnordered = [](const RenderInstance &r) {
+		return (r.instance->getFlags() & RT64_INSTANCE_RASTER_UNORDERED) != 0;
+	};
+
+	auto runBegin = rasterInstances.begin();
+	while (runBegin != rasterInstances.end()) {
+		runBegin = std::find_if(runBegin, rasterInstances.end(), isUnordered);
+		auto runEnd = std::find_if_not(runBegin, rasterInstances.end(), isUnordered);
+		std::stable_sort(runBegin, runEnd, stateLess);
+		runBegin = runEnd;
 	}
+}
+
+void RT64::View::batchRasterInstances(const std::vector<RenderInstance> &rasterInstances, bool applyScissorsAndViewports, std::vector<RasterDraw> &draws) {
+	// Instances without a scissor or a viewport of their own all use the full ones, whatever their rects hold.
+	auto sameScissor = [](const CD3DX12_RECT &a, const CD3DX12_RECT &b) {
+		const bool aApplied = (a.right > a.left);
+		const bool bApplied = (b.right > b.left);
+		if (!aApplied || !bApplied) {
+			return aApplied == bApplied;
+		}
+
+		return (a.left == b.left) && (a.top == b.top) && (a.right == b.right) && (a.bottom == b.bottom);
+	};
+
+	auto sameViewport = [](const CD3DX12_VIEWPORT &a, const CD3DX12_VIEWPORT &b) {
+		const bool aApplied = (a.Width > 0) && (a.Height > 0);
+		const bool bApplied = (b.Width > 0) && (b.Height > 0);
+		if (!aApplied || !bApplied) {
+			return aApplied == bApplied;
+		}
+
+		return (a.TopLeftX == b.TopLeftX) && (a.TopLeftY == b.TopLeftY) && (a.Width == b.Width) && (a.Height == b.Height) && (a.MinDepth == b.MinDepth) && (a.MaxDepth == b.MaxDepth);
+	};
+
+	// The slots of the instances are consecutive, so a run only needs the index of its first instance and the shader
+	// adds the instance ID to it.
+	draws.clear();
+	for (size_t j = 0; j < rasterInstances.size(); j++) {
+		const RenderInstance &renderInstance = rasterInstances[j];
+		if (!draws.empty()) {
+			RasterDraw &lastDraw = draws.back();
+			const RenderInstance &firstInstance = rasterInstances[lastDraw.firstInstance];
+			bool sameDraw = (firstInstance.shader == renderInstance.shader) &&
+				(firstInstance.vertexBufferView == renderInstance.vertexBufferView) &&
+				(firstInstance.indexBufferView == renderInstance.indexBufferView) &&
+				(firstInstance.indexCount == renderInstance.indexCount);
+
+			if (sameDraw && applyScissorsAndViewports) {
+				sameDraw = sameScissor(firstInstance.scissorRect, renderInstance.scissorRect) && sameViewport(firstInstance.viewport, renderInstance.viewport);
+			}
+
+			if (sameDraw) {
+				lastDraw.instanceCount++;
+				continue;
+			}
+		}
 
+		draws.push_back({ j, 1 });
+	}
+}
+
+void RT64::View::gatherInstances() {
 	if (!scene->getInstances().empty()) {
 		// Create the active instance vectors.
 		RenderInstance renderInstance;
 		Mesh* usedMesh = nullptr;
-		Texture *usedDiffuse = nullptr;
 		size_t totalInstances = scene->getInstances().size();
 		unsigned int instFlags = 0;
 		unsigned int screenHeight = getHeight();
 		rtInstances.clear();
 		rasterBgInstances.clear();
 		rasterFgInstances.clear();
-		usedTextures.clear();
 
 		rtInstances.reserve(totalInstances);
 		rasterBgInstances.reserve(totalInstances);
 		rasterFgInstances.reserve(totalInstances);
-		usedTextures.reserve(512);
-
-		auto getTextureIndex = [this](Texture *texture) {
-			if (texture == nullptr) {
-				return -1;
-			}
 
-			int currentIndex = texture->getCurrentIndex();
-			if (currentIndex < 0) {
-				currentIndex = (int)(usedTextures.size());
-				texture->setCurrentIndex(currentIndex);
-				usedTextures.push_back(texture);
+		for (Instance *instance : scene->getInstances()) {
+			// The mesh of the instance might have been destroyed.
+			usedMesh = instance->getMesh();
+			if (usedMesh == nullptr) {
+				continue;
 			}
 
-			return currentIndex;
-		};
-
-		for (Instance *instance : scene->getInstances()) {
 			instFlags = instance->getFlags();
-			usedMesh = instance->getMesh();
 			renderInstance.instance = instance;
 			renderInstance.bottomLevelAS = usedMesh->getBottomLevelASResult();
 			renderInstance.transform = instance->getTransform();
@@ -565,33 +780,9 @@ void RT64::View::update() {
 			renderInstance.indexBufferView = usedMesh->getIndexBufferView();
 			renderInstance.vertexBufferView = usedMesh->getVertexBufferView();
 			renderInstance.flags = (instFlags & RT64_INSTANCE_DISABLE_BACKFACE_CULLING) ? D3D12_RAYTRACING_INSTANCE_FLAG_TRIANGLE_CULL_DISABLE : D3D12_RAYTRACING_INSTANCE_FLAG_NONE;
-			renderInstance.material.diffuseTexIndex = getTextureIndex(instance->getDiffuseTexture());
-			renderInstance.material.normalTexIndex = getTextureIndex(instance->getNormalTexture());
-			renderInstance.material.specularTexIndex = getTextureIndex(instance->getSpecularTexture());
-
-			if (instance->hasScissorRect()) {
-				RT64_RECT rect = instance->getScissorRect();
-				renderInstance.scissorRect.left = rect.x;
-				renderInstance.scissorRect.top = screenHeight - rect.y - rect.h;
-				renderInstance.scissorRect.right = rect.x + rect.w;
-				renderInstance.scissorRect.bottom = screenHeight - rect.y;
-			}
-			else {
-				renderInstance.scissorRect = CD3DX12_RECT(0, 0, 0, 0);
-			}
+			setMaterialTextures(renderInstance.material, renderInstance.texScaleOffsets, instance);
 
-			if (instance->hasViewportRect()) {
-				RT64_RECT rect = instance->getViewportRect();
-				renderInstance.viewport = CD3DX12_VIEWPORT(
-					static_cast<float>(rect.x),
-					static_cast<float>(screenHeight - rect.y - rect.h),
-					static_cast<float>(rect.w),
-					static_cast<float>(rect.h)
-				);
-			}
-			else {
-				renderInstance.viewport = CD3DX12_VIEWPORT(0.0f, 0.0f, 0.0f, 0.0f);
-			}
+			updateRenderInstanceRects(renderInstance, screenHeight);
 
 			if (renderInstance.bottomLevelAS != nullptr) {
 				rtInstances.push_back(renderInstance);
@@ -604,37 +795,231 @@ void RT64::View::update() {
 			}
 		}
 
+		sortRasterInstances(rasterBgInstances);
+		sortRasterInstances(rasterFgInstances);
+
+		// Store where each instance ended up. The slots follow the same order as the instance buffers.
+		uint32_t slot = 0;
+		instanceSlots.clear();
+		for (const std::vector<RenderInstance> *renderInstances : { &rtInstances, &rasterBgInstances, &rasterFgInstances }) {
+			for (const RenderInstance &renderInstance : *renderInstances) {
+				instanceSlots[renderInstance.instance] = slot++;
+			}
+		}
+
 		// Create the acceleration structures used by the raytracer.
 		if (!rtInstances.empty()) {
 			createTopLevelAS(rtInstances);
 		}
-
-		// Create the instance buffers for the active instances (if necessary).
-		createInstanceTransformsBuffer();
-		createInstanceMaterialsBuffer();
-		
-		// Create the buffer containing the raytracing result (always output in a
-		// UAV), and create the heap referencing the resources used by the raytracing,
-		// such as the acceleration structure
-		createShaderResourceHeap();
-		
-		// Create the shader binding table and indicating which shaders
-		// are invoked for each instance in the AS.
-		createShaderBindingTable();
-
-		// Update the instance buffers for the active instances.
-		updateInstanceTransformsBuffer();
-		updateInstanceMaterialsBuffer();
 	}
 	else {
 		rtInstances.clear();
 		rasterBgInstances.clear();
 		rasterFgInstances.clear();
+		instanceSlots.clear();
+	}
+
+	// Every frame slot must write its instance buffers, descriptors and shader table again.
+	instancesVersion++;
+	descriptorsVersion++;
+	shaderTableVersion++;
+}
+
+bool RT64::View::isInstanceListChanged(Instance *instance) const {
+	// Meshes that get a BLAS for the first time or lose it move their instances between the raytraced and the
+	// raster lists.
+	auto slotIt = instanceSlots.find(instance);
+	if (slotIt == instanceSlots.end()) {
+		return false;
+	}
+
+	const bool raytraced = (slotIt->second < rtInstances.size());
+	return raytraced != (instance->getMesh()->getBottomLevelASResult() != nullptr);
+}
+
+void RT64::View::updateDirtyInstances() {
+	unsigned int screenHeight = getHeight();
+	bool topLevelASDirty = false;
+	bool shaderTableDirty = false;
+	for (Instance *instance : scene->getDirtyInstances()) {
+		auto slotIt = instanceSlots.find(instance);
+		if (slotIt == instanceSlots.end()) {
+			continue;
+		}
+
+		const uint32_t slot = slotIt->second;
+		const unsigned int dirtyMask = instance->getDirtyMask();
+		RenderInstance &renderInstance = getRenderInstance(slot);
+		if (dirtyMask & (Instance::DirtyTransform | Instance::DirtyMaterial | Instance::DirtyTextures)) {
+			// The instance buffers of every frame slot are written when the slot is recorded again.
+			for (FrameResources &frame : frames) {
+				frame.dirtyInstanceSlots.push_back(slot);
+			}
+		}
+
+		if (dirtyMask & Instance::DirtyTransform) {
+			renderInstance.transform = instance->getTransform();
+			topLevelASDirty = topLevelASDirty || (slot < rtInstances.size());
+		}
+
+		if (dirtyMask & (Instance::DirtyMaterial | Instance::DirtyTextures)) {
+			// Textures mark the instances that use them when their slot or atlas region changes, so reading them
+			// again here is enough.
+			renderInstance.material = instance->getMaterial();
+			setMaterialTextures(renderInstance.material, renderInstance.texScaleOffsets, instance);
+		}
+
+		if (dirtyMask & Instance::DirtyRects) {
+			updateRenderInstanceRects(renderInstance, screenHeight);
+		}
+
+		// The render instance points to the views of the mesh, so only the values that were copied from it need to
+		// be read again. The shader table holds the addresses of the buffers.
+		const bool raytraced = (slot < rtInstances.size());
+		if (dirtyMask & Instance::DirtyMeshBuffers) {
+			const Mesh *mesh = instance->getMesh();
+			renderInstance.indexCount = mesh->getIndexCount();
+			renderInstance.bottomLevelAS = mesh->getBottomLevelASResult();
+			topLevelASDirty = topLevelASDirty || raytraced;
+			shaderTableDirty = shaderTableDirty || raytraced;
+		}
+
+		if (dirtyMask & Instance::DirtyMeshGeometry) {
+			topLevelASDirty = topLevelASDirty || raytraced;
+		}
+	}
+
+	if (topLevelASDirty) {
+		createTopLevelAS(rtInstances);
+	}
+
+	if (shaderTableDirty) {
+		shaderTableVersion++;
+	}
+}
+
+void RT64::View::update() {
+	if (rtScale != resolutionScale) {
+		rtScale = std::max(std::min(resolutionScale, 2.0f), 0.01f);
+		resolutionScale = rtScale;
+		createOutputBuffers();
+	}
+
+	// Changing the mesh, shader or flags of an instance can move it to another list or change the shader table,
+	// so those need all the instances to be gathered again. Everything else is updated in place, and nothing is
+	// done at all if the scene didn't change.
+	const unsigned int inPlaceMask = Instance::DirtyTransform | Instance::DirtyMaterial | Instance::DirtyTextures | Instance::DirtyRects | Instance::DirtyMeshBuffers | Instance::DirtyMeshGeometry;
+	const std::vector<Instance *> &dirtyInstances = scene->getDirtyInstances();
+	bool gatherDirty = instancesDirty || scene->areInstancesDirty();
+	for (size_t i = 0; !gatherDirty && (i < dirtyInstances.size()); i++) {
+		const unsigned int dirtyMask = dirtyInstances[i]->getDirtyMask();
+		gatherDirty = ((dirtyMask & ~inPlaceMask) != 0) || ((dirtyMask & Instance::DirtyMeshBuffers) && isInstanceListChanged(dirtyInstances[i]));
+	}
+
+	if (gatherDirty) {
+		gatherInstances();
+		instancesDirty = false;
+		pickTracerDirty = true;
+	}
+	else {
+		if (!dirtyInstances.empty()) {
+			updateDirtyInstances();
+			pickTracerDirty = true;
+		}
+
+		// The size of the heap stays the same, so the shader table is still valid.
+		if (scene->areLightsDirty()) {
+			descriptorsVersion++;
+		}
+	}
+
+	// Every texture the instances use must stay resident, or be restored if it was evicted. The frame must also
+	// wait for the uploads of the meshes and textures it uses that the copy queue is still working on.
+	Device *device = scene->getDevice();
+	TextureResidency *textureResidency = device->getTextureResidency();
+	for (const std::vector<RenderInstance> *renderInstances : { &rtInstances, &rasterBgInstances, &rasterFgInstances }) {
+		for (const RenderInstance &renderInstance : *renderInstances) {
+			const Instance *instance = renderInstance.instance;
+			device->requireUpload(instance->getMesh()->getUploadFenceValue());
+			for (Texture *texture : { instance->getDiffuseTexture(), instance->getNormalTexture(), instance->getSpecularTexture() }) {
+				textureResidency->touch(texture);
+				if (texture != nullptr) {
+					device->requireUpload(texture->getUploadFenceValue());
+				}
+			}
+		}
+	}
+
+	updateFrameResources();
+}
+
+void RT64::View::updateFrameResources() {
+	Device *device = scene->getDevice();
+	TextureTable *textureTable = device->getTextureTable();
+	const UINT frameSlot = device->getFrameSlot();
+	FrameResources &frame = frames[frameSlot];
+	const uint32_t totalInstances = static_cast<uint32_t>(rtInstances.size() + rasterBgInstances.size() + rasterFgInstances.size());
+	const uint32_t entryCount = getRequiredDescriptorHeapEntryCount();
+	bool descriptorsDirty = (frame.descriptorsVersion != descriptorsVersion);
+	bool shaderTableDirty = (frame.shaderTableVersion != shaderTableVersion);
+
+	// Recreate the descriptor heap of the slot to be bigger if necessary. The texture descriptors are only copied
+	// in full when the heap is new, as they're kept up to date incrementally afterwards with the descriptors of the
+	// textures that were created or destroyed since the slot was last recorded.
+	if ((totalInstances > 0) && (frame.descriptorHeapEntryCount < entryCount)) {
+		if (frame.descriptorHeap != nullptr) {
+			frame.descriptorHeap->Release();
+		}
+
+		frame.descriptorHeap = nv_helpers_dx12::CreateDescriptorHeap(device->getD3D12Device(), entryCount, D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV, true);
+		frame.descriptorHeapEntryCount = entryCount;
+		textureTable->copyAllDescriptors(frame.descriptorHeap, HEAP_INDEX(gTextures));
+
+		// The shader table points to the heap.
+		descriptorsDirty = true;
+		shaderTableDirty = true;
+	}
+	else if ((frame.descriptorHeap != nullptr) && (frame.descriptorHeapEntryCount >= entryCount) && textureTable->hasDirtySlots(frameSlot)) {
+		textureTable->copyDirtyDescriptors(frame.descriptorHeap, HEAP_INDEX(gTextures), frameSlot);
+	}
+
+	if (totalInstances == 0) {
+		return;
+	}
+
+	// Write the instance buffers in full if the instances were gathered again since the slot was last recorded,
+	// and only the instances that changed otherwise.
+	if (frame.instancesVersion != instancesVersion) {
+		const bool transformsCreated = createInstanceTransformsBuffer(frame);
+		const bool materialsCreated = createInstanceMaterialsBuffer(frame);
+		descriptorsDirty = descriptorsDirty || transformsCreated || materialsCreated;
+		updateInstanceTransformsBuffer(frame, nullptr);
+		updateInstanceMaterialsBuffer(frame, nullptr);
+		frame.instancesVersion = instancesVersion;
+	}
+	else if (!frame.dirtyInstanceSlots.empty()) {
+		updateInstanceTransformsBuffer(frame, &frame.dirtyInstanceSlots);
+		updateInstanceMaterialsBuffer(frame, &frame.dirtyInstanceSlots);
+	}
+
+	frame.dirtyInstanceSlots.clear();
+
+	// Create the heap referencing the resources used by the raytracing, such as the acceleration structure.
+	if (descriptorsDirty) {
+		createShaderResourceHeap(frame);
+		frame.descriptorsVersion = descriptorsVersion;
+	}
+
+	// Create the shader binding table and indicating which shaders are invoked for each instance in the AS.
+	if (shaderTableDirty) {
+		createShaderBindingTable(frame);
+		frame.shaderTableVersion = shaderTableVersion;
 	}
 }
 
 void RT64::View::render() {
-	if (descriptorHeap == nullptr) {
+	FrameResources &frame = getFrameResources();
+	if (frame.descriptorHeap == nullptr) {
 		return;
 	}
 
@@ -642,7 +1027,9 @@ void RT64::View::render() {
 	auto scissorRect = scene->getDevice()->getD3D12ScissorRect();
 	auto d3dCommandList = scene->getDevice()->getD3D12CommandList();
 	auto d3d12RenderTarget = scene->getDevice()->getD3D12RenderTarget();
-	std::vector<ID3D12DescriptorHeap *> heaps = { descriptorHeap };
+	auto commandLog = scene->getDevice()->getCommandLog();
+	auto device = scene->getDevice();
+	std::vector<ID3D12DescriptorHeap *> heaps = { frame.descriptorHeap };
 
 	// Configure the current viewport.
 	auto resetScissor = [this, d3dCommandList, &scissorRect]() {
@@ -675,46 +1062,66 @@ void RT64::View::render() {
 		}
 	};
 
-	auto drawInstances = [d3dCommandList, &scissorRect, &heaps, applyScissor, applyViewport, this](const std::vector<RT64::View::RenderInstance> &rasterInstances, UINT baseInstanceIndex, bool applyScissorsAndViewports) {
-		d3dCommandList->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-		UINT rasterSz = (UINT)(rasterInstances.size());
-		Shader *previousShader = nullptr;
-		for (UINT j = 0; j < rasterSz; j++) {
-			const RenderInstance &renderInstance = rasterInstances[j];
-			if (applyScissorsAndViewports) {
-				applyScissor(renderInstance.scissorRect);
-				applyViewport(renderInstance.viewport);
-			}
+	// Large amounts of draws are recorded in order on command lists of their own from the worker threads.
+	auto drawInstances = [this, d3dCommandList, commandLog, &viewport, &scissorRect, &heaps, &frame, resetScissor, resetViewport](const std::vector<RT64::View::RenderInstance> &rasterInstances, UINT baseInstanceIndex, bool applyScissorsAndViewports, CD3DX12_CPU_DESCRIPTOR_HANDLE rtvHandle) {
+		Device *device = scene->getDevice();
+		batchRasterInstances(rasterInstances, applyScissorsAndViewports, rasterDraws);
 
-			if (previousShader != renderInstance.shader) {
-				const auto &rasterGroup = renderInstance.shader->getRasterGroup();
-				d3dCommandList->SetPipelineState(rasterGroup.pipelineState);
-				d3dCommandList->SetGraphicsRootSignature(rasterGroup.rootSignature);
-				previousShader = renderInstance.shader;
+		const size_t drawCount = rasterDraws.size();
+		const size_t listCount = std::min<size_t>(device->getWorkerPool()->getThreadCount(), drawCount / MinDrawsPerCommandList);
+		if (listCount <= 1) {
+			recordRasterInstances(d3dCommandList, frame.descriptorHeap, rasterInstances, rasterDraws, 0, drawCount, baseInstanceIndex, applyScissorsAndViewports, scissorApplied, viewportApplied, rasterStats);
+		}
+		else {
+			std::vector<RT64_RASTER_STATS> listStats(listCount, RT64_RASTER_STATS());
+			device->recordCommandLists(listCount, [&](ID3D12GraphicsCommandList4 *commandList, size_t listIndex) {
+				// The lists start without any state, so they're set up the same way the device list was before the draws.
+				bool listScissorApplied = false;
+				bool listViewportApplied = false;
+				commandList->OMSetRenderTargets(1, &rtvHandle, FALSE, nullptr);
+				commandList->RSSetViewports(1, &viewport);
+				commandList->RSSetScissorRects(1, &scissorRect);
+
+				const size_t begin = (drawCount * listIndex) / listCount;
+				const size_t end = (drawCount * (listIndex + 1)) / listCount;
+				recordRasterInstances(commandList, frame.descriptorHeap, rasterInstances, rasterDraws, begin, end, baseInstanceIndex, applyScissorsAndViewports, listScissorApplied, listViewportApplied, listStats[listIndex]);
+			});
+
+			for (const RT64_RASTER_STATS &stats : listStats) {
+				rasterStats.drawCount += stats.drawCount;
+				rasterStats.instanceCount += stats.instanceCount;
+				rasterStats.pipelineChanges += stats.pipelineChanges;
+				rasterStats.rootSignatureChanges += stats.rootSignatureChanges;
+				rasterStats.meshChanges += stats.meshChanges;
 			}
 
-			if (j == 0) {
-				d3dCommandList->SetDescriptorHeaps(static_cast<UINT>(heaps.size()), heaps.data());
-				d3dCommandList->SetGraphicsRootDescriptorTable(1, descriptorHeap->GetGPUDescriptorHandleForHeapStart());
-			}
+			// The device list was reset after the lists were submitted, so the state the following commands rely on
+			// must be set again.
+			d3dCommandList->OMSetRenderTargets(1, &rtvHandle, FALSE, nullptr);
+			d3dCommandList->SetDescriptorHeaps(static_cast<UINT>(heaps.size()), heaps.data());
+			d3dCommandList->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+			resetScissor();
+			resetViewport();
+		}
 
-			d3dCommandList->SetGraphicsRoot32BitConstant(0, baseInstanceIndex + j, 0);
-			d3dCommandList->IASetVertexBuffers(0, 1, renderInstance.vertexBufferView);
-			d3dCommandList->IASetIndexBuffer(renderInstance.indexBufferView);
-			d3dCommandList->DrawIndexedInstanced(renderInstance.indexCount, 1, 0, 0, 0);
+		// The log isn't shared with the worker threads, so the draws are recorded to it afterwards.
+		for (const RasterDraw &draw : rasterDraws) {
+			const RenderInstance &renderInstance = rasterInstances[draw.firstInstance];
+			commandLog->record(CommandLog::Type::Draw, renderInstance.instance, renderInstance.indexCount, draw.instanceCount);
 		}
 	};
 
 	// Draw the background instances to the screen.
+	rasterStats = {};
 	resetScissor();
 	resetViewport();
-	drawInstances(rasterBgInstances, (UINT)(rtInstances.size()), true);
+	drawInstances(rasterBgInstances, (UINT)(rtInstances.size()), true, scene->getDevice()->getD3D12RTV());
 	
 	// Draw the background instances to a buffer that can be used by the tracer as an environment map.
 	{
 		// Transition the background texture render target.
-		CD3DX12_RESOURCE_BARRIER bgBarrier = CD3DX12_RESOURCE_BARRIER::Transition(rasterBg.Get(), D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE, D3D12_RESOURCE_STATE_RENDER_TARGET);
-		d3dCommandList->ResourceBarrier(1, &bgBarrier);
+		device->queueTransition(rasterBg.Get(), D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE, D3D12_RESOURCE_STATE_RENDER_TARGET);
+		device->submitBarriers();
 		
 		// Set as render target and clear it.
 		CD3DX12_CPU_DESCRIPTOR_HANDLE rtvHandle(rasterBgHeap->GetCPUDescriptorHandleForHeapStart(), 0, outputRtvDescriptorSize);
@@ -725,18 +1132,21 @@ void RT64::View::render() {
 		// Draw background instances to it.
 		resetScissor();
 		resetViewport();
-		drawInstances(rasterBgInstances, (UINT)(rtInstances.size()), false);
+		drawInstances(rasterBgInstances, (UINT)(rtInstances.size()), false, rtvHandle);
 		
 		// Transition the the background from render target to SRV.
-		bgBarrier = CD3DX12_RESOURCE_BARRIER::Transition(rasterBg.Get(), D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
-		d3dCommandList->ResourceBarrier(1, &bgBarrier);
+		device->queueTransition(rasterBg.Get(), D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
 	}
 
-	// Raytracing.
+	// The raytracing output is transitioned in the same batch as the background.
 	if (!rtInstances.empty()) {
-		CD3DX12_RESOURCE_BARRIER rtBarrier = CD3DX12_RESOURCE_BARRIER::Transition(rtOutput.Get(), D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
-		d3dCommandList->ResourceBarrier(1, &rtBarrier);
+		device->queueTransition(rtOutput.Get(), D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+	}
+
+	device->submitBarriers();
 
+	// Raytracing.
+	if (!rtInstances.empty()) {
 		// Determine whether to use the viewport and scissor from the first RT Instance or not.
 		// TODO: Some less hackish way to determine what viewport to use for the raytraced content perhaps.
 		CD3DX12_RECT rtScissorRect = rtInstances[0].scissorRect;
@@ -753,25 +1163,11 @@ void RT64::View::render() {
 		viewParamsBufferData.viewport[1] = rtViewport.TopLeftY;
 		viewParamsBufferData.viewport[2] = rtViewport.Width;
 		viewParamsBufferData.viewport[3] = rtViewport.Height;
-		updateViewParamsBuffer();
+		updateViewParamsBuffer(frame);
 
-		// Ray generation.
+		// Shader tables.
 		D3D12_DISPATCH_RAYS_DESC desc = {};
-		uint32_t rayGenerationSectionSizeInBytes = sbtHelper.GetRayGenSectionSize();
-		desc.RayGenerationShaderRecord.StartAddress = sbtStorage.Get()->GetGPUVirtualAddress();
-		desc.RayGenerationShaderRecord.SizeInBytes = rayGenerationSectionSizeInBytes;
-
-		// Miss shader table.
-		uint32_t missSectionSizeInBytes = sbtHelper.GetMissSectionSize();
-		desc.MissShaderTable.StartAddress = sbtStorage.Get()->GetGPUVirtualAddress() + rayGenerationSectionSizeInBytes;
-		desc.MissShaderTable.SizeInBytes = missSectionSizeInBytes;
-		desc.MissShaderTable.StrideInBytes = sbtHelper.GetMissEntrySize();
-
-		// Hit group table.
-		uint32_t hitGroupsSectionSize = sbtHelper.GetHitGroupSectionSize();
-		desc.HitGroupTable.StartAddress = sbtStorage.Get()->GetGPUVirtualAddress() + rayGenerationSectionSizeInBytes + missSectionSizeInBytes;
-		desc.HitGroupTable.SizeInBytes = hitGroupsSectionSize;
-		desc.HitGroupTable.StrideInBytes = sbtHelper.GetHitGroupEntrySize();
+		frame.shaderTable->fillDispatchRaysDesc(desc);
 		
 		// Dimensions.
 		desc.Width = rtWidth;
@@ -781,19 +1177,20 @@ void RT64::View::render() {
 		// Bind pipeline and dispatch rays.
 		d3dCommandList->SetPipelineState1(scene->getDevice()->getD3D12RtStateObject());
 		d3dCommandList->DispatchRays(&desc);
+		commandLog->record(CommandLog::Type::DispatchRays, frame.shaderTable->getBuffer(), desc.Width * desc.Height, (UINT)(rtInstances.size()));
+
+		// The denoiser reads the albedo and the normals written by the rays, so their barriers go in the same batch.
+		const bool denoise = denoiserEnabled && (denoiser != nullptr);
+		device->queueTransition(rtOutput.Get(), D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE);
+		if (denoise) {
+			device->queueUAVBarrier(rtAlbedo.Get());
+			device->queueUAVBarrier(rtNormal.Get());
+		}
 
-		CD3DX12_RESOURCE_BARRIER barrier = CD3DX12_RESOURCE_BARRIER::Transition(rtOutput.Get(), D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE);
-		d3dCommandList->ResourceBarrier(1, &barrier);
+		device->submitBarriers();
 
 		// Denoiser.
-		if (denoiserEnabled && (denoiser != nullptr)) {
-			CD3DX12_RESOURCE_BARRIER barriers[] = {
-				CD3DX12_RESOURCE_BARRIER::UAV(rtAlbedo.Get()),
-				CD3DX12_RESOURCE_BARRIER::UAV(rtNormal.Get())
-			};
-
-			d3dCommandList->ResourceBarrier(_countof(barriers), barriers);
-			
+		if (denoise) {
 			// Wait for the raytracing step to be finished.
 			// TODO: Maybe use a fence for this instead so we don't need to wait on all of the GPU operations.
 			scene->getDevice()->submitCommandList();
@@ -819,12 +1216,13 @@ void RT64::View::render() {
 		// Draw the raytracing output.
 		d3dCommandList->SetPipelineState(scene->getDevice()->getComposePipelineState());
 		d3dCommandList->SetGraphicsRootSignature(scene->getDevice()->getComposeRootSignature());
-		std::vector<ID3D12DescriptorHeap *> composeHeaps = { composeHeap };
+		std::vector<ID3D12DescriptorHeap *> composeHeaps = { frame.composeHeap };
 		d3dCommandList->SetDescriptorHeaps(static_cast<UINT>(composeHeaps.size()), composeHeaps.data());
-		d3dCommandList->SetGraphicsRootDescriptorTable(0, composeHeap->GetGPUDescriptorHandleForHeapStart());
+		d3dCommandList->SetGraphicsRootDescriptorTable(0, frame.composeHeap->GetGPUDescriptorHandleForHeapStart());
 		d3dCommandList->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
 		d3dCommandList->IASetVertexBuffers(0, 0, nullptr);
 		d3dCommandList->DrawInstanced(3, 1, 0, 0);
+		commandLog->record(CommandLog::Type::Draw, rtOutput.Get(), 3, 1);
 	}
 	else {
 		CD3DX12_CPU_DESCRIPTOR_HANDLE rtvHandle = scene->getDevice()->getD3D12RTV();
@@ -834,24 +1232,93 @@ void RT64::View::render() {
 	// Draw the foreground to the screen.
 	resetScissor();
 	resetViewport();
-	drawInstances(rasterFgInstances, (UINT)(rasterBgInstances.size() + rtInstances.size()), true);
+	drawInstances(rasterFgInstances, (UINT)(rasterBgInstances.size() + rtInstances.size()), true, scene->getDevice()->getD3D12RTV());
 
 	// Clear flags.
-	rtHitInstanceIdReadbackUpdated = false;
 	viewParamsBufferUpdatedThisFrame = false;
 	viewParamsBufferData.frameCount++;
 }
 
+void RT64::View::recordRasterInstances(ID3D12GraphicsCommandList4 *commandList, ID3D12DescriptorHeap *descriptorHeap, const std::vector<RenderInstance> &rasterInstances, const std::vector<RasterDraw> &draws, size_t begin, size_t end, UINT baseInstanceIndex, bool applyScissorsAndViewports, bool &instanceScissorApplied, bool &instanceViewportApplied, RT64_RASTER_STATS &stats) const {
+	// Instances without a scissor or a viewport of their own use the full ones of the device.
+	const CD3DX12_RECT fullScissorRect = scene->getDevice()->getD3D12ScissorRect();
+	const CD3DX12_VIEWPORT fullViewport = scene->getDevice()->getD3D12Viewport();
+	commandList->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+	Shader *previousShader = nullptr;
+	ID3D12RootSignature *previousRootSignature = nullptr;
+	const D3D12_VERTEX_BUFFER_VIEW *previousVertexBufferView = nullptr;
+	const D3D12_INDEX_BUFFER_VIEW *previousIndexBufferView = nullptr;
+	for (size_t j = begin; j < end; j++) {
+		const RasterDraw &draw = draws[j];
+		const RenderInstance &renderInstance = rasterInstances[draw.firstInstance];
+		if (applyScissorsAndViewports) {
+			if (renderInstance.scissorRect.right > renderInstance.scissorRect.left) {
+				commandList->RSSetScissorRects(1, &renderInstance.scissorRect);
+				instanceScissorApplied = true;
+			}
+			else if (instanceScissorApplied) {
+				commandList->RSSetScissorRects(1, &fullScissorRect);
+				instanceScissorApplied = false;
+			}
+
+			if ((renderInstance.viewport.Width > 0) && (renderInstance.viewport.Height > 0)) {
+				commandList->RSSetViewports(1, &renderInstance.viewport);
+				instanceViewportApplied = true;
+			}
+			else if (instanceViewportApplied) {
+				commandList->RSSetViewports(1, &fullViewport);
+				instanceViewportApplied = false;
+			}
+		}
+
+		if (previousShader != renderInstance.shader) {
+			const auto &rasterGroup = renderInstance.shader->getRasterGroup();
+			commandList->SetPipelineState(rasterGroup.pipelineState);
+			stats.pipelineChanges++;
+
+			// Changing the root signature resets the root arguments, so the descriptor table is bound again after it.
+			if (previousRootSignature != rasterGroup.rootSignature) {
+				commandList->SetGraphicsRootSignature(rasterGroup.rootSignature);
+				if (j == begin) {
+					commandList->SetDescriptorHeaps(1, &descriptorHeap);
+				}
+
+				commandList->SetGraphicsRootDescriptorTable(1, descriptorHeap->GetGPUDescriptorHandleForHeapStart());
+				previousRootSignature = rasterGroup.rootSignature;
+				stats.rootSignatureChanges++;
+			}
+
+			previousShader = renderInstance.shader;
+		}
+
+		// Consecutive draws of the same mesh keep the buffers bound.
+		if ((previousVertexBufferView != renderInstance.vertexBufferView) || (previousIndexBufferView != renderInstance.indexBufferView)) {
+			commandList->IASetVertexBuffers(0, 1, renderInstance.vertexBufferView);
+			commandList->IASetIndexBuffer(renderInstance.indexBufferView);
+			previousVertexBufferView = renderInstance.vertexBufferView;
+			previousIndexBufferView = renderInstance.indexBufferView;
+			stats.meshChanges++;
+		}
+
+		// SV_InstanceID always starts from zero, so the index of the first instance is still passed as a constant.
+		commandList->SetGraphicsRoot32BitConstant(0, baseInstanceIndex + (UINT)(draw.firstInstance), 0);
+		commandList->DrawIndexedInstanced(renderInstance.indexCount, draw.instanceCount, 0, 0, 0);
+		stats.drawCount++;
+		stats.instanceCount += draw.instanceCount;
+	}
+}
+
 void RT64::View::renderInspector(Inspector *inspector) {
-	if (Im3d::GetDrawListCount() > 0) {
+	FrameResources &frame = getFrameResources();
+	if ((Im3d::GetDrawListCount() > 0) && (frame.descriptorHeap != nullptr)) {
 		auto d3dCommandList = scene->getDevice()->getD3D12CommandList();
 		auto viewport = scene->getDevice()->getD3D12Viewport();
 		auto scissorRect = scene->getDevice()->getD3D12ScissorRect();
 		d3dCommandList->SetGraphicsRootSignature(scene->getDevice()->getIm3dRootSignature());
 
-		std::vector<ID3D12DescriptorHeap *> heaps = { descriptorHeap };
+		std::vector<ID3D12DescriptorHeap *> heaps = { frame.descriptorHeap };
 		d3dCommandList->SetDescriptorHeaps(static_cast<UINT>(heaps.size()), heaps.data());
-		d3dCommandList->SetGraphicsRootDescriptorTable(0, descriptorHeap->GetGPUDescriptorHandleForHeapStart());
+		d3dCommandList->SetGraphicsRootDescriptorTable(0, frame.descriptorHeap->GetGPUDescriptorHandleForHeapStart());
 
 		d3dCommandList->RSSetViewports(1, &viewport);
 		d3dCommandList->RSSetScissorRects(1, &scissorRect);
@@ -863,38 +1330,38 @@ void RT64::View::renderInspector(Inspector *inspector) {
 		}
 
 		if (totalVertexCount > 0) {
-			// Release the previous vertex buffer if it should be bigger.
-			if (!im3dVertexBuffer.IsNull() && (totalVertexCount > im3dVertexCount)) {
-				im3dVertexBuffer.Release();
+			// Retire the previous vertex buffer of the frame slot if it should be bigger.
+			if (!frame.im3dVertexBuffer.IsNull() && (totalVertexCount > frame.im3dVertexCount)) {
+				scene->getDevice()->retireResource(frame.im3dVertexBuffer);
 			}
 
 			// Create the vertex buffer if it's empty.
 			const UINT vertexBufferSize = totalVertexCount * sizeof(Im3d::VertexData);
-			if (im3dVertexBuffer.IsNull()) {
+			if (frame.im3dVertexBuffer.IsNull()) {
 				CD3DX12_RESOURCE_DESC uploadBufferDesc = CD3DX12_RESOURCE_DESC::Buffer(vertexBufferSize);
-				im3dVertexBuffer = scene->getDevice()->allocateResource(D3D12_HEAP_TYPE_UPLOAD, &uploadBufferDesc, D3D12_RESOURCE_STATE_GENERIC_READ, nullptr);
-				im3dVertexCount = totalVertexCount;
-				im3dVertexBufferView.BufferLocation = im3dVertexBuffer.Get()->GetGPUVirtualAddress();
-				im3dVertexBufferView.StrideInBytes = sizeof(Im3d::VertexData);
-				im3dVertexBufferView.SizeInBytes = vertexBufferSize;
+				frame.im3dVertexBuffer = scene->getDevice()->allocateResource(D3D12_HEAP_TYPE_UPLOAD, &uploadBufferDesc, D3D12_RESOURCE_STATE_GENERIC_READ, nullptr);
+				frame.im3dVertexCount = totalVertexCount;
+				frame.im3dVertexBufferView.BufferLocation = frame.im3dVertexBuffer.Get()->GetGPUVirtualAddress();
+				frame.im3dVertexBufferView.StrideInBytes = sizeof(Im3d::VertexData);
+				frame.im3dVertexBufferView.SizeInBytes = vertexBufferSize;
 			}
 
 			// Copy data to vertex buffer.
 			UINT8 *pDataBegin;
 			CD3DX12_RANGE readRange(0, 0);
-			D3D12_CHECK(im3dVertexBuffer.Get()->Map(0, &readRange, reinterpret_cast<void **>(&pDataBegin)));
+			D3D12_CHECK(frame.im3dVertexBuffer.Get()->Map(0, &readRange, reinterpret_cast<void **>(&pDataBegin)));
 			for (Im3d::U32 i = 0, n = Im3d::GetDrawListCount(); i < n; ++i) {
 				auto &drawList = Im3d::GetDrawLists()[i];
 				size_t copySize = sizeof(Im3d::VertexData) * drawList.m_vertexCount;
 				memcpy(pDataBegin, drawList.m_vertexData, copySize);
 				pDataBegin += copySize;
 			}
-			im3dVertexBuffer.Get()->Unmap(0, nullptr);
+			frame.im3dVertexBuffer.Get()->Unmap(0, nullptr);
 
 			unsigned int vertexOffset = 0;
 			for (Im3d::U32 i = 0, n = Im3d::GetDrawListCount(); i < n; ++i) {
 				auto &drawList = Im3d::GetDrawLists()[i];
-				d3dCommandList->IASetVertexBuffers(0, 1, &im3dVertexBufferView);
+				d3dCommandList->IASetVertexBuffers(0, 1, &frame.im3dVertexBufferView);
 				switch (drawList.m_primType) {
 				case Im3d::DrawPrimitive_Points:
 					d3dCommandList->SetPipelineState(scene->getDevice()->getIm3dPipelineStatePoint());
@@ -913,6 +1380,7 @@ void RT64::View::renderInspector(Inspector *inspector) {
 				}
 
 				d3dCommandList->DrawInstanced(drawList.m_vertexCount, 1, vertexOffset, 0);
+				scene->getDevice()->getCommandLog()->record(CommandLog::Type::Draw, frame.im3dVertexBuffer.Get(), drawList.m_vertexCount, 1);
 				vertexOffset += drawList.m_vertexCount;
 			}
 		}
@@ -1062,50 +1530,108 @@ RT64_VECTOR3 RT64::View::getRayDirectionAt(int px, int py) {
 }
 
 RT64_INSTANCE *RT64::View::getRaytracedInstanceAt(int x, int y) {
-	// TODO: This doesn't handle cases properly when nothing was hit at the target pixel and returns
-	// the first instance instead. We need to determine what's the best solution for that.
-
-	// Copy instance id resource to readback if necessary.
-	if (!rtHitInstanceIdReadbackUpdated) {
-		auto d3dCommandList = scene->getDevice()->getD3D12CommandList();
-		CD3DX12_RESOURCE_BARRIER rtBarrier = CD3DX12_RESOURCE_BARRIER::Transition(rtHitInstanceId.Get(), D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_COPY_SOURCE);
-		d3dCommandList->ResourceBarrier(1, &rtBarrier);
-		d3dCommandList->CopyResource(rtHitInstanceIdReadback.Get(), rtHitInstanceId.Get());
-		rtBarrier = CD3DX12_RESOURCE_BARRIER::Transition(rtHitInstanceId.Get(), D3D12_RESOURCE_STATE_COPY_SOURCE, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
-		d3dCommandList->ResourceBarrier(1, &rtBarrier);
-		scene->getDevice()->submitCommandList();
-		scene->getDevice()->waitForGPU();
-		scene->getDevice()->resetCommandList();
-		rtHitInstanceIdReadbackUpdated = true;
-	}
-
-	// Check resource's bounds.
+	// Check the bounds of the raytracing resolution.
 	x = (int)(x * rtScale);
 	y = (int)(y * rtScale);
 	if ((x < 0) || (x >= rtWidth) || (y < 0) || (y >= rtHeight)) {
 		return nullptr;
 	}
-	
-	// Map the resource read the pixel.
-	size_t index = (rtWidth * y + x) * 2;
-	uint16_t instanceId = 0;
-	uint8_t *pData;
-	D3D12_CHECK(rtHitInstanceIdReadback.Get()->Map(0, nullptr, (void **)(&pData)));
-	memcpy(&instanceId, pData + index, sizeof(instanceId));
-	rtHitInstanceIdReadback.Get()->Unmap(0, nullptr);
-	
-	// Check the matching instance.
-	if (instanceId >= rtInstances.size()) {
+
+	// Cast the same ray as the one for the pixel against the scene on the CPU instead of reading
+	// back the hit buffers, so the GPU doesn't need to be synchronized. The instances are only
+	// gathered again after the view has been updated.
+	if (pickTracer == nullptr) {
+		pickTracer = new ReferenceTracer(scene->getDevice()->getWorkerPool());
+	}
+
+	if (pickTracerDirty) {
+		pickTracer->setInstances(getReferenceInstances());
+		pickTracerDirty = false;
+	}
+
+	pickTracer->setParams(getReferenceParams());
+	int instanceId = pickTracer->pick(x, y, rtWidth, rtHeight);
+	if ((instanceId < 0) || (instanceId >= (int)(rtInstances.size()))) {
 		return nullptr;
 	}
 	
 	return (RT64_INSTANCE *)(rtInstances[instanceId].instance);
 }
 
+std::vector<RT64::ReferenceTracer::Instance> RT64::View::getReferenceInstances() const {
+	// Use the same instance order as the TLAS so the instance IDs and distance biases match.
+	std::vector<ReferenceTracer::Instance> tracerInstances;
+	tracerInstances.reserve(rtInstances.size());
+	for (const RenderInstance &renderInstance : rtInstances) {
+		ReferenceTracer::Instance tracerInstance;
+		tracerInstance.mesh = renderInstance.instance->getMesh();
+		tracerInstance.shader = renderInstance.shader;
+		tracerInstance.diffuseTexture = renderInstance.instance->getDiffuseTexture();
+		tracerInstance.normalTexture = renderInstance.instance->getNormalTexture();
+		tracerInstance.specularTexture = renderInstance.instance->getSpecularTexture();
+		tracerInstance.transform = renderInstance.transform;
+		tracerInstance.material = renderInstance.material;
+		tracerInstance.cullDisable = (renderInstance.flags & D3D12_RAYTRACING_INSTANCE_FLAG_TRIANGLE_CULL_DISABLE) != 0;
+		tracerInstances.push_back(tracerInstance);
+	}
+
+	return tracerInstances;
+}
+
+RT64::ReferenceTracer::Params RT64::View::getReferenceParams() const {
+	// Derive the same parameters updateViewParamsBuffer() would upload for this camera.
+	ReferenceTracer::Params params;
+	XMVECTOR det;
+	params.view = viewParamsBufferData.view;
+	params.projection = viewParamsBufferData.projection;
+	params.viewI = XMMatrixInverse(&det, viewParamsBufferData.view);
+	params.projectionI = XMMatrixInverse(&det, viewParamsBufferData.projection);
+	XXHash32 viewProjHash(0);
+	viewProjHash.add(&params.view, sizeof(XMMATRIX));
+	viewProjHash.add(&params.projection, sizeof(XMMATRIX));
+	params.randomSeed = viewProjHash.hash();
+	params.softLightSamples = viewParamsBufferData.softLightSamples;
+	params.giBounces = viewParamsBufferData.giBounces;
+	params.giEnvBounces = viewParamsBufferData.giEnvBounces;
+	params.maxLightSamples = viewParamsBufferData.maxLightSamples;
+	params.ambGIMixWeight = viewParamsBufferData.ambGIMixWeight;
+	params.frameCount = viewParamsBufferData.frameCount;
+	return params;
+}
+
+void RT64::View::renderReference(int width, int height, RT64_VECTOR4 *output, RT64_VECTOR4 *albedo, RT64_VECTOR4 *normal) {
+	ReferenceTracer tracer(scene->getDevice()->getWorkerPool());
+	tracer.setInstances(getReferenceInstances());
+	tracer.setLights(scene->getLights());
+	tracer.setParams(getReferenceParams());
+	tracer.render(width, height, output, albedo, normal);
+}
+
 void RT64::View::resize() {
 	createOutputBuffers();
 }
 
+unsigned int RT64::View::getTopLevelASRebuildCount() const {
+	return topLevelASRebuildCount;
+}
+
+unsigned int RT64::View::getTopLevelASRefitCount() const {
+	return topLevelASRefitCount;
+}
+
+unsigned int RT64::View::getShaderTableWriteCount() const {
+	unsigned int writeCount = 0;
+	for (const FrameResources &frame : frames) {
+		writeCount += frame.shaderTable->getWriteCount();
+	}
+
+	return writeCount;
+}
+
+const RT64_RASTER_STATS &RT64::View::getRasterStats() const {
+	return rasterStats;
+}
+
 int RT64::View::getWidth() const {
 	return scene->getDevice()->getWidth();
 }
@@ -1145,6 +1671,22 @@ DLLEXPORT RT64_INSTANCE *RT64_GetViewRaytracedInstanceAt(RT64_VIEW *viewPtr, int
 	return view->getRaytracedInstanceAt(x, y);
 }
 
+DLLEXPORT void RT64_GetViewRasterStats(RT64_VIEW *viewPtr, RT64_RASTER_STATS *stats) {
+	assert(viewPtr != nullptr);
+	assert(stats != nullptr);
+	RT64::View *view = (RT64::View *)(viewPtr);
+	*stats = view->getRasterStats();
+}
+
+DLLEXPORT void RT64_RenderViewReference(RT64_VIEW *viewPtr, int width, int height, RT64_VECTOR4 *output, RT64_VECTOR4 *albedo, RT64_VECTOR4 *normal) {
+	assert(viewPtr != nullptr);
+	assert(width > 0);
+	assert(height > 0);
+	assert(output != nullptr);
+	RT64::View *view = (RT64::View *)(viewPtr);
+	view->renderReference(width, height, output, albedo, normal);
+}
+
 DLLEXPORT void RT64_DestroyView(RT64_VIEW *viewPtr) {
 	delete (RT64::View *)(viewPtr);
 }
@@ -7,14 +7,18 @@
 #include "rt64_common.h"
 
 #include <map>
+#include <unordered_map>
 
 #include "nv_helpers_dx12/TopLevelASGenerator.h"
-#include "nv_helpers_dx12/ShaderBindingTableGenerator.h"
+
+#include "rt64_frame_scheduler.h"
+#include "rt64_reference_tracer.h"
 
 namespace RT64 {
 	class Denoiser;
 	class Scene;
 	class Shader;
+	class ShaderTable;
 	class Inspector;
 	class Instance;
 	class Texture;
@@ -29,12 +33,21 @@ namespace RT64 {
 			ID3D12Resource* bottomLevelAS;
 			DirectX::XMMATRIX transform;
 			RT64_MATERIAL material;
+
+			// Scale and offset of the diffuse, normal and specular textures inside their atlas pages.
+			RT64_VECTOR4 texScaleOffsets[3];
 			Shader *shader;
 			CD3DX12_RECT scissorRect;
 			CD3DX12_VIEWPORT viewport;
 			UINT flags;
 		};
 
+		// Run of consecutive raster instances that share all the state of the draw and are drawn as instances of it.
+		struct RasterDraw {
+			size_t firstInstance;
+			UINT instanceCount;
+		};
+
 		struct ViewParamsBuffer {
 			XMMATRIX view;
 			XMMATRIX projection;
@@ -52,6 +65,37 @@ namespace RT64 {
 			unsigned int frameCount;
 		};
 
+		struct TopLevelASInstance {
+			ID3D12Resource *bottomLevelAS;
+			UINT flags;
+			XMFLOAT3 position;
+			float radius;
+		};
+
+		// Everything the CPU writes for the GPU to read during the frame. Each frame slot has its own copy, which is
+		// brought up to date when the slot is recorded again. The versions tell if the slot missed a full update,
+		// and the dirty slots list the instances that changed in place since it was last recorded.
+		struct FrameResources {
+			ID3D12DescriptorHeap *descriptorHeap;
+			UINT descriptorHeapEntryCount;
+			ID3D12DescriptorHeap *composeHeap;
+			ShaderTable *shaderTable;
+			AllocatedResource viewParamBufferResource;
+			AllocatedResource instanceTransforms;
+			uint32_t instanceTransformsSize;
+			AllocatedResource instanceMaterials;
+			uint32_t instanceMaterialsSize;
+			AllocatedResource topLevelASInstanceDescs;
+			UINT64 topLevelASInstanceDescsSize;
+			AllocatedResource im3dVertexBuffer;
+			D3D12_VERTEX_BUFFER_VIEW im3dVertexBufferView;
+			unsigned int im3dVertexCount;
+			std::vector<uint32_t> dirtyInstanceSlots;
+			uint64_t instancesVersion;
+			uint64_t descriptorsVersion;
+			uint64_t shaderTableVersion;
+		};
+
 		Scene *scene;
 		float fovRadians;
 		float nearDist;
@@ -59,6 +103,9 @@ namespace RT64 {
 		bool perspectiveControlActive;
 		AccelerationStructureBuffers topLevelASBuffers;
 		nv_helpers_dx12::TopLevelASGenerator topLevelASGenerator;
+		std::vector<TopLevelASInstance> topLevelASInstances;
+		unsigned int topLevelASRebuildCount;
+		unsigned int topLevelASRefitCount;
 		AllocatedResource rasterBg;
 		ID3D12DescriptorHeap *rasterBgHeap;
 		AllocatedResource rtOutput;
@@ -69,7 +116,6 @@ namespace RT64 {
 		AllocatedResource rtHitNormal;
 		AllocatedResource rtHitSpecular;
 		AllocatedResource rtHitInstanceId;
-		AllocatedResource rtHitInstanceIdReadback;
 		int rtWidth;
 		int rtHeight;
 		float rtScale;
@@ -77,44 +123,50 @@ namespace RT64 {
 		bool denoiserEnabled;
 		Denoiser *denoiser;
 
-		bool rtHitInstanceIdReadbackUpdated;
+		ReferenceTracer *pickTracer;
+		bool pickTracerDirty;
 		UINT outputRtvDescriptorSize;
-		ID3D12DescriptorHeap *descriptorHeap;
-		UINT descriptorHeapEntryCount;
-		ID3D12DescriptorHeap *composeHeap;
-		nv_helpers_dx12::ShaderBindingTableGenerator sbtHelper;
-		AllocatedResource sbtStorage;
-		UINT64 sbtStorageSize;
-		AllocatedResource viewParamBufferResource;
+		FrameResources frames[FrameScheduler::FramesInFlight];
+		uint64_t instancesVersion;
+		uint64_t descriptorsVersion;
+		uint64_t shaderTableVersion;
 		ViewParamsBuffer viewParamsBufferData;
 		uint32_t viewParamsBufferSize;
 		bool viewParamsBufferUpdatedThisFrame;
-		AllocatedResource activeInstancesBufferTransforms;
-		uint32_t activeInstancesBufferTransformsSize;
-		AllocatedResource activeInstancesBufferMaterials;
-		uint32_t activeInstancesBufferMaterialsSize;
 		std::vector<RenderInstance> rasterBgInstances;
 		std::vector<RenderInstance> rasterFgInstances;
 		std::vector<RenderInstance> rtInstances;
-		std::vector<Texture *> usedTextures;
+		std::unordered_map<Instance *, uint32_t> instanceSlots;
+		bool instancesDirty;
 		bool scissorApplied;
 		bool viewportApplied;
-
-		AllocatedResource im3dVertexBuffer;
-		D3D12_VERTEX_BUFFER_VIEW im3dVertexBufferView;
-		unsigned int im3dVertexCount;
+		RT64_RASTER_STATS rasterStats;
+		std::vector<RasterDraw> rasterDraws;
 		
 		void createOutputBuffers();
 		void releaseOutputBuffers();
-		void createInstanceTransformsBuffer();
-		void updateInstanceTransformsBuffer();
-		void createInstanceMaterialsBuffer();
-		void updateInstanceMaterialsBuffer();
+		FrameResources &getFrameResources();
+		bool createInstanceTransformsBuffer(FrameResources &frame);
+		void updateInstanceTransformsBuffer(FrameResources &frame, const std::vector<uint32_t> *slots);
+		bool createInstanceMaterialsBuffer(FrameResources &frame);
+		void updateInstanceMaterialsBuffer(FrameResources &frame, const std::vector<uint32_t> *slots);
 		void createTopLevelAS(const std::vector<RenderInstance> &rtInstances);
-		void createShaderResourceHeap();
-		void createShaderBindingTable();
+		uint32_t getRequiredDescriptorHeapEntryCount() const;
+		void createShaderResourceHeap(FrameResources &frame);
+		void createShaderBindingTable(FrameResources &frame);
 		void createViewParamsBuffer();
-		void updateViewParamsBuffer();
+		void updateViewParamsBuffer(FrameResources &frame);
+		void updateFrameResources();
+		void updateRenderInstanceRects(RenderInstance &renderInstance, unsigned int screenHeight);
+		RenderInstance &getRenderInstance(uint32_t slot);
+		bool isInstanceListChanged(Instance *instance) const;
+		void recordRasterInstances(ID3D12GraphicsCommandList4 *commandList, ID3D12DescriptorHeap *descriptorHeap, const std::vector<RenderInstance> &rasterInstances, const std::vector<RasterDraw> &draws, size_t begin, size_t end, UINT baseInstanceIndex, bool applyScissorsAndViewports, bool &instanceScissorApplied, bool &instanceViewportApplied, RT64_RASTER_STATS &stats) const;
+		static void sortRasterInstances(std::vector<RenderInstance> &rasterInstances);
+		static void batchRasterInstances(const std::vector<RenderInstance> &rasterInstances, bool applyScissorsAndViewports, std::vector<RasterDraw> &draws);
+		void gatherInstances();
+		void updateDirtyInstances();
+		std::vector<ReferenceTracer::Instance> getReferenceInstances() const;
+		ReferenceTracer::Params getReferenceParams() const;
 	public:
 		View(Scene *scene);
 		virtual ~View();
@@ -146,7 +198,12 @@ namespace RT64 {
 		bool getDenoiserEnabled() const;
 		RT64_VECTOR3 getRayDirectionAt(int x, int y);
 		RT64_INSTANCE *getRaytracedInstanceAt(int x, int y);
+		void renderReference(int width, int height, RT64_VECTOR4 *output, RT64_VECTOR4 *albedo, RT64_VECTOR4 *normal);
 		void resize();
+		unsigned int getTopLevelASRebuildCount() const;
+		unsigned int getTopLevelASRefitCount() const;
+		unsigned int getShaderTableWriteCount() const;
+		const RT64_RASTER_STATS &getRasterStats() const;
 		int getWidth() const;
 		int getHeight() const;
 	};
@@ -0,0 +1,95 @@
+//
+// RT64
+//
+
+#ifndef RT64_MINIMAL
+
+#include "rt64_workers.h"
+
+// Private
+
+RT64::WorkerPool::WorkerPool(unsigned int threadCount) {
+	taskFunction = nullptr;
+	taskCount = 0;
+	nextTask = 0;
+	activeThreads = 0;
+	generation = 0;
+	stopping = false;
+
+	// Use all the hardware threads by default. The calling thread counts as one of them.
+	if (threadCount == 0) {
+		threadCount = std::max(std::thread::hardware_concurrency(), 1U);
+	}
+
+	threads.reserve(threadCount - 1);
+	for (unsigned int i = 1; i < threadCount; i++) {
+		threads.emplace_back(&WorkerPool::threadLoop, this);
+	}
+}
+
+RT64::WorkerPool::~WorkerPool() {
+	{
+		std::unique_lock<std::mutex> lock(stateMutex);
+		stopping = true;
+	}
+
+	startCondition.notify_all();
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+}
+
+void RT64::WorkerPool::threadLoop() {
+	uint64_t lastGeneration = 0;
+	std::unique_lock<std::mutex> lock(stateMutex);
+	while (true) {
+		startCondition.wait(lock, [&]() { return stopping || (generation != lastGeneration); });
+		if (stopping) {
+			return;
+		}
+
+		lastGeneration = generation;
+		lock.unlock();
+		runTasks();
+		lock.lock();
+
+		activeThreads--;
+		if (activeThreads == 0) {
+			doneCondition.notify_one();
+		}
+	}
+}
+
+void RT64::WorkerPool::runTasks() {
+	size_t taskIndex = nextTask++;
+	while (taskIndex < taskCount) {
+		(*taskFunction)(taskIndex);
+		taskIndex = nextTask++;
+	}
+}
+
+void RT64::WorkerPool::run(size_t taskCount, const std::function<void(size_t)> &function) {
+	// Only one batch of tasks can be in flight at a time.
+	std::unique_lock<std::mutex> runLock(runMutex);
+	{
+		std::unique_lock<std::mutex> lock(stateMutex);
+		this->taskFunction = &function;
+		this->taskCount = taskCount;
+		nextTask = 0;
+		activeThreads = static_cast<unsigned int>(threads.size());
+		generation++;
+	}
+
+	startCondition.notify_all();
+	runTasks();
+
+	std::unique_lock<std::mutex> lock(stateMutex);
+	doneCondition.wait(lock, [&]() { return activeThreads == 0; });
+	taskFunction = nullptr;
+}
+
+unsigned int RT64::WorkerPool::getThreadCount() const {
+	return static_cast<unsigned int>(threads.size()) + 1;
+}
+
+#endif
@@ -0,0 +1,39 @@
+//
+// RT64
+//
+
+#pragma once
+
+#include "rt64_common.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace RT64 {
+	// Fixed pool of threads that run indexed tasks in parallel. The calling thread also works on the tasks.
+	class WorkerPool {
+	private:
+		std::vector<std::thread> threads;
+		std::mutex runMutex;
+		std::mutex stateMutex;
+		std::condition_variable startCondition;
+		std::condition_variable doneCondition;
+		const std::function<void(size_t)> *taskFunction;
+		size_t taskCount;
+		std::atomic<size_t> nextTask;
+		unsigned int activeThreads;
+		uint64_t generation;
+		bool stopping;
+
+		void threadLoop();
+		void runTasks();
+	public:
+		WorkerPool(unsigned int threadCount = 0);
+		virtual ~WorkerPool();
+		void run(size_t taskCount, const std::function<void(size_t)> &function);
+		unsigned int getThreadCount() const;
+	};
+};
@@ -60,11 +60,54 @@
 #define RT64_INSTANCE_RASTER_BACKGROUND			0x1
 #define RT64_INSTANCE_DISABLE_BACKFACE_CULLING	0x2
 
+// The raster draw of the instance can be reordered with the neighboring instances that also have this flag, so the
+// draws that share a shader, textures and a mesh are grouped together. Instances without it keep their place in the
+// draw order and no other instance is moved across them, which keeps alpha blended draws in order.
+#define RT64_INSTANCE_RASTER_UNORDERED			0x4
+
+// Ray flags.
+#define RT64_RAY_ANY_HIT						0x1
+#define RT64_RAY_CULL_BACK_FACES				0x2
+
 // Light flags.
 #define RT64_LIGHT_GROUP_MASK_ALL				0xFFFFFFFF
 #define RT64_LIGHT_GROUP_DEFAULT				0x1
 #define RT64_LIGHT_MAX_SAMPLES					128
 
+// Command log types.
+#define RT64_COMMAND_ALLOCATION					0
+#define RT64_COMMAND_BARRIER					1
+#define RT64_COMMAND_COPY						2
+#define RT64_COMMAND_DRAW						3
+#define RT64_COMMAND_DISPATCH_RAYS				4
+#define RT64_COMMAND_BUILD_AS					5
+#define RT64_COMMAND_SUBMIT						6
+#define RT64_COMMAND_WAIT						7
+
+// Texture compression modes.
+#define RT64_TEXTURE_COMPRESSION_NONE			0
+#define RT64_TEXTURE_COMPRESSION_BC1_BC3		1
+#define RT64_TEXTURE_COMPRESSION_BC7			2
+
+// Highest quality accepted by SetDeviceTextureCompression. The quality goes from 0 (fastest) to this value (best)
+// and is clamped to that range.
+#define RT64_TEXTURE_COMPRESSION_QUALITY_MAX	4
+
+// Texture formats.
+#define RT64_TEXTURE_FORMAT_RGBA32				0
+#define RT64_TEXTURE_FORMAT_RGBA16				1
+#define RT64_TEXTURE_FORMAT_IA16				2
+#define RT64_TEXTURE_FORMAT_IA8					3
+#define RT64_TEXTURE_FORMAT_IA4					4
+#define RT64_TEXTURE_FORMAT_I8					5
+#define RT64_TEXTURE_FORMAT_I4					6
+#define RT64_TEXTURE_FORMAT_CI4					7
+#define RT64_TEXTURE_FORMAT_CI8					8
+
+// Texture palette formats.
+#define RT64_TEXTURE_TLUT_RGBA16				0
+#define RT64_TEXTURE_TLUT_IA16					1
+
 // Forward declaration of types.
 typedef struct RT64_DEVICE RT64_DEVICE;
 typedef struct RT64_VIEW RT64_VIEW;
@@ -158,6 +201,70 @@ typedef struct {
 	unsigned int flags;
 } RT64_INSTANCE_DESC;
 
+// Ray traced against the scene on the CPU. Hits are only accepted inside [minDistance, maxDistance].
+typedef struct {
+	RT64_VECTOR3 origin;
+	RT64_VECTOR3 direction;
+	float minDistance;
+	float maxDistance;
+	unsigned int flags;
+} RT64_RAY;
+
+// The instance is null if the ray didn't hit anything. The barycentrics are the
+// weights of the second and third vertices of the triangle.
+typedef struct {
+	RT64_INSTANCE *instance;
+	int triangleIndex;
+	RT64_VECTOR2 barycentrics;
+	float distance;
+} RT64_HIT;
+
+// Command recorded by the log of a headless device. Headless devices still run on D3D12 (WARP without a capable
+// GPU), so they're only available on Windows.
+typedef struct {
+	int type;
+	const void *resource;
+	unsigned long long size;
+	unsigned int count;
+} RT64_COMMAND;
+
+// Sizes are in bytes. The eviction and restore counts are totals since the device was created.
+typedef struct {
+	unsigned long long budget;
+	unsigned long long residentSize;
+	unsigned int evictedCount;
+	unsigned int evictionCount;
+	unsigned int restoreCount;
+} RT64_TEXTURE_RESIDENCY;
+
+// Staging memory shared by all the uploads. Sizes are in bytes, and the peak includes the uploads that were too
+// large for the ring. Flushes count the times the ring ran out of space and had to wait for the GPU.
+typedef struct {
+	unsigned long long size;
+	unsigned long long usedSize;
+	unsigned long long peakSize;
+	unsigned int flushCount;
+} RT64_UPLOAD_RING;
+
+// CPU time in milliseconds spent by the last frame drawn by the device. Updating covers the scenes and their views,
+// rendering covers recording their commands, and submitting includes waiting for the GPU to free a frame slot.
+typedef struct {
+	float updateTime;
+	float renderTime;
+	float submitTime;
+} RT64_FRAME_TIMES;
+
+// State changes recorded by the raster draws of a view during the last frame it was rendered. Consecutive instances
+// that share the mesh, shader, scissor and viewport are drawn with a single call, so the draw count can be lower
+// than the instance count.
+typedef struct {
+	unsigned int drawCount;
+	unsigned int instanceCount;
+	unsigned int pipelineChanges;
+	unsigned int rootSignatureChanges;
+	unsigned int meshChanges;
+} RT64_RASTER_STATS;
+
 inline void RT64_ApplyMaterialAttributes(RT64_MATERIAL *dst, RT64_MATERIAL *src) {
 	if (src->enabledAttributes & RT64_ATTRIBUTE_IGNORE_NORMAL_FACTOR) {
 		dst->ignoreNormalFactor = src->ignoreNormalFactor;
@@ -225,13 +332,25 @@ typedef const char *(*GetLastErrorPtr)();
 typedef RT64_DEVICE* (*CreateDevicePtr)(void *hwnd);
 typedef void(*DestroyDevicePtr)(RT64_DEVICE* device);
 typedef void(*DrawDevicePtr)(RT64_DEVICE *device, int vsyncInterval);
+typedef RT64_DEVICE* (*CreateHeadlessDevicePtr)(int width, int height);
+typedef int(*GetDeviceCommandLogPtr)(RT64_DEVICE *device, RT64_COMMAND *commands, int maxCommands);
+typedef void(*SetDeviceTextureCompressionPtr)(RT64_DEVICE *device, int mode, int quality);
+typedef void(*SetDeviceTextureBudgetPtr)(RT64_DEVICE *device, unsigned long long budget);
+typedef void(*GetDeviceTextureResidencyPtr)(RT64_DEVICE *device, RT64_TEXTURE_RESIDENCY *residency);
+typedef void(*GetDeviceUploadRingPtr)(RT64_DEVICE *device, RT64_UPLOAD_RING *uploadRing);
+typedef void(*GetDeviceFrameTimesPtr)(RT64_DEVICE *device, RT64_FRAME_TIMES *frameTimes);
+typedef bool(*LoadTexturePackPtr)(RT64_DEVICE *device, const char *path);
+typedef void(*UnloadTexturePackPtr)(RT64_DEVICE *device);
 typedef RT64_VIEW* (*CreateViewPtr)(RT64_SCENE* scenePtr);
 typedef void(*SetViewPerspectivePtr)(RT64_VIEW *viewPtr, RT64_MATRIX4 viewMatrix, float fovRadians, float nearDist, float farDist);
 typedef void(*SetViewDescriptionPtr)(RT64_VIEW *viewPtr, RT64_VIEW_DESC viewDesc);
 typedef RT64_INSTANCE* (*GetViewRaytracedInstanceAtPtr)(RT64_VIEW *viewPtr, int x, int y);
+typedef void(*GetViewRasterStatsPtr)(RT64_VIEW *viewPtr, RT64_RASTER_STATS *stats);
+typedef void(*RenderViewReferencePtr)(RT64_VIEW *viewPtr, int width, int height, RT64_VECTOR4 *output, RT64_VECTOR4 *albedo, RT64_VECTOR4 *normal);
 typedef void(*DestroyViewPtr)(RT64_VIEW* viewPtr);
 typedef RT64_SCENE* (*CreateScenePtr)(RT64_DEVICE* devicePtr);
 typedef void (*SetSceneLightsPtr)(RT64_SCENE* scenePtr, RT64_LIGHT* lightArray, int lightCount);
+typedef void (*TraceRaysPtr)(RT64_SCENE* scenePtr, RT64_RAY* rayArray, int rayCount, RT64_HIT* hitArray);
 typedef void(*DestroyScenePtr)(RT64_SCENE* scenePtr);
 typedef RT64_MESH* (*CreateMeshPtr)(RT64_DEVICE* devicePtr, int flags);
 typedef void (*SetMeshPtr)(RT64_MESH* meshPtr, void* vertexArray, int vertexCount, int vertexStride, unsigned int* indexArray, int indexCount);
@@ -242,6 +361,9 @@ typedef RT64_INSTANCE* (*CreateInstancePtr)(RT64_SCENE* scenePtr);
 typedef void (*SetInstanceDescriptionPtr)(RT64_INSTANCE* instancePtr, RT64_INSTANCE_DESC instanceDesc);
 typedef void (*DestroyInstancePtr)(RT64_INSTANCE* instancePtr);
 typedef RT64_TEXTURE* (*CreateTextureFromRGBA8Ptr)(RT64_DEVICE* devicePtr, const void* bytes, int width, int height, int stride);
+typedef RT64_TEXTURE* (*CreateTextureFromFormatPtr)(RT64_DEVICE* devicePtr, const void* bytes, int width, int height, int rowPitch, int format, const void* tlut, int tlutFormat);
+typedef RT64_TEXTURE* (*SetTextureDataPtr)(RT64_TEXTURE* texture, const void* bytes, int width, int height, int stride);
+typedef RT64_TEXTURE* (*SetTextureRectPtr)(RT64_TEXTURE* texture, const void* bytes, int x, int y, int width, int height, int rowPitch);
 typedef void(*DestroyTexturePtr)(RT64_TEXTURE* texture);
 typedef RT64_INSPECTOR* (*CreateInspectorPtr)(RT64_DEVICE* devicePtr);
 typedef bool(*HandleMessageInspectorPtr)(RT64_INSPECTOR* inspectorPtr, UINT msg, WPARAM wParam, LPARAM lParam);
@@ -258,13 +380,25 @@ typedef struct {
 	DestroyDevicePtr DestroyDevice;
 #ifndef RT64_MINIMAL
 	DrawDevicePtr DrawDevice;
+	CreateHeadlessDevicePtr CreateHeadlessDevice;
+	GetDeviceCommandLogPtr GetDeviceCommandLog;
+	SetDeviceTextureCompressionPtr SetDeviceTextureCompression;
+	SetDeviceTextureBudgetPtr SetDeviceTextureBudget;
+	GetDeviceTextureResidencyPtr GetDeviceTextureResidency;
+	GetDeviceUploadRingPtr GetDeviceUploadRing;
+	GetDeviceFrameTimesPtr GetDeviceFrameTimes;
+	LoadTexturePackPtr LoadTexturePack;
+	UnloadTexturePackPtr UnloadTexturePack;
 	CreateViewPtr CreateView;
 	SetViewPerspectivePtr SetViewPerspective;
 	SetViewDescriptionPtr SetViewDescription;
 	GetViewRaytracedInstanceAtPtr GetViewRaytracedInstanceAt;
+	GetViewRasterStatsPtr GetViewRasterStats;
+	RenderViewReferencePtr RenderViewReference;
 	DestroyViewPtr DestroyView;
 	CreateScenePtr CreateScene;
 	SetSceneLightsPtr SetSceneLights;
+	TraceRaysPtr TraceRays;
 	DestroyScenePtr DestroyScene;
 	CreateMeshPtr CreateMesh;
 	SetMeshPtr SetMesh;
@@ -275,6 +409,9 @@ typedef struct {
 	SetInstanceDescriptionPtr SetInstanceDescription;
 	DestroyInstancePtr DestroyInstance;
 	CreateTextureFromRGBA8Ptr CreateTextureFromRGBA8;
+	CreateTextureFromFormatPtr CreateTextureFromFormat;
+	SetTextureDataPtr SetTextureData;
+	SetTextureRectPtr SetTextureRect;
 	DestroyTexturePtr DestroyTexture;
 	CreateInspectorPtr CreateInspector;
 	HandleMessageInspectorPtr HandleMessageInspector;
@@ -305,13 +442,25 @@ inline RT64_LIBRARY RT64_LoadLibrary() {
 
 #ifndef RT64_MINIMAL
 		lib.DrawDevice = (DrawDevicePtr)(GetProcAddress(lib.handle, "RT64_DrawDevice"));
+		lib.CreateHeadlessDevice = (CreateHeadlessDevicePtr)(GetProcAddress(lib.handle, "RT64_CreateHeadlessDevice"));
+		lib.GetDeviceCommandLog = (GetDeviceCommandLogPtr)(GetProcAddress(lib.handle, "RT64_GetDeviceCommandLog"));
+		lib.SetDeviceTextureCompression = (SetDeviceTextureCompressionPtr)(GetProcAddress(lib.handle, "RT64_SetDeviceTextureCompression"));
+		lib.SetDeviceTextureBudget = (SetDeviceTextureBudgetPtr)(GetProcAddress(lib.handle, "RT64_SetDeviceTextureBudget"));
+		lib.GetDeviceTextureResidency = (GetDeviceTextureResidencyPtr)(GetProcAddress(lib.handle, "RT64_GetDeviceTextureResidency"));
+		lib.GetDeviceUploadRing = (GetDeviceUploadRingPtr)(GetProcAddress(lib.handle, "RT64_GetDeviceUploadRing"));
+		lib.GetDeviceFrameTimes = (GetDeviceFrameTimesPtr)(GetProcAddress(lib.handle, "RT64_GetDeviceFrameTimes"));
+		lib.LoadTexturePack = (LoadTexturePackPtr)(GetProcAddress(lib.handle, "RT64_LoadTexturePack"));
+		lib.UnloadTexturePack = (UnloadTexturePackPtr)(GetProcAddress(lib.handle, "RT64_UnloadTexturePack"));
 		lib.CreateView = (CreateViewPtr)(GetProcAddress(lib.handle, "RT64_CreateView"));
 		lib.SetViewPerspective = (SetViewPerspectivePtr)(GetProcAddress(lib.handle, "RT64_SetViewPerspective"));
 		lib.SetViewDescription = (SetViewDescriptionPtr)(GetProcAddress(lib.handle, "RT64_SetViewDescription"));
 		lib.GetViewRaytracedInstanceAt = (GetViewRaytracedInstanceAtPtr)(GetProcAddress(lib.handle, "RT64_GetViewRaytracedInstanceAt"));
+		lib.GetViewRasterStats = (GetViewRasterStatsPtr)(GetProcAddress(lib.handle, "RT64_GetViewRasterStats"));
+		lib.RenderViewReference = (RenderViewReferencePtr)(GetProcAddress(lib.handle, "RT64_RenderViewReference"));
 		lib.DestroyView = (DestroyViewPtr)(GetProcAddress(lib.handle, "RT64_DestroyView"));
 		lib.CreateScene = (CreateScenePtr)(GetProcAddress(lib.handle, "RT64_CreateScene"));
 		lib.SetSceneLights = (SetSceneLightsPtr)(GetProcAddress(lib.handle, "RT64_SetSceneLights"));
+		lib.TraceRays = (TraceRaysPtr)(GetProcAddress(lib.handle, "RT64_TraceRays"));
 		lib.DestroyScene = (DestroyScenePtr)(GetProcAddress(lib.handle, "RT64_DestroyScene"));
 		lib.CreateMesh = (CreateMeshPtr)(GetProcAddress(lib.handle, "RT64_CreateMesh"));
 		lib.SetMesh = (SetMeshPtr)(GetProcAddress(lib.handle, "RT64_SetMesh"));
@@ -322,6 +471,9 @@ inline RT64_LIBRARY RT64_LoadLibrary() {
 		lib.SetInstanceDescription = (SetInstanceDescriptionPtr)(GetProcAddress(lib.handle, "RT64_SetInstanceDescription"));
 		lib.DestroyInstance = (DestroyInstancePtr)(GetProcAddress(lib.handle, "RT64_DestroyInstance"));
 		lib.CreateTextureFromRGBA8 = (CreateTextureFromRGBA8Ptr)(GetProcAddress(lib.handle, "RT64_CreateTextureFromRGBA8"));
+		lib.CreateTextureFromFormat = (CreateTextureFromFormatPtr)(GetProcAddress(lib.handle, "RT64_CreateTextureFromFormat"));
+		lib.SetTextureData = (SetTextureDataPtr)(GetProcAddress(lib.handle, "RT64_SetTextureData"));
+		lib.SetTextureRect = (SetTextureRectPtr)(GetProcAddress(lib.handle, "RT64_SetTextureRect"));
 		lib.DestroyTexture = (DestroyTexturePtr)(GetProcAddress(lib.handle, "RT64_DestroyTexture"));
 		lib.CreateInspector = (CreateInspectorPtr)(GetProcAddress(lib.handle, "RT64_CreateInspector"));
 		lib.HandleMessageInspector = (HandleMessageInspectorPtr)(GetProcAddress(lib.handle, "RT64_HandleMessageInspector"));
@@ -29,6 +29,11 @@ struct MaterialProperties {
 	float fogOffset;
 	uint fogEnabled;
 	uint _reserved;
+
+	// Filled in by the library after the host's material.
+	float4 diffuseTexScaleOffset;
+	float4 normalTexScaleOffset;
+	float4 specularTexScaleOffset;
 };
 //)raw"
 #endif
\ No newline at end of file
@@ -0,0 +1,153 @@
+//
+// RT64
+//
+
+// Standalone test for the barrier tracking of RT64::BarrierBatcher. The batcher never dereferences the resources
+// it's given, so plain pointers are enough as keys and the test doesn't need a device or a GPU.
+
+#include <cstdint>
+#include <cstdio>
+
+#include "private/rt64_barrier_batcher.h"
+
+namespace {
+	int failureCount = 0;
+
+	void check(bool condition, const char *expression, int line) {
+		if (!condition) {
+			fprintf(stderr, "barrier_batcher_test.cpp(%d): check failed: %s\n", line, expression);
+			failureCount++;
+		}
+	}
+
+#define CHECK(x) check((x), #x, __LINE__)
+
+	ID3D12Resource *fakeResource(uintptr_t id) {
+		return reinterpret_cast<ID3D12Resource *>(id * 0x100);
+	}
+
+	bool isTransition(const D3D12_RESOURCE_BARRIER &barrier, ID3D12Resource *resource, D3D12_RESOURCE_STATES before, D3D12_RESOURCE_STATES after) {
+		return (barrier.Type == D3D12_RESOURCE_BARRIER_TYPE_TRANSITION) && (barrier.Transition.pResource == resource) &&
+			(barrier.Transition.StateBefore == before) && (barrier.Transition.StateAfter == after);
+	}
+
+	bool isUAV(const D3D12_RESOURCE_BARRIER &barrier, ID3D12Resource *resource) {
+		return (barrier.Type == D3D12_RESOURCE_BARRIER_TYPE_UAV) && (barrier.UAV.pResource == resource);
+	}
+
+	void testTransition() {
+		RT64::BarrierBatcher batcher;
+		ID3D12Resource *a = fakeResource(1);
+		D3D12_RESOURCE_STATES state;
+		CHECK(!batcher.getPendingState(a, state));
+		CHECK(batcher.transition(a, D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_COPY_DEST));
+		CHECK(batcher.getPendingBarriers().size() == 1);
+		CHECK(isTransition(batcher.getPendingBarriers()[0], a, D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_COPY_DEST));
+		CHECK(batcher.getPendingBarriers()[0].Transition.Subresource == D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES);
+		CHECK(batcher.getPendingState(a, state) && (state == D3D12_RESOURCE_STATE_COPY_DEST));
+	}
+
+	void testStateMismatch() {
+		RT64::BarrierBatcher batcher;
+		ID3D12Resource *a = fakeResource(1);
+		CHECK(batcher.transition(a, D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_COPY_DEST));
+		CHECK(!batcher.transition(a, D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE));
+		CHECK(batcher.getPendingBarriers().size() == 1);
+		CHECK(batcher.getMergedCount() == 0);
+	}
+
+	void testMerge() {
+		RT64::BarrierBatcher batcher;
+		ID3D12Resource *a = fakeResource(1);
+		CHECK(batcher.transition(a, D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_COPY_DEST));
+		CHECK(batcher.transition(a, D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE));
+		CHECK(batcher.getPendingBarriers().size() == 1);
+		CHECK(isTransition(batcher.getPendingBarriers()[0], a, D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE));
+		CHECK(batcher.getMergedCount() == 1);
+	}
+
+	void testRoundTrip() {
+		RT64::BarrierBatcher batcher;
+		ID3D12Resource *a = fakeResource(1);
+		ID3D12Resource *b = fakeResource(2);
+		CHECK(batcher.transition(a, D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_COPY_DEST));
+		CHECK(batcher.transition(b, D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_COPY_SOURCE));
+		CHECK(batcher.transition(a, D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_COMMON));
+		CHECK(batcher.getPendingBarriers().size() == 1);
+		CHECK(isTransition(batcher.getPendingBarriers()[0], b, D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_COPY_SOURCE));
+
+		D3D12_RESOURCE_STATES state;
+		CHECK(!batcher.getPendingState(a, state));
+	}
+
+	void testUAVDedupe() {
+		RT64::BarrierBatcher batcher;
+		ID3D12Resource *a = fakeResource(1);
+		ID3D12Resource *b = fakeResource(2);
+		batcher.uav(a);
+		batcher.uav(a);
+		batcher.uav(b);
+		batcher.uav(b);
+		CHECK(batcher.getPendingBarriers().size() == 2);
+		CHECK(isUAV(batcher.getPendingBarriers()[0], a));
+		CHECK(isUAV(batcher.getPendingBarriers()[1], b));
+		CHECK(batcher.getMergedCount() == 2);
+	}
+
+	void testNoMergeAcrossOtherBarriers() {
+		// The UAV barrier between both transitions must stay between them.
+		RT64::BarrierBatcher batcher;
+		ID3D12Resource *a = fakeResource(1);
+		CHECK(batcher.transition(a, D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_UNORDERED_ACCESS));
+		batcher.uav(a);
+		CHECK(batcher.transition(a, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE));
+		batcher.uav(a);
+		const std::vector<D3D12_RESOURCE_BARRIER> &barriers = batcher.getPendingBarriers();
+		CHECK(barriers.size() == 4);
+		CHECK(isTransition(barriers[0], a, D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_UNORDERED_ACCESS));
+		CHECK(isUAV(barriers[1], a));
+		CHECK(isTransition(barriers[2], a, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE));
+		CHECK(isUAV(barriers[3], a));
+		CHECK(batcher.getMergedCount() == 0);
+
+		// The state mismatch is still detected against the last transition.
+		CHECK(!batcher.transition(a, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_COMMON));
+	}
+
+	void testDiscard() {
+		RT64::BarrierBatcher batcher;
+		ID3D12Resource *a = fakeResource(1);
+		ID3D12Resource *b = fakeResource(2);
+		CHECK(batcher.transition(a, D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_UNORDERED_ACCESS));
+		batcher.uav(b);
+		batcher.uav(a);
+		batcher.discard(a);
+		batcher.discard(nullptr);
+		CHECK(batcher.getPendingBarriers().size() == 1);
+		CHECK(isUAV(batcher.getPendingBarriers()[0], b));
+
+		// A discarded resource can start from any state again.
+		CHECK(batcher.transition(a, D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_COMMON));
+	}
+
+	void testEmptyFlush() {
+		// Nothing is recorded without pending barriers, so the command list isn't used.
+		RT64::BarrierBatcher batcher;
+		ID3D12GraphicsCommandList *commandList = reinterpret_cast<ID3D12GraphicsCommandList *>(fakeResource(3));
+		CHECK(batcher.flush(commandList) == 0);
+		CHECK(batcher.getFlushCount() == 0);
+		CHECK(batcher.getFlushedCount() == 0);
+	}
+};
+
+int runBarrierBatcherTests() {
+	testTransition();
+	testStateMismatch();
+	testMerge();
+	testRoundTrip();
+	testUAVDedupe();
+	testNoMergeAcrossOtherBarriers();
+	testDiscard();
+	testEmptyFlush();
+	return failureCount;
+}
@@ -0,0 +1,169 @@
+//
+// RT64
+//
+
+// Standalone test for RT64::FrameScheduler. The scheduler only deals with fence values, so the test drives it with a
+// simulated fence instead of a GPU. The retired resources are plain pointers that are never dereferenced, and the
+// scheduler under test records their releases instead of releasing them.
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "private/rt64_frame_scheduler.h"
+
+namespace {
+	int failureCount = 0;
+
+	void check(bool condition, const char *expression, int line) {
+		if (!condition) {
+			fprintf(stderr, "frame_scheduler_test.cpp(%d): check failed: %s\n", line, expression);
+			failureCount++;
+		}
+	}
+
+#define CHECK(x) check((x), #x, __LINE__)
+
+	// Signals increasing values like a command queue would, and completes them whenever the test says the GPU did.
+	struct SimulatedFence {
+		UINT64 signaledValue = 0;
+		UINT64 completedValue = 0;
+
+		UINT64 signal() {
+			return ++signaledValue;
+		}
+
+		void complete(UINT64 value) {
+			completedValue = value;
+		}
+	};
+
+	class RecordingScheduler : public RT64::FrameScheduler {
+	protected:
+		void releaseResource(RT64::AllocatedResource &resource) override {
+			released.push_back(resource.GetAllocation());
+		}
+	public:
+		std::vector<D3D12MA::Allocation *> released;
+
+		virtual ~RecordingScheduler() {
+			releaseAll();
+		}
+	};
+
+	D3D12MA::Allocation *fakeAllocation(uintptr_t id) {
+		return reinterpret_cast<D3D12MA::Allocation *>(id * 0x100);
+	}
+
+	void testEndFrameWithoutStall() {
+		RecordingScheduler scheduler;
+		SimulatedFence fence;
+		CHECK(scheduler.getFrameSlot() == 0);
+
+		// The second slot was never used, so the first frame never waits even if the GPU didn't start it.
+		UINT64 frameFenceValue = fence.signal();
+		CHECK(scheduler.endFrame(frameFenceValue, fence.completedValue) == 0);
+		CHECK(scheduler.getFrameSlot() == 1);
+		CHECK(scheduler.getFrameFenceValue(0) == frameFenceValue);
+
+		// The GPU keeps up with every frame.
+		for (int i = 0; i < 8; i++) {
+			fence.complete(fence.signaledValue);
+			frameFenceValue = fence.signal();
+			CHECK(scheduler.endFrame(frameFenceValue, fence.completedValue) == 0);
+		}
+
+		CHECK(scheduler.getFrameCount() == 9);
+		CHECK(scheduler.getStallCount() == 0);
+		CHECK(scheduler.getFrameSlot() == (9 % RT64::FrameScheduler::FramesInFlight));
+	}
+
+	void testEndFrameWithStall() {
+		RecordingScheduler scheduler;
+		SimulatedFence fence;
+		const UINT64 firstFenceValue = fence.signal();
+		CHECK(scheduler.endFrame(firstFenceValue, fence.completedValue) == 0);
+
+		// The GPU hasn't finished the first frame, so the slot it used can't be recorded yet.
+		const UINT64 secondFenceValue = fence.signal();
+		CHECK(scheduler.endFrame(secondFenceValue, fence.completedValue) == firstFenceValue);
+		CHECK(scheduler.getStallCount() == 1);
+		CHECK(scheduler.getFrameSlot() == 0);
+
+		// Waiting on the returned value completes the first frame, and only the second one is left in flight.
+		fence.complete(firstFenceValue);
+		const UINT64 thirdFenceValue = fence.signal();
+		CHECK(scheduler.endFrame(thirdFenceValue, fence.completedValue) == secondFenceValue);
+		CHECK(scheduler.getStallCount() == 2);
+
+		// A frame completed past the one the slot waits for doesn't stall either.
+		fence.complete(thirdFenceValue);
+		CHECK(scheduler.endFrame(fence.signal(), fence.completedValue) == 0);
+		CHECK(scheduler.getStallCount() == 2);
+		CHECK(scheduler.getFrameCount() == 4);
+	}
+
+	void testRetireOrdering() {
+		RecordingScheduler scheduler;
+		D3D12MA::Allocation *a = fakeAllocation(1);
+		D3D12MA::Allocation *b = fakeAllocation(2);
+		D3D12MA::Allocation *c = fakeAllocation(3);
+		scheduler.retire(RT64::AllocatedResource(a), 1);
+		scheduler.retire(RT64::AllocatedResource(), 1);
+		scheduler.retire(RT64::AllocatedResource(b), 1);
+		scheduler.retire(RT64::AllocatedResource(c), 3);
+		CHECK(scheduler.getRetiredCount() == 3);
+
+		// Resources retired with the same value are released in the order they were retired.
+		scheduler.collect(1);
+		CHECK((scheduler.released.size() == 2) && (scheduler.released[0] == a) && (scheduler.released[1] == b));
+		CHECK(scheduler.getRetiredCount() == 1);
+	}
+
+	void testCollectAgainstFence() {
+		RecordingScheduler scheduler;
+		SimulatedFence fence;
+		D3D12MA::Allocation *a = fakeAllocation(1);
+		D3D12MA::Allocation *b = fakeAllocation(2);
+
+		// Each resource is retired with the value signaled after the frame that last used it.
+		scheduler.retire(RT64::AllocatedResource(a), fence.signal());
+		scheduler.retire(RT64::AllocatedResource(b), fence.signal());
+
+		// Nothing is released until the fake fence reaches the value of each resource.
+		scheduler.collect(fence.completedValue);
+		CHECK(scheduler.released.empty());
+
+		fence.complete(1);
+		scheduler.collect(fence.completedValue);
+		CHECK((scheduler.released.size() == 1) && (scheduler.released[0] == a));
+
+		scheduler.collect(fence.completedValue);
+		CHECK(scheduler.released.size() == 1);
+
+		fence.complete(2);
+		scheduler.collect(fence.completedValue);
+		CHECK((scheduler.released.size() == 2) && (scheduler.released[1] == b));
+		CHECK(scheduler.getRetiredCount() == 0);
+	}
+
+	void testReleaseAll() {
+		RecordingScheduler scheduler;
+		D3D12MA::Allocation *a = fakeAllocation(1);
+		D3D12MA::Allocation *b = fakeAllocation(2);
+		scheduler.retire(RT64::AllocatedResource(a), 5);
+		scheduler.retire(RT64::AllocatedResource(b), 6);
+		scheduler.releaseAll();
+		CHECK((scheduler.released.size() == 2) && (scheduler.released[0] == a) && (scheduler.released[1] == b));
+		CHECK(scheduler.getRetiredCount() == 0);
+	}
+};
+
+int runFrameSchedulerTests() {
+	testEndFrameWithoutStall();
+	testEndFrameWithStall();
+	testRetireOrdering();
+	testCollectAgainstFence();
+	testReleaseAll();
+	return failureCount;
+}
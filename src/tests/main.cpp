@@ -0,0 +1,21 @@
+//
+// RT64
+//
+
+// Runs all the standalone tests. Each one returns how many of its checks failed.
+
+#include <cstdio>
+
+int runBarrierBatcherTests();
+int runFrameSchedulerTests();
+
+int main(int argc, char *argv[]) {
+	const int failureCount = runBarrierBatcherTests() + runFrameSchedulerTests();
+	if (failureCount > 0) {
+		fprintf(stderr, "%d checks failed.\n", failureCount);
+		return 1;
+	}
+
+	printf("All checks passed.\n");
+	return 0;
+}